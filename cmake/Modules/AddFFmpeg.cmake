@@ -61,7 +61,7 @@ set(CONFIGURE_COMMAND
  --enable-encoder=libvpx_vp8,libvpx_vp9,libopus \
  --enable-parser=vp8,vp9,opus \
  --enable-protocol=file,rtp,tcp,udp,pipe \
- --enable-demuxer=rtp,webm,matroska,opus \
+ --enable-demuxer=rtp,webm,matroska,opus,concat \
  --enable-muxer=webm,matroska,opus \
  --enable-filter=aformat,format,vflip,hflip,transpose,color,scale,trim,atrim,setpts,asetpts,amerge,anullsrc,pan,null,anull,overlay,concat,copy,acopy,abuffer,buffer,abuffersink,buffersink \
  --enable-bsf=setts \
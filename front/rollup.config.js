@@ -15,6 +15,7 @@ import svelte from 'rollup-plugin-svelte';
 import { terser } from 'rollup-plugin-terser';
 import autoPreprocess from 'svelte-preprocess';
 import alias from '@rollup/plugin-alias';
+import { brotliCompressSync, constants as zlibConstants } from 'zlib';
 
 const isWatch = process.env.ROLLUP_WATCH === 'true';
 const isProduction = process.env.NODE_ENV === 'production';
@@ -38,6 +39,17 @@ const minGeckoVersion = minFirefoxVersion;
 // Safari engine version, seems to be the same as safari version
 const minWebKitVersion = minSafariVersion;
 
+// Brotli variants of bundles are embedded into server along with gzip ones
+const brotli = (options = {}) =>
+  gzip({
+    ...options,
+    customCompression: (content) =>
+      brotliCompressSync(Buffer.from(content), {
+        params: { [zlibConstants.BROTLI_PARAM_QUALITY]: zlibConstants.BROTLI_MAX_QUALITY },
+      }),
+    fileName: '.br',
+  });
+
 const babelOptions = {
   babelHelpers: 'bundled',
   extensions: ['.js', '.ts'],
@@ -143,6 +155,7 @@ async function configAdmin() {
       })
     );
     plugins.push(gzip());
+    plugins.push(brotli());
   }
   return {
     input: 'src/admin/index.ts',
@@ -222,6 +235,7 @@ async function configPublic() {
       })
     );
     plugins.push(gzip());
+    plugins.push(brotli());
   }
 
   return {
@@ -335,6 +349,13 @@ async function configMain() {
         additionalFilesDelay: 500,
       })
     );
+
+    plugins.push(
+      brotli({
+        additionalFiles: [`${dist}/bundle.css`],
+        additionalFilesDelay: 500,
+      })
+    );
   }
 
   return {
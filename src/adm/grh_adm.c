@@ -18,6 +18,28 @@
 #include "grh_adm.h"
 #include "grh_adm_users.h"
 #include "gr_gauges.h"
+#include "lic_env.h"
+
+#if (ENABLE_RECORDING == 1)
+#include "rec/recording_engine.h"
+
+static int _recorders_get(struct iwn_wf_req *req, void *d) {
+  int ret = 500;
+  IWXSTR *xstr = iwxstr_new();
+  if (!xstr) {
+    return ret;
+  }
+  iwrc rc = recording_engine_stats(xstr);
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  } else {
+    ret = iwn_http_response_write(req->http, 200, "application/json", iwxstr_ptr(xstr), iwxstr_size(xstr)) ? 1 : -1;
+  }
+  iwxstr_destroy(xstr);
+  return ret;
+}
+
+#endif
 
 iwrc grh_route_adm(const struct iwn_wf_route *parent) {
   iwrc rc;
@@ -37,6 +59,15 @@ iwrc grh_route_adm(const struct iwn_wf_route *parent) {
   RCC(rc, finish, grh_route_adm_users(user));
   RCC(rc, finish, grh_route_gauges(gauges));
 
+#if (ENABLE_RECORDING == 1)
+  RCC(rc, finish, iwn_wf_route(&(struct iwn_wf_route) {
+    .parent = parent,
+    .pattern = "/recorders",
+    .handler = _recorders_get,
+    .flags = IWN_WF_GET,
+  }, 0));
+#endif
+
 finish:
   return rc;
 }
@@ -19,6 +19,8 @@
 #include "gr_watcher.h"
 #include "gr_task_worker.h"
 #include "gr_db_init.h"
+#include "gr_db_wb.h"
+#include "gr_gauges.h"
 #include "gr_crypt.h"
 #include "gr_sentry.h"
 #include "grh_routes.h"
@@ -63,8 +65,7 @@ struct gr_env g_env = {
   .periodic_worker                    = {
     .expire_session_timeout_sec       = -1,
     .expire_guest_session_timeout_sec = -1,
-    .expire_ws_ticket_timeout_sec     = -1,
-    .dispose_gauges_older_than_sec    = -1
+    .expire_ws_ticket_timeout_sec     = -1
   },
   .log                                = {
     .report_errors                    = 1,
@@ -402,6 +403,11 @@ static int _ini_handler(
       if (llv != 0) {
         g_env.session_cookies_max_age = llv;
       }
+    } else if (!strcmp(name, "session_cache_ttl_sec")) {
+      int64_t llv = iwatoi(value);
+      if (llv > 0) {
+        g_env.session_cache_ttl_sec = (int) llv;
+      }
     } else {
       iwlog_warn("Config: Unknown [%s] section property %s", section, name);
     }
@@ -510,6 +516,8 @@ static int _ini_handler(
       if (llv > 0) {
         g_env.ws.idle_timeout_sec = (int) llv;
       }
+    } else if (!strcmp(name, "tickets_db")) {
+      IWINI_PARSE_BOOL(g_env.ws.tickets_db);
     } else {
       iwlog_warn("Config: Unknown [%s] section property %s", section, name);
     }
@@ -534,10 +542,30 @@ static int _ini_handler(
       if (llv > 0) {
         g_env.periodic_worker.expire_ws_ticket_timeout_sec = (int) llv;
       }
-    } else if (!strcmp(name, "dispose_gauges_older_than_sec")) {
+    } else if (!strcmp(name, "task_workers")) {
+      int64_t llv = iwatoi(value);
+      if (llv > 0) {
+        g_env.periodic_worker.task_workers = (int) llv;
+      }
+    } else if (!strcmp(name, "task_max_attempts")) {
       int64_t llv = iwatoi(value);
       if (llv > 0) {
-        g_env.periodic_worker.dispose_gauges_older_than_sec = (int) llv;
+        g_env.periodic_worker.task_max_attempts = (int) llv;
+      }
+    } else if (!strcmp(name, "task_lease_sec")) {
+      int64_t llv = iwatoi(value);
+      if (llv > 0) {
+        g_env.periodic_worker.task_lease_sec = (int) llv;
+      }
+    } else if (!strcmp(name, "task_retry_delay_sec")) {
+      int64_t llv = iwatoi(value);
+      if (llv > 0) {
+        g_env.periodic_worker.task_retry_delay_sec = (int) llv;
+      }
+    } else if (!strcmp(name, "cleanup_time_budget_ms")) {
+      int64_t llv = iwatoi(value);
+      if (llv > 0) {
+        g_env.periodic_worker.cleanup_time_budget_ms = (int) llv;
       }
     } else {
       iwlog_warn("Config: Unknown [%s] section property %s", section, name);
@@ -552,6 +580,11 @@ static int _ini_handler(
       g_env.dbparams.bind = iwpool_strdup(pool, value, &rc);
     } else if (!strcmp(name, "truncate")) {
       IWINI_PARSE_BOOL(g_env.dbparams.truncate);
+    } else if (!strcmp(name, "wb_queue_limit")) {
+      int64_t llv = iwatoi(value);
+      if (llv > 0) {
+        g_env.dbparams.wb_queue_limit = (int) llv;
+      }
     } else {
       iwlog_warn("Config: Unknown [%s] section property %s", section, name);
     }
@@ -603,6 +636,35 @@ static int _ini_handler(
       if (llv > 0) {
         g_env.recording.max_processes = llv;
       }
+    } else if (!strcmp(name, "max_write_rate")) {
+      int64_t llv = iwatoi(value);
+      if (llv >= 0) {
+        g_env.recording.max_write_rate = llv;
+      }
+    } else if (!strcmp(name, "threads")) {
+      int64_t llv = iwatoi(value);
+      if (llv > 0) {
+        g_env.recording.threads = llv;
+      }
+    } else if (!strcmp(name, "postproc_workers")) {
+      int64_t llv = iwatoi(value);
+      if (llv > 0) {
+        g_env.recording.postproc_workers = llv;
+      }
+    } else if (!strcmp(name, "profile")) {
+      g_env.recording.output.profile = iwpool_strdup(pool, value, &rc);
+    } else if (!strcmp(name, "video_codec")) {
+      g_env.recording.output.codec = iwpool_strdup(pool, value, &rc);
+    } else if (!strcmp(name, "video_width")) {
+      g_env.recording.output.width = (int) iwatoi(value);
+    } else if (!strcmp(name, "video_height")) {
+      g_env.recording.output.height = (int) iwatoi(value);
+    } else if (!strcmp(name, "video_fps")) {
+      g_env.recording.output.fps = (int) iwatoi(value);
+    } else if (!strcmp(name, "video_speed")) {
+      g_env.recording.output.speed = (int) iwatoi(value);
+    } else if (!strcmp(name, "encoder_threads")) {
+      g_env.recording.output.threads = (int) iwatoi(value);
     } else if (!strcmp(name, "dir")) {
       g_env.recording.dir = iwpool_strdup(pool, value, &rc);
     } else if (!strcmp(name, "nopostproc")) {
@@ -631,6 +693,11 @@ static int _ini_handler(
       }
     } else if (!strcmp(name, "public_available")) {
       IWINI_PARSE_BOOL(g_env.whiteboard.public_available);
+    } else if (!strcmp(name, "snapshot_ops")) {
+      int64_t llv = iwatoi(value);
+      if (llv > 0) {
+        g_env.whiteboard.snapshot_ops = (int) llv;
+      }
     } else {
       iwlog_warn("Config: Unknown [%s] section property %s", section, name);
     }
@@ -824,17 +891,39 @@ static void _configure(int argc, char *argv[]) {
   if (g_env.periodic_worker.expire_ws_ticket_timeout_sec < 0) {
     g_env.periodic_worker.expire_ws_ticket_timeout_sec = 300; // 5 min
   }
-  if (g_env.periodic_worker.dispose_gauges_older_than_sec < 0) {
-    g_env.periodic_worker.dispose_gauges_older_than_sec = 60 * 60 * 24 * 31; // 31 days
+  if (g_env.periodic_worker.task_workers < 1 || g_env.periodic_worker.task_workers > 64) {
+    g_env.periodic_worker.task_workers = 2;
+  }
+  if (g_env.periodic_worker.task_max_attempts < 1) {
+    g_env.periodic_worker.task_max_attempts = 5;
+  }
+  if (g_env.periodic_worker.task_lease_sec < 1) {
+    g_env.periodic_worker.task_lease_sec = 600; // 10 min
+  }
+  if (g_env.periodic_worker.task_lease_sec < 2 * g_env.periodic_worker.check_timeout_sec) {
+    // Leases of running tasks are renewed by periodic worker
+    g_env.periodic_worker.task_lease_sec = 2 * g_env.periodic_worker.check_timeout_sec;
+  }
+  if (g_env.periodic_worker.task_retry_delay_sec < 1) {
+    g_env.periodic_worker.task_retry_delay_sec = 60; // 1 min
+  }
+  if (g_env.periodic_worker.cleanup_time_budget_ms < 1) {
+    g_env.periodic_worker.cleanup_time_budget_ms = 200;
   }
   if (g_env.dbparams.access_token && (g_env.dbparams.access_port == 0)) {
     g_env.dbparams.access_port = 9191;
   }
+  if (g_env.dbparams.wb_queue_limit < 1) {
+    g_env.dbparams.wb_queue_limit = 10000;
+  }
   if (g_env.session_cookies_max_age == 0) {
     g_env.session_cookies_max_age = 60 * 60 * 24 * 30;  // 30 days
   } else if (g_env.session_cookies_max_age == -1) {
     g_env.session_cookies_max_age = 0; // Make session cookie
   }
+  if (g_env.session_cache_ttl_sec < 1) {
+    g_env.session_cache_ttl_sec = 60 * 10; // 10 min
+  }
   if (g_env.alo.interval_ms < 1) {
     g_env.alo.interval_ms = 800;
   }
@@ -854,11 +943,23 @@ static void _configure(int argc, char *argv[]) {
     g_env.acme.endpoint = "https://acme-v02.api.letsencrypt.org/directory";
   }
   if (g_env.recording.max_processes < 1) {
-    g_env.recording.max_processes = 32;
+    g_env.recording.max_processes = 128;
+  }
+  if (g_env.recording.threads < 1 || g_env.recording.threads > 32) {
+    g_env.recording.threads = 2;
+  }
+  if (g_env.recording.postproc_workers < 1 || g_env.recording.postproc_workers > 64) {
+    g_env.recording.postproc_workers = 2;
+  }
+  if (g_env.whiteboard.snapshot_ops < 1) {
+    g_env.whiteboard.snapshot_ops = 1000;
   }
   if (!g_env.recording.ffmpeg) {
     g_env.recording.ffmpeg = g_env.program_file;
   }
+  if (!g_env.recording.output.profile) {
+    g_env.recording.output.profile = "balanced";
+  }
   if (!g_env.recording.dir) {
     g_env.recording.dir = iwpool_printf(pool, "%s/recordings", g_env.data_dir);
     RCA(g_env.recording.dir, exit);
@@ -1217,6 +1318,8 @@ iwrc gr_init_noweb(int argc, char *argv[]) {
 
   RCC(rc, finish, _db_open(argc, argv));
   RCC(rc, finish, gr_db_init());
+  RCC(rc, finish, gr_db_wb_init());
+  RCC(rc, finish, gr_gauges_init());
 
   if (_admin_pw) {
     RCC(rc, finish, gr_db_user_create_or_update_pw("admin", _admin_pw, 0, 0));
@@ -131,6 +131,7 @@ struct gr_env {
   bool ssl_enabled;
 
   int session_cookies_max_age; /**< Max age of sessions cookies in seconds Default 1 Month */
+  int session_cache_ttl_sec;   /**< Idle time in seconds after which session is evicted from memory cache. Default 10 min */
   pthread_mutex_t mtx;         /**< Global app mutex */
   struct {
     const char **roots;
@@ -161,20 +162,26 @@ struct gr_env {
     int max_history_rooms;    /**< Max number of previous rooms shown to user. */
   } room;
   struct {
-    int idle_timeout_sec;  /**< Websocket idle connection timeout seconds  */
+    int  idle_timeout_sec; /**< Websocket idle connection timeout seconds  */
+    bool tickets_db;       /**< Store WS tickets in database, used for multi-process setups. Default false */
   } ws;
   struct {
     int check_timeout_sec;                /**< Periodic worker checks timeout in seconds. */
     int expire_session_timeout_sec;       /**< Number of seconds when idle sessions will be removed */
     int expire_guest_session_timeout_sec; /**< Number of seconds when idle guest sessions will be removed */
     int expire_ws_ticket_timeout_sec;     /**< Number of seconds when ws ticket will be expired */
-    int dispose_gauges_older_than_sec;    /**< Dispose gauges older than sec */
+    int task_workers;                     /**< Number of persistent task worker threads. Default 2 */
+    int task_max_attempts;                /**< Max number of persistent task execution attempts. Default 5 */
+    int task_lease_sec;                   /**< Persistent task lease time in seconds. Default 600 */
+    int task_retry_delay_sec;             /**< Initial delay of postponed task retry in seconds. Default 60 */
+    int cleanup_time_budget_ms;           /**< Max time of expired data cleanup run in milliseconds. Default 200 */
   } periodic_worker;
   struct {
     const char *path;
     const char *bind;
     const char *access_token;
     int  access_port;
+    int  wb_queue_limit;  /**< Max number of pending write-behind operations. Default 10000 */
     bool access_enabled;
     bool truncate;
   } dbparams;
@@ -197,7 +204,19 @@ struct gr_env {
   struct {
     const char *dir;        /**< Directory to store room recordings */
     const char *ffmpeg;     /**< Path to ffmpeg executable */
-    int  max_processes;     /**< Max number of recording processes */
+    int  max_processes;     /**< Max number of simultaneously recorded media streams, the rest are queued */
+    int  max_write_rate;    /**< Max recordings write rate KB/s, video is dropped above it. Zero is unlimited */
+    int  threads;           /**< Number of recording threads. Default 2 */
+    int  postproc_workers;  /**< Max number of parallel segment renderers of recording post-processing. Default 2 */
+    struct {
+      const char *profile;  /**< Output profile: fast, balanced, quality, h264. Default balanced */
+      const char *codec;    /**< Overrides profile video codec: vp8, vp9, h264 */
+      int width;            /**< Overrides profile video width */
+      int height;           /**< Overrides profile video height */
+      int fps;              /**< Overrides profile video frame rate */
+      int speed;            /**< Overrides profile encoder speed, 1 (slowest) - 9 (fastest) */
+      int threads;          /**< Overrides profile number of encoder threads */
+    } output;
     bool verbose;           /**< Print debug recording messages */
     bool nopostproc;        /**< Recording postprocessing disabled */
     bool nopostproc_wallts; /**< Do not take into account absoluta wall time stamp (PTS) or recorded videos*/
@@ -209,6 +228,7 @@ struct gr_env {
   struct {
     int  room_data_ttl_sec; /**< Number of seconds when stored whiteboard data will be removed. <= 0 is disabled */
     bool public_available;  /**< If true not participants will have readonly access */
+    int  snapshot_ops;      /**< Number of logged whiteboard changes compacted into the new snapshot */
   } whiteboard;
   struct gr_pair   *http_headers;
   struct gr_server *servers;
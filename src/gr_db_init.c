@@ -43,10 +43,13 @@ static iwrc _db_init(void) {
   IWRC(ejdb_ensure_index(db, "rooms", "/uuid", EJDB_IDX_UNIQUE | EJDB_IDX_STR), rc);
   IWRC(ejdb_ensure_index(db, "rooms", "/cid", EJDB_IDX_STR), rc);
   IWRC(ejdb_ensure_index(db, "tasks", "/hook", EJDB_IDX_STR), rc);
+  IWRC(ejdb_ensure_index(db, "tasks", "/next", EJDB_IDX_I64), rc);
   IWRC(ejdb_ensure_index(db, "joins", "/k", EJDB_IDX_UNIQUE | EJDB_IDX_STR), rc);
   IWRC(ejdb_ensure_index(db, "files", "/uuid", EJDB_IDX_UNIQUE | EJDB_IDX_STR), rc);
-  IWRC(ejdb_ensure_index(db, "gauges", "/t", EJDB_IDX_I64), rc);
+  IWRC(ejdb_ensure_index(db, "files", "/hash", EJDB_IDX_STR), rc);
   IWRC(ejdb_ensure_index(db, "whiteboards", "/cid", EJDB_IDX_UNIQUE | EJDB_IDX_STR), rc);
+  IWRC(ejdb_ensure_index(db, "whiteboard_ops", "/cid", EJDB_IDX_STR), rc);
+  IWRC(ejdb_ensure_index(db, "whiteboard_ops", "/ts", EJDB_IDX_I64), rc);
 
   rc = ejdb_get(db, "meta", 1, &jbl);
   if (rc == IW_ERROR_NOT_EXISTS) {
@@ -176,6 +179,30 @@ finish:
   return rc;
 }
 
+/// Builds indexes missing in databases created by previous versions.
+/// Applied indexes version is kept in `__indexes__` meta field.
+static iwrc _indexes_apply(void) {
+  int64_t llv = 0;
+  JBL jbl = 0;
+  EJDB db = g_env.db;
+  iwrc rc = ejdb_get(db, "meta", 1, &jbl);
+  RCGO(rc, finish);
+  jbl_object_get_i64(jbl, "__indexes__", &llv);
+  if (llv < 1) {
+    iwlog_info2("DB | Building expiration indexes of tickets and whiteboards");
+    RCC(rc, finish, ejdb_ensure_index(db, "tickets", "/ts", EJDB_IDX_I64));
+    RCC(rc, finish, ejdb_ensure_index(db, "whiteboards", "/ctime", EJDB_IDX_I64));
+    RCC(rc, finish, ejdb_merge_or_put(db, "meta", "{\"__indexes__\":1}", 1));
+  }
+
+finish:
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
+  jbl_destroy(&jbl);
+  return rc;
+}
+
 static iwrc _users_apply(void) {
   iwrc rc = 0;
   JQL q = 0;
@@ -219,6 +246,7 @@ finish:
 
 iwrc gr_db_init(void) {
   iwrc rc = RCR(_db_init());
+  rc = RCR(_indexes_apply());
   rc = RCR(_users_apply());
   if (g_env.initial_data >= 1) {
     rc = _stages_apply();
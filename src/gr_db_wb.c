@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "gr_db_wb.h"
+
+#include <ejdb2/ejdb2.h>
+#include <iowow/iwkv.h>
+#include <iowow/iwstw.h>
+
+#include <errno.h>
+#include <pthread.h>
+
+/// Max memory held by queued operations
+#define WB_QUEUE_MAX_BYTES (64 * 1024 * 1024)
+
+extern struct gr_env g_env;
+
+struct wb_op {
+  gr_db_wb_op_e op;
+  bool     ignore_unique;
+  bool     sync;
+  int64_t  id;
+  uint64_t seq;
+  size_t   size;
+  const char *coll;
+  const char *query;
+  const char *key;
+  JBL_NODE    json;
+  iwrc   *rcp;        ///< Write result slot of waiting submitter
+  IWPOOL *pool;
+  struct wb_op *next;
+};
+
+static struct {
+  pthread_mutex_t mtx;
+  pthread_mutex_t wmtx;   ///< Serializes batch writers
+  pthread_cond_t  cond;
+  struct wb_op   *head;
+  struct wb_op   *tail;
+  IWSTW    stw;           ///< Writer thread
+  uint64_t seq;           ///< Sequence number of the last submitted operation
+  uint64_t applied_seq;   ///< Sequence number of the last applied operation
+  uint64_t sync_seq;      ///< Sync to disk requested up to this sequence number
+  uint64_t synced_seq;    ///< Operations up to this sequence number are synced to disk
+  size_t   num;           ///< Number of operations not yet applied
+  size_t   size;          ///< Memory held by operations not yet applied
+  bool     drain_pending;
+  bool     shutdown;
+} _q = {
+  .mtx  = PTHREAD_MUTEX_INITIALIZER,
+  .wmtx = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static iwrc _op_apply(struct wb_op *op) {
+  iwrc rc = 0;
+  JQL q = 0;
+
+  switch (op->op) {
+    case GR_DB_WB_PUT_NEW: {
+      int64_t id;
+      rc = ejdb_put_new_jbn(g_env.db, op->coll, op->json, &id);
+      break;
+    }
+    case GR_DB_WB_PATCH:
+      rc = ejdb_patch_jbn(g_env.db, op->coll, op->json, op->id);
+      break;
+    case GR_DB_WB_UPDATE: {
+      int idx = 0;
+      RCC(rc, finish, jql_create(&q, op->coll, op->query));
+      if (op->key) {
+        RCC(rc, finish, jql_set_str(q, 0, idx++, op->key));
+      }
+      if (op->json) {
+        RCC(rc, finish, jql_set_json(q, 0, idx++, op->json));
+      }
+      rc = ejdb_update(g_env.db, q);
+      break;
+    }
+    case GR_DB_WB_DEL:
+      rc = ejdb_del(g_env.db, op->coll, op->id);
+      break;
+    default:
+      rc = IW_ERROR_INVALID_ARGS;
+      break;
+  }
+
+finish:
+  jql_destroy(&q);
+  if ((rc == EJDB_ERROR_UNIQUE_INDEX_CONSTRAINT_VIOLATED) && op->ignore_unique) {
+    rc = 0;
+  }
+  return rc;
+}
+
+static iwrc _db_sync(void) {
+  IWKV kv;
+  iwrc rc = RCR(ejdb_get_iwkv(g_env.db, &kv));
+  return iwkv_sync(kv, IWFS_FDATASYNC);
+}
+
+static void _drain(void *arg) {
+  iwrc sync_rc = 0;
+  uint64_t seq = 0;
+  size_t num = 0, size = 0;
+
+  pthread_mutex_lock(&_q.wmtx);
+
+  pthread_mutex_lock(&_q.mtx);
+  struct wb_op *head = _q.head;
+  uint64_t sync_seq = _q.sync_seq;
+  uint64_t synced_seq = _q.synced_seq;
+  _q.head = _q.tail = 0;
+  _q.drain_pending = false;
+  pthread_mutex_unlock(&_q.mtx);
+
+  // Operations are applied in submission order, so operations of any write class
+  // are never overtaken by later ones, including operations on other collections
+  for (struct wb_op *op = head; op; op = op->next) {
+    iwrc rc = _op_apply(op);
+    if (op->rcp) {
+      *op->rcp = rc;
+    } else if (rc) {
+      iwlog_ecode_error(rc, "Write-behind operation failed, collection: %s", op->coll);
+    }
+    if (op->seq > seq) {
+      seq = op->seq;
+    }
+    ++num;
+    size += op->size;
+  }
+
+  if (sync_seq > synced_seq) {
+    sync_rc = _db_sync();
+    if (sync_rc) {
+      iwlog_ecode_error3(sync_rc);
+    }
+  }
+
+  for (struct wb_op *op = head, *next; op; op = next) {
+    next = op->next;
+    if (op->sync && op->rcp && !*op->rcp) {
+      *op->rcp = sync_rc;
+    }
+    iwpool_destroy(op->pool); // NOLINT
+  }
+
+  pthread_mutex_lock(&_q.mtx);
+  if (seq > _q.applied_seq) {
+    _q.applied_seq = seq;
+  }
+  if (sync_seq > _q.synced_seq) {
+    _q.synced_seq = sync_seq;
+  }
+  _q.num -= num;
+  _q.size -= size;
+  pthread_cond_broadcast(&_q.cond);
+  pthread_mutex_unlock(&_q.mtx);
+
+  pthread_mutex_unlock(&_q.wmtx);
+}
+
+/// Schedules queue drain on writer thread.
+/// Returns true if queue should be drained by caller.
+/// @note Must be called in _q.mtx locked context
+static bool _drain_schedule_locked(void) {
+  if (_q.shutdown || !_q.stw) {
+    return true;
+  }
+  if (!_q.drain_pending) {
+    iwrc rc = iwstw_schedule(_q.stw, _drain, 0);
+    if (rc) {
+      iwlog_ecode_error3(rc);
+      return true;
+    }
+    _q.drain_pending = true;
+  }
+  return false;
+}
+
+static void _wait_for(uint64_t seq, bool sync) {
+  pthread_mutex_lock(&_q.mtx);
+  while (seq > (sync ? _q.synced_seq : _q.applied_seq)) {
+    pthread_cond_wait(&_q.cond, &_q.mtx);
+  }
+  pthread_mutex_unlock(&_q.mtx);
+}
+
+iwrc gr_db_wb_submit(const struct gr_db_wb_spec *spec) {
+  if (  !spec || !spec->coll
+     || ((spec->op == GR_DB_WB_UPDATE) && !spec->query)
+     || ((spec->op == GR_DB_WB_PUT_NEW || spec->op == GR_DB_WB_PATCH) && !spec->json && !spec->jbl)) {
+    return IW_ERROR_INVALID_ARGS;
+  }
+
+  iwrc rc = 0, wrc = 0;
+  struct wb_op *op;
+  IWPOOL *pool = iwpool_create_empty();
+  if (!pool) {
+    return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+  }
+
+  RCB(finish, op = iwpool_calloc(sizeof(*op), pool));
+  op->pool = pool;
+  op->op = spec->op;
+  op->id = spec->id;
+  op->ignore_unique = spec->ignore_unique;
+  op->sync = spec->wclass == GR_DB_WB_SYNC;
+  RCB(finish, op->coll = iwpool_strdup2(pool, spec->coll));
+  if (spec->query) {
+    RCB(finish, op->query = iwpool_strdup2(pool, spec->query));
+  }
+  if (spec->key) {
+    RCB(finish, op->key = iwpool_strdup2(pool, spec->key));
+  }
+  if (spec->json) {
+    RCC(rc, finish, jbn_clone(spec->json, &op->json, pool));
+  } else if (spec->jbl) {
+    RCC(rc, finish, jbl_to_node(spec->jbl, &op->json, true, pool));
+  }
+  if (spec->wclass != GR_DB_WB_LAZY) {
+    op->rcp = &wrc;
+  }
+  op->size = iwpool_allocated_size(pool);
+
+  pthread_mutex_lock(&_q.mtx);
+  while (  !_q.shutdown && _q.stw
+        && (_q.num >= g_env.dbparams.wb_queue_limit || _q.size >= WB_QUEUE_MAX_BYTES)) {
+    pthread_cond_wait(&_q.cond, &_q.mtx);
+  }
+  uint64_t seq = op->seq = ++_q.seq;
+  ++_q.num;
+  _q.size += op->size;
+  if (op->sync) {
+    _q.sync_seq = seq;
+  }
+  if (_q.tail) {
+    _q.tail->next = op;
+  } else {
+    _q.head = op;
+  }
+  _q.tail = op;
+  bool drain = _drain_schedule_locked();
+  pthread_mutex_unlock(&_q.mtx);
+  pool = 0; // Operation is owned by queue
+
+  if (drain) {
+    _drain(0);
+  }
+  if (spec->wclass != GR_DB_WB_LAZY) {
+    _wait_for(seq, spec->wclass == GR_DB_WB_SYNC);
+    rc = wrc;
+  }
+
+finish:
+  iwpool_destroy(pool);
+  return rc;
+}
+
+iwrc gr_db_wb_flush(bool sync) {
+  pthread_mutex_lock(&_q.mtx);
+  uint64_t seq = _q.seq;
+  if (sync && (seq > _q.sync_seq)) {
+    _q.sync_seq = seq;
+  }
+  bool drain = _drain_schedule_locked();
+  pthread_mutex_unlock(&_q.mtx);
+  if (drain) {
+    _drain(0);
+  }
+  _wait_for(seq, sync);
+  return 0;
+}
+
+static void _shutdown(void *data) {
+  // Writer thread is detached under lock since `_q.stw` is read by submitters
+  pthread_mutex_lock(&_q.mtx);
+  IWSTW stw = _q.stw;
+  _q.stw = 0;
+  _q.shutdown = true;
+  pthread_cond_broadcast(&_q.cond);
+  pthread_mutex_unlock(&_q.mtx);
+  iwstw_shutdown(&stw, true);
+  gr_db_wb_flush(true);
+}
+
+iwrc gr_db_wb_init(void) {
+  RCR(iwstw_start("grdbw", 1024, false, &_q.stw));
+  gr_shutdown_hook_add(_shutdown, 0);
+  return 0;
+}
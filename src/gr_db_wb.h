@@ -0,0 +1,69 @@
+#pragma once
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "gr.h"
+
+/// Durability class of write-behind operation.
+typedef enum {
+  GR_DB_WB_LAZY = 0, ///< Fire and forget. Write will be applied as part of the next batch.
+  GR_DB_WB_COMMIT,   ///< Caller waits until write is applied to the database.
+  GR_DB_WB_SYNC,     ///< Caller waits until write is applied and database data is synced to disk.
+} gr_db_wb_class_e;
+
+/// Write-behind operation type.
+typedef enum {
+  GR_DB_WB_PUT_NEW = 1, ///< Insert `json` as new document into `coll`.
+  GR_DB_WB_PATCH,       ///< Apply `json` patch to the document identified by `id`.
+  GR_DB_WB_UPDATE,      ///< Execute update `query`, `key` is bound to the first placeholder, `json` to the next one.
+  GR_DB_WB_DEL,         ///< Remove document identified by `id`.
+} gr_db_wb_op_e;
+
+struct gr_db_wb_spec {
+  gr_db_wb_op_e    op;
+  gr_db_wb_class_e wclass;
+  const char *coll;          ///< Collection name. Required.
+  const char *query;         ///< JQL query text used by GR_DB_WB_UPDATE.
+  const char *key;           ///< Optional string value bound to the first query placeholder.
+  JBL_NODE    json;          ///< Document, patch or query argument.
+  JBL jbl;                   ///< Document, patch or query argument if `json` is not set.
+  int64_t     id;            ///< Document id for GR_DB_WB_PATCH, GR_DB_WB_DEL.
+  bool ignore_unique;        ///< Silently ignore unique index constraint violations.
+};
+
+/**
+ * @brief Submits write operation into write-behind queue.
+ *
+ * All operation data is copied so caller may release spec data right after call.
+ * Operations are applied by the dedicated writer thread in batches,
+ * in the order of submission regardless of their collection and write class.
+ *
+ * Memory used by the queue is bounded, if queue is full caller is blocked until writer thread
+ * frees some space.
+ *
+ * For GR_DB_WB_COMMIT and GR_DB_WB_SYNC classes function returns error code of database write,
+ * for GR_DB_WB_LAZY class write errors are only logged.
+ */
+iwrc gr_db_wb_submit(const struct gr_db_wb_spec *spec);
+
+/**
+ * @brief Waits until all submitted writes are applied.
+ * @param sync If true database data will be synced to disk.
+ */
+iwrc gr_db_wb_flush(bool sync);
+
+iwrc gr_db_wb_init(void);
@@ -18,112 +18,339 @@
 #include "gr_gauges.h"
 
 #include "gr.h"
+#include "gr_db_wb.h"
 #include "grh_ws.h"
 #include "grh_auth.h"
 
+#include <iowow/iwulist.h>
+#include <iwnet/iwn_scheduler.h>
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/// Gauges history file in data directory
+#define GAUGES_SNAPSHOT_FILE    "gauges.snapshot"
+#define GAUGES_SNAPSHOT_MAGIC   0x47524753U
+#define GAUGES_SNAPSHOT_VERSION 1U
+
+/// Gauges history depth
+#define GAUGES_HISTORY_SEC (60 * 60 * 24 * 31)
+
+#define GAUGES_NUM 5
+
+/// Min interval between gauges change notifications sent to admins
+#define GAUGES_NOTIFY_INTERVAL_MS 1000U
 
 extern struct gr_env g_env;
 
-struct gcheck {
-  uint64_t    ts;
-  uint32_t    gauge;
-  int64_t     level;
-  const char *message;
+/// Gauge level `l` at time `t` seconds since epoch
+struct gpoint {
+  int64_t t;
+  int64_t l;
+};
+
+/// Fixed size ring of gauge points.
+/// Raw ring (`step` is zero) keeps the last gauge level changes,
+/// downsampled rings keep the max gauge level of every `step` seconds bucket.
+struct gring {
+  struct gpoint *p;
+  uint32_t       num;  ///< Ring capacity
+  uint32_t       step; ///< Bucket size in seconds, zero for the raw ring
+  uint32_t       len;  ///< Number of stored points
+  uint32_t       head; ///< Index of the most recent point
+};
+
+enum {
+  GRING_RAW = 0,
+  GRING_1M,
+  GRING_15M,
+  GRING_1H,
+  GRING_NUM,
+};
+
+#define GRING_RAW_NUM 1024
+#define GRING_1M_NUM  (24 * 60)
+#define GRING_15M_NUM (7 * 24 * 4)
+#define GRING_1H_NUM  (GAUGES_HISTORY_SEC / (60 * 60))
+
+#define GRING_POINTS_NUM (GRING_RAW_NUM + GRING_1M_NUM + GRING_15M_NUM + GRING_1H_NUM)
+
+struct gauge {
+  uint32_t     type;
+  int64_t      level; ///< Current gauge level
+  struct gring rings[GRING_NUM];
+};
+
+struct snapshot_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t gauges_num;
+  uint32_t rings_num;
 };
 
-struct gctx {
-  int64_t ts_from;
-  IWXSTR *xstr;
-  int32_t first;
+struct snapshot_gauge {
+  uint32_t type;
+  uint32_t reserved;
+  int64_t  level;
+};
+
+struct snapshot_ring {
+  uint32_t num;
+  uint32_t step;
+  uint32_t len;
+  uint32_t reserved;
+};
+
+static struct gpoint _points[GAUGES_NUM][GRING_POINTS_NUM];
+
+#define _GAUGE_RINGS(idx_) {                                                                         \
+    { .p = _points[idx_], .num = GRING_RAW_NUM },                                                    \
+    { .p = _points[idx_] + GRING_RAW_NUM, .num = GRING_1M_NUM, .step = 60 },                         \
+    { .p = _points[idx_] + GRING_RAW_NUM + GRING_1M_NUM, .num = GRING_15M_NUM, .step = 15 * 60 },    \
+    { .p = _points[idx_] + GRING_RAW_NUM + GRING_1M_NUM + GRING_15M_NUM, .num = GRING_1H_NUM,        \
+      .step = 60 * 60 },                                                                             \
+}
+
+static struct {
+  pthread_mutex_t mtx;
+  struct gauge    gauges[GAUGES_NUM];
+  IWULIST  subscribers;     ///< WS ids of admin sessions subscribed to gauges changes
+  uint32_t changed;         ///< Gauges changed since the last subscribers notification
+  bool     notify_pending;  ///< Subscribers notification is scheduled
+  bool     dirty;           ///< Gauges were changed since the last snapshot
+} _g = {
+  .mtx    = PTHREAD_MUTEX_INITIALIZER,
+  .gauges = {
+    { .type = GAUGE_ROOMS, .rings = _GAUGE_RINGS(0) },
+    { .type = GAUGE_ROOM_USERS, .rings = _GAUGE_RINGS(1) },
+    { .type = GAUGE_STREAMS, .rings = _GAUGE_RINGS(2) },
+    { .type = GAUGE_RECORDINGS, .rings = _GAUGE_RINGS(3) },
+    { .type = GAUGE_RECORDING_LAG, .rings = _GAUGE_RINGS(4) },
+  }
 };
 
+#undef _GAUGE_RINGS
+
 struct gset {
   uint32_t gauge;
   int64_t  level;
 };
 
-static bool _gauge_notify_visitor(struct ws_session *wss, void *op) {
-  if (!grh_auth_has_any_perms(wss->ws->req, "admin")) {
+static struct gauge* _gauge_find(uint32_t type) {
+  for (int i = 0; i < GAUGES_NUM; ++i) {
+    if (_g.gauges[i].type == type) {
+      return &_g.gauges[i];
+    }
+  }
+  return 0;
+}
+
+/// Returns i-th most recent point of the ring.
+IW_INLINE struct gpoint* _gring_at(struct gring *r, uint32_t i) {
+  return &r->p[(r->head + r->num - i) % r->num];
+}
+
+static void _gring_push(struct gring *r, int64_t t, int64_t l) {
+  r->head = (r->head + 1) % r->num;
+  r->p[r->head] = (struct gpoint) {
+    .t = t,
+    .l = l
+  };
+  if (r->len < r->num) {
+    ++r->len;
+  }
+}
+
+/// Records gauge level `l` set at time `t`, `prev` is the gauge level before `t`.
+/// Returns true if ring points were appended or modified.
+static bool _gring_put(struct gring *r, int64_t t, int64_t l, int64_t prev) {
+  struct gpoint *last = r->len ? _gring_at(r, 0) : 0;
+  if (r->step == 0) { // Raw ring
+    if (last && last->t >= t) {
+      if (last->l == l) {
+        return false;
+      }
+      last->l = l;
+    } else {
+      _gring_push(r, t, l);
+    }
     return true;
   }
-  struct gcheck *gc = op;
-  grh_ws_send_by_wsid(wss->wsid, gc->message, -1);
+  int64_t bt = t - t % r->step;
+  if (last) {
+    if (last->t == bt) {
+      if (last->l >= l) {
+        return false;
+      }
+      last->l = l;
+      return true;
+    } else if (last->t > bt) { // Time went backward
+      return false;
+    }
+    // Fill buckets without gauge changes with the previous level
+    int64_t ft = MAX(last->t + r->step, bt - (int64_t) (r->num - 1) * r->step);
+    for ( ; ft < bt; ft += r->step) {
+      _gring_push(r, ft, prev);
+    }
+    if (t > bt) { // Bucket started with the previous level
+      l = MAX(l, prev);
+    }
+  }
+  _gring_push(r, bt, l);
   return true;
 }
 
-static void _gauge_notify(void *op) {
-  // Notify admins about gauge change
+/// Sets gauge level at time `ts` (seconds since epoch).
+/// Returns true if gauge level has been changed.
+/// @note Must be called in `_g.mtx` locked context
+static bool _gauge_put_lk(struct gauge *g, int64_t ts, int64_t level) {
+  bool changed = g->level != level;
+  for (int i = 0; i < GRING_NUM; ++i) {
+    if (  (changed || i != GRING_RAW || !g->rings[i].len)
+       && _gring_put(&g->rings[i], ts, level, g->level)) {
+      _g.dirty = true;
+    }
+  }
+  g->level = level;
+  return changed;
+}
+
+static void _gauges_notify(void *d) {
   iwrc rc = 0;
-  struct gcheck *gc = op;
-  JBL jbl = 0, jbl2 = 0;
+  IWULIST wsids = { 0 };
   IWXSTR *xstr = iwxstr_new();
-  RCA(xstr, finish);
 
-  RCC(rc, finish, jbl_create_empty_object(&jbl));
-  RCC(rc, finish, jbl_set_string(jbl, "event", "GAUGE"));
-
-  RCC(rc, finish, jbl_create_empty_array(&jbl2));
-  RCC(rc, finish, jbl_set_int64(jbl2, 0, gc->ts));
-  RCC(rc, finish, jbl_set_int64(jbl2, 0, gc->gauge));
-  RCC(rc, finish, jbl_set_int64(jbl2, 0, gc->level));
-  RCC(rc, finish, jbl_set_nested(jbl, "data", jbl2));
-
-  RCC(rc, finish, jbl_as_json(jbl, jbl_xstr_json_printer, xstr, 0));
-  gc->message = iwxstr_ptr(xstr);
+  pthread_mutex_lock(&_g.mtx);
+  uint32_t changed = _g.changed;
+  _g.changed = 0;
+  _g.notify_pending = false;
+  if (!xstr || !changed || !iwulist_length(&_g.subscribers)) {
+    pthread_mutex_unlock(&_g.mtx);
+    goto finish;
+  }
+  rc = iwulist_init(&wsids, iwulist_length(&_g.subscribers), sizeof(int));
+  for (int i = 0, l = iwulist_length(&_g.subscribers); !rc && i < l; ++i) {
+    rc = iwulist_push(&wsids, iwulist_at2(&_g.subscribers, i));
+  }
+  if (!rc) {
+    rc = iwxstr_cat2(xstr, "{\"event\":\"GAUGES\",\"data\":[");
+  }
+  for (int i = 0; !rc && i < GAUGES_NUM; ++i) {
+    struct gauge *g = &_g.gauges[i];
+    struct gring *r = &g->rings[GRING_RAW];
+    if ((changed & g->type) && r->len) {
+      struct gpoint *p = _gring_at(r, 0);
+      rc = iwxstr_printf(xstr, "%s[%" PRId64 ",%" PRIu32 ",%" PRId64 "]",
+                         iwxstr_ptr(xstr)[iwxstr_size(xstr) - 1] == '[' ? "" : ",",
+                         p->t, g->type, p->l);
+    }
+  }
+  pthread_mutex_unlock(&_g.mtx);
+  RCGO(rc, finish);
+  RCC(rc, finish, iwxstr_cat2(xstr, "]}"));
 
-  rc = grh_ws_visit_clients(_gauge_notify_visitor, op);
+  for (int i = 0, l = iwulist_length(&wsids); i < l; ++i) {
+    grh_ws_send_by_wsid(*(int*) iwulist_at2(&wsids, i), iwxstr_ptr(xstr), iwxstr_size(xstr));
+  }
 
 finish:
   if (rc) {
     iwlog_ecode_error3(rc);
   }
-  jbl_destroy(&jbl);
-  jbl_destroy(&jbl2);
+  iwulist_destroy_keep(&wsids);
   iwxstr_destroy(xstr);
-  free(gc);
 }
 
-static iwrc _gauge_set_with_ts(uint64_t ts, uint32_t gauge, int64_t level, bool notify) {
-  iwrc rc = 0;
-  JQL q = 0;
-  EJDB_LIST list = 0;
-  JBL jbl = 0;
-  int64_t llv;
+/// Schedules notification of gauges subscribers.
+/// Changes are coalesced so subscribers are notified at most once per GAUGES_NOTIFY_INTERVAL_MS.
+/// @note Must be called in `_g.mtx` locked context
+static void _gauges_notify_schedule_lk(uint32_t gauge) {
+  _g.changed |= gauge;
+  if (_g.notify_pending || !iwulist_length(&_g.subscribers) || g_env.shutdown) {
+    return;
+  }
+  iwrc rc = iwn_schedule(&(struct iwn_scheduler_spec) {
+    .poller = g_env.poller,
+    .task_fn = _gauges_notify,
+    .timeout_ms = GAUGES_NOTIFY_INTERVAL_MS,
+  });
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  } else {
+    _g.notify_pending = true;
+  }
+}
 
+static iwrc _gauge_set_with_ts(uint64_t ts, uint32_t gauge, int64_t level, bool notify) {
   ts /= 1000; // ms => sec
 
-  RCC(rc, finish, jql_create(&q, "gauges", "/[g = :?]"));
-  RCC(rc, finish, jql_set_i64(q, 0, 0, gauge));
-  RCC(rc, finish, ejdb_list4(g_env.db, q, 1, 0, &list));
-
-  if (!list->first || jbl_object_get_i64(list->first->raw, "l", &llv) || llv != level) {
-    RCC(rc, finish, jbl_create_empty_object(&jbl));
-    RCC(rc, finish, jbl_set_int64(jbl, "t", ts));
-    RCC(rc, finish, jbl_set_int64(jbl, "g", gauge));
-    RCC(rc, finish, jbl_set_int64(jbl, "l", level));
-    RCC(rc, finish, ejdb_put_new(g_env.db, "gauges", jbl, &llv));
-    if (notify) {
-      struct gcheck *gc = malloc(sizeof(*gc));
-      if (gc) {
-        *gc = (struct gcheck) {
-          .ts = ts,
-          .gauge = gauge,
-          .level = level
-        };
-        if (iwtp_schedule(g_env.tp, _gauge_notify, gc)) {
-          free(gc);
-        }
-      }
+  pthread_mutex_lock(&_g.mtx);
+  struct gauge *g = _gauge_find(gauge);
+  if (g && _gauge_put_lk(g, ts, level) && notify) {
+    _gauges_notify_schedule_lk(gauge);
+  }
+  pthread_mutex_unlock(&_g.mtx);
+
+  return g ? 0 : IW_ERROR_INVALID_ARGS;
+}
+
+static void _subscriber_remove_lk(int wsid) {
+  for (int i = 0, l = iwulist_length(&_g.subscribers); i < l; ++i) {
+    if (*(int*) iwulist_at2(&_g.subscribers, i) == wsid) {
+      iwulist_remove(&_g.subscribers, i);
+      break;
     }
   }
+}
+
+static void _subscriber_dispose(struct grh_user_data *ud) {
+  pthread_mutex_lock(&_g.mtx);
+  _subscriber_remove_lk((int) (intptr_t) ud->data);
+  pthread_mutex_unlock(&_g.mtx);
+  free(ud);
+}
+
+static iwrc _gauges_subscribe(struct ws_message_ctx *ctx, void *op) {
+  iwrc rc = 0;
+  const char *error = 0;
+  int wsid = ctx->wss->wsid;
+  struct grh_user_data *ud = 0;
+
+  if (!grh_auth_has_any_perms(ctx->wss->ws->req, "admin")) {
+    error = "error.insufficient_permissions";
+    goto finish;
+  }
+  if (grh_wss_get_data_of_type(ctx->wss, GRH_USER_DATA_TYPE_WS_GAUGES)) {
+    goto finish; // Subscribed already
+  }
+  RCB(finish, ud = malloc(sizeof(*ud)));
+  *ud = (struct grh_user_data) {
+    .type = GRH_USER_DATA_TYPE_WS_GAUGES,
+    .dispose = _subscriber_dispose,
+    .data = (void*) (intptr_t) wsid
+  };
+
+  pthread_mutex_lock(&_g.mtx);
+  rc = iwulist_push(&_g.subscribers, &wsid);
+  pthread_mutex_unlock(&_g.mtx);
+  if (rc) {
+    free(ud);
+    goto finish;
+  }
+  // Subscriber is removed by `_subscriber_dispose` when WS session is closed
+  grh_wss_set_data_of_type(ctx->wss, ud);
 
 finish:
-  jql_destroy(&q);
-  ejdb_list_destroy(&list);
-  jbl_destroy(&jbl);
-  return rc;
+  SIMPLE_HANDLER_FINISH_RET(0);
+}
+
+static iwrc _gauges_unsubscribe(struct ws_message_ctx *ctx, void *op) {
+  grh_wss_unset_data_of_type(ctx->wss, GRH_USER_DATA_TYPE_WS_GAUGES);
+  return grh_ws_send_confirm(ctx, 0);
 }
 
 static iwrc _gauge_set(uint32_t gauge, int64_t level) {
@@ -164,78 +391,73 @@ static iwrc _gauges_reset_all(void) {
   IWRC(_gauge_set_with_ts(ts, GAUGE_ROOMS, 0, 0), rc);
   IWRC(_gauge_set_with_ts(ts, GAUGE_ROOM_USERS, 0, 0), rc);
   IWRC(_gauge_set_with_ts(ts, GAUGE_STREAMS, 0, 0), rc);
+  IWRC(_gauge_set_with_ts(ts, GAUGE_RECORDINGS, 0, 0), rc);
+  IWRC(_gauge_set_with_ts(ts, GAUGE_RECORDING_LAG, 0, 0), rc);
   return rc;
 }
 
-static iwrc _get_visitor(EJDB_EXEC *ex, EJDB_DOC doc, int64_t *step) {
-  iwrc rc = 0;
-  int64_t t, g, l;
-  struct gctx *gctx = ex->opaque;
-
-  bool need_comma = true;
-  RCC(rc, finish, jbl_object_get_i64(doc->raw, "t", &t));
-  RCC(rc, finish, jbl_object_get_i64(doc->raw, "g", &g));
-  RCC(rc, finish, jbl_object_get_i64(doc->raw, "l", &l));
-
-  if ((gctx->first & g) == 0) {
-    gctx->first |= g;
-    uint64_t ts;
-    char buf[255];
-    RCC(rc, finish, iwp_current_time_ms(&ts, false));
-    snprintf(buf, sizeof(buf), "[%" PRId64 ",%" PRId64 ",%" PRId64 "],", (int64_t) (ts / 1000), g, l);
-    if (iwxstr_size(gctx->xstr) == 0) {
-      need_comma = false;
+/// Selects the ring having the most detailed data for the last `ts_back` seconds.
+static struct gring* _gauge_ring_select(struct gauge *g, int64_t ts_from, int64_t ts_back) {
+  struct gring *r = &g->rings[GRING_RAW];
+  // Raw ring has complete history if it was never wrapped
+  if (r->len && ((r->len < r->num) || (_gring_at(r, r->len - 1)->t <= ts_from))) {
+    return r;
+  }
+  for (int i = GRING_RAW + 1; i < GRING_NUM; ++i) {
+    r = &g->rings[i];
+    if ((int64_t) r->num * r->step >= ts_back) {
+      break;
     }
-    RCC(rc, finish, iwxstr_unshift(gctx->xstr, buf, strlen(buf)));
-  } else if (ex->cnt == 0) {
-    need_comma = false;
   }
+  return r;
+}
 
-  if (need_comma) {
-    RCC(rc, finish, iwxstr_cat(gctx->xstr, ",", 1));
-  }
+static iwrc _gauge_export_lk(struct gauge *g, int64_t ts, int64_t ts_from, int64_t ts_back, IWXSTR *xstr) {
+  iwrc rc = 0;
+  struct gring *r = _gauge_ring_select(g, ts_from, ts_back);
 
-  RCC(rc, finish, iwxstr_printf(gctx->xstr, "[%" PRId64 ",%" PRId64 ",%" PRId64 "]", t, g, l));
+  // Current gauge level goes first
+  RCR(iwxstr_printf(xstr, "%s[%" PRId64 ",%" PRIu32 ",%" PRId64 "]",
+                    iwxstr_size(xstr) > 1 ? "," : "", ts, g->type, g->level));
 
-  if (t <= gctx->ts_from) {
-    *step = 0;
-    return 0;
+  for (uint32_t i = 0; i < r->len; ++i) {
+    struct gpoint *p = _gring_at(r, i);
+    RCR(iwxstr_printf(xstr, ",[%" PRId64 ",%" PRIu32 ",%" PRId64 "]", p->t, g->type, p->l));
+    if (p->t <= ts_from) {
+      break;
+    }
   }
-
-finish:
   return rc;
 }
 
 static int _gauges_get(int64_t ts_back, struct iwn_wf_req *req) {
   iwrc rc = 0;
   int ret = 500;
-  JQL q = 0;
-  uint64_t ts_from;
-
-  RCC(rc, finish, iwp_current_time_ms(&ts_from, false));
-  ts_from = ts_from / 1000 - ts_back;
-
-  RCC(rc, finish, jql_create(&q, "gauges", "/*"));
+  uint64_t ts;
+  IWXSTR *xstr = 0;
 
-  struct gctx gctx = {
-    .ts_from = ts_from,
-  };
-  RCB(finish, gctx.xstr = iwxstr_new());
-  EJDB_EXEC ex = {
-    .db      = g_env.db,
-    .q       = q,
-    .visitor = _get_visitor,
-    .opaque  = &gctx,
-  };
+  RCC(rc, finish, iwp_current_time_ms(&ts, false));
+  ts /= 1000;
+  RCB(finish, xstr = iwxstr_new());
+  RCC(rc, finish, iwxstr_cat(xstr, "[", 1));
+
+  pthread_mutex_lock(&_g.mtx);
+  for (int i = 0; !rc && i < GAUGES_NUM; ++i) {
+    struct gauge *g = &_g.gauges[i];
+    _gauge_put_lk(g, ts, g->level);
+    rc = _gauge_export_lk(g, ts, ts - ts_back, ts_back, xstr);
+  }
+  pthread_mutex_unlock(&_g.mtx);
+  RCGO(rc, finish);
 
-  RCC(rc, finish, ejdb_exec(&ex));
-  RCC(rc, finish, iwxstr_unshift(gctx.xstr, "[", 1));
-  RCC(rc, finish, iwxstr_cat(gctx.xstr, "]", 1));
-  ret = iwn_http_response_gz(req->http, "application/json", iwxstr_ptr(gctx.xstr), iwxstr_size(gctx.xstr), true);
+  RCC(rc, finish, iwxstr_cat(xstr, "]", 1));
+  ret = iwn_http_response_gz(req->http, "application/json", iwxstr_ptr(xstr), iwxstr_size(xstr), true);
 
 finish:
-  iwxstr_destroy(gctx.xstr);
-  jql_destroy(&q);
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
+  iwxstr_destroy(xstr);
   return ret;
 }
 
@@ -252,11 +474,16 @@ static int _week(struct iwn_wf_req *req, void *d) {
 }
 
 static int _month(struct iwn_wf_req *req, void *d) {
-  return _gauges_get(60 * 60 * 24 * 7 * 30, req);
+  return _gauges_get(60 * 60 * 24 * 30, req);
 }
 
 iwrc grh_route_gauges(const struct iwn_wf_route *parent) {
-  iwrc rc = RCR(_gauges_reset_all());
+  iwrc rc = 0;
+
+  RCC(rc, finish, grh_ws_register_wsh_handler(
+        "gauges_subscribe", "gr_gauges::gauges_subscribe", _gauges_subscribe, 0, 0));
+  RCC(rc, finish, grh_ws_register_wsh_handler(
+        "gauges_unsubscribe", "gr_gauges::gauges_unsubscribe", _gauges_unsubscribe, 0, 0));
 
   RCC(rc, finish, iwn_wf_route(&(struct iwn_wf_route) {
     .parent = parent,
@@ -286,59 +513,233 @@ finish:
   return rc;
 }
 
-iwrc _gr_gauges_maintain_type(uint64_t ts, int64_t type, IWPOOL *pool) {
+static iwrc _snapshot_save(void) {
   iwrc rc = 0;
-  JQL q;
-  JBL_NODE n1, n2, n3;
-  EJDB_DOC doc1, doc2;
-  int64_t id;
-
-  // EJDB lists rows from recent to older
-  // So to make gauges to be accessible when selecting time segment when there were no changes
-  // We can just maintain last db entry:
-  // If last two entries have same numbers, latest is maintained one, change it's timestamp
-  // If last two entries have different numbers, create next with the same to maintain
-  // And make sure that history is correct: delete created entry if there is something new
-
-  RCC(rc, finish, jql_create(&q, "gauges", "/[g = :?] | /{t,g,l}"));
-  RCC(rc, finish, jql_set_i64(q, 0, 0, type));
-  RCC(rc, finish, ejdb_list(g_env.db, q, &doc1, 2, pool));
-  if (doc1 && !jbn_at(doc1->node, "/t", &n1) && n1->type == JBV_I64) {
-    const bool got_n2 = !jbn_at(doc1->node, "/l", &n2) && n2->type == JBV_I64;
-    const bool got_n3 = doc1->next && !jbn_at(doc1->next->node, "/l", &n3) && n3->type == JBV_I64;
-    if (doc1->next && got_n2 && got_n3 && n2->vi64 == n3->vi64) {
-      n1->vi64 = ts;
-      RCC(rc, finish, ejdb_put_jbn(g_env.db, "gauges", doc1->node, doc1->id));
-    } else {
-      n1->vi64 = ts;
-      RCC(rc, finish, ejdb_put_new_jbn(g_env.db, "gauges", doc1->node, &id));
+  FILE *f = 0;
+  IWXSTR *xstr = 0, *path = 0, *path_tmp = 0;
+
+  RCB(finish, xstr = iwxstr_new2(64 * 1024));
+  RCB(finish, path = iwxstr_new());
+  RCB(finish, path_tmp = iwxstr_new());
+  RCC(rc, finish, iwxstr_printf(path, "%s/%s", g_env.data_dir, GAUGES_SNAPSHOT_FILE));
+  RCC(rc, finish, iwxstr_printf(path_tmp, "%s.tmp", iwxstr_ptr(path)));
+
+  pthread_mutex_lock(&_g.mtx);
+  struct snapshot_header h = {
+    .magic = GAUGES_SNAPSHOT_MAGIC,
+    .version = GAUGES_SNAPSHOT_VERSION,
+    .gauges_num = GAUGES_NUM,
+    .rings_num = GRING_NUM
+  };
+  rc = iwxstr_cat(xstr, &h, sizeof(h));
+  for (int i = 0; !rc && i < GAUGES_NUM; ++i) {
+    struct gauge *g = &_g.gauges[i];
+    struct snapshot_gauge sg = {
+      .type = g->type,
+      .level = g->level
+    };
+    rc = iwxstr_cat(xstr, &sg, sizeof(sg));
+    for (int j = 0; !rc && j < GRING_NUM; ++j) {
+      struct gring *r = &g->rings[j];
+      struct snapshot_ring sr = {
+        .num = r->num,
+        .step = r->step,
+        .len = r->len
+      };
+      rc = iwxstr_cat(xstr, &sr, sizeof(sr));
+      for (uint32_t k = r->len; !rc && k > 0; --k) { // From oldest to recent
+        rc = iwxstr_cat(xstr, _gring_at(r, k - 1), sizeof(struct gpoint));
+      }
+    }
+  }
+  if (!rc) {
+    _g.dirty = false;
+  }
+  pthread_mutex_unlock(&_g.mtx);
+  RCGO(rc, finish);
+
+  f = fopen(iwxstr_ptr(path_tmp), "w");
+  if (!f) {
+    rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+    goto finish;
+  }
+  if (fwrite(iwxstr_ptr(xstr), iwxstr_size(xstr), 1, f) != 1) {
+    rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+    goto finish;
+  }
+  if (fclose(f)) {
+    f = 0;
+    rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+    goto finish;
+  }
+  f = 0;
+  if (rename(iwxstr_ptr(path_tmp), iwxstr_ptr(path))) {
+    rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+  }
+
+finish:
+  if (f) {
+    fclose(f);
+  }
+  if (rc) {
+    pthread_mutex_lock(&_g.mtx);
+    _g.dirty = true;
+    pthread_mutex_unlock(&_g.mtx);
+  }
+  iwxstr_destroy(xstr);
+  iwxstr_destroy(path);
+  iwxstr_destroy(path_tmp);
+  return rc;
+}
 
-      RCC(rc, finish, ejdb_list(g_env.db, q, &doc2, 2, pool));
-      if (doc2 && (doc2->id != id || (doc2->next && doc2->next->id != doc1->id))) {
-        RCC(rc, finish, ejdb_del(g_env.db, "gauges", id));
+#define _SNAPSHOT_READ(ptr_, size_)                 \
+  if (end - rp < (ssize_t) (size_)) {               \
+    rc = IW_ERROR_INVALID_VALUE;                    \
+    goto finish;                                    \
+  }                                                 \
+  memcpy((ptr_), rp, (size_));                      \
+  rp += (size_)
+
+/// Loads gauges from snapshot file.
+/// Returns IW_ERROR_NOT_EXISTS if there is no snapshot file.
+static iwrc _snapshot_load(void) {
+  iwrc rc = 0;
+  FILE *f = 0;
+  char *data = 0;
+  size_t len = 0;
+  IWXSTR *path = 0;
+  struct stat st;
+  struct snapshot_header h;
+
+  RCB(finish, path = iwxstr_new());
+  RCC(rc, finish, iwxstr_printf(path, "%s/%s", g_env.data_dir, GAUGES_SNAPSHOT_FILE));
+  f = fopen(iwxstr_ptr(path), "r");
+  if (!f) {
+    rc = errno == ENOENT ? IW_ERROR_NOT_EXISTS : iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+    goto finish;
+  }
+  if (fstat(fileno(f), &st)) {
+    rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+    goto finish;
+  }
+  len = st.st_size;
+  RCB(finish, data = malloc(len ? len : 1));
+  if (len && (fread(data, len, 1, f) != 1)) {
+    rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+    goto finish;
+  }
+
+  const char *rp = data, *end = data + len;
+  _SNAPSHOT_READ(&h, sizeof(h));
+  if (  (h.magic != GAUGES_SNAPSHOT_MAGIC) || (h.version != GAUGES_SNAPSHOT_VERSION)
+     || (h.rings_num != GRING_NUM)) {
+    rc = IW_ERROR_INVALID_VALUE;
+    goto finish;
+  }
+
+  for (uint32_t i = 0; i < h.gauges_num; ++i) {
+    struct snapshot_gauge sg;
+    _SNAPSHOT_READ(&sg, sizeof(sg));
+    struct gauge *g = _gauge_find(sg.type);
+    if (g) {
+      g->level = sg.level;
+    }
+    for (int j = 0; j < GRING_NUM; ++j) {
+      struct snapshot_ring sr;
+      _SNAPSHOT_READ(&sr, sizeof(sr));
+      struct gring *r = g ? &g->rings[j] : 0;
+      if (r && ((sr.num != r->num) || (sr.step != r->step))) {
+        r = 0; // Ring geometry was changed, skip it
+      }
+      for (uint32_t k = 0; k < sr.len; ++k) {
+        struct gpoint p;
+        _SNAPSHOT_READ(&p, sizeof(p));
+        if (r) {
+          _gring_push(r, p.t, p.l);
+        }
       }
     }
   }
 
 finish:
-  jql_destroy(&q);
+  if (f) {
+    fclose(f);
+  }
+  free(data);
+  iwxstr_destroy(path);
   return rc;
 }
 
-iwrc gr_gauges_maintain(void) {
+#undef _SNAPSHOT_READ
+
+/// Imports gauges stored in `gauges` collection by previous versions.
+static iwrc _legacy_import(void) {
   iwrc rc = 0;
-  IWPOOL *pool = 0;
+  JQL q = 0;
+  EJDB_LIST list = 0;
   uint64_t ts;
 
-  RCR(iwp_current_time_ms(&ts, false));
-  ts /= 1000;
+  RCC(rc, finish, iwp_current_time_ms(&ts, false));
+  RCC(rc, finish, jql_create(&q, "gauges", "/[t >= :?] | asc /t"));
+  RCC(rc, finish, jql_set_i64(q, 0, 0, ts / 1000 - GAUGES_HISTORY_SEC));
+  RCC(rc, finish, ejdb_list4(g_env.db, q, 0, 0, &list));
+
+  pthread_mutex_lock(&_g.mtx);
+  for (EJDB_DOC doc = list->first; doc; doc = doc->next) {
+    int64_t t, g, l;
+    if (  !jbl_object_get_i64(doc->raw, "t", &t)
+       && !jbl_object_get_i64(doc->raw, "g", &g)
+       && !jbl_object_get_i64(doc->raw, "l", &l)) {
+      struct gauge *gauge = _gauge_find(g);
+      if (gauge) {
+        _gauge_put_lk(gauge, t, l);
+      }
+    }
+  }
+  pthread_mutex_unlock(&_g.mtx);
 
-  RCB(finish, pool = iwpool_create_empty());
-  RCC(rc, finish, _gr_gauges_maintain_type(ts, GAUGE_ROOMS, pool));
-  RCC(rc, finish, _gr_gauges_maintain_type(ts, GAUGE_ROOM_USERS, pool));
-  RCC(rc, finish, _gr_gauges_maintain_type(ts, GAUGE_STREAMS, pool));
+  RCC(rc, finish, _snapshot_save());
+  rc = ejdb_remove_collection(g_env.db, "gauges");
 
 finish:
-  iwpool_destroy(pool);
+  jql_destroy(&q);
+  ejdb_list_destroy(&list);
   return rc;
 }
+
+static void _shutdown(void *d) {
+  iwrc rc = _snapshot_save();
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
+}
+
+iwrc gr_gauges_init(void) {
+  iwrc rc = RCR(iwulist_init(&_g.subscribers, 16, sizeof(int)));
+  rc = _snapshot_load();
+  if (rc == IW_ERROR_NOT_EXISTS) {
+    rc = _legacy_import();
+  }
+  if (rc) {
+    iwlog_ecode_warn(rc, "Failed to load gauges history");
+  }
+  rc = _gauges_reset_all();
+  gr_shutdown_hook_add(_shutdown, 0);
+  return rc;
+}
+
+iwrc gr_gauges_maintain(void) {
+  uint64_t ts;
+  RCR(iwp_current_time_ms(&ts, false));
+  ts /= 1000;
+
+  pthread_mutex_lock(&_g.mtx);
+  for (int i = 0; i < GAUGES_NUM; ++i) {
+    struct gauge *g = &_g.gauges[i];
+    _gauge_put_lk(g, ts, g->level);
+  }
+  bool dirty = _g.dirty;
+  pthread_mutex_unlock(&_g.mtx);
+
+  return dirty ? _snapshot_save() : 0;
+}
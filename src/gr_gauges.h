@@ -21,9 +21,20 @@
 #define  GAUGE_ROOMS        0x01U   ///< Number of rooms
 #define  GAUGE_ROOM_USERS   0x02U   ///< Number of room users
 #define  GAUGE_STREAMS      0x08U   ///< Number of network WebRTC streams
+#define  GAUGE_RECORDINGS   0x10U   ///< Number of recorded media streams
+#define  GAUGE_RECORDING_LAG 0x20U  ///< Max lag of media stream recorders in milliseconds
 
 iwrc gr_gauge_set_async(uint32_t gauge, int64_t level);
 
+/**
+ * @brief Loads gauges history snapshot from data directory and resets gauges levels.
+ */
+iwrc gr_gauges_init(void);
+
+/**
+ * @brief Advances gauges time series up to the current time
+ *        and saves gauges snapshot into data directory if gauges were changed.
+ */
 iwrc gr_gauges_maintain(void);
 
 iwrc grh_route_gauges(const struct iwn_wf_route *parent);
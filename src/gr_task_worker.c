@@ -19,6 +19,8 @@
 
 #include "acme/acme.h"
 #include "gr_gauges.h"
+#include "grh_auth.h"
+#include "grh_session.h"
 #include "lic_env.h"
 
 #include <iwnet/iwn_scheduler.h>
@@ -29,6 +31,7 @@
 #include <ejdb2/iowow/iwarr.h>
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
@@ -36,6 +39,7 @@
 static IWSTW _stw;
 
 static void _on_timeout();
+static void _pt_leases_renew(void);
 static iwrc _do_persistent_tasks();
 
 static void _next_run() {
@@ -50,87 +54,248 @@ static void _next_run() {
   }
 }
 
-static void _on_timeout(void *arg) {
-  iwrc rc = 0;
-  JQL q = 0;
-  uint64_t ts;
-  RCC(rc, finish, iwp_current_time_ms(&ts, false));
+///////////////////////////////////////////////////////////////////////////
+//		                    Expired data cleanup                           //
+///////////////////////////////////////////////////////////////////////////
 
-  int64_t timeout = (int64_t) g_env.periodic_worker.expire_guest_session_timeout_sec * 1000;
-  if ((timeout > 0) && (timeout < ts)) {
-    RCC(rc, finish, jql_create(&q, "sessions", "/[__ts__ <= :?] and /[__perms__ = :?] | del"));
-    RCC(rc, finish, jql_set_i64(q, 0, 0, ts - timeout));
-    RCC(rc, finish, jql_set_str(q, 0, 1, "guest"));
-    rc = ejdb_update(g_env.db, q);
-    if (rc) {
-      iwlog_ecode_error3(rc);
-    }
+/// Max number of documents removed in a single cleanup batch
+#define CLEANUP_BATCH_SIZE 128
+/// Max number of documents checked in a single cleanup batch
+#define CLEANUP_BATCH_SCAN (CLEANUP_BATCH_SIZE * 8)
+/// Pause before continuation of cleanup interrupted by time budget
+#define CLEANUP_PAUSE_MS 1000
+
+/// Removal of expired documents using range scan over indexed expiry `field` of collection.
+struct sweep {
+  const char *coll;
+  const char *field;
+  const char *query;          ///< Range scan query, lower bound of `field` is bound to placeholder
+  const int  *timeout_sec;    ///< Documents having `field` older than timeout are expired
+  const bool *enabled;        ///< Optional sweep enabled flag
+  bool (*match)(JBL doc);     ///< Optional filter of expired documents
+  int64_t     cursor;         ///< Documents having `field` below cursor are already checked
+};
+
+struct sweep_ctx {
+  struct sweep *s;
+  int64_t cutoff;
+  int     scanned;
+  bool    more;
+  IWULIST ids;
+};
+
+static bool _sweep_match_guest_session(JBL doc) {
+  const char *perms = 0;
+  return !jbl_object_get_str(doc, GR_PERMISSIONS_SESSION_KEY, &perms) && !strcmp(perms, "guest");
+}
 
-    jql_destroy(&q);
-    RCC(rc, finish, jql_create(&q, "users", "/[ctime <= :?] and /[guest = :?] | del"));
-    RCC(rc, finish, jql_set_i64(q, 0, 0, ts - timeout));
-    RCC(rc, finish, jql_set_bool(q, 0, 1, true));
-    rc = ejdb_update(g_env.db, q);
-    if (rc) {
-      iwlog_ecode_error3(rc);
-    }
+static bool _sweep_match_guest_user(JBL doc) {
+  bool guest = false;
+  return !jbl_object_get_bool(doc, "guest", &guest) && guest;
+}
+
+static struct sweep _sweeps[] = {
+  {
+    .coll        = "sessions",
+    .field       = "__ts__",
+    .query       = "/[__ts__ >= :?] | asc /__ts__",
+    .timeout_sec = &g_env.periodic_worker.expire_guest_session_timeout_sec,
+    .match       = _sweep_match_guest_session,
+  },
+  {
+    .coll        = "users",
+    .field       = "ctime",
+    .query       = "/[ctime >= :?] | asc /ctime",
+    .timeout_sec = &g_env.periodic_worker.expire_guest_session_timeout_sec,
+    .match       = _sweep_match_guest_user,
+  },
+  {
+    .coll        = "sessions",
+    .field       = "__ts__",
+    .query       = "/[__ts__ >= :?] | asc /__ts__",
+    .timeout_sec = &g_env.periodic_worker.expire_session_timeout_sec,
+  },
+  {
+    .coll        = "tickets",
+    .field       = "ts",
+    .query       = "/[ts >= :?] | asc /ts",
+    .timeout_sec = &g_env.periodic_worker.expire_ws_ticket_timeout_sec,
+    .enabled     = &g_env.ws.tickets_db,
+  },
+  {
+    .coll        = "whiteboards",
+    .field       = "ctime",
+    .query       = "/[ctime >= :?] | asc /ctime",
+    .timeout_sec = &g_env.whiteboard.room_data_ttl_sec,
+  },
+  {
+    .coll        = "whiteboard_ops",
+    .field       = "ts",
+    .query       = "/[ts >= :?] | asc /ts",
+    .timeout_sec = &g_env.whiteboard.room_data_ttl_sec,
+  },
+};
+
+#define SWEEPS_NUM (sizeof(_sweeps) / sizeof(_sweeps[0]))
+
+static struct {
+  pthread_mutex_t mtx;
+  size_t idx;     ///< Sweep to start the next cleanup run with
+  bool   busy;    ///< Cleanup is in progress
+  bool   pending; ///< Continuation of cleanup is scheduled
+} _cleanup = {
+  .mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static iwrc _sweep_visitor(EJDB_EXEC *ux, EJDB_DOC doc, int64_t *step) {
+  int64_t v;
+  struct sweep_ctx *ctx = ux->opaque;
+  if (jbl_object_get_i64(doc->raw, ctx->s->field, &v)) {
+    return 0;
+  }
+  if (v > ctx->cutoff) { // Reached not expired documents
+    *step = 0;
+    return 0;
   }
+  ctx->s->cursor = v;
+  if (!ctx->s->match || ctx->s->match(doc->raw)) {
+    RCR(iwulist_push(&ctx->ids, &doc->id));
+  }
+  if (ctx->ids.num >= CLEANUP_BATCH_SIZE || ++ctx->scanned >= CLEANUP_BATCH_SCAN) {
+    ctx->more = true;
+    *step = 0;
+  }
+  return 0;
+}
 
-  timeout = (int64_t) g_env.periodic_worker.expire_session_timeout_sec * 1000;
-  if ((timeout > 0) && (timeout < ts)) {
-    jql_destroy(&q);
-    RCC(rc, finish, jql_create(&q, "sessions", "/[__ts__ <= :?] | del"));
-    RCC(rc, finish, jql_set_i64(q, 0, 0, ts - timeout));
-    rc = ejdb_update(g_env.db, q);
-    if (rc) {
-      iwlog_ecode_error3(rc);
+/// Removes next batch of expired documents, sets `more` if sweep is not completed.
+static iwrc _sweep_batch(struct sweep *s, int64_t cutoff, bool *more) {
+  JQL q = 0;
+  struct sweep_ctx ctx = {
+    .s      = s,
+    .cutoff = cutoff,
+  };
+  *more = false;
+  iwrc rc = RCR(iwulist_init(&ctx.ids, 32, sizeof(int64_t)));
+  RCC(rc, finish, jql_create(&q, s->coll, s->query));
+  RCC(rc, finish, jql_set_i64(q, 0, 0, s->cursor));
+  RCC(rc, finish, ejdb_exec(&(EJDB_EXEC) {
+    .db = g_env.db,
+    .q = q,
+    .opaque = &ctx,
+    .visitor = _sweep_visitor
+  }));
+  for (size_t i = 0; i < ctx.ids.num; ++i) {
+    iwrc rc2 = ejdb_del(g_env.db, s->coll, *(int64_t*) iwulist_at2(&ctx.ids, i));
+    if (rc2 && rc2 != IW_ERROR_NOT_EXISTS) {
+      iwlog_ecode_error3(rc2);
     }
   }
+  *more = ctx.more;
 
-  timeout = (int64_t) g_env.periodic_worker.expire_ws_ticket_timeout_sec * 1000;
-  if ((timeout > 0) && (timeout < ts)) {
-    jql_destroy(&q);
-    RCC(rc, finish, jql_create(&q, "tickets", "/[ts <= :?] | del"));
-    RCC(rc, finish, jql_set_i64(q, 0, 0, ts - timeout));
-    rc = ejdb_update(g_env.db, q);
-    if (rc) {
-      iwlog_ecode_error3(rc);
+finish:
+  jql_destroy(&q);
+  iwulist_destroy_keep(&ctx.ids);
+  return rc;
+}
+
+/// Runs sweeps until all expired documents are removed or time budget is exhausted.
+/// Returns true if cleanup was interrupted by time budget.
+static bool _cleanup_run(void) {
+  uint64_t start, ts;
+  if (iwp_current_time_ms(&start, false)) {
+    return false;
+  }
+  pthread_mutex_lock(&_cleanup.mtx);
+  size_t idx = _cleanup.idx;
+  pthread_mutex_unlock(&_cleanup.mtx);
+
+  for (size_t i = 0; i < SWEEPS_NUM && !g_env.shutdown; ++i) {
+    struct sweep *s = &_sweeps[(idx + i) % SWEEPS_NUM];
+    int64_t timeout = (int64_t) *s->timeout_sec * 1000;
+    if ((s->enabled && !*s->enabled) || (timeout <= 0) || (timeout >= start)) {
+      continue;
     }
+    bool more;
+    do {
+      iwrc rc = _sweep_batch(s, start - timeout, &more);
+      if (rc) {
+        iwlog_ecode_error(rc, "Failed to remove expired documents of: %s", s->coll);
+        break;
+      }
+      if (more && !iwp_current_time_ms(&ts, false)
+          && (ts - start >= g_env.periodic_worker.cleanup_time_budget_ms)) {
+        pthread_mutex_lock(&_cleanup.mtx);
+        _cleanup.idx = (idx + i) % SWEEPS_NUM; // Continue with this sweep next time
+        pthread_mutex_unlock(&_cleanup.mtx);
+        return true;
+      }
+    } while (more && !g_env.shutdown);
   }
+  return false;
+}
 
-  if (g_env.periodic_worker.dispose_gauges_older_than_sec > 0) {
-    // Gleanup old gauges
-    int64_t t = ts / 1000 - g_env.periodic_worker.dispose_gauges_older_than_sec;
-    jql_destroy(&q);
-    RCC(rc, finish, jql_create(&q, "gauges", "/[t < :?] | del"));
-    RCC(rc, finish, jql_set_i64(q, 0, 0, t));
-    rc = ejdb_update(g_env.db, q);
-    if (rc) {
-      iwlog_ecode_error3(rc);
-    }
+static void _cleanup_continue(void *arg);
+
+static void _cleanup_do(void) {
+  pthread_mutex_lock(&_cleanup.mtx);
+  if (_cleanup.busy) {
+    pthread_mutex_unlock(&_cleanup.mtx);
+    return;
   }
+  _cleanup.busy = true;
+  pthread_mutex_unlock(&_cleanup.mtx);
+
+  bool more = _cleanup_run();
 
-  timeout = (int64_t) g_env.whiteboard.room_data_ttl_sec * 1000;
-  if ((timeout > 0) && (timeout < ts)) {
-    jql_destroy(&q);
-    RCC(rc, finish, jql_create(&q, "whiteboards", "/[ctime <= :?] | del"));
-    RCC(rc, finish, jql_set_i64(q, 0, 0, ts - timeout));
-    rc = ejdb_update(g_env.db, q);
+  pthread_mutex_lock(&_cleanup.mtx);
+  _cleanup.busy = false;
+  more = more && !_cleanup.pending && !g_env.shutdown;
+  if (more) {
+    _cleanup.pending = true;
+  }
+  pthread_mutex_unlock(&_cleanup.mtx);
+
+  if (more) {
+    iwrc rc = iwn_schedule(&(struct iwn_scheduler_spec) {
+      .poller = g_env.poller,
+      .task_fn = _cleanup_continue,
+      .timeout_ms = CLEANUP_PAUSE_MS,
+    });
     if (rc) {
       iwlog_ecode_error3(rc);
+      pthread_mutex_lock(&_cleanup.mtx);
+      _cleanup.pending = false;
+      pthread_mutex_unlock(&_cleanup.mtx);
     }
   }
+}
+
+static void _cleanup_continue(void *arg) {
+  pthread_mutex_lock(&_cleanup.mtx);
+  _cleanup.pending = false;
+  pthread_mutex_unlock(&_cleanup.mtx);
+  _cleanup_do();
+}
 
-  RCC(rc, finish, gr_gauges_maintain());
+static void _on_timeout(void *arg) {
+  iwrc rc = 0;
+
+  _cleanup_do();
+
+  grh_session_cache_maintain();
+
+  rc = gr_gauges_maintain();
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
 
   if (g_env.domain_name) {
     acme_sync_consumer_detached(0, acme_consumer_callback);
   }
 
+  _pt_leases_renew();
   _do_persistent_tasks();
-
-finish:
-  jql_destroy(&q);
   _next_run();
 }
 
@@ -142,24 +307,25 @@ finish:
 #include "rec/recording_postproc.h"
 #endif
 
-static iwrc _pt_task_visitor(EJDB_EXEC *exec, EJDB_DOC doc, int64_t *step) {
-  iwrc rc = 0;
-  int64_t status = 0;
-  IWULIST *pending = exec->opaque;
-  RCC(rc, finish, jbl_object_get_i64(doc->raw, "status", &status));
-  if (status) { // We have reached a one of completed task
-    *step = 0;
-    goto finish;
-  }
-  iwulist_push(pending, &doc->id);
+/// Max retry delay of postponed task
+#define PT_RETRY_DELAY_MAX_MS (3600 * 1000LL)
 
-finish:
-  if (rc) {
-    iwlog_ecode_error3(rc);
-    *step = 0;
-  }
-  return 0;
-}
+/// Task taken by this process
+struct pt_running {
+  int64_t id;
+  char   *hook;
+  struct pt_running *next;
+};
+
+static struct {
+  pthread_mutex_t    mtx;
+  IWTP tp;                    ///< Task handlers thread pool
+  struct pt_running *running; ///< Tasks currently executed by this process
+  int      num_running;
+  uint64_t wakeup_at;         ///< Time of scheduled queue wakeup, zero if not scheduled
+} _pt = {
+  .mtx = PTHREAD_MUTEX_INITIALIZER,
+};
 
 static int(*_pt_handler_get(int type))(int64_t, JBL) {
   // Hardcodec task handlers
@@ -167,12 +333,16 @@ static int(*_pt_handler_get(int type))(int64_t, JBL) {
 #if (ENABLE_RECORDING == 1)
     case PT_RECORDING_POSTPROC:
       return recording_postproc;
+    case PT_RECORDING_PRERENDER:
+      return recording_prerender;
 #endif
   }
   return 0;
 }
 
-static void _pt_task_update(int64_t id, int status, const char *log, iwrc rc_status) {
+/// Updates task state and stores number of failed execution `attempts` if not negative.
+/// Finished task (status != 0) is removed from `/next` index.
+static void _pt_task_update(int64_t id, int status, int64_t next, int64_t attempts, const char *log, iwrc rc_status) {
   JBL_NODE n;
   iwrc rc = 0;
   IWPOOL *pool = iwpool_create_empty();
@@ -182,6 +352,14 @@ static void _pt_task_update(int64_t id, int status, const char *log, iwrc rc_sta
   }
   RCC(rc, finish, jbn_from_json("{}", &n, pool));
   RCC(rc, finish, jbn_add_item_i64(n, "status", status, 0, pool));
+  if (status) {
+    RCC(rc, finish, jbn_add_item_null(n, "next", pool));
+  } else {
+    RCC(rc, finish, jbn_add_item_i64(n, "next", next, 0, pool));
+  }
+  if (attempts >= 0) {
+    RCC(rc, finish, jbn_add_item_i64(n, "attempts", attempts, 0, pool));
+  }
   if (log) {
     RCC(rc, finish, jbn_add_item_str(n, "log", log, -1, 0, pool));
   }
@@ -194,78 +372,357 @@ finish:
   }
 }
 
-static void _persistent_tasks_worker(void *arg) {
+/// Takes a lease on task for `task_lease_sec`.
+/// Lease is not an execution attempt, so task resumed after crash or restart of its process is not penalized.
+static iwrc _pt_task_lease(int64_t id, uint64_t ts) {
+  JBL_NODE n;
+  IWPOOL *pool = iwpool_create_empty();
+  if (!pool) {
+    return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+  }
+  iwrc rc = 0;
+  RCC(rc, finish, jbn_from_json("{}", &n, pool));
+  RCC(rc, finish, jbn_add_item_i64(n, "next", ts + g_env.periodic_worker.task_lease_sec * 1000LL, 0, pool));
+  RCC(rc, finish, ejdb_patch_jbn(g_env.db, "tasks", n, id));
+
+finish:
+  iwpool_destroy(pool);
+  return rc;
+}
+
+static bool _pt_is_running_lk(int64_t id, const char *hook) {
+  for (struct pt_running *r = _pt.running; r; r = r->next) {
+    if (r->id == id || (hook && r->hook && strcmp(r->hook, hook) == 0)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void _pt_running_remove(struct pt_running *run) {
+  pthread_mutex_lock(&_pt.mtx);
+  for (struct pt_running *r = _pt.running, *prev = 0; r; prev = r, r = r->next) {
+    if (r == run) {
+      if (prev) {
+        prev->next = r->next;
+      } else {
+        _pt.running = r->next;
+      }
+      --_pt.num_running;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&_pt.mtx);
+  free(run->hook);
+  free(run);
+}
+
+/// Executes leased task on handlers thread pool.
+static void _pt_task_worker(void *arg) {
+  struct pt_running *run = arg;
+  int64_t id = run->id, type, attempts = 0;
+  int status = 0;
+  uint64_t ts;
+  JBL doc = 0;
+
+  iwrc rc = ejdb_get(g_env.db, "tasks", id, &doc);
+  if (rc) {
+    iwlog_ecode_error3(rc);
+    goto finish;
+  }
+  rc = jbl_object_get_i64(doc, "type", &type);
+  if (rc) {
+    _pt_task_update(id, -1, 0, -1, "Invalid task data", rc);
+    goto finish;
+  }
+  jbl_object_get_i64(doc, "attempts", &attempts);
+
+  int (*handler)(int64_t, JBL) = _pt_handler_get(type);
+  if (!handler) {
+    iwlog_warn("Unsupported/disabled task of type %" PRId64 " task: %" PRId64, type, id);
+    _pt_task_update(id, -1, 0, -1, 0, 0);
+    goto finish;
+  }
+  status = handler(id, doc);
+
+  if (status) {
+    _pt_task_update(id, status, 0, -1, 0, 0);
+  } else if (iwp_current_time_ms(&ts, false)) {
+    ; // Lease will expire so task will be resumed later
+  } else if (g_env.shutdown) {
+    // Interrupted by shutdown, it is not a failure of task so it is resumed on the next start
+    _pt_task_update(id, 0, ts, -1, 0, 0);
+  } else {
+    // Postponed by handler, retry with exponential backoff
+    ++attempts;
+    int64_t delay = g_env.periodic_worker.task_retry_delay_sec * 1000LL;
+    for (int64_t i = 1; i < attempts && delay < PT_RETRY_DELAY_MAX_MS; ++i) {
+      delay *= 2;
+    }
+    if (delay > PT_RETRY_DELAY_MAX_MS) {
+      delay = PT_RETRY_DELAY_MAX_MS;
+    }
+    iwlog_warn("Task %" PRId64 " postponed by handler, attempt: %" PRId64 " next run in %" PRId64 " sec",
+               id, attempts, delay / 1000);
+    _pt_task_update(id, 0, ts + delay, attempts, 0, 0);
+  }
+
+finish:
+  jbl_destroy(&doc);
+  _pt_running_remove(run);
+  _do_persistent_tasks();
+}
+
+static void _pt_wakeup(void *arg) {
+  pthread_mutex_lock(&_pt.mtx);
+  _pt.wakeup_at = 0;
+  pthread_mutex_unlock(&_pt.mtx);
+  _do_persistent_tasks();
+}
+
+/// Schedules queue check at the time of the nearest postponed task.
+static void _pt_wakeup_schedule(uint64_t ts) {
   JQL q = 0;
-  IWULIST pending = { 0 };
-  iwrc rc = jql_create(&q, "tasks", "/*");
-  EJDB_EXEC ux = {
-    .db      = g_env.db,
-    .q       = q,
-    .opaque  = &pending,
-    .visitor = _pt_task_visitor
-  };
-  RCGO(rc, finish);
-  RCC(rc, finish, iwulist_init(&pending, 32, sizeof(int64_t)));
+  EJDB_LIST list = 0;
+  uint64_t at = 0;
+
+  pthread_mutex_lock(&_pt.mtx);
+  int limit = _pt.num_running + 1;
+  pthread_mutex_unlock(&_pt.mtx);
 
-  while (pending.num == 0) {
-    RCC(rc, finish, ejdb_exec(&ux));
-    if (pending.num == 0) {
+  iwrc rc = jql_create(&q, "tasks", "/[next > :?] | asc /next");
+  RCGO(rc, finish);
+  RCC(rc, finish, jql_set_i64(q, 0, 0, ts));
+  RCC(rc, finish, ejdb_list4(g_env.db, q, limit, 0, &list));
+
+  pthread_mutex_lock(&_pt.mtx);
+  for (EJDB_DOC doc = list->first; doc; doc = doc->next) {
+    int64_t next = 0;
+    if (!_pt_is_running_lk(doc->id, 0) && !jbl_object_get_i64(doc->raw, "next", &next)) {
+      at = next;
       break;
     }
-    while (pending.num) {
-      int status = 0;
-      JBL doc = 0;
-      int64_t type;
-      int64_t id = *(int64_t*) iwulist_at2(&pending, pending.num - 1);
-      iwulist_pop(&pending);
-
-      if (g_env.shutdown) {
-        goto finish;
-      }
+  }
+  if (at && (_pt.wakeup_at == 0 || at < _pt.wakeup_at)) {
+    _pt.wakeup_at = at;
+  } else {
+    at = 0;
+  }
+  pthread_mutex_unlock(&_pt.mtx);
+
+  if (at) {
+    rc = iwn_schedule(&(struct iwn_scheduler_spec) {
+      .poller = g_env.poller,
+      .task_fn = _pt_wakeup,
+      .timeout_ms = at - ts,
+    });
+  }
 
-      rc = ejdb_get(g_env.db, "tasks", id, &doc);
-      if (rc) {
-        continue;
-      }
-      rc = jbl_object_get_i64(doc, "type", &type);
-      if (rc) {
-        _pt_task_update(id, -1, "Invalid task data", rc);
-        jbl_destroy(&doc);
-        continue;
-      }
-      int (*handler)(int64_t, JBL) = _pt_handler_get(type);
-      if (handler) {
-        status = handler(id, doc);
-      }
-      jbl_destroy(&doc);
+finish:
+  ejdb_list_destroy(&list);
+  jql_destroy(&q);
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
+}
 
-      if (!handler) {
-        iwlog_warn("Unsupported/disabled task of type %" PRId64 " task: %" PRId64, type, id);
-        _pt_task_update(id, -1, 0, rc); // Mark task failed in advance
-        continue;
-      }
-      if (status == 0) {
-        iwlog_warn("Tasks processing postponed by handler, task id: %" PRId64, id);
-        goto finish;
-      }
-      _pt_task_update(id, status, 0, 0);
+/// Due task selected for execution.
+struct pt_candidate {
+  int64_t     id;
+  int64_t     attempts;
+  const char *hook;
+};
+
+struct pt_dispatch_ctx {
+  IWULIST candidates; ///< struct pt_candidate
+  IWPOOL *pool;       ///< Holds hooks of candidates
+  int     slots;      ///< Number of free worker slots not yet taken by candidates
+};
+
+/// Selects due tasks for free worker slots. Tasks blocked by running or already selected tasks
+/// with the same hook are skipped, so they never hide runnable tasks queued behind them.
+static iwrc _pt_dispatch_visitor(EJDB_EXEC *ux, EJDB_DOC doc, int64_t *step) {
+  struct pt_dispatch_ctx *ctx = ux->opaque;
+  struct pt_candidate c = { .id = doc->id };
+  bool blocked;
+  iwrc rc = 0;
+
+  jbl_object_get_str(doc->raw, "hook", &c.hook);
+  jbl_object_get_i64(doc->raw, "attempts", &c.attempts);
+
+  pthread_mutex_lock(&_pt.mtx);
+  blocked = _pt_is_running_lk(c.id, c.hook);
+  pthread_mutex_unlock(&_pt.mtx);
+  for (size_t i = 0; i < ctx->candidates.num && !blocked && c.hook; ++i) {
+    struct pt_candidate *c2 = iwulist_at2(&ctx->candidates, i);
+    blocked = c2->hook && strcmp(c2->hook, c.hook) == 0;
+  }
+  if (blocked) {
+    return 0; // Task is in progress or it depends on the task with the same hook
+  }
+  if (c.hook) {
+    c.hook = iwpool_strdup(ctx->pool, c.hook, &rc);
+    RCR(rc);
+  }
+  RCR(iwulist_push(&ctx->candidates, &c));
+  // Tasks exceeded max attempts are failed by dispatcher and do not take a slot
+  if (c.attempts < g_env.periodic_worker.task_max_attempts && --ctx->slots < 1) {
+    *step = 0;
+  }
+  return 0;
+}
+
+/// Takes due tasks for free worker slots. Called on `_stw` thread only.
+static void _pt_dispatch(void *arg) {
+  JQL q = 0;
+  uint64_t ts;
+  int slots;
+  struct pt_dispatch_ctx ctx = { 0 };
+
+  pthread_mutex_lock(&_pt.mtx);
+  slots = g_env.periodic_worker.task_workers - _pt.num_running;
+  pthread_mutex_unlock(&_pt.mtx);
+
+  if (slots < 1 || g_env.shutdown) {
+    return;
+  }
+
+  iwrc rc = iwp_current_time_ms(&ts, false);
+  RCGO(rc, finish);
+  RCB(finish, ctx.pool = iwpool_create_empty());
+  RCC(rc, finish, iwulist_init(&ctx.candidates, slots, sizeof(struct pt_candidate)));
+  ctx.slots = slots;
+
+  RCC(rc, finish, jql_create(&q, "tasks", "/[next <= :?] | asc /next"));
+  RCC(rc, finish, jql_set_i64(q, 0, 0, ts));
+  RCC(rc, finish, ejdb_exec(&(EJDB_EXEC) {
+    .db = g_env.db,
+    .q = q,
+    .opaque = &ctx,
+    .visitor = _pt_dispatch_visitor
+  }));
+
+  for (size_t i = 0; i < ctx.candidates.num && slots > 0 && !g_env.shutdown; ++i) {
+    struct pt_candidate *c = iwulist_at2(&ctx.candidates, i);
+    if (c->attempts >= g_env.periodic_worker.task_max_attempts) {
+      iwlog_warn("Task %" PRId64 " failed after %" PRId64 " attempts", c->id, c->attempts);
+      _pt_task_update(c->id, -1, 0, -1, "Max number of task attempts exceeded", 0);
+      continue;
+    }
+
+    struct pt_running *run = calloc(1, sizeof(*run));
+    if (!run) {
+      rc = iwrc_set_errno(IW_ERROR_ALLOC, errno);
+      goto finish;
+    }
+    run->id = c->id;
+    if (c->hook && !(run->hook = strdup(c->hook))) {
+      free(run);
+      rc = iwrc_set_errno(IW_ERROR_ALLOC, errno);
+      goto finish;
+    }
+    rc = _pt_task_lease(c->id, ts);
+    if (rc) {
+      free(run->hook);
+      free(run);
+      goto finish;
+    }
+
+    pthread_mutex_lock(&_pt.mtx);
+    run->next = _pt.running;
+    _pt.running = run;
+    ++_pt.num_running;
+    pthread_mutex_unlock(&_pt.mtx);
+
+    rc = iwtp_schedule(_pt.tp, _pt_task_worker, run);
+    if (rc) {
+      // Task lease will expire so task will be resumed later
+      _pt_running_remove(run);
+      goto finish;
     }
+    --slots;
+  }
+
+  if (slots > 0) {
+    _pt_wakeup_schedule(ts);
   }
 
 finish:
-  iwulist_destroy_keep(&pending);
   jql_destroy(&q);
+  iwulist_destroy_keep(&ctx.candidates);
+  iwpool_destroy(ctx.pool);
   if (rc) {
     iwlog_ecode_error3(rc);
   }
 }
 
+/// Extends leases of tasks executed by this process.
+static void _pt_leases_renew(void) {
+  iwrc rc = 0;
+  uint64_t ts;
+  IWULIST ids = { 0 };
+
+  RCC(rc, finish, iwp_current_time_ms(&ts, false));
+  RCC(rc, finish, iwulist_init(&ids, 8, sizeof(int64_t)));
+  pthread_mutex_lock(&_pt.mtx);
+  for (struct pt_running *r = _pt.running; r && !rc; r = r->next) {
+    rc = iwulist_push(&ids, &r->id);
+  }
+  pthread_mutex_unlock(&_pt.mtx);
+  RCGO(rc, finish);
+
+  for (size_t i = 0; i < ids.num; ++i) {
+    iwrc rc2 = _pt_task_lease(*(int64_t*) iwulist_at2(&ids, i), ts);
+    if (rc2) {
+      iwlog_ecode_error3(rc2);
+    }
+  }
+
+finish:
+  iwulist_destroy_keep(&ids);
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
+}
+
+static iwrc _pt_visitor_legacy(EJDB_EXEC *exec, EJDB_DOC doc, int64_t *step) {
+  int64_t next;
+  if (jbl_object_get_i64(doc->raw, "next", &next)) {
+    return iwulist_push(exec->opaque, &doc->id);
+  }
+  return 0;
+}
+
+/// Puts pending tasks created by previous versions into `/next` index.
+static iwrc _pt_legacy_upgrade(void) {
+  JQL q = 0;
+  uint64_t ts;
+  IWULIST ids = { 0 };
+  iwrc rc = RCR(iwp_current_time_ms(&ts, false));
+  RCC(rc, finish, iwulist_init(&ids, 8, sizeof(int64_t)));
+  RCC(rc, finish, jql_create(&q, "tasks", "/[status = 0]"));
+  RCC(rc, finish, ejdb_exec(&(EJDB_EXEC) {
+    .db = g_env.db,
+    .q = q,
+    .opaque = &ids,
+    .visitor = _pt_visitor_legacy
+  }));
+  for (size_t i = 0; i < ids.num; ++i) {
+    _pt_task_update(*(int64_t*) iwulist_at2(&ids, i), 0, ts, -1, 0, 0);
+  }
+
+finish:
+  jql_destroy(&q);
+  iwulist_destroy_keep(&ids);
+  return rc;
+}
+
 static iwrc _do_persistent_tasks(void) {
   if (!_stw || g_env.shutdown) {
     return 0;
   }
   bool done;
-  return iwstw_schedule_empty_only(_stw, _persistent_tasks_worker, 0, &done);
+  return iwstw_schedule_empty_only(_stw, _pt_dispatch, 0, &done);
 }
 
 iwrc gr_persistent_task_submit(int type, const char *hook, JBL spec) {
@@ -287,6 +744,8 @@ iwrc gr_persistent_task_submit(int type, const char *hook, JBL spec) {
   RCC(rc, finish, jbl_create_empty_object(&jbl));
   RCC(rc, finish, jbl_set_int64(jbl, "ts", ts));
   RCC(rc, finish, jbl_set_int64(jbl, "status", 0));
+  RCC(rc, finish, jbl_set_int64(jbl, "next", ts));
+  RCC(rc, finish, jbl_set_int64(jbl, "attempts", 0));
   RCC(rc, finish, jbl_set_int64(jbl, "type", type));
   RCC(rc, finish, jbl_set_string(jbl, "hook", hook));
   RCC(rc, finish, jbl_set_nested(jbl, "spec", spec));
@@ -302,10 +761,20 @@ finish:
 
 static void _shutdown(void *data) {
   iwstw_shutdown(&_stw, true);
+  iwtp_shutdown(&_pt.tp, true);
 }
 
 iwrc gr_periodic_worker_init(void) {
+  iwrc rc = _pt_legacy_upgrade();
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
   RCR(iwstw_start("grtw", 10000, false, &_stw));
+  RCR(iwtp_start_by_spec(&(struct iwtp_spec) {
+    .num_threads = g_env.periodic_worker.task_workers,
+    .thread_name_prefix = "grpt-",
+    .queue_limit = 1024
+  }, &_pt.tp));
   gr_shutdown_hook_add(_shutdown, 0);
   _on_timeout(0);
   return 0;
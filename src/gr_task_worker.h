@@ -21,11 +21,19 @@
 /// Postprocess room recording
 #define PT_RECORDING_POSTPROC 0x01
 
+/// Render finished segments of room recording in progress
+#define PT_RECORDING_PRERENDER 0x02
+
 /// Submits persistent durable task of given `type`.
 ///
 /// The following task types are supported:
 ///
 /// * PT_RECORDING_POSTPROC
+/// * PT_RECORDING_PRERENDER
+///
+/// Tasks are executed in parallel by `task_workers` threads, tasks with the same `hook`
+/// are executed sequentially. Task handler returns `1` on success, `-1` on failure
+/// and `0` if task should be retried later with exponential backoff.
 ///
 iwrc gr_persistent_task_submit(int type, const char *hook, JBL spec);
 
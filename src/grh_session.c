@@ -16,48 +16,247 @@
  */
 
 #include "grh_session.h"
+#include "grh_auth.h"
+#include "gr_db_wb.h"
 
 #include <ejdb2/ejdb2.h>
 #include <ejdb2/iowow/iwpool.h>
 #include <ejdb2/iowow/iwp.h>
+#include <ejdb2/iowow/iwarr.h>
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 #include <assert.h>
 
 extern struct gr_env g_env;
 
-static char* _get(struct iwn_wf_session_store *sst, const char *sid, const char *key) {
-  if (!sst || !sid || !key) {
-    iwlog_ecode_error3(IW_ERROR_INVALID_ARGS);
+#define SESSION_SHARDS 16
+
+struct session_kv {
+  char *key;
+  char *val;
+  struct session_kv *next;
+};
+
+struct session {
+  char    *user;              ///< GR_USER_SESSION_KEY
+  char    *user_id;           ///< GR_USER_ID_SESSION_KEY
+  char    *perms;             ///< GR_PERMISSIONS_SESSION_KEY
+  struct session_kv *kvs;     ///< Other session keys
+  uint64_t wts;               ///< Last session update time ms
+  uint64_t ats;               ///< Last session access time ms
+};
+
+struct shard {
+  pthread_mutex_t mtx;
+  IWHMAP  *map; ///< sid => struct session*
+  uint64_t gen; ///< Incremented on every session clear, sessions loaded before it are not cached
+};
+
+static struct shard _shards[SESSION_SHARDS];
+
+static struct shard* _shard(const char *sid) {
+  uint32_t h = 2166136261U;
+  for (const char *p = sid; *p; ++p) {
+    h = (h ^ (uint8_t) *p) * 16777619U;
+  }
+  return &_shards[h % SESSION_SHARDS];
+}
+
+static void _session_free(struct session *s) {
+  if (!s) {
+    return;
+  }
+  free(s->user);
+  free(s->user_id);
+  free(s->perms);
+  for (struct session_kv *kv = s->kvs, *next; kv; kv = next) {
+    next = kv->next;
+    free(kv->key);
+    free(kv->val);
+    free(kv);
+  }
+  free(s);
+}
+
+static void _session_kv_free(void *key, void *val) {
+  free(key);
+  _session_free(val);
+}
+
+/// Returns pointer to the session slot holding value of `key`.
+static char** _session_slot(struct session *s, const char *key, bool create) {
+  if (strcmp(key, GR_USER_SESSION_KEY) == 0) {
+    return &s->user;
+  } else if (strcmp(key, GR_USER_ID_SESSION_KEY) == 0) {
+    return &s->user_id;
+  } else if (strcmp(key, GR_PERMISSIONS_SESSION_KEY) == 0) {
+    return &s->perms;
+  }
+  for (struct session_kv *kv = s->kvs; kv; kv = kv->next) {
+    if (strcmp(kv->key, key) == 0) {
+      return &kv->val;
+    }
+  }
+  if (!create) {
+    return 0;
+  }
+  struct session_kv *kv = calloc(1, sizeof(*kv));
+  if (!kv) {
+    return 0;
+  }
+  kv->key = strdup(key);
+  if (!kv->key) {
+    free(kv);
     return 0;
   }
+  kv->next = s->kvs;
+  s->kvs = kv;
+  return &kv->val;
+}
+
+static iwrc _session_set(struct session *s, const char *key, const char *val) {
+  char **slot = _session_slot(s, key, val != 0);
+  if (!slot) {
+    return val ? iwrc_set_errno(IW_ERROR_ALLOC, errno) : 0;
+  }
+  char *v = 0;
+  if (val) {
+    v = strdup(val);
+    if (!v) {
+      return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+    }
+  }
+  free(*slot);
+  *slot = v;
+  return 0;
+}
 
+/// Loads session from database. Sets `*out` to zero if session is not found.
+static iwrc _session_load(const char *sid, struct session **out) {
+  *out = 0;
   iwrc rc = 0;
-  char *ret = 0;
   JQL q = 0;
   EJDB_LIST list = 0;
+  struct session *s = 0;
 
-  RCC(rc, finish, jql_create(&q, "sessions", "/[__id__ = :sid] and /[* = :key] | /:key"));
-  RCC(rc, finish, jql_set_str(q, "sid", 0, sid));
-  RCC(rc, finish, jql_set_str(q, "key", 0, key));
+  RCC(rc, finish, jql_create(&q, "sessions", "/[__id__ = :?]"));
+  RCC(rc, finish, jql_set_str(q, 0, 0, sid));
   RCC(rc, finish, ejdb_list4(g_env.db, q, 1, 0, &list));
-
-  if (list->first) {
-    JBL_NODE n = list->first->node->child;
-    assert(n);
+  if (!list->first) {
+    goto finish;
+  }
+  RCB(finish, s = calloc(1, sizeof(*s)));
+  for (JBL_NODE n = list->first->node->child; n; n = n->next) {
+    if (!n->key) {
+      continue;
+    }
     if (n->type == JBV_STR) {
-      ret = strdup(n->vptr);
+      char key[n->klidx + 1];
+      memcpy(key, n->key, n->klidx);
+      key[n->klidx] = '\0';
+      if (strcmp(key, "__id__") != 0) {
+        RCC(rc, finish, _session_set(s, key, n->vptr));
+      }
+    } else if ((n->type == JBV_I64) && (n->klidx == IW_LLEN("__ts__")) && !strncmp(n->key, "__ts__", n->klidx)) {
+      s->wts = n->vi64;
+    }
+  }
+  *out = s;
+  s = 0;
+
+finish:
+  _session_free(s);
+  jql_destroy(&q);
+  ejdb_list_destroy(&list);
+  return rc;
+}
+
+/// Returns a session from cache, loads it from database on cache miss.
+/// If session is not found and `create` is true a new empty session is created.
+/// @note On success shard mutex is locked.
+static iwrc _session_acquire(const char *sid, bool create, struct shard *shard, struct session **out) {
+  *out = 0;
+  iwrc rc = 0;
+  uint64_t ts;
+  struct session *s;
+  char *key = 0;
+
+  RCR(iwp_current_time_ms(&ts, false));
+
+again:
+  pthread_mutex_lock(&shard->mtx);
+  s = iwhmap_get(shard->map, sid);
+  if (s) {
+    s->ats = ts;
+    *out = s;
+    return 0;
+  }
+  uint64_t gen = shard->gen;
+  pthread_mutex_unlock(&shard->mtx);
+
+  RCR(_session_load(sid, &s));
+  if (!s) {
+    if (!create) {
+      return 0;
+    }
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+      return iwrc_set_errno(IW_ERROR_ALLOC, errno);
     }
   }
+  s->ats = ts;
+
+  pthread_mutex_lock(&shard->mtx);
+  if (shard->gen != gen) { // Session may be cleared while it was loaded
+    pthread_mutex_unlock(&shard->mtx);
+    _session_free(s);
+    goto again;
+  }
+  struct session *s2 = iwhmap_get(shard->map, sid);
+  if (s2) { // Session was cached concurrently
+    _session_free(s);
+    s2->ats = ts;
+    *out = s2;
+    return 0;
+  }
+  RCB(finish, key = strdup(sid));
+  RCC(rc, finish, iwhmap_put(shard->map, key, s));
+  *out = s;
 
 finish:
+  if (rc) {
+    pthread_mutex_unlock(&shard->mtx);
+    free(key);
+    _session_free(s);
+  }
+  return rc;
+}
+
+static char* _get(struct iwn_wf_session_store *sst, const char *sid, const char *key) {
+  if (!sst || !sid || !key) {
+    iwlog_ecode_error3(IW_ERROR_INVALID_ARGS);
+    return 0;
+  }
+
+  char *ret = 0;
+  struct session *s;
+  struct shard *shard = _shard(sid);
+
+  iwrc rc = _session_acquire(sid, false, shard, &s);
   if (rc) {
     iwlog_ecode_error3(rc);
+    return 0;
+  }
+  if (s) {
+    char **slot = _session_slot(s, key, false);
+    if (slot && *slot) {
+      ret = strdup(*slot);
+    }
+    pthread_mutex_unlock(&shard->mtx);
   }
-  jql_destroy(&q);
-  ejdb_list_destroy(&list);
   return ret;
 }
 
@@ -65,12 +264,21 @@ static iwrc _put(struct iwn_wf_session_store *sst, const char *sid, const char *
   if (!sst || !sid || !key) {
     return IW_ERROR_INVALID_ARGS;
   }
-  JBL jbl;
+  JBL jbl = 0;
   uint64_t ts;
   iwrc rc = 0;
-  JQL q = 0;
+  struct session *s;
+  struct shard *shard = _shard(sid);
 
   RCC(rc, finish, iwp_current_time_ms(&ts, false));
+  RCC(rc, finish, _session_acquire(sid, true, shard, &s));
+  rc = _session_set(s, key, val);
+  if (!rc) {
+    s->wts = ts;
+  }
+  pthread_mutex_unlock(&shard->mtx);
+  RCGO(rc, finish);
+
   RCC(rc, finish, jbl_create_empty_object(&jbl));
   RCC(rc, finish, jbl_set_string(jbl, "__id__", sid));
   RCC(rc, finish, jbl_set_int64(jbl, "__ts__", ts));
@@ -79,13 +287,16 @@ static iwrc _put(struct iwn_wf_session_store *sst, const char *sid, const char *
   } else {
     RCC(rc, finish, jbl_set_null(jbl, key));
   }
-  RCC(rc, finish, jql_create(&q, "sessions", "/[__id__ = :sid] | upsert :doc"));
-  RCC(rc, finish, jql_set_str(q, "sid", 0, sid));
-  RCC(rc, finish, jql_set_json_jbl(q, "doc", 0, jbl));
-  rc = ejdb_update(g_env.db, q);
+  rc = gr_db_wb_submit(&(struct gr_db_wb_spec) {
+    .op = GR_DB_WB_UPDATE,
+    .wclass = GR_DB_WB_LAZY,
+    .coll = "sessions",
+    .query = "/[__id__ = :?] | upsert :?",
+    .key = sid,
+    .jbl = jbl
+  });
 
 finish:
-  jql_destroy(&q);
   jbl_destroy(&jbl);
   return rc;
 }
@@ -101,30 +312,88 @@ static void _clear(struct iwn_wf_session_store *sst, const char *sid) {
   if (!sst || !sid) {
     return;
   }
-  JQL q;
-  iwrc rc;
-  RCC(rc, finish, jql_create(&q, "sessions", "/[__id__ = :sid] | del"));
-  RCC(rc, finish, jql_set_str(q, "sid", 0, sid));
-  rc = ejdb_update(g_env.db, q);
+  struct shard *shard = _shard(sid);
 
-finish:
+  // Session is evicted only after it is removed from database, and loads started
+  // before eviction are discarded by generation check, so it cannot be cached again.
+  iwrc rc = gr_db_wb_submit(&(struct gr_db_wb_spec) {
+    .op = GR_DB_WB_UPDATE,
+    .wclass = GR_DB_WB_COMMIT,
+    .coll = "sessions",
+    .query = "/[__id__ = :?] | del",
+    .key = sid
+  });
   if (rc) {
     iwlog_ecode_error3(rc);
   }
-  jql_destroy(&q);
+
+  pthread_mutex_lock(&shard->mtx);
+  ++shard->gen;
+  iwhmap_remove(shard->map, sid);
+  pthread_mutex_unlock(&shard->mtx);
+}
+
+void grh_session_cache_maintain(void) {
+  uint64_t ts;
+  if (iwp_current_time_ms(&ts, false)) {
+    return;
+  }
+  int64_t ttl = (int64_t) g_env.session_cache_ttl_sec * 1000;
+  int64_t session_ttl = (int64_t) g_env.periodic_worker.expire_session_timeout_sec * 1000;
+  int64_t guest_ttl = (int64_t) g_env.periodic_worker.expire_guest_session_timeout_sec * 1000;
+
+  for (int i = 0; i < SESSION_SHARDS; ++i) {
+    IWHMAP_ITER iter;
+    IWULIST keys = { 0 };
+    struct shard *shard = &_shards[i];
+    if (!shard->map || iwulist_init(&keys, 32, sizeof(char*))) {
+      continue;
+    }
+    pthread_mutex_lock(&shard->mtx);
+    iwhmap_iter_init(shard->map, &iter);
+    while (iwhmap_iter_next(&iter)) {
+      const struct session *s = iter.val;
+      bool guest = s->perms && strcmp(s->perms, "guest") == 0;
+      if (  (ttl > 0 && s->ats + ttl <= ts)
+         || (session_ttl > 0 && s->wts + session_ttl <= ts)
+         || (guest && guest_ttl > 0 && s->wts + guest_ttl <= ts)) {
+        iwulist_push(&keys, &iter.key);
+      }
+    }
+    for (int j = 0; j < keys.num; ++j) {
+      iwhmap_remove(shard->map, *(char**) iwulist_at2(&keys, j));
+    }
+    pthread_mutex_unlock(&shard->mtx);
+    iwulist_destroy_keep(&keys);
+  }
 }
 
 static void _dispose(struct iwn_wf_session_store *sst) {
-  struct ctx *ctx = sst->user_data;
-  free(ctx);
+  for (int i = 0; i < SESSION_SHARDS; ++i) {
+    struct shard *shard = &_shards[i];
+    if (shard->map) {
+      iwhmap_destroy(shard->map);
+      shard->map = 0;
+      pthread_mutex_destroy(&shard->mtx);
+    }
+  }
 }
 
 iwrc grh_session_store_create(struct iwn_wf_session_store *ss) {
   iwrc rc = 0;
+  for (int i = 0; i < SESSION_SHARDS; ++i) {
+    struct shard *shard = &_shards[i];
+    if (!shard->map) {
+      RCB(finish, shard->map = iwhmap_create_str(_session_kv_free));
+      pthread_mutex_init(&shard->mtx, 0);
+    }
+  }
   ss->get = _get;
   ss->put = _put;
   ss->del = _del;
   ss->clear = _clear;
   ss->dispose = _dispose;
+
+finish:
   return rc;
 }
@@ -19,3 +19,8 @@
 #include "grh.h"
 
 iwrc grh_session_store_create(struct iwn_wf_session_store *fout);
+
+/**
+ * @brief Evicts idle and expired sessions from in-memory sessions cache.
+ */
+void grh_session_cache_maintain(void);
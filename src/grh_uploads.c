@@ -22,16 +22,56 @@
 #include <iwnet/iwn_mimetypes.h>
 #include <iwnet/iwn_wf_files.h>
 #include <iwnet/iwn_codec.h>
+#include <iwnet/bearssl_hash.h>
+#include <iowow/iwhmap.h>
 
 #include <string.h>
 #include <regex.h>
 #include <stdlib.h>
-#include <sys/mman.h>
+#include <limits.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+
+/// Directory within uploads dir where files are written before they are moved into place.
+/// It is on the same filesystem as uploads so the final rename is atomic.
+#define UPLOADS_TMP_DIR ".tmp"
+
+/// Directory within uploads dir holding file contents addressed by their SHA-256 hash.
+#define UPLOADS_BLOBS_DIR "blobs"
+
+/// Serializes blob existence checks, blob creation and release against `files` references updates.
+static pthread_mutex_t _blobs_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/// Max number of file metadata entries kept in downloads cache.
+#define UPLOADS_META_CACHE_SIZE 1024
+
+/// Cached `files` document fields needed to serve file download.
+struct file_meta {
+  char     uuid[IW_UUID_STR_LEN + 1];
+  char    *path;        ///< File content path
+  char    *ctype;       ///< Content type
+  char    *disposition; ///< Content-Disposition header value
+  uint64_t mtime;       ///< File creation time ms, uploaded files are never modified
+  int      refs;        ///< Number of cache and request references guarded by `_meta_mtx`
+};
+
+/// LRU cache of downloaded files metadata: uuid => struct file_meta*
+static IWHMAP *_meta_cache;
+static pthread_mutex_t _meta_mtx = PTHREAD_MUTEX_INITIALIZER;
+/// Incremented under `_meta_mtx` on every file removal,
+/// metadata loaded before removal is not cached since it may belong to the removed file.
+static uint64_t _meta_gen;
+
+/// Persisted upload content descriptor.
+struct upload_blob {
+  char    hash[2 * br_sha256_SIZE + 1]; ///< Hex encoded SHA-256 of file content
+  int64_t size;
+};
 
 static bool _file_name_is_valid(const struct iwn_val *filename) {
   for (size_t i = 0; i < filename->len; ++i) {
@@ -49,13 +89,13 @@ static bool _file_name_is_valid(const struct iwn_val *filename) {
   return true;
 }
 
-static char* _file_path_create(const char *uuid, bool rdonly) {
+static char* _path_create(const char *prefix, const char *name, bool rdonly) {
   iwrc rc = 0;
   IWXSTR *xstr = iwxstr_new();
   if (!xstr) {
     return 0;
   }
-  if (iwxstr_printf(xstr, "%s/%.2s/%.2s", g_env.uploads.dir, uuid, uuid + 2)) {
+  if (iwxstr_printf(xstr, "%s%s/%.2s/%.2s", g_env.uploads.dir, prefix, name, name + 2)) {
     iwxstr_destroy(xstr);
     return 0;
   }
@@ -66,13 +106,23 @@ static char* _file_path_create(const char *uuid, bool rdonly) {
       return 0;
     }
   }
-  if (iwxstr_printf(xstr, "/%s", uuid)) {
+  if (iwxstr_printf(xstr, "/%s", name)) {
     iwxstr_destroy(xstr);
     return 0;
   }
   return iwxstr_destroy_keep_ptr(xstr);
 }
 
+/// Path of file uploaded before content addressing: `uploads/xx/yy/uuid`.
+static char* _file_path_create(const char *uuid, bool rdonly) {
+  return _path_create("", uuid, rdonly);
+}
+
+/// Path of file content shared by all uploads with the same hash: `uploads/blobs/xx/yy/hash`.
+static char* _blob_path_create(const char *hash, bool rdonly) {
+  return _path_create("/" UPLOADS_BLOBS_DIR, hash, rdonly);
+}
+
 static char* _file_link_create(struct iwn_wf_req *req, const char *uuid, const struct iwn_val *fname) {
   const char *sp = strrchr(req->path, '/');
   if (!sp) {
@@ -95,32 +145,78 @@ static char* _file_link_create(struct iwn_wf_req *req, const char *uuid, const s
   return iwxstr_destroy_keep_ptr(xstr);
 }
 
-static iwrc _file_persist(struct iwn_pair *file, const char *path) {
-  size_t aunit = iwp_alloc_unit();
-  int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+/// Syncs directory containing the given `path` so a file renamed into it survives a crash.
+static void _file_dir_sync(const char *path) {
+  char dir[PATH_MAX];
+  const char *sp = strrchr(path, '/');
+  if (!sp || sp - path >= (ptrdiff_t) sizeof(dir)) {
+    return;
+  }
+  memcpy(dir, path, sp - path);
+  dir[sp - path] = '\0';
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd > -1) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+/// Computes SHA-256 of uploaded file content.
+/// Multipart body is fully buffered by the web framework, so content is hashed at once.
+static void _blob_hash(struct iwn_pair *file, struct upload_blob *blob) {
+  uint8_t hash[br_sha256_SIZE];
+  br_sha256_context ctx;
+
+  br_sha256_init(&ctx);
+  br_sha256_update(&ctx, file->val, file->val_len);
+  br_sha256_out(&ctx, hash);
+
+  for (int i = 0; i < br_sha256_SIZE; ++i) {
+    snprintf(blob->hash + 2 * i, 3, "%02x", hash[i]);
+  }
+  blob->size = file->val_len;
+}
+
+/// Writes uploaded file content into the `tmp` file and syncs it.
+static iwrc _blob_write(struct iwn_pair *file, const char *tmp) {
+  iwrc rc = 0;
+  const char *rp = file->val;
+  size_t len = file->val_len;
+
+  int fd = open(tmp, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
   if (fd == -1) {
     return iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
   }
-  if (ftruncate(fd, file->val_len) == -1) {
-    return iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+  while (len > 0) {
+    ssize_t wb = write(fd, rp, len);
+    if (wb == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+      goto finish;
+    }
+    rp += wb;
+    len -= wb;
   }
-  size_t mlen = IW_ROUNDUP(file->val_len, aunit);
-  void *mm = mmap(0, mlen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (mm == MAP_FAILED) {
-    return iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+  if (fsync(fd) == -1) {
+    rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
   }
-  memcpy(mm, file->val, file->val_len);
-  munmap(mm, mlen);
-  fsync(fd);
+
+finish:
   close(fd);
-  return 0;
+  if (rc) {
+    unlink(tmp);
+  }
+  return rc;
 }
 
 static iwrc _file_meta_persist(
-  int64_t               uid,
-  const char           *uuid,
-  const struct iwn_val *fname,
-  const char           *ctype
+  int64_t                   uid,
+  const char               *uuid,
+  const struct iwn_val     *fname,
+  const char               *ctype,
+  const struct upload_blob *blob
   ) {
   iwrc rc = 0;
   int64_t id;
@@ -135,7 +231,8 @@ static iwrc _file_meta_persist(
         &n, pool,
         "{\"uuid\": \"\", \"filename\":\"\", "
         "\"owner\": %" PRIu64 ", \"ctime\": %" PRIu64 ", "
-        "\"ctype\":\"\"}", uid, ts));
+        "\"ctype\":\"\", \"hash\": \"%s\", \"size\": %" PRId64 "}",
+        uid, ts, blob->hash, blob->size));
   if (!jbn_at(n, "/uuid", &n2) && n2->type == JBV_STR) {
     n2->vptr = uuid;
     n2->vsize = IW_UUID_STR_LEN;
@@ -160,10 +257,38 @@ finish:
   return rc;
 }
 
+/// Removes blob of the given content `hash` if it is not referenced by `files` anymore.
+/// Number of `files` documents having the same hash is the blob reference count.
+/// Must be called with `_blobs_mtx` held.
+static iwrc _blob_release_lk(const char *hash) {
+  iwrc rc = 0;
+  int64_t refs = 0;
+  char *path = 0;
+  JQL q = 0;
+
+  RCC(rc, finish, jql_create(&q, "files", "/[hash = :?] | count"));
+  RCC(rc, finish, jql_set_str(q, 0, 0, hash));
+  RCC(rc, finish, ejdb_count(g_env.db, q, &refs, 1));
+  if (refs == 0) {
+    RCB(finish, path = _blob_path_create(hash, true));
+    if (unlink(path) == -1 && errno != ENOENT) {
+      rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+    }
+  }
+
+finish:
+  jql_destroy(&q);
+  free(path);
+  return rc;
+}
+
 static int _upload(struct iwn_wf_req *req, void *d) {
   iwrc rc = 0;
   int ret = 500;
   char uuid[IW_UUID_STR_LEN + 1];
+  char tmp[PATH_MAX];
+  char *path = 0, *link = 0;
+  struct upload_blob blob;
 
   int64_t uid = grh_auth_get_userid(req);
   if (uid == 0 || !grh_auth_has_any_perms(req, "user")) {
@@ -171,9 +296,12 @@ static int _upload(struct iwn_wf_req *req, void *d) {
   }
 
   struct iwn_pair *file = iwn_pair_find(&req->form_params, "file", IW_LLEN("file"));
-  if (!file->val_len) {
+  if (!file || !file->val_len) {
     return 400;
   }
+  if (file->val_len > g_env.uploads.max_size) { // Uploaded content is fully buffered in memory
+    return 413;
+  }
 
   struct iwn_val fname = iwn_pair_find_val(file->extra, "filename", IW_LLEN("filename"));
   fname.len = iwn_url_decode_inplace2(fname.buf, fname.buf + fname.len);
@@ -184,23 +312,52 @@ static int _upload(struct iwn_wf_req *req, void *d) {
   iwu_uuid4_fill(uuid);
   uuid[IW_UUID_STR_LEN] = '\0';
 
-  char *path = _file_path_create(uuid, false);
-  if (!path) {
-    return 500;
-  }
-  char *link = _file_link_create(req, uuid, &fname);
+  link = _file_link_create(req, uuid, &fname);
   if (!link) {
-    free(path);
     return 500;
   }
 
-  RCC(rc, finish, _file_persist(file, path));
-
   const char *ctype = iwn_mimetype_find_by_path2(fname.buf, fname.len);
   if (!ctype) {
     ctype = "application/octet-stream";
   }
-  RCC(rc, finish, _file_meta_persist(uid, uuid, &fname, ctype));
+
+  _blob_hash(file, &blob);
+  RCB(finish, path = _blob_path_create(blob.hash, false));
+
+  // Content already stored by another upload, only a new reference to it is created
+  pthread_mutex_lock(&_blobs_mtx);
+  bool exists = access(path, F_OK) == 0;
+  if (exists) {
+    rc = _file_meta_persist(uid, uuid, &fname, ctype, &blob);
+  }
+  pthread_mutex_unlock(&_blobs_mtx);
+  RCGO(rc, finish);
+
+  if (!exists) {
+    // Content is written into the temp file out of lock and then atomically moved into place,
+    // so partially written blobs are never visible. Concurrent uploads of the same content
+    // may both write it, the last rename wins with identical data.
+    if (snprintf(tmp, sizeof(tmp), "%s/" UPLOADS_TMP_DIR "/%s", g_env.uploads.dir, uuid) >= (int) sizeof(tmp)) {
+      rc = IW_ERROR_OVERFLOW;
+      goto finish;
+    }
+    RCC(rc, finish, _blob_write(file, tmp));
+
+    pthread_mutex_lock(&_blobs_mtx);
+    if (rename(tmp, path) == -1) {
+      rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+      unlink(tmp);
+    } else {
+      _file_dir_sync(path);
+      rc = _file_meta_persist(uid, uuid, &fname, ctype, &blob);
+      if (rc) {
+        _blob_release_lk(blob.hash);
+      }
+    }
+    pthread_mutex_unlock(&_blobs_mtx);
+    RCGO(rc, finish);
+  }
 
   ret = iwn_http_response_write(req->http, 200, "text/plain", link, -1) ? 1 : -1;
 
@@ -214,6 +371,141 @@ finish:
   return ret;
 }
 
+static void _file_meta_unref_lk(struct file_meta *meta) {
+  if (meta && --meta->refs == 0) {
+    free(meta->path);
+    free(meta->ctype);
+    free(meta->disposition);
+    free(meta);
+  }
+}
+
+static void _file_meta_release(struct file_meta *meta) {
+  pthread_mutex_lock(&_meta_mtx);
+  _file_meta_unref_lk(meta);
+  pthread_mutex_unlock(&_meta_mtx);
+}
+
+static void _file_meta_kv_free(void *key, void *val) {
+  // Key is owned by metadata entry, called by cache with `_meta_mtx` held
+  _file_meta_unref_lk(val);
+}
+
+/// Loads metadata of the given file from `files` collection.
+static iwrc _file_meta_load(const char *uuid, struct file_meta **out) {
+  iwrc rc = 0;
+  JBL_NODE n;
+  EJDB_DOC doc;
+  JQL q = 0;
+  EJDB_LIST list = 0;
+  IWXSTR *xstr = 0;
+  struct file_meta *meta = 0;
+  const char *fname, *ctype;
+  char *fname_encoded = 0;
+
+  *out = 0;
+  RCC(rc, finish, jql_create(&q, "files", "/[uuid = :?] | /{filename, ctype, ctime, hash}"));
+  RCC(rc, finish, jql_set_str(q, 0, 0, uuid));
+  RCC(rc, finish, ejdb_list4(g_env.db, q, 1, 0, &list));
+
+  doc = list->first;
+  if (!doc || jbn_at(doc->node, "/filename", &n) || n->type != JBV_STR) {
+    rc = IW_ERROR_NOT_EXISTS;
+    goto finish;
+  }
+  fname = n->vptr;
+
+  size_t len = iwn_url_encoded_len(fname, n->vsize) + 1;
+  RCB(finish, fname_encoded = malloc(len));
+  iwn_url_encode(fname, n->vsize, fname_encoded, len);
+
+  if (!jbn_at(doc->node, "/ctype", &n) && n->type == JBV_STR) {
+    ctype = n->vptr;
+  } else {
+    ctype = iwn_mimetype_find_by_path(fname);
+  }
+  if (!ctype) {
+    rc = IW_ERROR_NOT_EXISTS;
+    goto finish;
+  }
+
+  RCB(finish, meta = calloc(1, sizeof(*meta)));
+  memcpy(meta->uuid, uuid, sizeof(meta->uuid));
+  meta->refs = 1;
+  RCB(finish, meta->ctype = strdup(ctype));
+
+  RCB(finish, xstr = iwxstr_new());
+  RCC(rc, finish, iwxstr_printf(xstr, "inline; filename=\"%s\"; filename*=UTF-8''%s", fname_encoded, fname_encoded));
+  meta->disposition = iwxstr_destroy_keep_ptr(xstr), xstr = 0;
+
+  if (!jbn_at(doc->node, "/hash", &n) && n->type == JBV_STR) {
+    RCB(finish, meta->path = _blob_path_create(n->vptr, true));
+  } else {
+    RCB(finish, meta->path = _file_path_create(uuid, true));
+  }
+  if (!jbn_at(doc->node, "/ctime", &n) && n->type == JBV_I64) {
+    meta->mtime = n->vi64;
+  }
+
+  *out = meta;
+
+finish:
+  if (rc) {
+    _file_meta_release(meta);
+  }
+  iwxstr_destroy(xstr);
+  free(fname_encoded);
+  jql_destroy(&q);
+  ejdb_list_destroy(&list);
+  return rc;
+}
+
+/// Returns metadata of the given file from cache loading it from `files` collection on cache miss.
+/// Returned entry must be released by `_file_meta_release()`.
+static iwrc _file_meta_get(const char *uuid, struct file_meta **out) {
+  struct file_meta *meta, *cached;
+  uint64_t gen;
+
+  pthread_mutex_lock(&_meta_mtx);
+  meta = iwhmap_get(_meta_cache, uuid);
+  if (meta) {
+    ++meta->refs;
+  }
+  gen = _meta_gen;
+  pthread_mutex_unlock(&_meta_mtx);
+  if (meta) {
+    *out = meta;
+    return 0;
+  }
+
+  RCR(_file_meta_load(uuid, &meta));
+
+  pthread_mutex_lock(&_meta_mtx);
+  cached = iwhmap_get(_meta_cache, uuid);
+  if (cached) { // Loaded by concurrent request
+    ++cached->refs;
+    _file_meta_unref_lk(meta);
+    meta = cached;
+  } else if (gen == _meta_gen) {
+    ++meta->refs;
+    if (iwhmap_put(_meta_cache, meta->uuid, meta)) {
+      --meta->refs;
+    }
+  }
+  pthread_mutex_unlock(&_meta_mtx);
+
+  *out = meta;
+  return 0;
+}
+
+/// Evicts metadata of removed file, must be called after its `files` document is deleted.
+static void _file_meta_evict(const char *uuid) {
+  pthread_mutex_lock(&_meta_mtx);
+  ++_meta_gen;
+  iwhmap_remove(_meta_cache, uuid);
+  pthread_mutex_unlock(&_meta_mtx);
+}
+
 static int _file_del(struct iwn_wf_req *req, const char *uuid) {
   iwrc rc;
   JBL_NODE n;
@@ -223,7 +515,7 @@ static int _file_del(struct iwn_wf_req *req, const char *uuid) {
   char *path = 0;
   int ret = 500;
 
-  RCC(rc, finish, jql_create(&q, "files", "/[uuid = :?] | /{owner}"));
+  RCC(rc, finish, jql_create(&q, "files", "/[uuid = :?] | /{owner, hash}"));
   RCC(rc, finish, jql_set_str(q, 0, 0, uuid));
   RCC(rc, finish, ejdb_list4(g_env.db, q, 1, 0, &list));
 
@@ -246,10 +538,30 @@ static int _file_del(struct iwn_wf_req *req, const char *uuid) {
     goto finish;
   }
 
-  path = _file_path_create(uuid, true);
-
-  ejdb_del(g_env.db, "files", doc->id);
-  unlink(path);
+  if (!jbn_at(doc->node, "/hash", &n) && n->type == JBV_STR) {
+    // Blob is shared by all uploads of the same content, remove it with the last reference
+    pthread_mutex_lock(&_blobs_mtx);
+    rc = ejdb_del(g_env.db, "files", doc->id);
+    if (!rc) {
+      // Evicted along with removal, cached entry would keep the shared blob downloadable by this uuid
+      _file_meta_evict(uuid);
+      rc = _blob_release_lk(n->vptr);
+    }
+    pthread_mutex_unlock(&_blobs_mtx);
+    RCGO(rc, finish);
+  } else {
+    path = _file_path_create(uuid, true);
+    pthread_mutex_lock(&_blobs_mtx);
+    rc = ejdb_del(g_env.db, "files", doc->id);
+    if (!rc) {
+      _file_meta_evict(uuid);
+    }
+    pthread_mutex_unlock(&_blobs_mtx);
+    RCGO(rc, finish);
+    if (path) {
+      unlink(path);
+    }
+  }
 
   ret = 201;
 
@@ -264,68 +576,34 @@ finish:
 }
 
 static int _file_get(struct iwn_wf_req *req, const char *uuid) {
-  iwrc rc = 0;
-  JBL_NODE n;
-  EJDB_DOC doc;
-  JQL q = 0;
+  iwrc rc;
   int ret = 500;
-  char *path = 0;
-  EJDB_LIST list = 0;
-  const char *fname = 0, *ctype = 0;
-  char *fname_encoded = 0;
-
-  RCC(rc, finish, jql_create(&q, "files", "/[uuid = :?] | /{owner, filename, ctype}"));
-  RCC(rc, finish, jql_set_str(q, 0, 0, uuid));
-  RCC(rc, finish, ejdb_list4(g_env.db, q, 1, 0, &list));
+  char etag[IW_UUID_STR_LEN + 24];
+  struct file_meta *meta = 0;
 
-  doc = list->first;
-  if (!doc) {
-    ret = 404;
-    goto finish;
+  rc = _file_meta_get(uuid, &meta);
+  if (rc == IW_ERROR_NOT_EXISTS) {
+    return 404;
   }
+  RCGO(rc, finish);
 
-  if (!jbn_at(doc->node, "/filename", &n) && n->type == JBV_STR) {
-    fname = n->vptr;
-  } else {
-    ret = 404;
-    goto finish;
-  }
-
-  size_t len = iwn_url_encoded_len(fname, n->vsize) + 1;
-  RCB(finish, fname_encoded = malloc(len));
-  iwn_url_encode(fname, n->vsize, fname_encoded, len);
-
-  if (!jbn_at(doc->node, "/ctype", &n) && n->type == JBV_STR) {
-    ctype = n->vptr;
-  } else {
-    ctype = iwn_mimetype_find_by_path(fname);
-  }
-  if (ctype == 0) {
-    ret = 404;
+  // Uploaded file is never changed, so its identity and creation time is a strong validator
+  snprintf(etag, sizeof(etag), "\"%s-%" PRIx64 "\"", uuid, meta->mtime);
+  if (iwn_http_response_not_modified(req->http, etag, meta->mtime)) {
+    ret = 304;
     goto finish;
   }
 
-  RCC(rc, finish, iwn_http_response_header_printf(
-        req->http,
-        "content-disposition",
-        "inline; filename=\"%s\"; filename*=UTF-8''%s", fname_encoded, fname_encoded));
+  RCC(rc, finish, iwn_http_response_header_set(req->http, "content-disposition", meta->disposition,
+                                               strlen(meta->disposition)));
 
-  path = _file_path_create(uuid, true);
-  if (!path) {
-    goto finish;
-  }
-
-  ret = iwn_wf_file_serve(req, ctype, path);
+  ret = iwn_wf_file_serve(req, meta->ctype, meta->path);
 
 finish:
   if (rc) {
     iwlog_ecode_error3(rc);
   }
-  jql_destroy(&q);
-  ejdb_list_destroy(&list);
-  free(path);
-  free(fname_encoded);
-
+  _file_meta_release(meta);
   return ret;
 }
 
@@ -346,7 +624,44 @@ static int _file(struct iwn_wf_req *req, void *d) {
   return 500;
 }
 
+/// Creates uploads temp dir and removes files left there by uploads interrupted by server shutdown.
+static iwrc _tmp_dir_init(void) {
+  char path[PATH_MAX];
+  struct dirent *entry;
+
+  if (snprintf(path, sizeof(path), "%s/" UPLOADS_TMP_DIR, g_env.uploads.dir) >= (int) sizeof(path)) {
+    return IW_ERROR_OVERFLOW;
+  }
+  RCR(iwp_mkdirs(path));
+
+  DIR *d = opendir(path);
+  if (!d) {
+    return iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+  }
+  while ((entry = readdir(d))) {
+    if (entry->d_name[0] != '.') {
+      unlinkat(dirfd(d), entry->d_name, 0);
+    }
+  }
+  closedir(d);
+  return 0;
+}
+
+static void _file_dispose(struct iwn_wf_ctx *ctx, void *d) {
+  pthread_mutex_lock(&_meta_mtx);
+  iwhmap_destroy(_meta_cache);
+  _meta_cache = 0;
+  pthread_mutex_unlock(&_meta_mtx);
+}
+
 iwrc grh_route_uploads(struct iwn_wf_route *parent) {
+  RCR(_tmp_dir_init());
+
+  if (!(_meta_cache = iwhmap_create_str(_file_meta_kv_free))) {
+    return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+  }
+  iwhmap_lru_init(_meta_cache, iwhmap_lru_eviction_max_count, (void*) (uintptr_t) UPLOADS_META_CACHE_SIZE);
+
   RCR(iwn_wf_route(&(struct iwn_wf_route) {
     .parent = parent,
     .pattern = "/files",
@@ -364,6 +679,7 @@ iwrc grh_route_uploads(struct iwn_wf_route *parent) {
     .parent = parent,
     .pattern = "^/([a-z0-9]{8}-[a-z0-9]{4}-[a-z0-9]{4}-[a-z0-9]{4}-[a-z0-9]{12})(/.*)?",
     .handler = _file,
+    .handler_dispose = _file_dispose,
     .flags = IWN_WF_GET | IWN_WF_DELETE
   }, 0));
 
@@ -17,6 +17,8 @@
 
 #include "grh_ws.h"
 #include "grh_ws_user.h"
+#include "grh_ws_ticket.h"
+#include "grh_ws_dispatch.h"
 #include "grh_auth.h"
 
 #include <ejdb2/ejdb2.h>
@@ -30,8 +32,6 @@
 #include <assert.h>
 #include <stdlib.h>
 
-#define WS_TICKET_LEN IW_UUID_STR_LEN
-
 static pthread_rwlock_t _rwl;
 
 #define RLOCK() pthread_rwlock_rdlock(&_rwl)
@@ -42,15 +42,22 @@ static pthread_rwlock_t _rwl;
 
 static iwrc _init(void);
 
+static bool _initialized = false;
+
 // Mapping WS session id wsid (int) -> *wsdata
 static IWHMAP *_map_wsid_wsdata;
 
 // Mapping ws session uuid (char*) -> *wsdata
 static IWHMAP *_map_uuid_sessions;
 
-static IWHMAP *_wsh_handlers;
+// Mapping user id (int64) -> *wsdata list of user WS sessions linked by `user_next`
+static IWHMAP *_map_user_sessions;
+
+// Mapping room session cid (char*) -> IWULIST of room participants user ids (int64)
+static IWHMAP *_map_room_users;
 
-static pthread_mutex_t _handlers_mtx;
+// Mapping command name (char*) -> *wsh_handler. Sealed when the first WS session is opened.
+static struct grh_ws_handlers _handlers;
 
 struct wsh_handler {
   wsh_handler_fn wsh;
@@ -61,27 +68,12 @@ struct wsh_handler {
 };
 
 static iwrc _ws_ticket_pull(struct ws_session *wss, const char *ticket) {
-  JQL q = 0;
-  EJDB_LIST list = 0;
-  const char *val;
-
-  iwrc rc = jql_create(&q, "tickets", "/[name = :?] | del");
-  RCGO(rc, finish);
-  RCC(rc, finish, jql_set_str(q, 0, 0, ticket));
-  RCC(rc, finish, ejdb_list4(g_env.db, q, 1, 0, &list));
-
-  if (!list->first) {
-    rc = GR_ERROR_UNKNOWN_TICKET_ID;
-    goto finish;
-  }
-
-  RCC(rc, finish, jbl_object_get_str(list->first->raw, "session_id", &val));
-  RCC(rc, finish, iwn_wf_session_id_set(wss->ws->req, val));
+  char *session_id;
+  iwrc rc = RCR(grh_ws_ticket_redeem(ticket, &session_id));
+  rc = iwn_wf_session_id_set(wss->ws->req, session_id);
+  free(session_id);
+  RCRET(rc);
   grh_auth_request_init(wss->ws->req);
-
-finish:
-  jql_destroy(&q);
-  ejdb_list_destroy(&list);
   return rc;
 }
 
@@ -188,18 +180,114 @@ void grh_ws_send_by_uuid(const char *uuid, const char *data, ssize_t len) {
   UNLOCK();
 }
 
-iwrc grh_ws_send_all_room_participants(int64_t room_id, const char *data, ssize_t len) {
+/// Links WS session into the list of sessions of its user.
+/// @note Must be called in WLOCK context
+static iwrc _user_session_link(struct ws_session *wss) {
+  struct ws_session *head = iwhmap_get_u64(_map_user_sessions, wss->user_id);
+  if (head) {
+    wss->user_next = head->user_next;
+    head->user_next = wss;
+    return 0;
+  }
+  wss->user_next = 0;
+  return iwhmap_put_u64(_map_user_sessions, wss->user_id, wss);
+}
+
+/// Unlinks WS session from the list of sessions of its user.
+/// @note Must be called in WLOCK context
+static void _user_session_unlink(struct ws_session *wss) {
+  struct ws_session *head = iwhmap_get_u64(_map_user_sessions, wss->user_id);
+  if (head == wss) {
+    if (wss->user_next) {
+      iwhmap_put_u64(_map_user_sessions, wss->user_id, wss->user_next);
+    } else {
+      iwhmap_remove_u64(_map_user_sessions, wss->user_id);
+    }
+  } else {
+    for ( ; head && head->user_next != wss; head = head->user_next);
+    if (head) {
+      head->user_next = wss->user_next;
+    }
+  }
+  wss->user_next = 0;
+}
+
+static void _room_users_free(void *key, void *val) {
+  IWULIST *users = val;
+  iwulist_destroy(&users);
+  free(key);
+}
+
+iwrc grh_ws_room_participant_add(const char *room_cid, int64_t user_id) {
+  if (!room_cid) {
+    return IW_ERROR_INVALID_ARGS;
+  }
+  RCR(_init());
+
+  iwrc rc = 0;
+  char *key = 0;
+  IWULIST *users = 0;
+
+  WLOCK();
+  users = iwhmap_get(_map_room_users, room_cid);
+  if (users) {
+    for (int i = 0, l = iwulist_length(users); i < l; ++i) {
+      if (*(int64_t*) iwulist_at2(users, i) == user_id) {
+        goto finish; // User is registered already
+      }
+    }
+    rc = iwulist_push(users, &user_id);
+    goto finish;
+  }
+
+  RCB(finish, key = strdup(room_cid));
+  RCB(finish, users = iwulist_create(8, sizeof(int64_t)));
+  RCC(rc, finish, iwulist_push(users, &user_id));
+  RCC(rc, finish, iwhmap_put(_map_room_users, key, users));
+  key = 0, users = 0;
+
+finish:
+  UNLOCK();
+  free(key);
+  iwulist_destroy(&users);
+  return rc;
+}
+
+void grh_ws_room_participant_remove(const char *room_cid, int64_t user_id) {
+  if (!room_cid || !__atomic_load_n(&_initialized, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  WLOCK();
+  IWULIST *users = iwhmap_get(_map_room_users, room_cid);
+  if (users) {
+    for (int i = 0, l = iwulist_length(users); i < l; ++i) {
+      if (*(int64_t*) iwulist_at2(users, i) == user_id) {
+        iwulist_remove(users, i);
+        break;
+      }
+    }
+    if (iwulist_length(users) == 0) {
+      iwhmap_remove(_map_room_users, room_cid);
+    }
+  }
+  UNLOCK();
+}
+
+void grh_ws_room_participants_release(const char *room_cid) {
+  if (!room_cid || !__atomic_load_n(&_initialized, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  WLOCK();
+  iwhmap_remove(_map_room_users, room_cid);
+  UNLOCK();
+}
+
+/// Loads room participants from `/events` of room document. See model.txt
+static iwrc _room_users_load(int64_t room_id, IWULIST *users) {
   JQL q = 0;
   iwrc rc = 0;
   EJDB_LIST qlist = 0;
   JBL_NODE n_events;
-  IWHMAP_ITER iter;
-
-  IWULIST wsidlist = { 0 };
-  IWHMAP *idmap = iwhmap_create_u64(0);
-  RCA(idmap, finish);
-
-  RCC(rc, finish, iwulist_init(&wsidlist, 32, sizeof(uint32_t)));
 
   RCC(rc, finish, jql_create(&q, "rooms", "/= :? | /events"));
   RCC(rc, finish, jql_set_i64(q, 0, 0, room_id));
@@ -213,7 +301,6 @@ iwrc grh_ws_send_all_room_participants(int64_t room_id, const char *data, ssize_
     rc = 0;
     goto finish;
   }
-  // See model.txt
   for (JBL_NODE n = n_events->child; n; n = n->next) {
     if (n->type != JBV_ARRAY) {
       continue;
@@ -226,41 +313,64 @@ iwrc grh_ws_send_all_room_participants(int64_t room_id, const char *data, ssize_
     if (!nn || nn->type != JBV_I64) {
       continue;
     }
-    iwhmap_put_u64(idmap, nn->vi64, (void*) (intptr_t) -1); // Save user ID
+    RCC(rc, finish, iwulist_push(users, &nn->vi64));
+  }
+
+finish:
+  ejdb_list_destroy(&qlist);
+  jql_destroy(&q);
+  return rc;
+}
+
+iwrc grh_ws_send_all_room_participants(int64_t room_id, const char *room_cid, const char *data, ssize_t len) {
+  iwrc rc = 0;
+  IWULIST users = { 0 }, wsidlist = { 0 };
+  bool indexed = false;
+
+  if (len < 0) {
+    len = strlen(data);
+  }
+  RCC(rc, finish, iwulist_init(&users, 32, sizeof(int64_t)));
+  RCC(rc, finish, iwulist_init(&wsidlist, 32, sizeof(uint32_t)));
+
+  if (room_cid) {
+    RLOCK();
+    IWULIST *ul = iwhmap_get(_map_room_users, room_cid);
+    if (ul) {
+      indexed = true;
+      for (int i = 0, l = iwulist_length(ul); !rc && i < l; ++i) {
+        rc = iwulist_push(&users, iwulist_at2(ul, i));
+      }
+    }
+    UNLOCK();
+    RCGO(rc, finish);
+  }
+  if (!indexed) {
+    // Room participants are not tracked by this process, eg: server was restarted
+    RCC(rc, finish, _room_users_load(room_id, &users));
   }
-  if (iwhmap_count(idmap) == 0) {
+  if (iwulist_length(&users) == 0) {
     goto finish;
   }
 
   RLOCK();
-  iwhmap_iter_init(_map_wsid_wsdata, &iter);
-  while (iwhmap_iter_next(&iter)) {
-    const struct ws_session *wss = iter.val;
-    int64_t user_id = grh_auth_get_userid(wss->ws->req);
-    if ((intptr_t) iwhmap_get(idmap, (void*) user_id) == (intptr_t) -1) {
-      iwulist_push(&wsidlist, &wss->wsid);
+  for (int i = 0, l = iwulist_length(&users); i < l; ++i) {
+    int64_t user_id = *(int64_t*) iwulist_at2(&users, i);
+    for (struct ws_session *wss = iwhmap_get_u64(_map_user_sessions, user_id); wss; wss = wss->user_next) {
+      if (iwulist_push(&wsidlist, &wss->wsid)) {
+        break;
+      }
     }
   }
   UNLOCK();
 
-  for (int i = 0; i < wsidlist.num; ++i) {
+  for (int i = 0, l = iwulist_length(&wsidlist); i < l; ++i) {
     uint32_t wsid = *(uint32_t*) iwulist_at2(&wsidlist, i);
-    RLOCK();
-    struct ws_session *wss = iwhmap_get(_map_wsid_wsdata, (void*) (intptr_t) wsid);
-    if (wss) {
-#ifdef _DEBUG
-      int64_t user_id = grh_auth_get_userid(wss->ws->req);
-      iwlog_debug("SEND[%d, %" PRId64 "]: %.*s", wss->wsid, user_id, (int) len, data);
-#endif
-      iwn_ws_server_write(wss->ws, data, len);
-    }
-    UNLOCK();
+    grh_ws_send_by_wsid(wsid, data, len);
   }
 
 finish:
-  ejdb_list_destroy(&qlist);
-  jql_destroy(&q);
-  iwhmap_destroy(idmap);
+  iwulist_destroy_keep(&users);
   iwulist_destroy_keep(&wsidlist);
   return rc;
 }
@@ -343,11 +453,18 @@ iwrc grh_ws_register_wsh_handler(
   }
 
   iwrc rc = 0;
-  pthread_mutex_lock(&_handlers_mtx);
+  pthread_mutex_lock(&_handlers.mtx);
 
   char *ccmd = 0;
   struct wsh_handler *handler_new = 0;
-  struct wsh_handler *handler = iwhmap_get(_wsh_handlers, cmd);
+  struct wsh_handler *handler = 0;
+
+  if (_handlers.sealed) {
+    iwlog_error("WSH: %s %s cannot be registered after WS server is started", name, cmd);
+    rc = IW_ERROR_INVALID_STATE;
+    goto finish;
+  }
+  handler = iwhmap_get(_handlers.map, cmd);
 
   RCB(finish, handler_new = malloc(sizeof(*handler_new)));
   handler_new->name = name;
@@ -363,11 +480,11 @@ iwrc grh_ws_register_wsh_handler(
     handler->next = handler_new;
   } else {
     RCB(finish, ccmd = strdup(cmd));
-    RCC(rc, finish, iwhmap_put(_wsh_handlers, ccmd, handler_new));
+    RCC(rc, finish, iwhmap_put(_handlers.map, ccmd, handler_new));
   }
 
 finish:
-  pthread_mutex_unlock(&_handlers_mtx);
+  pthread_mutex_unlock(&_handlers.mtx);
   if (rc) {
     _free_wsh_handlers_entry(ccmd, handler_new);
   }
@@ -387,33 +504,23 @@ static bool _ws_message_handle(struct ws_session *wss, const char *msg, size_t m
 #endif
 
   iwrc rc = 0;
-  JBL_NODE n = 0, n2;
+  JBL_NODE n = 0;
   const char *hook = 0, *cmd;
-  bool locked = false;
 
-  IWPOOL *pool = iwpool_create_empty();
+  IWPOOL *pool = grh_ws_arena_acquire();
   RCB(finish, pool);
 
-  RCC(rc, finish, jbn_from_json(msg, &n, pool));
-  jbn_at(n, "/cmd", &n2);
-  if (n2 && (n2->type == JBV_STR)) {
-    cmd = n2->vptr;
-  } else {
+  rc = grh_ws_message_parse(msg, pool, &n, &cmd, &hook);
+  if (rc == IW_ERROR_INVALID_VALUE) {
     iwlog_warn("Invalid WS command received: %s", msg);
-    rc = IW_ERROR_INVALID_VALUE;
-    goto finish;
-  }
-  jbn_at(n, "/hook", &n2);
-  if (n2 && (n2->type == JBV_STR)) {
-    hook = n2->vptr;
   }
-  pthread_mutex_lock(&_handlers_mtx), locked = true;
-  struct wsh_handler *handler = iwhmap_get(_wsh_handlers, cmd);
+  RCGO(rc, finish);
+
+  struct wsh_handler *handler = grh_ws_handlers_find(&_handlers, cmd);
   if (!handler) {
     iwlog_warn("Unknown command received: %s", msg);
     goto finish;
   }
-  pthread_mutex_unlock(&_handlers_mtx), locked = false;
 
   struct ws_message_ctx ctx = {
     .cmd     = cmd,
@@ -432,10 +539,7 @@ static bool _ws_message_handle(struct ws_session *wss, const char *msg, size_t m
   }
 
 finish:
-  if (locked) {
-    pthread_mutex_unlock(&_handlers_mtx);
-  }
-  iwpool_destroy(pool);
+  grh_ws_arena_release(pool);
   if (rc) {
     iwlog_ecode_error3(rc);
   }
@@ -458,10 +562,14 @@ static bool _ws_message_init(struct ws_session *wss, const char *msg, size_t msg
   RCC(rc, finish, _ws_ticket_pull(wss, ticket));
   iwn_ws_server_write(wss->ws, "{}", IW_LLEN("{}"));
 
+  wss->user_id = grh_auth_get_userid(wss->ws->req);
+
   WLOCK();
   iwhmap_put_u32(_map_wsid_wsdata, wss->wsid, wss);
   iwhmap_put(_map_uuid_sessions, wss->uuid, wss);
+  rc = _user_session_link(wss);
   UNLOCK();
+  RCGO(rc, finish);
 
 finish:
   if (rc) {
@@ -484,22 +592,6 @@ static bool _on_ws_message(struct iwn_ws_sess *ws, const char *msg, size_t msg_l
   }
 }
 
-static iwrc _ws_ticket_save(const char *ticket, const char *session_id) {
-  uint64_t ts;
-  int64_t id;
-  JBL jbl = 0;
-  iwrc rc = RCR(iwp_current_time_ms(&ts, false));
-  RCC(rc, finish, jbl_create_empty_object(&jbl));
-  RCC(rc, finish, jbl_set_string(jbl, "name", ticket));
-  RCC(rc, finish, jbl_set_string(jbl, "session_id", session_id));
-  RCC(rc, finish, jbl_set_int64(jbl, "ts", ts));
-  RCC(rc, finish, ejdb_put_new(g_env.db, "tickets", jbl, &id));
-
-finish:
-  jbl_destroy(&jbl);
-  return rc;
-}
-
 static int _handler_ticket(struct iwn_wf_req *req, void *d) {
   iwrc rc = 0;
   int ret = 500;
@@ -509,11 +601,8 @@ static int _handler_ticket(struct iwn_wf_req *req, void *d) {
     return 403;
   }
 
-  char ticket[IW_UUID_STR_LEN + 1];
-  iwu_uuid4_fill(ticket);
-  ticket[IW_UUID_STR_LEN] = '\0';
-
-  RCC(rc, finish, _ws_ticket_save(ticket, sid));
+  char ticket[WS_TICKET_LEN + 1];
+  RCC(rc, finish, grh_ws_ticket_issue(sid, ticket));
   RCC(rc, finish, iwn_http_response_header_set(req->http, "cache-control", "no-store, max-age=0", -1));
   iwn_http_response_write(req->http, 200, "text/plain", ticket, IW_UUID_STR_LEN);
 
@@ -550,20 +639,24 @@ static void _on_wsid_wsdata_free(void *key, void *val) {
   struct ws_session *wss = val;
   if (val) {
     iwhmap_remove(_map_uuid_sessions, wss->uuid);
+    _user_session_unlink(wss);
     free(wss);
   }
 }
 
-static bool _initialized = false;
-
 void grh_ws_destroy(void) {
   if (!__sync_bool_compare_and_swap(&_initialized, true, false)) {
     grh_ws_user_destroy();
-    iwhmap_destroy(_wsh_handlers);
+    grh_ws_ticket_destroy();
+    iwhmap_destroy(_handlers.map);
+    _handlers.map = 0;
     iwhmap_destroy(_map_wsid_wsdata);
     iwhmap_destroy(_map_uuid_sessions);
+    iwhmap_destroy(_map_user_sessions);
+    iwhmap_destroy(_map_room_users);
     pthread_rwlock_destroy(&_rwl);
-    pthread_mutex_destroy(&_handlers_mtx);
+    pthread_mutex_destroy(&_handlers.mtx);
+    _handlers.sealed = false;
   }
 }
 
@@ -572,15 +665,18 @@ static iwrc _init(void) {
     return 0;  // initialized already
   }
   iwrc rc = 0;
-  pthread_mutex_init(&_handlers_mtx, 0);
+  pthread_mutex_init(&_handlers.mtx, 0);
   pthread_rwlock_init(&_rwl, 0);
 
   RCB(finish, _map_wsid_wsdata = iwhmap_create_u32(_on_wsid_wsdata_free));
   RCB(finish, _map_uuid_sessions = iwhmap_create_str(0));
-  RCB(finish, _wsh_handlers = iwhmap_create_str(_free_wsh_handlers_entry));
+  RCB(finish, _map_user_sessions = iwhmap_create_u64(0));
+  RCB(finish, _map_room_users = iwhmap_create_str(_room_users_free));
+  RCB(finish, _handlers.map = iwhmap_create_str(_free_wsh_handlers_entry));
 
   RCC(rc, finish, grh_ws_register_wsh_handler("ping", "grh_ws::ping", _ping, 0, 0));
   RCC(rc, finish, grh_ws_user_init());
+  RCC(rc, finish, grh_ws_ticket_init());
 
 finish:
   if (rc) {
@@ -592,6 +688,7 @@ finish:
 static bool _on_wss_init(struct iwn_ws_sess *ws) {
   iwrc rc = 0;
   RCC(rc, finish, _init());
+  grh_ws_handlers_seal(&_handlers);
 
   struct ws_session *wss = calloc(1, sizeof(*wss));
   RCB(finish, wss);
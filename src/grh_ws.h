@@ -44,9 +44,11 @@ struct ws_session {
     void (*fn)(struct ws_session *wss, void *data);
     void *data;
   } on_close;
-  int  wsid;    ///< WS id
-  char uuid[IW_UUID_STR_LEN + 1];
-  bool initialized;
+  struct ws_session *user_next; ///< Next WS session of the same user
+  int64_t  user_id;             ///< Session user id
+  int      wsid;                ///< WS id
+  char     uuid[IW_UUID_STR_LEN + 1];
+  bool     initialized;
 };
 
 struct ws_message_ctx {
@@ -67,6 +69,13 @@ void grh_wss_set_data_of_type(struct ws_session *wss, struct grh_user_data *data
 
 void grh_wss_unset_data_of_type(struct ws_session *wss, int data_type);
 
+/**
+ * @brief Registers WS command handler.
+ *
+ * Handlers table becomes immutable once the first WS session is opened,
+ * so all handlers must be registered at the application startup.
+ * @return IW_ERROR_INVALID_STATE if handlers table is sealed already.
+ */
 iwrc grh_ws_register_wsh_handler(
   const char *cmd, const char *name, wsh_handler_fn wsh, void *data,
   void (*dispose)(void*));
@@ -91,7 +100,35 @@ iwrc grh_ws_peek_client_by_session_uuid(const char *uuid, ws_clients_visitor vis
  */
 iwrc grh_ws_send_all(const char *data, ssize_t len);
 
-iwrc grh_ws_send_all_room_participants(int64_t room_id, const char *data, ssize_t len);
+/**
+ * @brief Send a message to all WS sessions of users participated in the room.
+ *
+ * Participants present in the open room session are taken from in-memory index maintained by
+ * `grh_ws_room_participant_add()` and `grh_ws_room_participant_remove()`,
+ * otherwise all participants joined the room are loaded from `/events` of room document.
+ *
+ * @param room_id  Room document id
+ * @param room_cid Optional room session id
+ * @param data Message data pointer.
+ * @param len  Message length or `-1` if length of message will be computed by `strlen()`
+ */
+iwrc grh_ws_send_all_room_participants(int64_t room_id, const char *room_cid, const char *data, ssize_t len);
+
+/**
+ * @brief Registers user as a participant of the room session identified by `room_cid`.
+ */
+iwrc grh_ws_room_participant_add(const char *room_cid, int64_t user_id);
+
+/**
+ * @brief Unregisters user who left the room session identified by `room_cid`.
+ */
+void grh_ws_room_participant_remove(const char *room_cid, int64_t user_id);
+
+/**
+ * @brief Releases room session participants index entry when room-wide notifications
+ *        are not expected anymore.
+ */
+void grh_ws_room_participants_release(const char *room_cid);
 
 /**
  * @brief Send a message to user indentified by user document id.
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "grh_ws_dispatch.h"
+
+IWPOOL* grh_ws_arena_acquire(void) {
+  return iwpool_create(WS_ARENA_INITIAL_SIZE);
+}
+
+void grh_ws_arena_release(IWPOOL *pool) {
+  iwpool_destroy(pool);
+}
+
+iwrc grh_ws_message_parse(
+  const char  *msg,
+  IWPOOL      *pool,
+  JBL_NODE    *n_out,
+  const char **cmd_out,
+  const char **hook_out
+  ) {
+  JBL_NODE n, n2;
+  iwrc rc = RCR(jbn_from_json(msg, &n, pool));
+  if (jbn_at(n, "/cmd", &n2) || n2->type != JBV_STR) {
+    return IW_ERROR_INVALID_VALUE;
+  }
+  *cmd_out = n2->vptr;
+  if (!jbn_at(n, "/hook", &n2) && n2->type == JBV_STR) {
+    *hook_out = n2->vptr;
+  } else {
+    *hook_out = 0;
+  }
+  *n_out = n;
+  return rc;
+}
+
+void grh_ws_handlers_seal(struct grh_ws_handlers *hs) {
+  if (!__atomic_load_n(&hs->sealed, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&hs->mtx);
+    __atomic_store_n(&hs->sealed, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&hs->mtx);
+  }
+}
+
+void* grh_ws_handlers_find(struct grh_ws_handlers *hs, const char *cmd) {
+  // Handlers table is sealed before any WS message is received
+  return iwhmap_get(hs->map, cmd);
+}
@@ -0,0 +1,69 @@
+#pragma once
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include <ejdb2/ejdb2.h>
+#include <iowow/iwhmap.h>
+
+#include <pthread.h>
+
+/// Initial size of WS message parse arena, fits parsed JSON of typical signalling message
+#define WS_ARENA_INITIAL_SIZE 4096
+
+/// WS command handlers table.
+struct grh_ws_handlers {
+  IWHMAP *map;         ///< Command name (char*) => handlers chain. Immutable when `sealed` is set.
+  pthread_mutex_t mtx; ///< Guards `map` until it is sealed
+  bool sealed;         ///< No more handlers can be registered, lookup is performed without locking
+};
+
+/**
+ * @brief Creates parse arena of a single WS message preallocated by WS_ARENA_INITIAL_SIZE.
+ */
+IWPOOL* grh_ws_arena_acquire(void);
+
+/**
+ * @brief Releases parse arena once the message is handled.
+ *
+ * Arena memory is never carried over to the next message.
+ */
+void grh_ws_arena_release(IWPOOL *pool);
+
+/**
+ * @brief Parses WS message JSON in the given `pool`.
+ *
+ * @param [out] n_out Message JSON.
+ * @param [out] cmd_out Message `cmd` field.
+ * @param [out] hook_out Optional message `hook` field, zero if not set.
+ * @return IW_ERROR_INVALID_VALUE if message has no string `cmd` field.
+ */
+iwrc grh_ws_message_parse(
+  const char  *msg,
+  IWPOOL      *pool,
+  JBL_NODE    *n_out,
+  const char **cmd_out,
+  const char **hook_out);
+
+/**
+ * @brief Makes handlers table immutable.
+ */
+void grh_ws_handlers_seal(struct grh_ws_handlers *hs);
+
+/**
+ * @brief Returns handlers chain of the given command in sealed handlers table.
+ */
+void* grh_ws_handlers_find(struct grh_ws_handlers *hs, const char *cmd);
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+#include "grh_ws_ticket.h"
+#include "gr_db_wb.h"
+
+#include <ejdb2/ejdb2.h>
+#include <iowow/iwp.h>
+#include <iowow/iwhmap.h>
+#include <iwnet/iwn_scheduler.h>
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/// Number of timer wheel slots
+#define WHEEL_SLOTS 64
+
+/// Max number of tickets kept in memory
+#define TICKETS_MAX (128 * 1024)
+
+struct ticket {
+  char     name[WS_TICKET_LEN + 1];
+  uint64_t expire_at;       ///< Ticket expiration time ms
+  struct ticket *prev;      ///< Previous ticket in the wheel slot
+  struct ticket *next;      ///< Next ticket in the wheel slot
+  char     session_id[];
+};
+
+static struct {
+  pthread_mutex_t mtx;
+  IWHMAP   *map;            ///< Ticket name => struct ticket*
+  struct ticket *wheel[WHEEL_SLOTS];
+  uint64_t  tick_ms;        ///< Duration of wheel slot
+  uint64_t  last_slot;      ///< Absolute number of the last processed wheel slot
+  bool      initialized;
+} _t = {
+  .mtx = PTHREAD_MUTEX_INITIALIZER
+};
+
+static iwrc _db_ticket_save(const char *ticket, const char *session_id) {
+  uint64_t ts;
+  JBL jbl = 0;
+  iwrc rc = RCR(iwp_current_time_ms(&ts, false));
+  RCC(rc, finish, jbl_create_empty_object(&jbl));
+  RCC(rc, finish, jbl_set_string(jbl, "name", ticket));
+  RCC(rc, finish, jbl_set_string(jbl, "session_id", session_id));
+  RCC(rc, finish, jbl_set_int64(jbl, "ts", ts));
+  // Ticket will be redeemed by client right after response so wait for commit
+  RCC(rc, finish, gr_db_wb_submit(&(struct gr_db_wb_spec) {
+    .op = GR_DB_WB_PUT_NEW,
+    .wclass = GR_DB_WB_COMMIT,
+    .coll = "tickets",
+    .jbl = jbl
+  }));
+
+finish:
+  jbl_destroy(&jbl);
+  return rc;
+}
+
+static iwrc _db_ticket_pull(const char *ticket, char **out_session_id) {
+  JQL q = 0;
+  EJDB_LIST list = 0;
+  const char *val;
+
+  iwrc rc = jql_create(&q, "tickets", "/[name = :?] | del");
+  RCGO(rc, finish);
+  RCC(rc, finish, jql_set_str(q, 0, 0, ticket));
+  RCC(rc, finish, ejdb_list4(g_env.db, q, 1, 0, &list));
+
+  if (!list->first) {
+    rc = GR_ERROR_UNKNOWN_TICKET_ID;
+    goto finish;
+  }
+  RCC(rc, finish, jbl_object_get_str(list->first->raw, "session_id", &val));
+  RCB(finish, *out_session_id = strdup(val));
+
+finish:
+  jql_destroy(&q);
+  ejdb_list_destroy(&list);
+  return rc;
+}
+
+static void _wheel_unlink(struct ticket *t, uint32_t slot) {
+  if (t->prev) {
+    t->prev->next = t->next;
+  } else if (_t.wheel[slot] == t) {
+    _t.wheel[slot] = t->next;
+  }
+  if (t->next) {
+    t->next->prev = t->prev;
+  }
+  t->prev = t->next = 0;
+}
+
+static uint32_t _wheel_slot(const struct ticket *t) {
+  return (uint32_t) ((t->expire_at / _t.tick_ms) % WHEEL_SLOTS);
+}
+
+static void _on_tick(void *arg);
+
+static void _tick_schedule(void) {
+  if (g_env.shutdown) {
+    return;
+  }
+  iwrc rc = iwn_schedule(&(struct iwn_scheduler_spec) {
+    .poller = g_env.poller,
+    .task_fn = _on_tick,
+    .timeout_ms = _t.tick_ms,
+  });
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
+}
+
+static void _on_tick(void *arg) {
+  uint64_t ts;
+  if (iwp_current_time_ms(&ts, false)) {
+    _tick_schedule();
+    return;
+  }
+  pthread_mutex_lock(&_t.mtx);
+  if (!_t.initialized) {
+    pthread_mutex_unlock(&_t.mtx);
+    return;
+  }
+  // Expire tickets in all wheel slots completed since the last tick
+  uint64_t target = ts / _t.tick_ms - 1;
+  if (target > _t.last_slot + WHEEL_SLOTS) {
+    _t.last_slot = target - WHEEL_SLOTS;
+  }
+  while (_t.last_slot < target) {
+    uint32_t slot = (uint32_t) (++_t.last_slot % WHEEL_SLOTS);
+    struct ticket *t = _t.wheel[slot];
+    while (t) {
+      struct ticket *next = t->next;
+      if (t->expire_at / _t.tick_ms <= _t.last_slot) {
+        _wheel_unlink(t, slot);
+        iwhmap_remove(_t.map, t->name);
+      }
+      t = next;
+    }
+  }
+  pthread_mutex_unlock(&_t.mtx);
+  _tick_schedule();
+}
+
+iwrc grh_ws_ticket_issue(const char *session_id, char out_ticket[WS_TICKET_LEN + 1]) {
+  iwu_uuid4_fill(out_ticket);
+  out_ticket[WS_TICKET_LEN] = '\0';
+  if (g_env.ws.tickets_db) {
+    return _db_ticket_save(out_ticket, session_id);
+  }
+
+  uint64_t ts;
+  iwrc rc = RCR(iwp_current_time_ms(&ts, false));
+  size_t len = strlen(session_id);
+  struct ticket *t = malloc(sizeof(*t) + len + 1);
+  if (!t) {
+    return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+  }
+  memcpy(t->name, out_ticket, sizeof(t->name));
+  memcpy(t->session_id, session_id, len + 1);
+  t->expire_at = ts + (uint64_t) g_env.periodic_worker.expire_ws_ticket_timeout_sec * 1000;
+  t->prev = 0;
+
+  pthread_mutex_lock(&_t.mtx);
+  if (iwhmap_count(_t.map) >= TICKETS_MAX) {
+    rc = IW_ERROR_OVERFLOW;
+    goto finish;
+  }
+  RCC(rc, finish, iwhmap_put(_t.map, t->name, t));
+  uint32_t slot = _wheel_slot(t);
+  t->next = _t.wheel[slot];
+  if (t->next) {
+    t->next->prev = t;
+  }
+  _t.wheel[slot] = t;
+  t = 0;
+
+finish:
+  pthread_mutex_unlock(&_t.mtx);
+  free(t);
+  return rc;
+}
+
+iwrc grh_ws_ticket_redeem(const char *ticket, char **out_session_id) {
+  *out_session_id = 0;
+  if (g_env.ws.tickets_db) {
+    return _db_ticket_pull(ticket, out_session_id);
+  }
+
+  uint64_t ts;
+  iwrc rc = RCR(iwp_current_time_ms(&ts, false));
+
+  pthread_mutex_lock(&_t.mtx);
+  struct ticket *t = iwhmap_get(_t.map, ticket);
+  if (!t) {
+    rc = GR_ERROR_UNKNOWN_TICKET_ID;
+    goto finish;
+  }
+  if (t->expire_at > ts) {
+    *out_session_id = strdup(t->session_id);
+    if (!*out_session_id) {
+      rc = iwrc_set_errno(IW_ERROR_ALLOC, errno);
+    }
+  } else {
+    rc = GR_ERROR_UNKNOWN_TICKET_ID;
+  }
+  _wheel_unlink(t, _wheel_slot(t));
+  iwhmap_remove(_t.map, ticket);
+
+finish:
+  pthread_mutex_unlock(&_t.mtx);
+  return rc;
+}
+
+static void _ticket_free(void *key, void *val) {
+  free(val);
+}
+
+iwrc grh_ws_ticket_init(void) {
+  if (g_env.ws.tickets_db) {
+    iwlog_info2("WS tickets are stored in the database");
+    return 0;
+  }
+  uint64_t ts;
+  iwrc rc = 0;
+  bool started = false;
+  RCR(iwp_current_time_ms(&ts, false));
+
+  pthread_mutex_lock(&_t.mtx);
+  if (_t.initialized) {
+    goto finish;
+  }
+  RCB(finish, _t.map = iwhmap_create_str(_ticket_free));
+  // Slot duration is chosen to fit ticket lifetime into single wheel round
+  _t.tick_ms = (uint64_t) g_env.periodic_worker.expire_ws_ticket_timeout_sec * 1000 / (WHEEL_SLOTS - 2) + 1;
+  if (_t.tick_ms < 1000) {
+    _t.tick_ms = 1000;
+  }
+  _t.last_slot = ts / _t.tick_ms - 1;
+  _t.initialized = true;
+  started = true;
+
+finish:
+  pthread_mutex_unlock(&_t.mtx);
+  if (started) {
+    _tick_schedule();
+  }
+  return rc;
+}
+
+void grh_ws_ticket_destroy(void) {
+  pthread_mutex_lock(&_t.mtx);
+  if (_t.initialized) {
+    iwhmap_destroy(_t.map);
+    _t.map = 0;
+    memset(_t.wheel, 0, sizeof(_t.wheel));
+    _t.initialized = false;
+  }
+  pthread_mutex_unlock(&_t.mtx);
+}
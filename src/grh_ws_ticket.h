@@ -0,0 +1,47 @@
+#pragma once
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "grh.h"
+
+#include <iowow/iwuuid.h>
+
+#define WS_TICKET_LEN IW_UUID_STR_LEN
+
+/**
+ * @brief Issues a new WS connection ticket bound to the given HTTP session.
+ *
+ * By default tickets are kept in process-local memory table,
+ * database `tickets` collection is used only if `[ws] tickets_db` option is set.
+ *
+ * @param session_id HTTP session id.
+ * @param[out] out_ticket Ticket buffer, zero terminated.
+ */
+iwrc grh_ws_ticket_issue(const char *session_id, char out_ticket[WS_TICKET_LEN + 1]);
+
+/**
+ * @brief Redeems (removes) ticket and returns HTTP session id bound to it.
+ *
+ * @param ticket Ticket id.
+ * @param[out] out_session_id Session id, must be released by `free()`.
+ * @return GR_ERROR_UNKNOWN_TICKET_ID if ticket is not found or expired.
+ */
+iwrc grh_ws_ticket_redeem(const char *ticket, char **out_session_id);
+
+iwrc grh_ws_ticket_init(void);
+
+void grh_ws_ticket_destroy(void);
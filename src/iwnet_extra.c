@@ -23,6 +23,8 @@
 
 #include <libdeflate.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <errno.h>
 
 int iwn_http_response_gz(
@@ -104,6 +106,67 @@ finish:
   return ret;
 }
 
+/// Checks if `etag` is in `If-None-Match` entity tags list using weak comparison.
+static bool _etag_list_match(const struct iwn_val *val, const char *etag) {
+  size_t len = strlen(etag);
+  const char *sp = val->buf, *ep = val->buf + val->len, *tp;
+
+  while (sp < ep) {
+    while (sp < ep && (*sp == ' ' || *sp == ',')) {
+      ++sp;
+    }
+    if (sp < ep && *sp == '*') {
+      return true;
+    }
+    if (ep - sp > 2 && sp[0] == 'W' && sp[1] == '/') {
+      sp += 2;
+    }
+    tp = sp;
+    if (tp < ep && *tp == '"') {
+      for (++tp; tp < ep && *tp != '"'; ++tp);
+      if (tp < ep) {
+        ++tp;
+      }
+    }
+    if (tp - sp == len && memcmp(sp, etag, len) == 0) {
+      return true;
+    }
+    for (sp = tp; sp < ep && *sp != ','; ++sp);
+  }
+  return false;
+}
+
+bool iwn_http_response_not_modified(struct iwn_http_req *req, const char *etag, uint64_t mtime_ms) {
+  char buf[64];
+  struct tm tm;
+  time_t mtime = mtime_ms / 1000;
+
+  if (etag) {
+    iwn_http_response_header_set(req, "etag", etag, strlen(etag));
+  }
+  if (mtime_ms && gmtime_r(&mtime, &tm)) {
+    size_t len = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (len) {
+      iwn_http_response_header_set(req, "last-modified", buf, len);
+    }
+  }
+
+  // If-None-Match takes precedence, If-Modified-Since is ignored when it is present
+  struct iwn_val val = iwn_http_request_header_get(req, "if-none-match", IW_LLEN("if-none-match"));
+  if (val.len) {
+    return etag && _etag_list_match(&val, etag);
+  }
+  val = iwn_http_request_header_get(req, "if-modified-since", IW_LLEN("if-modified-since"));
+  if (!mtime_ms || !val.len || val.len >= sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, val.buf, val.len);
+  buf[val.len] = '\0';
+  memset(&tm, 0, sizeof(tm));
+  const char *ep = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return ep && *ep == '\0' && mtime <= timegm(&tm);
+}
+
 bool iwn_ws_server_write_jbl(struct iwn_ws_sess *ws, JBL json) {
   iwrc rc = 0;
   bool ret = false;
@@ -22,6 +22,7 @@
 #define GRH_USER_DATA_TYPE_WS            0x01U
 #define GRH_USER_DATA_TYPE_WB            0x02U
 #define GRH_USER_DATA_TYPE_WSROOM_MEMBER 0x03U
+#define GRH_USER_DATA_TYPE_WS_GAUGES     0x04U
 
 #define GRH_USER_DATA_FIELDS              \
   int type;                               \
@@ -53,6 +54,16 @@ int iwn_http_response_jbl(
   int                  code,
   bool                 gzip);
 
+/**
+ * @brief Sets `etag` and `last-modified` validators of response and evaluates
+ *        `If-None-Match` and `If-Modified-Since` request preconditions.
+ *
+ * @param etag Strong entity tag of response representation including double quotes. Optional.
+ * @param mtime_ms Representation modification time in milliseconds since epoch, zero if unknown.
+ * @return True if client has up to date copy of representation, so `304 Not Modified` should be sent.
+ */
+bool iwn_http_response_not_modified(struct iwn_http_req *req, const char *etag, uint64_t mtime_ms);
+
 bool iwn_ws_server_write_jbl(struct iwn_ws_sess *ws, JBL json);
 
 bool iwn_ws_server_write_jbn(struct iwn_ws_sess *ws, JBL_NODE json);
@@ -17,6 +17,7 @@
 
 #include "grh_ws.h"
 #include "grh_auth.h"
+#include "gr_db_wb.h"
 #include "rct_room_internal.h"
 #include "rct_room_recording.h"
 #include "rct/rct.h"
@@ -29,6 +30,10 @@
 #include "utils/html.h"
 #include "lic/lic.h"
 
+#if (ENABLE_WHITEBOARD == 1)
+#include "wb/wb.h"
+#endif
+
 #include <iowow/iwhmap.h>
 #include <iowow/iwarr.h>
 #include <iowow/iwuuid.h>
@@ -1188,7 +1193,6 @@ static iwrc _room_message(struct ws_message_ctx *ctx, void *op) {
   iwrc rc = 0;
   const char *error = 0;
 
-  JQL q = 0;
   char *message = 0;
   char *member_name = 0;
   JBL_NODE n, resp = 0, patch, patch_op, patch_value;
@@ -1257,11 +1261,14 @@ static iwrc _room_message(struct ws_message_ctx *ctx, void *op) {
   RCC(rc, finish, jbn_add_item_i64(patch_value, 0, recipient_id, 0, ctx->pool));
   RCC(rc, finish, jbn_add_item_str(patch_value, 0, message, -1, 0, ctx->pool));
 
-  RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] | apply :?"));
-  RCC(rc, finish, jql_set_str(q, 0, 0, room_uuid));
-  RCC(rc, finish, jql_set_json(q, 0, 1, patch));
-
-  RCC(rc, finish, ejdb_update(g_env.db, q));
+  RCC(rc, finish, gr_db_wb_submit(&(struct gr_db_wb_spec) {
+    .op = GR_DB_WB_UPDATE,
+    .wclass = GR_DB_WB_LAZY,
+    .coll = "rooms",
+    .query = "/[uuid = :?] | apply :?",
+    .key = room_uuid,
+    .json = patch
+  }));
 
   RCC(rc, finish, jbn_from_json("{}", &resp, ctx->pool));
   RCC(rc, finish, jbn_add_item_str(resp, "cmd", "message", sizeof("message") - 1, 0, ctx->pool));
@@ -1295,7 +1302,6 @@ static iwrc _room_message(struct ws_message_ctx *ctx, void *op) {
 finish:
   free(member_name);
   free(message);
-  jql_destroy(&q);
   SIMPLE_HANDLER_FINISH_RET(resp);
 }
 
@@ -1411,7 +1417,6 @@ finish:
 }
 
 static iwrc _room_backup_previous(wrc_resource_t room_id) {
-  int64_t id;
   rct_resource_base_t b;
   JQL q = 0;
   EJDB_LIST res = 0;
@@ -1426,6 +1431,8 @@ static iwrc _room_backup_previous(wrc_resource_t room_id) {
     }
     return rc;
   }
+  // Previous session document must include all its queued events
+  RCC(rc, finish, gr_db_wb_flush(false));
   RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] | /*"));
   RCC(rc, finish, jql_set_str(q, 0, 0, b.uuid));
   RCC(rc, finish, ejdb_list4(g_env.db, q, 1, 0, &res));
@@ -1452,7 +1459,12 @@ static iwrc _room_backup_previous(wrc_resource_t room_id) {
     n_sess->vbool = true;
     memcpy((char*) n_cid->vptr, n_uuid->vptr, IW_UUID_STR_LEN);
     memcpy((char*) n_uuid->vptr, uuid, IW_UUID_STR_LEN);
-    RCC(rc, finish, ejdb_put_new_jbn(g_env.db, "rooms", doc, &id));
+    RCC(rc, finish, gr_db_wb_submit(&(struct gr_db_wb_spec) {
+      .op = GR_DB_WB_PUT_NEW,
+      .wclass = GR_DB_WB_COMMIT,
+      .coll = "rooms",
+      .json = doc
+    }));
   }
 
 finish:
@@ -1464,7 +1476,6 @@ finish:
 static void _on_room_created(wrc_resource_t room_id) {
   JBL_NODE n, n2, n3;
   iwrc rc = 0;
-  JQL q = 0;
   IWPOOL *pool = 0;
   bool locked = false;
 
@@ -1494,16 +1505,23 @@ static void _on_room_created(wrc_resource_t room_id) {
 
   rct_resource_unlock(room, __func__), locked = false;
 
-  RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] | upsert :?"));
-  RCC(rc, finish, jql_set_str(q, 0, 0, room->uuid));
-  RCC(rc, finish, jql_set_json(q, 0, 1, n));
-  RCC(rc, finish, ejdb_update(g_env.db, q));
+  // Rooms documents are written through write-behind queue only, so events are kept in order
+  RCC(rc, finish, gr_db_wb_submit(&(struct gr_db_wb_spec) {
+    .op = GR_DB_WB_UPDATE,
+    .wclass = GR_DB_WB_COMMIT,
+    .coll = "rooms",
+    .query = "/[uuid = :?] | upsert :?",
+    .key = room->uuid,
+    .json = n
+  }));
+#if (ENABLE_WHITEBOARD == 1)
+  wb_room_meta_invalidate(room->cid);
+#endif
 
 finish:
   if (locked) {
     rct_resource_unlock(room, __func__);
   }
-  jql_destroy(&q);
   iwpool_destroy(pool);
   if (rc) {
     iwlog_ecode_error3(rc);
@@ -1514,8 +1532,13 @@ static void _on_room_closed(JBL event_data) {
   JBL uuid;
   JBL_NODE n;
   uint64_t ts;
-  JQL q = 0;
   iwrc rc = 0;
+  const char *cid = 0;
+
+  // Participants notified when recording is processed are loaded from room `/events`
+  if (!jbl_object_get_str(event_data, "cid", &cid)) {
+    grh_ws_room_participants_release(cid);
+  }
 
   IWPOOL *pool = iwpool_create_empty();
   RCA(pool, finish);
@@ -1534,17 +1557,19 @@ static void _on_room_closed(JBL event_data) {
         ts
         ));
 
-  RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] | apply :?"));
-  RCC(rc, finish, jql_set_str(q, 0, 0, jbl_get_str(uuid)));
-  RCC(rc, finish, jql_set_json(q, 0, 1, n));
-
-  RCC(rc, finish, ejdb_update(g_env.db, q));
+  RCC(rc, finish, gr_db_wb_submit(&(struct gr_db_wb_spec) {
+    .op = GR_DB_WB_UPDATE,
+    .wclass = GR_DB_WB_LAZY,
+    .coll = "rooms",
+    .query = "/[uuid = :?] | apply :?",
+    .key = jbl_get_str(uuid),
+    .json = n
+  }));
 
 finish:
   if (rc) {
     iwlog_ecode_error3(rc);
   }
-  jql_destroy(&q);
   jbl_destroy(&uuid);
   iwpool_destroy(pool);
 }
@@ -1554,7 +1579,6 @@ static void _on_member_join(wrc_resource_t member_id) {
   int64_t user_id, room_id;
 
   iwrc rc = 0;
-  JQL q = 0;
   JBL jbl = 0;
   JBL_NODE n = 0;
   bool locked = false;
@@ -1610,15 +1634,19 @@ static void _on_member_join(wrc_resource_t member_id) {
       n_name->vptr = member_name;
       n_name->vsize = (int) strlen(member_name);
     }
-    RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] | apply :?"));
-    RCC(rc, finish, jql_set_str(q, 0, 0, room_uuid));
-    RCC(rc, finish, jql_set_json(q, 0, 1, n));
-    RCC(rc, finish, ejdb_update(g_env.db, q));
+    RCC(rc, finish, gr_db_wb_submit(&(struct gr_db_wb_spec) {
+      .op = GR_DB_WB_UPDATE,
+      .wclass = GR_DB_WB_LAZY,
+      .coll = "rooms",
+      .query = "/[uuid = :?] | apply :?",
+      .key = room_uuid,
+      .json = n
+    }));
+    RCC(rc, finish, grh_ws_room_participant_add(room_cid, user_id));
   }
 
   // Register room participation
   {
-    int64_t id;
     char key[sizeof(room_cid) + NUMBUSZ + 1]; // Buffer for @joins/k
     snprintf(key, sizeof(key), "%" PRId64 ":%s", user_id, room_cid);
     RCC(rc, finish, jbl_create_empty_object(&jbl));
@@ -1626,10 +1654,13 @@ static void _on_member_join(wrc_resource_t member_id) {
     jbl_set_string(jbl, "u", room_uuid);
     jbl_set_int64(jbl, "t", ts);
     jbl_set_bool(jbl, "o", owner);
-    rc = ejdb_put_new(g_env.db, "joins", jbl, &id);
-    if (rc == EJDB_ERROR_UNIQUE_INDEX_CONSTRAINT_VIOLATED) {
-      rc = 0;
-    }
+    rc = gr_db_wb_submit(&(struct gr_db_wb_spec) {
+      .op = GR_DB_WB_PUT_NEW,
+      .wclass = GR_DB_WB_LAZY,
+      .coll = "joins",
+      .jbl = jbl,
+      .ignore_unique = true
+    });
     jbl_destroy(&jbl);
     RCGO(rc, finish);
   }
@@ -1658,7 +1689,6 @@ finish:
     iwlog_ecode_error3(rc);
   }
   free(member_name);
-  jql_destroy(&q);
   iwpool_destroy(pool);
 }
 
@@ -1670,8 +1700,8 @@ static void _on_member_left(JBL event_data) {
   int64_t user_id, owner_user_id = 0;
   rct_room_t *room;
   const char *uuid;
+  char room_cid[IW_UUID_STR_LEN + 1] = { 0 };
 
-  JQL q = 0;
   iwrc rc = 0;
   int room_flags = 0;
 
@@ -1688,6 +1718,7 @@ static void _on_member_left(JBL event_data) {
   if (room) {
     room_flags = room->flags;
     owner_user_id = room->owner_user_id;
+    memcpy(room_cid, room->cid, sizeof(room_cid));
   }
   rct_resource_unlock(room, __func__);
 
@@ -1695,6 +1726,9 @@ static void _on_member_left(JBL event_data) {
   if (n->type != JBV_I64) {
     goto finish;
   }
+  if (room_cid[0]) {
+    grh_ws_room_participant_remove(room_cid, n->vi64);
+  }
   RCC(rc, finish, jbn_at(n_data, "/member_name", &n_member_name));
   if (n_member_name->type != JBV_STR) {
     goto finish;
@@ -1716,17 +1750,20 @@ static void _on_member_left(JBL event_data) {
       n2->vptr = n_member_name->vptr;
       n2->vsize = n_member_name->vsize;
     }
-    RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] | apply :?"));
-    RCC(rc, finish, jql_set_str(q, 0, 0, uuid));
-    RCC(rc, finish, jql_set_json(q, 0, 1, n_apply));
-    rc = ejdb_update(g_env.db, q);
+    rc = gr_db_wb_submit(&(struct gr_db_wb_spec) {
+      .op = GR_DB_WB_UPDATE,
+      .wclass = GR_DB_WB_LAZY,
+      .coll = "rooms",
+      .query = "/[uuid = :?] | apply :?",
+      .key = uuid,
+      .json = n_apply
+    });
   }
 
 finish:
   if (rc) {
     iwlog_ecode_error3(rc);
   }
-  jql_destroy(&q);
   iwpool_destroy(pool);
 }
 
@@ -2410,7 +2447,6 @@ static iwrc _room_info_set_apply(
   const char            *name_old
   ) {
   iwrc rc = 0;
-  JQL q = 0;
   JBL_NODE n, n2;
   uint64_t ts;
   int namelen = (int) strlen(name);
@@ -2418,7 +2454,6 @@ static iwrc _room_info_set_apply(
   RCC(rc, finish, iwp_current_time_ms(&ts, false));
 
   // Update room name and events history
-  RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] | apply :?"));
   RCC(rc, finish, jbn_from_json_printf(
         &n, ctx->pool,
         "["
@@ -2440,9 +2475,17 @@ static iwrc _room_info_set_apply(
     n2->vptr = name;
     n2->vsize = namelen;
   }
-  RCC(rc, finish, jql_set_str(q, 0, 0, room->uuid));
-  RCC(rc, finish, jql_set_json(q, 0, 1, n));
-  RCC(rc, finish, ejdb_update(g_env.db, q));
+  RCC(rc, finish, gr_db_wb_submit(&(struct gr_db_wb_spec) {
+    .op = GR_DB_WB_UPDATE,
+    .wclass = GR_DB_WB_COMMIT,
+    .coll = "rooms",
+    .query = "/[uuid = :?] | apply :?",
+    .key = room->uuid,
+    .json = n
+  }));
+#if (ENABLE_WHITEBOARD == 1)
+  wb_room_meta_invalidate(room->cid);
+#endif
 
   // Patch rooms history of every room participant
   for (int i = 0; i < mlist->num; ++i) {
@@ -2454,7 +2497,6 @@ static iwrc _room_info_set_apply(
   }
 
 finish:
-  jql_destroy(&q);
   return rc;
 }
 
@@ -2610,8 +2652,8 @@ static iwrc _whiteboard_open(struct ws_message_ctx *ctx, void *op) {
   rct_room_member_t *member = 0;
   wrc_resource_t member_id = _wss_member_get(ctx->wss), room_id;
   JBL jbl = 0;
-  JQL q = 0;
   JBL_NODE n = 0, n2 = 0;
+  char room_uuid[IW_UUID_STR_LEN + 1];
   uint64_t ts;
 
   RCC(rc, finish, iwp_current_time_ms(&ts, false));
@@ -2627,7 +2669,6 @@ static iwrc _whiteboard_open(struct ws_message_ctx *ctx, void *op) {
 
   if (  (member->room->owner_user_id == member->user_id || (member->room->flags & RCT_ROOM_MEETING))
      && (member->room->num_whiteboard_clicks)++ == 0) {
-    RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] | apply :?"));
     RCC(rc, finish, jbn_from_json_printf(
           &n, ctx->pool,
           "["
@@ -2640,8 +2681,7 @@ static iwrc _whiteboard_open(struct ws_message_ctx *ctx, void *op) {
       jbn_add_item_str(n2, 0, member->name, -1, 0, ctx->pool);
       jbn_add_item_str(n2, 0, member->room->whiteboard_link, -1, 0, ctx->pool);
     }
-    RCC(rc, finish, jql_set_str(q, 0, 0, member->room->uuid));
-    RCC(rc, finish, jql_set_json(q, 0, 1, n));
+    memcpy(room_uuid, member->room->uuid, sizeof(room_uuid));
 
     RCC(rc, finish, jbl_create_empty_object(&jbl));
     RCC(rc, finish, jbl_set_string(jbl, "event", "ROOM_WHITEBOARD_INIT"));
@@ -2652,8 +2692,15 @@ static iwrc _whiteboard_open(struct ws_message_ctx *ctx, void *op) {
 
   rct_unlock(), locked = false;
 
-  if (q != 0) {
-    RCC(rc, finish, ejdb_update(g_env.db, q));
+  if (n != 0) {
+    RCC(rc, finish, gr_db_wb_submit(&(struct gr_db_wb_spec) {
+      .op = GR_DB_WB_UPDATE,
+      .wclass = GR_DB_WB_LAZY,
+      .coll = "rooms",
+      .query = "/[uuid = :?] | apply :?",
+      .key = room_uuid,
+      .json = n
+    }));
   }
 
   if (jbl != 0) {
@@ -2664,7 +2711,6 @@ finish:
   if (locked) {
     rct_unlock();
   }
-  jql_destroy(&q);
   if (rc) {
     // If rc == 0 it will be destroyed in _send_to_members
     jbl_destroy(&jbl);
@@ -3054,7 +3100,6 @@ finish:
 
 void _on_recording(wrc_resource_t room_id, bool recording) {
   iwrc rc = 0;
-  JQL q = 0;
   JBL jbl = 0;
   JBL_NODE patch, patch_op, patch_value;
   uint64_t ts;
@@ -3077,11 +3122,14 @@ void _on_recording(wrc_resource_t room_id, bool recording) {
   RCC(rc, finish, jbn_add_item_i64(patch_value, 0, (int64_t) ts, 0, pool));
 
   RCC(rc, finish, rct_resource_probe_by_id(room_id, &b));
-  RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] | apply :?"));
-  RCC(rc, finish, jql_set_str(q, 0, 0, b.uuid));
-  RCC(rc, finish, jql_set_json(q, 0, 1, patch));
-
-  RCC(rc, finish, ejdb_update(g_env.db, q));
+  RCC(rc, finish, gr_db_wb_submit(&(struct gr_db_wb_spec) {
+    .op = GR_DB_WB_UPDATE,
+    .wclass = GR_DB_WB_LAZY,
+    .coll = "rooms",
+    .query = "/[uuid = :?] | apply :?",
+    .key = b.uuid,
+    .json = patch
+  }));
 
   // Send event to room participants
   RCC(rc, finish, jbl_create_empty_object(&jbl));
@@ -3096,7 +3144,6 @@ finish:
     iwlog_ecode_error3(rc);
     jbl_destroy(&jbl);
   }
-  jql_destroy(&q);
   iwpool_destroy(pool);
 }
 
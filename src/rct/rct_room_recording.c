@@ -21,19 +21,20 @@
 #include "rct_consumer.h"
 #include "gr_task_worker.h"
 #include "utils/files.h"
+#include "lic_env.h"
+
+#if (ENABLE_RECORDING == 1)
+#include "rec/recording_engine.h"
+#endif
 
 #include <ejdb2/ejdb2.h>
 #include <iowow/iwarr.h>
-#include <iwnet/iwn_proc.h>
 #include <iwnet/iwn_scheduler.h>
 
 #include <pthread.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
-#include <stdatomic.h>
-#include <signal.h>
-#include <sys/types.h>
-#include <sys/wait.h>
 
 extern struct gr_env g_env;
 
@@ -41,48 +42,29 @@ static struct slot {
   struct rct_room *room;
   struct rct_producer_export *export;
   struct slot *next;
-  int proc_pid;
+  char    *output_file;  // Media file of recorded stream
+  uint32_t stream_id;
+  bool     audio;        // Audio stream
+  bool     pending;      // Stream is queued until recording engine has free capacity
+  bool     reserved;     // Recording capacity is taken by stream being started or recorded
 } *_slots;
 
-struct proc {
-  wrc_resource_t export_id;
-  IWPOOL *pool;
-};
-
 static pthread_mutex_t _mtx = PTHREAD_MUTEX_INITIALIZER;
-static atomic_int _num_workers;
 
-static void _proc_spec_destroy(struct proc *proc) {
-  --_num_workers;
-  if (proc && proc->pool) {
-    iwpool_destroy(proc->pool);
-  }
-}
+/// Number of streams reserved for recording, limited by `max_processes`
+static int _num_reserved;
 
-static void _proc_on_exit(const struct iwn_proc_ctx *ctx) {
-  int code = WIFEXITED(ctx->wstatus) ? WEXITSTATUS(ctx->wstatus) : -1;
-  if (g_env.log.verbose) {
-    iwlog_info("[ffm-rec:%d] terminated, exit code: %d", ctx->pid, code);
-  }
-  struct proc *proc = ctx->user_data;
-  assert(proc);
-  wrc_resource_t export_id = 0;
-  pthread_mutex_lock(&_mtx);
-  for (struct slot *s = _slots; s; s = s->next) {
-    if (s->proc_pid == ctx->pid && proc->export_id == s->export->id) {
-      export_id = s->export->id;
-      s->proc_pid = 0;
-      break;
-    }
-  }
-  pthread_mutex_unlock(&_mtx);
-  if (export_id) {
-    rct_export_consumer_pause(export_id);
+/// Releases recording capacity taken by slot. Returns true if it was reserved.
+static bool _slot_release_lk(struct slot *slot) {
+  if (!slot->reserved) {
+    return false;
   }
-  _proc_spec_destroy(proc);
+  slot->reserved = false;
+  --_num_reserved;
+  return true;
 }
 
-static char* _proc_output_file(struct proc *proc, struct rct_producer_export *export, iwrc *rcp) {
+static char* _rec_output_file(struct rct_producer_export *export, const char *ext, iwrc *rcp) {
   iwrc rc = 0;
   *rcp = 0;
   uint64_t ts;
@@ -125,7 +107,7 @@ static char* _proc_output_file(struct proc *proc, struct rct_producer_export *ex
 
   RCC(rc, finish, iwxstr_printf(xstr, "/%" PRIu64 "-%" PRId64 "-%s.%s", time, user_id,
                                 (rcp_kind == RTP_KIND_VIDEO ? "v" : "a"),
-                                "webm"));
+                                ext));
 
 finish:
   if (rc) {
@@ -137,12 +119,120 @@ finish:
   return res;
 }
 
-static void _proc_on_stdout(const struct iwn_proc_ctx *ctx, const char *chunk, size_t len) {
-  iwlog_info("[ffm-rec:%d] %.*s", ctx->pid, (int) len, chunk);
+#if (ENABLE_RECORDING == 1)
+
+/// Delay before rendering finished segments of recording in progress
+/// after one of its streams is closed. Closings within this period are coalesced.
+#define PRERENDER_DELAY_MS 10000
+
+/// Rooms having pending segments prerendering
+static struct prerender {
+  char cid[IW_UUID_STR_LEN + 1];
+  struct prerender *next;
+} *_prerenders;
+
+static void _prerender_remove(struct prerender *pr) {
+  pthread_mutex_lock(&_mtx);
+  for (struct prerender *p = _prerenders, *pp = 0; p; pp = p, p = p->next) {
+    if (p == pr) {
+      if (pp) {
+        pp->next = p->next;
+      } else {
+        _prerenders = p->next;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&_mtx);
 }
 
-static void _proc_on_stderr(const struct iwn_proc_ctx *ctx, const char *chunk, size_t len) {
-  iwlog_info("[ffm-rec:%d] %.*s", ctx->pid, (int) len, chunk);
+static void _prerender_submit(void *arg) {
+  iwrc rc = 0;
+  uint64_t ts;
+  JBL jbl = 0;
+  JBL_NODE n, open;
+  struct prerender *pr = arg;
+  IWPOOL *pool = iwpool_create_empty();
+
+  _prerender_remove(pr);
+
+  RCA(pool, finish);
+  RCC(rc, finish, iwp_current_time_ms(&ts, false));
+  RCC(rc, finish, jbn_from_json("{}", &n, pool));
+  RCC(rc, finish, jbn_add_item_i64(n, "ts", (int64_t) ts, 0, pool));
+  RCC(rc, finish, jbn_add_item_arr(n, "open", &open, pool));
+
+  pthread_mutex_lock(&_mtx);
+  for (struct slot *s = _slots; s; s = s->next) {
+    if (s->output_file && !strcmp(s->room->cid, pr->cid)) {
+      const char *fname = strrchr(s->output_file, '/');
+      rc = jbn_add_item_str(open, 0, fname ? fname + 1 : s->output_file, -1, 0, pool);
+      if (rc) {
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&_mtx);
+  RCGO(rc, finish);
+
+  RCC(rc, finish, jbl_from_node(&jbl, n));
+  RCC(rc, finish, gr_persistent_task_submit(PT_RECORDING_PRERENDER, pr->cid, jbl));
+
+finish:
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
+  jbl_destroy(&jbl);
+  iwpool_destroy(pool);
+  free(pr);
+}
+
+/// Scheduled prerendering is cancelled on shutdown, pending room entry is disposed.
+static void _prerender_cancel(void *arg) {
+  struct prerender *pr = arg;
+  _prerender_remove(pr);
+  free(pr);
+}
+
+/// Schedules background rendering of recording segments
+/// finished so far to reduce postprocessing time once room is closed.
+static void _prerender_schedule(struct rct_room *room) {
+  iwrc rc = 0;
+  struct prerender *pr = 0;
+  if (g_env.recording.nopostproc) {
+    return;
+  }
+  pthread_mutex_lock(&_mtx);
+  for (pr = _prerenders; pr; pr = pr->next) {
+    if (!strcmp(pr->cid, room->cid)) {
+      break;
+    }
+  }
+  if (pr) { // Already scheduled
+    pthread_mutex_unlock(&_mtx);
+    return;
+  }
+  pr = malloc(sizeof(*pr));
+  if (!pr) {
+    pthread_mutex_unlock(&_mtx);
+    return;
+  }
+  memcpy(pr->cid, room->cid, sizeof(pr->cid));
+  pr->next = _prerenders;
+  _prerenders = pr;
+  pthread_mutex_unlock(&_mtx);
+
+  rc = iwn_schedule(&(struct iwn_scheduler_spec) {
+    .poller = g_env.poller,
+    .user_data = pr,
+    .task_fn = _prerender_submit,
+    .on_cancel = _prerender_cancel,
+    .timeout_ms = PRERENDER_DELAY_MS,
+  });
+  if (rc) {
+    iwlog_ecode_error3(rc);
+    _prerender_cancel(pr);
+  }
 }
 
 static void _request_key_frame(void *arg) {
@@ -153,171 +243,268 @@ static void _request_key_frame(void *arg) {
   }
 }
 
-static iwrc _proc_spawn(struct rct_producer_export *export) {
-  if (_num_workers > g_env.recording.max_processes) {
-    iwlog_warn("Reached the maximum number of recorder processes %d", g_env.recording.max_processes);
-    return 0;
+static void _rec_on_key_frame_request(void *user_data) {
+  iwrc rc = iwn_schedule(&(struct iwn_scheduler_spec) {
+    .poller = g_env.poller,
+    .user_data = user_data,
+    .task_fn = _request_key_frame,
+  });
+  if (rc) {
+    iwlog_ecode_error3(rc);
   }
-  iwrc rc = 0;
-  char *output_file;
-  struct iwn_proc_spec *pspec;
-  IWXSTR *xargs = 0;
+}
 
-  IWPOOL *pool = iwpool_create_empty();
-  if (!pool) {
-    return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+static void _rec_stop(struct rct_room *room, uint32_t stream_id, char *output_file);
+
+/// Releases recording capacity of stream which recorder gave up after failed restarts.
+static void _rec_failed(void *arg) {
+  wrc_resource_t consumer_id = (wrc_resource_t) (uintptr_t) arg;
+  uint32_t stream_id = 0;
+  char *output_file = 0;
+  struct rct_room *room = 0;
+  bool released = false;
+  pthread_mutex_lock(&_mtx);
+  for (struct slot *s = _slots; s; s = s->next) {
+    if (s->stream_id && s->export->consumer->id == consumer_id) {
+      room = s->room;
+      stream_id = s->stream_id;
+      output_file = s->output_file;
+      s->stream_id = 0;
+      s->output_file = 0;
+      released = _slot_release_lk(s);
+      break;
+    }
   }
-  pspec = iwpool_alloc(sizeof(*pspec) + sizeof(struct proc), pool);
-  if (!pspec) {
-    iwpool_destroy(pool);
-    return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+  pthread_mutex_unlock(&_mtx);
+  if (stream_id) {
+    iwlog_warn("Recording of stream %u failed, its slot is released", stream_id);
+  }
+  if (released) {
+    _rec_stop(room, stream_id, output_file);
+  } else {
+    free(output_file);
   }
+}
 
-  struct proc *proc = (void*) &pspec[1];
-  *pspec = (struct iwn_proc_spec) {
+/// Called on recording thread, so slot is released on the poller thread.
+static void _rec_on_failed(void *user_data) {
+  iwrc rc = iwn_schedule(&(struct iwn_scheduler_spec) {
     .poller = g_env.poller,
-    .path = g_env.recording.ffmpeg,
-    .user_data = proc,
-    .on_stdout = _proc_on_stdout,
-    .on_stderr = _proc_on_stderr,
-    .on_exit = _proc_on_exit,
-    .write_stdin = true
-  };
-
-  ++_num_workers; // Will be decremented in `_proc_destroy()`
+    .user_data = user_data,
+    .task_fn = _rec_failed,
+  });
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
+}
 
-  proc->pool = pool;
-  proc->export_id = export->id;
+/// Keeps output file of restarted recorder in its slot, so prerender knows the file is still being written.
+static void _rec_on_output_file(void *user_data, const char *output_file) {
+  wrc_resource_t consumer_id = (wrc_resource_t) (uintptr_t) user_data;
+  pthread_mutex_lock(&_mtx);
+  for (struct slot *s = _slots; s; s = s->next) {
+    if (s->stream_id && s->export->consumer->id == consumer_id) {
+      char *file = strdup(output_file);
+      if (file) {
+        free(s->output_file);
+        s->output_file = file;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&_mtx);
+}
 
-  RCB(finish, xargs = iwxstr_new());
-  if (pspec->path == g_env.program_file) {
-    iwxstr_cat2(xargs, "f"); // ffmpeg options selector
+static iwrc _rec_start(struct rct_producer_export *export) {
+  // Capacity is reserved before the stream is opened so concurrent starts cannot exceed `max_processes`
+  pthread_mutex_lock(&_mtx);
+  struct slot *slot = export->hook_user_data;
+  if (!slot || slot->reserved) { // Export is closed or its stream is started already
+    pthread_mutex_unlock(&_mtx);
+    return 0;
   }
-  if (g_env.recording.verbose) {
-    RCC(rc, finish, iwxstr_cat2(xargs, "\1-loglevel\1debug"));
-  } else {
-    RCC(rc, finish, iwxstr_cat2(xargs, "\1-loglevel\1fatal"));
-  }
-  RCC(rc, finish, iwxstr_cat2(xargs, "\1-copyts"));
-  RCC(rc, finish, iwxstr_cat2(xargs, "\1-use_wallclock_as_timestamps" "\1" "1"));
-  RCC(rc, finish, iwxstr_cat2(
-        xargs,
-        "\1-protocol_whitelist"
-        "\1pipe,udp,rtp"
-        "\1-f"
-        "\1sdp"
-        "\1-i"
-        "\1pipe:0"
-        ));
-
-  if (export->producer->spec->rtp_kind == RTP_KIND_AUDIO) {
-    RCC(rc, finish, iwxstr_cat2(
-          xargs,
-          "\1-map"
-          "\1" "0:a:0"
-          "\1-c:a"
-          "\1copy"
-          ));
-  } else {
-    RCC(rc, finish, iwxstr_cat2(
-          xargs,
-          "\1-map"
-          "\1" "0:v:0"
-          "\1-c:v"
-          "\1copy"
-          ));
-  }
-  RCC(rc, finish, iwxstr_cat2(xargs, "\1-fflags"));
-  if (export->producer->spec->rtp_kind == RTP_KIND_AUDIO) {
-    RCC(rc, finish, iwxstr_cat2(xargs, "\1flush_packets+discardcorrupt+nobuffer"));
-  } else {
-    RCC(rc, finish, iwxstr_cat2(xargs, "\1discardcorrupt+nobuffer"));
+  if (_num_reserved >= g_env.recording.max_processes) {
+    slot->pending = true;
+    pthread_mutex_unlock(&_mtx);
+    iwlog_info("Reached the maximum number of recorded streams %d, stream is queued",
+               g_env.recording.max_processes);
+    return 0;
   }
-  RCC(rc, finish, iwxstr_cat2(
-        xargs,
-        "\1-flags"
-        "\1+low_delay"
-        ));
+  slot->pending = false;
+  slot->reserved = true;
+  ++_num_reserved;
+  pthread_mutex_unlock(&_mtx);
 
-  output_file = _proc_output_file(proc, export, &rc);
-  RCGO(rc, finish);
-  iwxstr_printf(xargs, "\1-y\1%s", output_file);
-  free(output_file);
+  iwrc rc = 0;
+  uint32_t stream_id = 0;
+  char *output_file = 0;
+  JBL_NODE n, codec = export->codec;
+  struct recording_stream_spec spec = {
+    .port = export->port,
+    .on_key_frame_request = _rec_on_key_frame_request,
+    .on_failed = _rec_on_failed,
+    .on_output_file = _rec_on_output_file,
+    .user_data = (void*) (uintptr_t) export->consumer->id,
+  };
 
-  RCB(finish, pspec->args = iwpool_split_string(pool, iwxstr_ptr(xargs), "\1", true));
-  if (g_env.log.verbose) {
-    char *cmd = iwn_proc_command_get(pspec);
-    if (cmd) {
-      iwlog_info("Spawn: %s", cmd);
-    }
-    free(cmd);
-    iwlog_debug("Stdin:\n%s", export->sdp);
+  RCC(rc, finish, jbn_at(codec, "/mimeType", &n));
+  RCIF(n->type != JBV_STR, rc, IW_ERROR_INVALID_VALUE, finish);
+  spec.mime_type = n->vptr;
+  RCC(rc, finish, jbn_at(codec, "/payloadType", &n));
+  RCIF(n->type != JBV_I64, rc, IW_ERROR_INVALID_VALUE, finish);
+  spec.payload_type = (int) n->vi64;
+  if (!jbn_at(codec, "/clockRate", &n) && n->type == JBV_I64) {
+    spec.clock_rate = (int) n->vi64;
+  }
+  if (!jbn_at(codec, "/channels", &n) && n->type == JBV_I64) {
+    spec.channels = (int) n->vi64;
   }
 
-  int pid;
-  RCC(rc, finish, iwn_proc_spawn(pspec, &pid));
-  RCC(rc, finish, iwn_proc_stdin_write(pid, export->sdp, strlen(export->sdp), true));
+  output_file = _rec_output_file(export, strcasecmp(spec.mime_type, "video/H264") ? "webm" : "mkv", &rc);
+  RCGO(rc, finish);
+  spec.output_file = output_file;
+
+  RCC(rc, finish, recording_engine_stream_open(&spec, &stream_id));
 
   pthread_mutex_lock(&_mtx);
-  struct slot *slot = export->hook_user_data;
-  if (slot) {
-    slot->proc_pid = pid;
+  slot = export->hook_user_data;
+  if (slot && slot->reserved && !slot->stream_id) {
+    free(slot->output_file);
+    slot->output_file = output_file;
+    slot->stream_id = stream_id;
+    output_file = 0;
+    stream_id = 0;
   }
   pthread_mutex_unlock(&_mtx);
+  if (stream_id) { // Export is closed or paused already, its reservation is released by the closing side
+    recording_engine_stream_close(stream_id);
+    goto finish;
+  }
 
   if (export->consumer->paused) {
     rct_export_consumer_resume(export->id);
   }
-  if (export->producer->spec->rtp_kind == RTP_KIND_VIDEO) {
-    RCC(rc, finish, iwn_schedule(&(struct iwn_scheduler_spec) {
-      .poller = g_env.poller,
-      .timeout_ms = 1000,
-      .user_data = (void*) (uintptr_t) export->consumer->id,
-      .task_fn = _request_key_frame,
-    }));
-  }
 
 finish:
+  free(output_file);
   if (rc) {
-    if (proc) {
-      _proc_spec_destroy(proc);
-    } else {
-      iwpool_destroy(pool);
+    bool released = false;
+    pthread_mutex_lock(&_mtx);
+    slot = export->hook_user_data;
+    if (slot && !slot->stream_id) {
+      released = _slot_release_lk(slot);
+    }
+    pthread_mutex_unlock(&_mtx);
+    if (released) {
+      _rec_stop(0, 0, 0);
     }
+    iwlog_ecode_error3(rc);
   }
-  iwxstr_destroy(xargs);
   return rc;
 }
 
+/// Starts recording of the most prioritized queued stream.
+/// Audio streams go first, then streams of rooms having less recorded streams.
+static void _rec_pending_start(void) {
+  int best_num = 0;
+  struct slot *best = 0;
+  wrc_resource_t export_id = 0;
+
+  pthread_mutex_lock(&_mtx);
+  for (struct slot *s = _slots; s; s = s->next) {
+    if (!s->pending) {
+      continue;
+    }
+    int num = 0;
+    for (struct slot *s2 = _slots; s2; s2 = s2->next) {
+      if (s2->room == s->room && s2->stream_id) {
+        ++num;
+      }
+    }
+    if (!best || (s->audio && !best->audio) || (s->audio == best->audio && num < best_num)) {
+      best = s;
+      best_num = num;
+    }
+  }
+  if (best) {
+    export_id = best->export->id; // Export is referenced by id since it may be closed once unlocked
+  }
+  pthread_mutex_unlock(&_mtx);
+
+  if (export_id) {
+    struct rct_producer_export *export = rct_resource_by_id_unlocked(export_id, RCT_TYPE_PRODUCER_EXPORT, __func__);
+    if (export) {
+      _rec_start(export);
+      rct_resource_ref_unlock(export, false, -1, __func__);
+    }
+  }
+}
+
+/// Stops recording of stream which capacity reservation is released by caller
+/// and starts the next queued stream. Stream may be not opened yet if `stream_id` is zero.
+static void _rec_stop(struct rct_room *room, uint32_t stream_id, char *output_file) {
+  if (stream_id) {
+    recording_engine_stream_close(stream_id);
+    _prerender_schedule(room);
+  }
+  free(output_file);
+  _rec_pending_start();
+}
+
+#else
+
+static iwrc _rec_start(struct rct_producer_export *export) {
+  return IW_ERROR_NOT_IMPLEMENTED;
+}
+
+static void _rec_stop(struct rct_room *room, uint32_t stream_id, char *output_file) {
+  free(output_file);
+}
+
+#endif
+
 static void _export_on_resume(struct rct_producer_export *export) {
-  int pid = 0;
+  uint32_t stream_id = 0;
   pthread_mutex_lock(&_mtx);
   struct slot *slot = export->hook_user_data;
   if (slot) {
-    pid = slot->proc_pid;
+    stream_id = slot->stream_id;
   }
   pthread_mutex_unlock(&_mtx);
-  if (!pid) {
-    _proc_spawn(export);
+  if (!stream_id) {
+    _rec_start(export);
   }
 }
 
 static void _export_on_pause(struct rct_producer_export *export) {
-  int pid = 0;
+  uint32_t stream_id = 0;
+  char *output_file = 0;
+  struct rct_room *room = 0;
+  bool released = false;
   pthread_mutex_lock(&_mtx);
   struct slot *slot = export->hook_user_data;
   if (slot) {
-    pid = slot->proc_pid;
-    slot->proc_pid = 0;
+    room = slot->room;
+    stream_id = slot->stream_id;
+    output_file = slot->output_file;
+    slot->stream_id = 0;
+    slot->output_file = 0;
+    slot->pending = false;
+    released = _slot_release_lk(slot);
   }
   pthread_mutex_unlock(&_mtx);
-  if (pid) {
-    iwn_proc_kill_ensure(g_env.poller, pid, SIGINT, -30, SIGINT);
+  if (released) {
+    _rec_stop(room, stream_id, output_file);
+  } else {
+    free(output_file);
   }
 }
 
 static void _export_on_close(struct rct_producer_export *export) {
-  int pid = 0;
+  uint32_t stream_id = 0;
+  char *output_file = 0;
+  struct rct_room *room = 0;
+  bool released = false;
   pthread_mutex_lock(&_mtx);
   for (struct slot *s = _slots, *p = 0; s; p = s, s = s->next) {
     if (s->export == export) {
@@ -328,8 +515,12 @@ static void _export_on_close(struct rct_producer_export *export) {
       }
       if (export->hook_user_data) {
         struct slot *slot = export->hook_user_data;
-        pid = slot->proc_pid;
-        slot->proc_pid = 0;
+        room = slot->room;
+        stream_id = slot->stream_id;
+        output_file = slot->output_file;
+        slot->stream_id = 0;
+        slot->output_file = 0;
+        released = _slot_release_lk(slot);
         export->hook_user_data = 0;
       }
       free(s);
@@ -337,8 +528,10 @@ static void _export_on_close(struct rct_producer_export *export) {
     }
   }
   pthread_mutex_unlock(&_mtx);
-  if (pid) {
-    iwn_proc_kill_ensure(g_env.poller, pid, SIGINT, -30, SIGINT);
+  if (released) {
+    _rec_stop(room, stream_id, output_file);
+  } else {
+    free(output_file);
   }
 }
 
@@ -349,9 +542,14 @@ static iwrc _export_on_start(struct rct_producer_export *export) {
   struct slot *slot = malloc(sizeof(*slot)), *n = 0;
   RCA(slot, finish);
 
+  rct_lock();
+  bool audio = producer->spec->rtp_kind == RTP_KIND_AUDIO;
+  rct_unlock();
+
   *slot = (struct slot) {
     .room = producer->transport->router->room,
     .export = export,
+    .audio = audio,
   };
 
   pthread_mutex_lock(&_mtx);
@@ -373,7 +571,7 @@ static iwrc _export_on_start(struct rct_producer_export *export) {
   pthread_mutex_unlock(&_mtx);
 
   if (!paused) {
-    RCC(rc, finish, _proc_spawn(export));
+    RCC(rc, finish, _rec_start(export));
   }
 
 finish:
@@ -0,0 +1,1323 @@
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "recording_engine.h"
+#include "gr_gauges.h"
+
+#include <iowow/iwp.h>
+#include <iowow/iwhmap.h>
+#include <iowow/iwarr.h>
+#include <iwnet/iwn_poller.h>
+
+#include <libavformat/avformat.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <time.h>
+
+extern struct gr_env g_env;
+
+/// Max size of assembled video frame
+#define FRAME_MAX_SIZE (4 * 1024 * 1024)
+/// Min interval between key frame requests
+#define KEY_FRAME_REQUEST_INTERVAL_MS 1000
+/// Socket receive buffer size
+#define SOCKET_RCVBUF_SIZE (1024 * 1024)
+/// Max number of recorder restarts after output failures
+#define RESTARTS_MAX 5
+/// Max delay before restart of failed recorder
+#define RESTART_DELAY_MAX_MS 30000
+/// Recorder lag after which video frames are dropped until recorder catches up
+#define LAG_DEGRADE_MS 2000
+/// Min interval between recording lag gauge updates
+#define LAG_REPORT_INTERVAL_MS 1000
+/// Max size of received RTP packet
+#define RTP_PACKET_MAX 2048
+/// Number of RTP packets held to restore order of reordered packets, power of two
+#define RTP_REORDER_NUM 16
+/// Opus encoder delay in 48kHz samples stored as OpusHead pre-skip, libopus default
+#define OPUS_PRE_SKIP 312
+
+typedef enum {
+  CODEC_OPUS = 1,
+  CODEC_VP8,
+  CODEC_VP9,
+  CODEC_H264,
+} codec_e;
+
+struct stream {
+  uint32_t id;
+  int      fd;
+  codec_e  codec;
+  int      payload_type;
+  int      clock_rate;
+  int      channels;
+  char    *output_file;
+  void (*on_key_frame_request)(void *user_data);
+  void (*on_failed)(void *user_data);
+  void (*on_output_file)(void *user_data, const char *output_file);
+  void *user_data;
+
+  pthread_mutex_t  mtx;
+  AVFormatContext *oc;
+  AVPacket *pkt;
+  bool     failed;            ///< Stream muxing failed, all subsequent packets are ignored
+
+  // RTP state
+  bool     rtp_started;
+  uint16_t seq;               ///< Last received sequence number
+  uint32_t ts;                ///< Last received RTP timestamp
+  int64_t  ts_ext;            ///< Extended (unwrapped) RTP timestamp
+  int64_t  ts_first;          ///< Extended RTP timestamp of the first packet
+  int64_t  wall_first_ms;     ///< Wall clock time of the first packet
+  int64_t  pts_last;          ///< Last written PTS (ms)
+  uint64_t key_request_ms;    ///< Time of the last key frame request
+
+  // Packets received ahead of the next expected one, slot is selected by sequence number
+  uint8_t  reorder[RTP_REORDER_NUM][RTP_PACKET_MAX];
+  size_t   reorder_len[RTP_REORDER_NUM];
+
+  // Video frame assembly
+  uint8_t *frame;
+  size_t   frame_len;
+  size_t   frame_cap;
+  int64_t  frame_ts;
+  bool     frame_active;      ///< Frame assembly is in progress
+  bool     frame_broken;      ///< Packets of the current frame are lost
+  bool     need_key;          ///< Waiting for key frame
+
+  // H264 parameter sets
+  uint8_t  sps[256];
+  size_t   sps_len;
+  uint8_t  pps[256];
+  size_t   pps_len;
+
+  // Video dimensions parsed from the last key frame, required by muxer header
+  int width;
+  int height;
+
+  // Supervision
+  uint64_t opened_ms;         ///< Time recording into the current output file started
+  uint64_t restart_at;        ///< Time of the next restart attempt of failed recorder
+  int      restarts;          ///< Number of recorder restarts
+  int64_t  lag_ms;            ///< Age of the oldest packet handled by the last read
+  uint64_t bytes;             ///< Bytes written into output files
+  uint64_t frames_dropped;    ///< Video frames dropped by backpressure
+};
+
+static struct {
+  pthread_mutex_t     mtx;
+  struct iwn_poller  *poller;
+  pthread_t poll_thr;
+  IWHMAP   *streams;
+  uint32_t  seq;
+  int       num;
+  bool      shutdown;
+  // Write budget, guarded by `wb_mtx` since it is taken with stream locked
+  pthread_mutex_t wb_mtx;
+  uint64_t wb_window_ms;      ///< Start of the current write budget window
+  uint64_t wb_bytes;          ///< Bytes written within the current window
+  // Lag reporting, updated atomically by recording threads
+  uint64_t lag_report_ms;     ///< Time of the last lag gauge update
+  int64_t  lag_max_ms;        ///< Max recorder lag since the last lag gauge update
+} _e = {
+  .mtx    = PTHREAD_MUTEX_INITIALIZER,
+  .wb_mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline uint16_t _be16(const uint8_t *p) {
+  return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t _be32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/// Accounts `len` bytes written into output files.
+/// Returns false if `max_write_rate` budget is exhausted and `force` is not set.
+static bool _write_budget_take(size_t len, bool force) {
+  uint64_t budget = (uint64_t) g_env.recording.max_write_rate * 1024, ts;
+  if (!budget || iwp_current_time_ms(&ts, true)) {
+    return true;
+  }
+  bool ret = true;
+  pthread_mutex_lock(&_e.wb_mtx);
+  if (ts - _e.wb_window_ms >= 1000) {
+    _e.wb_window_ms = ts;
+    _e.wb_bytes = 0;
+  }
+  if (!force && _e.wb_bytes + len > budget) {
+    ret = false;
+  } else {
+    _e.wb_bytes += len;
+  }
+  pthread_mutex_unlock(&_e.wb_mtx);
+  return ret;
+}
+
+static void _key_frame_request(struct stream *s) {
+  uint64_t ts;
+  if (!s->on_key_frame_request || iwp_current_time_ms(&ts, false)) {
+    return;
+  }
+  if (ts - s->key_request_ms >= KEY_FRAME_REQUEST_INTERVAL_MS) {
+    s->key_request_ms = ts;
+    s->on_key_frame_request(s->user_data);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+//                            Codec headers                              //
+///////////////////////////////////////////////////////////////////////////
+
+/// MSB first bit reader of codec headers.
+struct bits {
+  const uint8_t *p;
+  size_t len;    ///< Number of available bits
+  size_t pos;
+  bool   overrun; ///< Attempt to read past the end of data
+};
+
+static uint32_t _bits_get(struct bits *b, int n) {
+  uint32_t v = 0;
+  while (n-- > 0) {
+    if (b->pos >= b->len) {
+      b->overrun = true;
+      return 0;
+    }
+    v = (v << 1) | ((b->p[b->pos >> 3] >> (7 - (b->pos & 7))) & 1);
+    ++b->pos;
+  }
+  return v;
+}
+
+/// Exp-Golomb unsigned value, ITU-T H.264 9.1
+static uint32_t _bits_ue(struct bits *b) {
+  int zeros = 0;
+  while (!_bits_get(b, 1)) {
+    if (b->overrun || ++zeros > 31) {
+      b->overrun = true;
+      return 0;
+    }
+  }
+  return ((1U << zeros) - 1) + _bits_get(b, zeros);
+}
+
+static int32_t _bits_se(struct bits *b) {
+  uint32_t k = _bits_ue(b);
+  return (k & 1) ? (int32_t) ((k + 1) / 2) : -(int32_t) (k / 2);
+}
+
+/// VP8 key frame header, RFC 6386 9.1
+static bool _vp8_dimensions_parse(struct stream *s) {
+  const uint8_t *f = s->frame;
+  if (s->frame_len < 10 || f[3] != 0x9d || f[4] != 0x01 || f[5] != 0x2a) {
+    return false;
+  }
+  s->width = (f[6] | (f[7] << 8)) & 0x3fff;
+  s->height = (f[8] | (f[9] << 8)) & 0x3fff;
+  return true;
+}
+
+/// Uncompressed header of VP9 key frame, VP9 bitstream specification 6.2
+static bool _vp9_dimensions_parse(struct stream *s) {
+  struct bits b = { .p = s->frame, .len = s->frame_len * 8 };
+  if (_bits_get(&b, 2) != 2) { // frame_marker
+    return false;
+  }
+  int profile = _bits_get(&b, 1);
+  profile |= _bits_get(&b, 1) << 1;
+  if (profile == 3) {
+    _bits_get(&b, 1); // reserved_zero
+  }
+  if (_bits_get(&b, 1) || _bits_get(&b, 1)) { // show_existing_frame, frame_type is not KEY_FRAME
+    return false;
+  }
+  _bits_get(&b, 2); // show_frame, error_resilient_mode
+  if (_bits_get(&b, 24) != 0x498342) { // frame_sync_code
+    return false;
+  }
+  if (profile >= 2) {
+    _bits_get(&b, 1); // ten_or_twelve_bit
+  }
+  if (_bits_get(&b, 3) != 7) { // color_space is not CS_RGB
+    _bits_get(&b, 1);          // color_range
+    if (profile == 1 || profile == 3) {
+      _bits_get(&b, 3);        // subsampling_x, subsampling_y, reserved_zero
+    }
+  } else if (profile == 1 || profile == 3) {
+    _bits_get(&b, 1);          // reserved_zero
+  }
+  int width = (int) _bits_get(&b, 16) + 1;
+  int height = (int) _bits_get(&b, 16) + 1;
+  if (b.overrun) {
+    return false;
+  }
+  s->width = width;
+  s->height = height;
+  return true;
+}
+
+static void _h264_scaling_list_skip(struct bits *b, int size) {
+  int32_t last = 8, next = 8;
+  for (int i = 0; i < size && !b->overrun; ++i) {
+    if (next) {
+      next = (last + _bits_se(b) + 256) % 256;
+    }
+    last = next ? next : last;
+  }
+}
+
+/// H264 sequence parameter set, ITU-T H.264 7.3.2.1.1
+static bool _h264_dimensions_parse(struct stream *s) {
+  uint8_t rbsp[sizeof(s->sps)];
+  size_t len = 0;
+  if (!s->sps_len) {
+    return false;
+  }
+  // Remove emulation prevention bytes
+  for (size_t i = 0, zeros = 0; i < s->sps_len; ++i) {
+    if (zeros >= 2 && s->sps[i] == 3) {
+      zeros = 0;
+      continue;
+    }
+    zeros = s->sps[i] ? 0 : zeros + 1;
+    rbsp[len++] = s->sps[i];
+  }
+
+  struct bits b = { .p = rbsp, .len = len * 8 };
+  uint32_t chroma_format_idc = 1, separate_colour_plane = 0;
+  _bits_get(&b, 8); // NAL unit header
+  uint32_t profile_idc = _bits_get(&b, 8);
+  _bits_get(&b, 16); // constraint_set flags, level_idc
+  _bits_ue(&b);      // seq_parameter_set_id
+  switch (profile_idc) {
+    case 100: case 110: case 122: case 244: case 44: case 83:
+    case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+      chroma_format_idc = _bits_ue(&b);
+      if (chroma_format_idc == 3) {
+        separate_colour_plane = _bits_get(&b, 1);
+      }
+      _bits_ue(&b);      // bit_depth_luma_minus8
+      _bits_ue(&b);      // bit_depth_chroma_minus8
+      _bits_get(&b, 1);  // qpprime_y_zero_transform_bypass_flag
+      if (_bits_get(&b, 1)) { // seq_scaling_matrix_present_flag
+        for (int i = 0; i < (chroma_format_idc != 3 ? 8 : 12); ++i) {
+          if (_bits_get(&b, 1)) {
+            _h264_scaling_list_skip(&b, i < 6 ? 16 : 64);
+          }
+        }
+      }
+      break;
+  }
+  _bits_ue(&b); // log2_max_frame_num_minus4
+  uint32_t poc_type = _bits_ue(&b);
+  if (poc_type == 0) {
+    _bits_ue(&b); // log2_max_pic_order_cnt_lsb_minus4
+  } else if (poc_type == 1) {
+    _bits_get(&b, 1); // delta_pic_order_always_zero_flag
+    _bits_se(&b);     // offset_for_non_ref_pic
+    _bits_se(&b);     // offset_for_top_to_bottom_field
+    for (uint32_t i = 0, n = _bits_ue(&b); i < n && !b.overrun; ++i) {
+      _bits_se(&b);
+    }
+  }
+  _bits_ue(&b);     // max_num_ref_frames
+  _bits_get(&b, 1); // gaps_in_frame_num_value_allowed_flag
+  uint32_t width_mbs = _bits_ue(&b) + 1;
+  uint32_t height_map_units = _bits_ue(&b) + 1;
+  uint32_t frame_mbs_only = _bits_get(&b, 1);
+  if (!frame_mbs_only) {
+    _bits_get(&b, 1); // mb_adaptive_frame_field_flag
+  }
+  _bits_get(&b, 1); // direct_8x8_inference_flag
+  uint32_t crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+  if (_bits_get(&b, 1)) { // frame_cropping_flag
+    crop_left = _bits_ue(&b);
+    crop_right = _bits_ue(&b);
+    crop_top = _bits_ue(&b);
+    crop_bottom = _bits_ue(&b);
+  }
+  if (b.overrun) {
+    return false;
+  }
+  // Crop units, ITU-T H.264 Table 6-1
+  uint32_t crop_x = 1, crop_y = 2 - frame_mbs_only;
+  if (!separate_colour_plane && chroma_format_idc == 1) {
+    crop_x = 2;
+    crop_y *= 2;
+  } else if (!separate_colour_plane && chroma_format_idc == 2) {
+    crop_x = 2;
+  }
+  int64_t width = (int64_t) width_mbs * 16 - (int64_t) crop_x * (crop_left + crop_right);
+  int64_t height = (int64_t) (2 - frame_mbs_only) * height_map_units * 16
+                   - (int64_t) crop_y * (crop_top + crop_bottom);
+  if (width < 1 || height < 1 || width > 16384 || height > 16384) {
+    return false;
+  }
+  s->width = (int) width;
+  s->height = (int) height;
+  return true;
+}
+
+/// Takes video dimensions from the assembled key frame, they must be known before muxer is opened.
+static bool _frame_dimensions_parse(struct stream *s) {
+  switch (s->codec) {
+    case CODEC_VP8:
+      return _vp8_dimensions_parse(s);
+    case CODEC_VP9:
+      return _vp9_dimensions_parse(s);
+    case CODEC_H264:
+      return s->pps_len && _h264_dimensions_parse(s);
+    default:
+      return true;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+//                               Muxing                                  //
+///////////////////////////////////////////////////////////////////////////
+
+static iwrc _mux_extradata_set(struct stream *s, AVCodecParameters *par) {
+  uint8_t *e = 0;
+  size_t len = 0;
+  if (s->codec == CODEC_OPUS) {
+    // OpusHead, RFC 7845
+    len = 19;
+    e = av_mallocz(len + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!e) {
+      return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+    }
+    memcpy(e, "OpusHead", 8);
+    e[8] = 1;                    // Version
+    e[9] = (uint8_t) s->channels;
+    e[10] = OPUS_PRE_SKIP & 0xff; // Pre-skip, little endian
+    e[11] = OPUS_PRE_SKIP >> 8;
+    e[12] = 48000 & 0xff;        // Input sample rate, little endian
+    e[13] = (48000 >> 8) & 0xff;
+  } else if (s->codec == CODEC_H264) {
+    // Annex B SPS and PPS, converted to avcC by muxer
+    len = 8 + s->sps_len + s->pps_len;
+    e = av_mallocz(len + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!e) {
+      return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+    }
+    e[3] = 1;
+    memcpy(e + 4, s->sps, s->sps_len);
+    e[4 + s->sps_len + 3] = 1;
+    memcpy(e + 8 + s->sps_len, s->pps, s->pps_len);
+  }
+  par->extradata = e;
+  par->extradata_size = (int) len;
+  return 0;
+}
+
+static iwrc _mux_open(struct stream *s) {
+  iwrc rc = 0;
+  int rci;
+  AVStream *st;
+  AVCodecParameters *par;
+  const char *format = s->codec == CODEC_H264 ? "matroska" : "webm";
+
+  if ((rci = avformat_alloc_output_context2(&s->oc, 0, format, s->output_file)) < 0) {
+    iwlog_error("REC | %s", av_err2str(rci));
+    return GR_ERROR_MEDIA_PROCESSING;
+  }
+  s->oc->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+  RCB(finish, st = avformat_new_stream(s->oc, 0));
+  st->time_base = (AVRational) { 1, 1000 };
+  par = st->codecpar;
+
+  switch (s->codec) {
+    case CODEC_OPUS:
+      par->codec_type = AVMEDIA_TYPE_AUDIO;
+      par->codec_id = AV_CODEC_ID_OPUS;
+      par->sample_rate = 48000;
+      av_channel_layout_default(&par->ch_layout, s->channels);
+      break;
+    case CODEC_VP8:
+      par->codec_type = AVMEDIA_TYPE_VIDEO;
+      par->codec_id = AV_CODEC_ID_VP8;
+      break;
+    case CODEC_VP9:
+      par->codec_type = AVMEDIA_TYPE_VIDEO;
+      par->codec_id = AV_CODEC_ID_VP9;
+      break;
+    case CODEC_H264:
+      par->codec_type = AVMEDIA_TYPE_VIDEO;
+      par->codec_id = AV_CODEC_ID_H264;
+      break;
+  }
+  if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+    par->width = s->width;
+    par->height = s->height;
+  }
+  RCC(rc, finish, _mux_extradata_set(s, par));
+
+  if ((rci = avio_open(&s->oc->pb, s->output_file, AVIO_FLAG_WRITE)) < 0) {
+    iwlog_error("REC | Failed to open %s: %s", s->output_file, av_err2str(rci));
+    rc = GR_ERROR_MEDIA_PROCESSING;
+    goto finish;
+  }
+  if ((rci = avformat_write_header(s->oc, 0)) < 0) {
+    iwlog_error("REC | Failed to write header of %s: %s", s->output_file, av_err2str(rci));
+    rc = GR_ERROR_MEDIA_PROCESSING;
+    goto finish;
+  }
+  if (g_env.recording.verbose) {
+    iwlog_info("REC | Recording %s", s->output_file);
+  }
+
+finish:
+  if (rc) {
+    if (s->oc) {
+      avio_closep(&s->oc->pb);
+      avformat_free_context(s->oc);
+      s->oc = 0;
+    }
+  }
+  return rc;
+}
+
+static void _mux_close(struct stream *s) {
+  if (!s->oc) {
+    return;
+  }
+  int rci = av_write_trailer(s->oc);
+  if (rci < 0) {
+    iwlog_warn("REC | Failed to finalize %s: %s", s->output_file, av_err2str(rci));
+  }
+  avio_closep(&s->oc->pb);
+  avformat_free_context(s->oc);
+  s->oc = 0;
+}
+
+/// Marks recorder as failed and schedules its restart.
+static void _mux_fail(struct stream *s) {
+  uint64_t ts = 0;
+  _mux_close(s); // Partially written output is kept finalized for postprocessing
+  s->failed = true;
+  if (s->restarts < RESTARTS_MAX && !iwp_current_time_ms(&ts, false)) {
+    int64_t delay = MIN(1000LL << s->restarts, RESTART_DELAY_MAX_MS);
+    s->restart_at = ts + delay;
+    iwlog_warn("REC | Stream %u recorder failed, restart in %" PRId64 " ms", s->id, delay);
+  } else {
+    s->restart_at = 0;
+    iwlog_error("REC | Stream %u recorder failed, giving up after %d restarts", s->id, s->restarts);
+    if (s->on_failed) {
+      s->on_failed(s->user_data);
+    }
+  }
+}
+
+static void _mux_write(struct stream *s, uint8_t *data, size_t len, int64_t ts_ext, bool key) {
+  if (s->failed) {
+    return;
+  }
+  if (!s->oc) {
+    if (_mux_open(s)) {
+      _mux_fail(s);
+      return;
+    }
+  }
+  int64_t pts = s->wall_first_ms + (ts_ext - s->ts_first) * 1000 / s->clock_rate;
+  if (pts <= s->pts_last) {
+    pts = s->pts_last + 1;
+  }
+  s->pts_last = pts;
+
+  AVPacket *pkt = s->pkt;
+  pkt->data = data;
+  pkt->size = (int) len;
+  pkt->stream_index = 0;
+  pkt->pts = pkt->dts = pts;
+  pkt->duration = 0;
+  pkt->flags = key ? AV_PKT_FLAG_KEY : 0;
+  av_packet_rescale_ts(pkt, (AVRational) { 1, 1000 }, s->oc->streams[0]->time_base);
+
+  int rci = av_write_frame(s->oc, pkt);
+  pkt->data = 0;
+  pkt->size = 0;
+  if (rci < 0) {
+    iwlog_error("REC | Failed to write %s: %s", s->output_file, av_err2str(rci));
+    _mux_fail(s);
+  } else {
+    s->bytes += len;
+  }
+}
+
+/// Returns output file of restarted recorder keeping its timeline position:
+/// leading `<offset ms>-` of file name is advanced by time elapsed since the current file was opened.
+static char* _restart_output_file(struct stream *s, uint64_t ts) {
+  char *ret = 0;
+  const char *fname = strrchr(s->output_file, '/');
+  fname = fname ? fname + 1 : s->output_file;
+  int dlen = (int) (fname - s->output_file);
+  char *rest;
+  long long off = strtoll(fname, &rest, 10);
+  if (rest != fname && *rest == '-') {
+    if (asprintf(&ret, "%.*s%lld%s", dlen, s->output_file, off + (long long) (ts - s->opened_ms), rest) < 0) {
+      ret = 0;
+    }
+  } else {
+    const char *ext = strrchr(fname, '.');
+    int len = ext ? (int) (ext - s->output_file) : (int) strlen(s->output_file);
+    if (asprintf(&ret, "%.*s-%d%s", len, s->output_file, s->restarts, ext ? ext : "") < 0) {
+      ret = 0;
+    }
+  }
+  return ret;
+}
+
+/// Restarts failed recorder writing into the new output file.
+static void _restart(struct stream *s, uint64_t ts) {
+  ++s->restarts;
+  char *file = _restart_output_file(s, ts);
+  if (!file) {
+    _mux_fail(s);
+    return;
+  }
+  iwlog_info("REC | Stream %u recorder restarted, output: %s", s->id, file);
+  free(s->output_file);
+  s->output_file = file;
+  if (s->on_output_file) {
+    s->on_output_file(s->user_data, file);
+  }
+  s->opened_ms = ts;
+  s->restart_at = 0;
+  s->failed = false;
+  s->rtp_started = false; // Timestamps of the new file start from the next packet
+  s->frame_active = false;
+  memset(s->reorder_len, 0, sizeof(s->reorder_len));
+  s->pts_last = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//                         RTP depacketization                           //
+///////////////////////////////////////////////////////////////////////////
+
+static bool _frame_append(struct stream *s, const uint8_t *data, size_t len) {
+  if (s->frame_len + len > s->frame_cap) {
+    size_t cap = s->frame_cap ? s->frame_cap : 64 * 1024;
+    while (cap < s->frame_len + len) {
+      cap *= 2;
+    }
+    if (cap > FRAME_MAX_SIZE) {
+      return false;
+    }
+    uint8_t *frame = realloc(s->frame, cap + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!frame) {
+      return false;
+    }
+    s->frame = frame;
+    s->frame_cap = cap;
+  }
+  memcpy(s->frame + s->frame_len, data, len);
+  s->frame_len += len;
+  return true;
+}
+
+static void _frame_start(struct stream *s, int64_t ts_ext) {
+  s->frame_len = 0;
+  s->frame_ts = ts_ext;
+  s->frame_active = true;
+  s->frame_broken = false;
+}
+
+static bool _frame_is_key(struct stream *s) {
+  switch (s->codec) {
+    case CODEC_VP8:
+      return s->frame_len >= 10 && !(s->frame[0] & 0x01);
+    case CODEC_VP9:
+      // Profile 0-2 non show-existing key frame
+      return s->frame_len > 0 && (s->frame[0] & 0xc0) == 0x80 && !(s->frame[0] & 0x0c);
+    case CODEC_H264:
+      for (size_t i = 0; i + 4 < s->frame_len; ++i) {
+        if (  s->frame[i] == 0 && s->frame[i + 1] == 0 && s->frame[i + 2] == 0 && s->frame[i + 3] == 1
+           && (s->frame[i + 4] & 0x1f) == 5) {
+          return true;
+        }
+      }
+      return false;
+    default:
+      return true;
+  }
+}
+
+static void _frame_complete(struct stream *s) {
+  if (!s->frame_active) {
+    return;
+  }
+  s->frame_active = false;
+  if (s->frame_broken || s->frame_len == 0) {
+    s->need_key = true;
+    _key_frame_request(s);
+    return;
+  }
+  bool key = _frame_is_key(s);
+  if (s->need_key) {
+    // Muxer is opened on key frame with known dimensions, otherwise its header is rejected
+    if (!key || (!s->oc && !_frame_dimensions_parse(s))) {
+      _key_frame_request(s);
+      return;
+    }
+    s->need_key = false;
+  }
+  if (  (s->lag_ms > LAG_DEGRADE_MS && !key)
+     || !_write_budget_take(s->frame_len, false)) {
+    // Recorder is overloaded: drop video until the next key frame, audio is always kept
+    s->frames_dropped++;
+    s->need_key = true;
+    return;
+  }
+  _mux_write(s, s->frame, s->frame_len, s->frame_ts, key);
+}
+
+static void _h264_nal_append(struct stream *s, const uint8_t *nal, size_t len) {
+  static const uint8_t start_code[] = { 0, 0, 0, 1 };
+  if (len == 0) {
+    return;
+  }
+  int type = nal[0] & 0x1f;
+  if (type == 7 && len <= sizeof(s->sps)) {
+    memcpy(s->sps, nal, len);
+    s->sps_len = len;
+  } else if (type == 8 && len <= sizeof(s->pps)) {
+    memcpy(s->pps, nal, len);
+    s->pps_len = len;
+  }
+  if (!_frame_append(s, start_code, sizeof(start_code)) || !_frame_append(s, nal, len)) {
+    s->frame_broken = true;
+  }
+}
+
+/// RFC 6184 packetization modes 0 and 1: single NAL unit, STAP-A and FU-A packets.
+static void _h264_depacketize(struct stream *s, const uint8_t *p, size_t len) {
+  int type = p[0] & 0x1f;
+  if (type >= 1 && type <= 23) {
+    _h264_nal_append(s, p, len);
+  } else if (type == 24) { // STAP-A
+    for (size_t off = 1; off + 2 <= len; ) {
+      size_t sz = _be16(p + off);
+      off += 2;
+      if (off + sz > len) {
+        s->frame_broken = true;
+        break;
+      }
+      _h264_nal_append(s, p + off, sz);
+      off += sz;
+    }
+  } else if (type == 28 && len > 2) { // FU-A
+    uint8_t fuh = p[1];
+    if (fuh & 0x80) { // Start of fragmented NAL
+      uint8_t hdr[] = { 0, 0, 0, 1, (p[0] & 0xe0) | (fuh & 0x1f) };
+      if (!_frame_append(s, hdr, sizeof(hdr))) {
+        s->frame_broken = true;
+      }
+    } else if (s->frame_len == 0) {
+      s->frame_broken = true; // Missing start of fragmented NAL
+    }
+    if (!_frame_append(s, p + 2, len - 2)) {
+      s->frame_broken = true;
+    }
+  } else {
+    s->frame_broken = true; // Unsupported packetization
+  }
+}
+
+/// RFC 7741 payload descriptor. Returns offset of VP8 payload or -1.
+static int _vp8_descriptor_parse(const uint8_t *p, size_t len, bool *start) {
+  size_t off = 1;
+  *start = (p[0] & 0x10) && (p[0] & 0x07) == 0;
+  if (p[0] & 0x80) {
+    if (len < 2) {
+      return -1;
+    }
+    uint8_t x = p[1];
+    off = 2;
+    if (x & 0x80) { // PictureID
+      if (len < off + 1) {
+        return -1;
+      }
+      off += (p[off] & 0x80) ? 2 : 1;
+    }
+    if (x & 0x40) { // TL0PICIDX
+      ++off;
+    }
+    if (x & 0x30) { // TID/Y/KEYIDX
+      ++off;
+    }
+  }
+  return off < len ? (int) off : -1;
+}
+
+/// VP9 payload descriptor (draft-ietf-payload-vp9). Returns offset of VP9 payload or -1.
+static int _vp9_descriptor_parse(const uint8_t *p, size_t len, bool *start) {
+  uint8_t b = p[0];
+  size_t off = 1;
+  *start = (b & 0x08) != 0;
+  if (b & 0x80) { // PictureID
+    if (len < off + 1) {
+      return -1;
+    }
+    off += (p[off] & 0x80) ? 2 : 1;
+  }
+  if (b & 0x20) { // Layer indices
+    off += (b & 0x10) ? 1 : 2;
+  }
+  if ((b & 0x40) && (b & 0x10)) { // Reference indices of flexible mode
+    for (int i = 0; i < 3 && off < len; ++i) {
+      if (!(p[off++] & 0x01)) {
+        break;
+      }
+    }
+  }
+  if (b & 0x02) { // Scalability structure
+    if (len < off + 1) {
+      return -1;
+    }
+    uint8_t ss = p[off++];
+    int n_s = (ss >> 5) + 1;
+    if (ss & 0x10) {
+      off += 4 * n_s;
+    }
+    if (ss & 0x08) {
+      if (len < off + 1) {
+        return -1;
+      }
+      int n_g = p[off++];
+      for (int i = 0; i < n_g && off < len; ++i) {
+        off += 1 + ((p[off] >> 2) & 0x03) * 2;
+      }
+    }
+  }
+  return off < len ? (int) off : -1;
+}
+
+/// Depacketizes RTP packet, packets are passed in sequence order.
+static void _rtp_packet_handle(struct stream *s, const uint8_t *buf, size_t len) {
+  bool marker = (buf[1] & 0x80) != 0;
+  uint16_t seq = _be16(buf + 2);
+  uint32_t ts = _be32(buf + 4);
+  size_t off = 12 + (buf[0] & 0x0f) * 4;
+
+  if (buf[0] & 0x10) { // Header extension
+    if (len < off + 4) {
+      return;
+    }
+    off += 4 + _be16(buf + off + 2) * 4;
+  }
+  if (buf[0] & 0x20) { // Padding
+    uint8_t pad = buf[len - 1];
+    if (pad > len) {
+      return;
+    }
+    len -= pad;
+  }
+  if (off >= len) {
+    return;
+  }
+  const uint8_t *p = buf + off;
+  len -= off;
+
+  if (s->failed) {
+    uint64_t now;
+    if (!s->restart_at || iwp_current_time_ms(&now, false) || now < s->restart_at) {
+      return;
+    }
+    _restart(s, now);
+  }
+  if (!s->rtp_started) {
+    uint64_t now;
+    if (iwp_current_time_ms(&now, false)) {
+      return;
+    }
+    s->rtp_started = true;
+    s->wall_first_ms = (int64_t) now;
+    s->ts_ext = s->ts_first = ts;
+    s->need_key = s->codec != CODEC_OPUS;
+  } else {
+    int16_t delta = (int16_t) (seq - s->seq);
+    if (delta <= 0) {
+      return; // Duplicated or reordered packet, too late
+    }
+    if (delta > 1 && s->frame_active) {
+      s->frame_broken = true; // Packets lost
+    }
+    s->ts_ext += (int32_t) (ts - s->ts);
+  }
+  s->seq = seq;
+  s->ts = ts;
+
+  switch (s->codec) {
+    case CODEC_OPUS:
+      _write_budget_take(len, true);
+      _mux_write(s, (uint8_t*) p, len, s->ts_ext, true);
+      return;
+    case CODEC_H264:
+      if (s->frame_active && s->frame_ts != s->ts_ext) {
+        _frame_complete(s); // Marker of previous frame is lost
+      }
+      if (!s->frame_active) {
+        _frame_start(s, s->ts_ext);
+      }
+      _h264_depacketize(s, p, len);
+      break;
+    case CODEC_VP8:
+    case CODEC_VP9: {
+      bool start;
+      int po = s->codec == CODEC_VP8 ? _vp8_descriptor_parse(p, len, &start) : _vp9_descriptor_parse(p, len, &start);
+      if (po < 0) {
+        s->frame_broken = true;
+        break;
+      }
+      if (start) {
+        if (s->frame_active) {
+          s->frame_broken = true;
+          _frame_complete(s);
+        }
+        _frame_start(s, s->ts_ext);
+      } else if (!s->frame_active || s->frame_ts != s->ts_ext) {
+        break; // Start of frame is lost
+      }
+      if (!_frame_append(s, p + po, len - po)) {
+        s->frame_broken = true;
+      }
+      break;
+    }
+  }
+  if (marker) {
+    _frame_complete(s);
+  }
+}
+
+/// Handles held packets following the last handled one.
+static void _rtp_reorder_drain(struct stream *s) {
+  for (uint16_t seq = s->seq + 1; ; seq = s->seq + 1) {
+    int i = seq & (RTP_REORDER_NUM - 1);
+    if (!s->reorder_len[i] || _be16(s->reorder[i] + 2) != seq) {
+      break;
+    }
+    size_t len = s->reorder_len[i];
+    s->reorder_len[i] = 0;
+    _rtp_packet_handle(s, s->reorder[i], len);
+    if (!s->rtp_started) {
+      break; // Recorder restarted
+    }
+  }
+}
+
+/// Handles all held packets in sequence order, missing packets are considered lost.
+static void _rtp_reorder_flush(struct stream *s) {
+  uint16_t base = s->seq;
+  for (int n = 1; n < RTP_REORDER_NUM; ++n) {
+    uint16_t seq = base + n;
+    int i = seq & (RTP_REORDER_NUM - 1);
+    if (s->reorder_len[i] && _be16(s->reorder[i] + 2) == seq) {
+      size_t len = s->reorder_len[i];
+      s->reorder_len[i] = 0;
+      _rtp_packet_handle(s, s->reorder[i], len);
+    }
+  }
+  memset(s->reorder_len, 0, sizeof(s->reorder_len));
+}
+
+/// Passes received RTP packet to depacketizer in sequence order.
+/// Packets arrived ahead of the expected one are held within RTP_REORDER_NUM window,
+/// the gap is considered lost once a packet beyond the window is received.
+static void _rtp_handle(struct stream *s, const uint8_t *buf, size_t len) {
+  if (len < 12 || len > RTP_PACKET_MAX || (buf[0] >> 6) != 2) {
+    return;
+  }
+  if (buf[1] >= 192 && buf[1] <= 223) { // RTCP multiplexed with RTP
+    return;
+  }
+  if ((buf[1] & 0x7f) != s->payload_type) {
+    return;
+  }
+  if (!s->rtp_started || s->failed) {
+    _rtp_packet_handle(s, buf, len);
+    return;
+  }
+  uint16_t seq = _be16(buf + 2);
+  int16_t delta = (int16_t) (seq - s->seq);
+  if (delta <= 0) {
+    return; // Duplicated or reordered packet, too late
+  } else if (delta == 1) {
+    _rtp_packet_handle(s, buf, len);
+  } else if (delta >= RTP_REORDER_NUM) {
+    _rtp_reorder_flush(s);
+    _rtp_packet_handle(s, buf, len);
+  } else {
+    int i = seq & (RTP_REORDER_NUM - 1);
+    memcpy(s->reorder[i], buf, len);
+    s->reorder_len[i] = len;
+    return;
+  }
+  if (s->rtp_started) {
+    _rtp_reorder_drain(s);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+//                               Streams                                 //
+///////////////////////////////////////////////////////////////////////////
+
+/// Updates recording lag gauge by max lag of recorders observed within the report interval.
+static void _lag_report(int64_t lag) {
+  uint64_t ts;
+  if (iwp_current_time_ms(&ts, true)) {
+    return;
+  }
+  for (int64_t max = __atomic_load_n(&_e.lag_max_ms, __ATOMIC_RELAXED); lag > max; ) {
+    if (__atomic_compare_exchange_n(&_e.lag_max_ms, &max, lag, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  uint64_t report_ms = __atomic_load_n(&_e.lag_report_ms, __ATOMIC_RELAXED);
+  if (  ts < report_ms + LAG_REPORT_INTERVAL_MS
+     || !__atomic_compare_exchange_n(&_e.lag_report_ms, &report_ms, ts, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    return; // Not yet time to report or reported by another recording thread
+  }
+  lag = __atomic_exchange_n(&_e.lag_max_ms, 0, __ATOMIC_RELAXED);
+  gr_gauge_set_async(GAUGE_RECORDING_LAG, lag);
+}
+
+static int64_t _on_ready(const struct iwn_poller_task *t, uint32_t events) {
+  struct stream *s = t->user_data;
+  uint8_t buf[RTP_PACKET_MAX];
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(struct timeval))];
+  } cbuf;
+  struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+  };
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  int64_t now_us = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000, lag_us = 0;
+
+  pthread_mutex_lock(&s->mtx);
+  for ( ; ; ) {
+    msg.msg_control = cbuf.buf;
+    msg.msg_controllen = sizeof(cbuf.buf);
+    ssize_t len = recvmsg(t->fd, &msg, 0);
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    // Kernel receive time of the packet gives the time packet was waiting for recorder
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMP) {
+        struct timeval tv;
+        memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+        int64_t l = now_us - ((int64_t) tv.tv_sec * 1000000 + tv.tv_usec);
+        if (l > lag_us) {
+          lag_us = l;
+        }
+      }
+    }
+    _rtp_handle(s, buf, len);
+  }
+  s->lag_ms = lag_us / 1000;
+  pthread_mutex_unlock(&s->mtx);
+
+  _lag_report(lag_us / 1000);
+  return 0;
+}
+
+static void _on_dispose(const struct iwn_poller_task *t) {
+  struct stream *s = t->user_data;
+  pthread_mutex_lock(&s->mtx);
+  if (s->rtp_started && !s->failed) {
+    _rtp_reorder_flush(s);
+  }
+  _mux_close(s);
+  pthread_mutex_unlock(&s->mtx);
+  if (g_env.recording.verbose) {
+    iwlog_info("REC | Stream %u closed", s->id);
+  }
+  pthread_mutex_destroy(&s->mtx);
+  av_packet_free(&s->pkt);
+  free(s->frame);
+  free(s->output_file);
+  free(s);
+}
+
+static codec_e _codec_by_mime(const char *mime) {
+  const char *name = strchr(mime, '/');
+  name = name ? name + 1 : mime;
+  if (!strcasecmp(name, "opus")) {
+    return CODEC_OPUS;
+  } else if (!strcasecmp(name, "VP8")) {
+    return CODEC_VP8;
+  } else if (!strcasecmp(name, "VP9")) {
+    return CODEC_VP9;
+  } else if (!strcasecmp(name, "H264")) {
+    return CODEC_H264;
+  }
+  return 0;
+}
+
+static int _socket_open(int port, iwrc *rcp) {
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port   = htons(port),
+  };
+  int rcvbuf = SOCKET_RCVBUF_SIZE, on = 1;
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    *rcp = iwrc_set_errno(IW_ERROR_ERRNO, errno);
+    return -1;
+  }
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+  if (bind(fd, (void*) &addr, sizeof(addr)) < 0) {
+    *rcp = iwrc_set_errno(IW_ERROR_ERRNO, errno);
+    iwlog_ecode_error(*rcp, "REC | Failed to bind 127.0.0.1:%d", port);
+    close(fd);
+    return -1;
+  }
+  *rcp = 0;
+  return fd;
+}
+
+static void _shutdown(void *data) {
+  IWULIST ids;
+  IWHMAP_ITER iter;
+  struct iwn_poller *poller;
+  if (iwulist_init(&ids, 32, sizeof(uint32_t))) {
+    return;
+  }
+  pthread_mutex_lock(&_e.mtx);
+  _e.shutdown = true;
+  poller = _e.poller;
+  iwhmap_iter_init(_e.streams, &iter);
+  while (iwhmap_iter_next(&iter)) {
+    uint32_t id = (uint32_t) (uintptr_t) iter.key;
+    iwulist_push(&ids, &id);
+  }
+  pthread_mutex_unlock(&_e.mtx);
+
+  for (size_t i = 0; i < ids.num; ++i) {
+    recording_engine_stream_close(*(uint32_t*) iwulist_at2(&ids, i));
+  }
+  iwulist_destroy_keep(&ids);
+
+  if (poller) {
+    iwn_poller_shutdown_request(poller);
+    pthread_join(_e.poll_thr, 0);
+    iwn_poller_destroy(&poller); // Finalizes all remaining streams
+  }
+  pthread_mutex_lock(&_e.mtx);
+  _e.poller = 0;
+  iwhmap_destroy(_e.streams);
+  _e.streams = 0;
+  pthread_mutex_unlock(&_e.mtx);
+}
+
+/// Starts recording threads on the first recorded stream.
+static iwrc _engine_start_lk(void) {
+  if (_e.poller) {
+    return 0;
+  }
+  iwrc rc = 0;
+  if (!_e.streams) {
+    RCB(finish, _e.streams = iwhmap_create_u32(0));
+  }
+  RCC(rc, finish, iwn_poller_create_by_spec(&(struct iwn_poller_spec) {
+    .num_threads = g_env.recording.threads,
+    .queue_limit = 1024,
+  }, &_e.poller));
+  rc = iwn_poller_poll_in_thread(_e.poller, "grrec", &_e.poll_thr);
+  if (rc) {
+    iwn_poller_destroy(&_e.poller);
+    goto finish;
+  }
+  gr_shutdown_hook_add(_shutdown, 0);
+
+finish:
+  return rc;
+}
+
+iwrc recording_engine_stream_open(const struct recording_stream_spec *spec, uint32_t *out_id) {
+  if (!spec || !spec->output_file || !spec->mime_type || spec->port < 1 || !out_id) {
+    return IW_ERROR_INVALID_ARGS;
+  }
+  *out_id = 0;
+  codec_e codec = _codec_by_mime(spec->mime_type);
+  if (!codec) {
+    iwlog_warn("REC | Unsupported codec: %s", spec->mime_type);
+    return GR_ERROR_MEDIA_PROCESSING;
+  }
+
+  iwrc rc = 0;
+  struct stream *s = calloc(1, sizeof(*s));
+  if (!s) {
+    return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+  }
+  pthread_mutex_init(&s->mtx, 0);
+  s->fd = -1;
+  s->codec = codec;
+  s->payload_type = spec->payload_type;
+  s->clock_rate = spec->clock_rate > 0 ? spec->clock_rate : (codec == CODEC_OPUS ? 48000 : 90000);
+  s->channels = spec->channels > 0 ? spec->channels : 2;
+  s->on_key_frame_request = spec->on_key_frame_request;
+  s->on_failed = spec->on_failed;
+  s->on_output_file = spec->on_output_file;
+  s->user_data = spec->user_data;
+  RCB(finish, s->output_file = strdup(spec->output_file));
+  RCB(finish, s->pkt = av_packet_alloc());
+  RCC(rc, finish, iwp_current_time_ms(&s->opened_ms, false));
+
+  s->fd = _socket_open(spec->port, &rc);
+  RCGO(rc, finish);
+
+  pthread_mutex_lock(&_e.mtx);
+  if (_e.shutdown) {
+    rc = IW_ERROR_INVALID_STATE;
+  } else {
+    rc = _engine_start_lk();
+  }
+  if (!rc) {
+    s->id = ++_e.seq;
+    if (!s->id) {
+      s->id = ++_e.seq;
+    }
+    rc = iwhmap_put_u32(_e.streams, s->id, s);
+  }
+  if (!rc) {
+    ++_e.num;
+    gr_gauge_set_async(GAUGE_RECORDINGS, _e.num);
+  }
+  struct iwn_poller *poller = _e.poller;
+  pthread_mutex_unlock(&_e.mtx);
+  RCGO(rc, finish);
+
+  rc = iwn_poller_add(&(struct iwn_poller_task) {
+    .poller = poller,
+    .fd = s->fd,
+    .user_data = s,
+    .on_ready = _on_ready,
+    .on_dispose = _on_dispose,
+    .events = IWN_POLLIN,
+    .events_mod = IWN_POLLET,
+  });
+  if (rc) {
+    pthread_mutex_lock(&_e.mtx);
+    iwhmap_remove_u32(_e.streams, s->id);
+    --_e.num;
+    gr_gauge_set_async(GAUGE_RECORDINGS, _e.num);
+    pthread_mutex_unlock(&_e.mtx);
+    goto finish;
+  }
+  *out_id = s->id;
+  if (g_env.recording.verbose) {
+    iwlog_info("REC | Stream %u opened, port: %d, codec: %s, output: %s",
+               s->id, spec->port, spec->mime_type, spec->output_file);
+  }
+  return 0;
+
+finish:
+  if (s->fd > -1) {
+    close(s->fd);
+  }
+  av_packet_free(&s->pkt);
+  free(s->output_file);
+  pthread_mutex_destroy(&s->mtx);
+  free(s);
+  return rc;
+}
+
+void recording_engine_stream_close(uint32_t id) {
+  int fd = -1;
+  struct iwn_poller *poller = 0;
+  pthread_mutex_lock(&_e.mtx);
+  struct stream *s = _e.streams ? iwhmap_get_u32(_e.streams, id) : 0;
+  if (s) {
+    fd = s->fd;
+    poller = _e.poller;
+    iwhmap_remove_u32(_e.streams, id);
+    --_e.num; // Stream slot is released right away, its output is finalized in background
+    gr_gauge_set_async(GAUGE_RECORDINGS, _e.num);
+  }
+  pthread_mutex_unlock(&_e.mtx);
+  if (poller && fd > -1) {
+    iwn_poller_remove(poller, fd); // Stream is finalized in `_on_dispose()`
+  }
+}
+
+int recording_engine_num_streams(void) {
+  pthread_mutex_lock(&_e.mtx);
+  int ret = _e.num;
+  pthread_mutex_unlock(&_e.mtx);
+  return ret;
+}
+
+static const char* _codec_name(codec_e codec) {
+  switch (codec) {
+    case CODEC_OPUS:
+      return "opus";
+    case CODEC_VP8:
+      return "VP8";
+    case CODEC_VP9:
+      return "VP9";
+    case CODEC_H264:
+      return "H264";
+  }
+  return "";
+}
+
+iwrc recording_engine_stats(IWXSTR *xstr) {
+  iwrc rc = 0;
+  IWHMAP_ITER iter;
+  bool first = true;
+  RCR(iwxstr_cat(xstr, "[", 1));
+  pthread_mutex_lock(&_e.mtx);
+  if (_e.streams) {
+    iwhmap_iter_init(_e.streams, &iter);
+    while (!rc && iwhmap_iter_next(&iter)) {
+      struct stream *s = (void*) iter.val;
+      const char *fname;
+      pthread_mutex_lock(&s->mtx);
+      fname = strrchr(s->output_file, '/');
+      rc = iwxstr_printf(xstr, "%s{\"id\":%u,\"codec\":\"%s\",\"file\":\"%s\","
+                         "\"lag\":%" PRId64 ",\"bytes\":%" PRIu64 ",\"dropped\":%" PRIu64 ","
+                         "\"restarts\":%d,\"failed\":%s}",
+                         first ? "" : ",", s->id, _codec_name(s->codec), fname ? fname + 1 : s->output_file,
+                         s->lag_ms, s->bytes, s->frames_dropped, s->restarts, s->failed ? "true" : "false");
+      pthread_mutex_unlock(&s->mtx);
+      first = false;
+    }
+  }
+  pthread_mutex_unlock(&_e.mtx);
+  RCR(rc);
+  return iwxstr_cat(xstr, "]", 1);
+}
@@ -0,0 +1,75 @@
+#pragma once
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "gr.h"
+
+#include <iowow/iwxstr.h>
+
+/// Recorded RTP stream specification.
+struct recording_stream_spec {
+  const char *output_file;  ///< Output media file. Required.
+  const char *mime_type;    ///< RTP codec mime type: video/VP8, video/VP9, video/H264, audio/opus. Required.
+  int port;                 ///< Local UDP port RTP stream is sent to. Required.
+  int payload_type;         ///< RTP payload type of recorded codec.
+  int clock_rate;           ///< RTP clock rate of recorded codec.
+  int channels;             ///< Number of audio channels.
+  /// Called when stream needs a video key frame to continue recording.
+  void (*on_key_frame_request)(void *user_data);
+  /// Called when recorder gives up after failed restarts. Stream should be closed to release its capacity.
+  void (*on_failed)(void *user_data);
+  /// Called on recorder restart with the new output file. `output_file` is valid only during the call.
+  void (*on_output_file)(void *user_data, const char *output_file);
+  void *user_data;
+};
+
+/**
+ * @brief Starts in-process recording of RTP stream received on `spec->port` into the media file.
+ *
+ * RTP packets are received and depacketized by the small pool of recording threads,
+ * frames are muxed by libavformat into WebM (Matroska for H264) file.
+ * Presentation timestamps of recorded frames are absolute wall clock time in milliseconds.
+ *
+ * If writing of output file fails recorder is restarted with backoff into the new file.
+ * When output file name starts with `<timeline offset ms>-` the new file gets offset
+ * advanced by the recording time of the failed file.
+ * Partially written output file is finalized and kept, so it is postprocessed along with the new one.
+ * Video frames are dropped until the next key frame if recorder lags
+ * or `max_write_rate` budget is exhausted, audio is always recorded.
+ *
+ * @param [out] out_id Recorded stream id.
+ */
+iwrc recording_engine_stream_open(const struct recording_stream_spec *spec, uint32_t *out_id);
+
+/**
+ * @brief Stops recording of the given stream and finalizes its media file.
+ */
+void recording_engine_stream_close(uint32_t id);
+
+/**
+ * @brief Returns number of currently recorded streams.
+ */
+int recording_engine_num_streams(void);
+
+/**
+ * @brief Writes JSON array of recorded streams states into `xstr`.
+ *
+ * Every item holds stream `id`, `codec`, output `file`, recorder `lag` in milliseconds,
+ * written `bytes`, number of video frames `dropped` by backpressure,
+ * number of recorder `restarts` and `failed` flag.
+ */
+iwrc recording_engine_stats(IWXSTR *xstr);
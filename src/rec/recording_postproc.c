@@ -19,6 +19,8 @@
 #include "wrc/wrc.h"
 #include "grh_ws.h"
 #include "utils/files.h"
+#include "gr_task_worker.h"
+#include "gr_db_wb.h"
 
 #include <iowow/iwpool.h>
 #include <iowow/iwp.h>
@@ -31,13 +33,16 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <regex.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include <math.h>
 #include <assert.h>
 #include <signal.h>
+#include <pthread.h>
 
 extern struct gr_env g_env;
 
@@ -61,6 +66,8 @@ struct _m {
   int     id;
   int     nchannels; // Audio channels
   int     nstream;   // Stream number
+  int     in;        // Input index of media in the current ffmpeg run
+  enum AVCodecID codec_id; // Codec of main media stream
   const char *container;
   const char *fname;
   char       *path;
@@ -70,17 +77,104 @@ struct _m {
   uint8_t      flags;
 };
 
+/// Output profile of composed recording
+struct _profile {
+  const char *name;
+  const char *codec; // vp8, vp9, h264
+  int width;
+  int height;
+  int fps;
+  int speed;         // Encoder speed 0 (slowest) - 9 (fastest)
+  int threads;       // Encoder threads, 0 - auto
+};
+
+static const struct _profile _profiles[] = {
+  { "fast",     "vp8",  960,  720,  15, 8, 0 },
+  { "balanced", "vp9",  1280, 960,  25, 5, 0 },
+  { "quality",  "vp9",  1280, 960,  30, 2, 0 },
+  { "h264",     "h264", 1280, 960,  25, 7, 0 },
+};
+
 struct _ctx {
   int64_t task_id;
   int64_t room_ctime;
+  int64_t cutoff;   // If set only segments finished before this time are rendered
   JBL     room;
+  JBL_NODE    open; // Array of media file names still being recorded
   const char *basedir;
   const char *output_fname;
   IWPOOL     *pool;
   struct _m  *media;
   struct _box size;
+  struct _profile profile;
 };
 
+/// Resolves output profile configured by `[recording]` options.
+static void _profile_apply(struct _ctx *ctx) {
+  struct _profile *p = &ctx->profile;
+  *p = _profiles[1];
+  for (int i = 0; i < sizeof(_profiles) / sizeof(_profiles[0]); ++i) {
+    if (!strcmp(_profiles[i].name, g_env.recording.output.profile)) {
+      *p = _profiles[i];
+      break;
+    }
+  }
+  if (g_env.recording.output.codec) {
+    p->codec = g_env.recording.output.codec;
+  }
+  if (g_env.recording.output.width > 0) {
+    p->width = g_env.recording.output.width & ~1;
+  }
+  if (g_env.recording.output.height > 0) {
+    p->height = g_env.recording.output.height & ~1;
+  }
+  if (g_env.recording.output.fps > 0) {
+    p->fps = g_env.recording.output.fps;
+  }
+  if (g_env.recording.output.speed > 0) {
+    p->speed = MIN(g_env.recording.output.speed, 9);
+  }
+  if (g_env.recording.output.threads > 0) {
+    p->threads = g_env.recording.output.threads;
+  }
+  ctx->size = (struct _box) {
+    .w = p->width,
+    .h = p->height
+  };
+  ctx->output_fname = strcmp(p->codec, "h264") ? "output.webm" : "output.mkv";
+}
+
+/// Output container format name of the profile.
+static const char* _profile_format(const struct _profile *p) {
+  return strcmp(p->codec, "h264") ? "webm" : "matroska";
+}
+
+/// Adds video and audio encoder options of the profile to ffmpeg arguments.
+static iwrc _profile_encoder_args(const struct _profile *p, IWXSTR *xargs) {
+  iwrc rc = 0;
+  int speed = p->speed;
+  if (!strcmp(p->codec, "h264")) {
+    static const char *presets[] = {
+      "veryslow", "slower", "slow", "medium", "fast", "faster", "veryfast", "superfast", "ultrafast", "ultrafast"
+    };
+    RCC(rc, finish, iwxstr_printf(xargs, "\1-c:v\1libx264\1-preset\1%s\1-pix_fmt\1yuv420p", presets[speed]));
+  } else if (!strcmp(p->codec, "vp8")) {
+    RCC(rc, finish, iwxstr_printf(xargs, "\1-c:v\1libvpx\1-deadline\1%s\1-cpu-used\1%d\1-auto-alt-ref\1" "0",
+                                  speed >= 5 ? "realtime" : "good", speed));
+  } else {
+    RCC(rc, finish, iwxstr_printf(xargs, "\1-c:v\1libvpx-vp9\1-deadline\1%s\1-cpu-used\1%d"
+                                  "\1-row-mt\1" "1" "\1-auto-alt-ref\1" "0",
+                                  speed >= 5 ? "realtime" : "good", MIN(speed, 8)));
+  }
+  if (p->threads > 0) {
+    RCC(rc, finish, iwxstr_printf(xargs, "\1-threads\1%d", p->threads));
+  }
+  RCC(rc, finish, iwxstr_cat2(xargs, "\1-c:a\1libopus\1-application\1voip"));
+
+finish:
+  return rc;
+}
+
 static iwrc _m_process(struct _ctx *ctx, struct _m *m) {
   // Validate media file and get recording durarion and number of audio channels
   iwrc rc = 0;
@@ -113,6 +207,7 @@ static iwrc _m_process(struct _ctx *ctx, struct _m *m) {
     for (int i = 0; i < fctx->nb_streams; ++i) {
       if (fctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
         m->nstream = i;
+        m->codec_id = fctx->streams[i]->codecpar->codec_id;
         m->nchannels = fctx->streams[i]->codecpar->ch_layout.nb_channels;
         break;
       }
@@ -125,6 +220,7 @@ static iwrc _m_process(struct _ctx *ctx, struct _m *m) {
     for (int i = 0; i < fctx->nb_streams; ++i) {
       if (fctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
         m->nstream = i;
+        m->codec_id = fctx->streams[i]->codecpar->codec_id;
         break;
       }
     }
@@ -198,6 +294,17 @@ error:
   return 0;
 }
 
+static bool _m_is_open(struct _ctx *ctx, const char *fname) {
+  if (ctx->open) {
+    for (JBL_NODE n = ctx->open->child; n; n = n->next) {
+      if (n->type == JBV_STR && n->vsize == strlen(fname) && !strncmp(n->vptr, fname, n->vsize)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
 static iwrc _m_collect(struct _ctx *ctx) {
   iwrc rc = 0;
   DIR *d = 0;
@@ -217,7 +324,13 @@ static iwrc _m_collect(struct _ctx *ctx) {
   struct _m *pm = 0;
   while ((dir = readdir(d))) {
     struct _m *m;
+    if (_m_is_open(ctx, dir->d_name)) {
+      continue;
+    }
     if ((m = _m_create(&rx, ctx, dir->d_name))) {
+      if (ctx->cutoff && m->start_time >= ctx->cutoff) {
+        continue; // Started after prerender request, may be still written
+      }
       if (_m_process(ctx, m) == 0) {
         if (pm) {
           pm->next = m;
@@ -237,98 +350,112 @@ finish:
   return rc;
 }
 
-static void _ffmfix_on_output(const struct iwn_proc_ctx *ctx, const char *chunk, size_t len) {
-  iwlog_info("FFR | [fix:%d] %.*s", ctx->pid, (int) len, chunk);
-}
-
-static void _ffmfix_on_exit(const struct iwn_proc_ctx *ctx) {
-  int code = WIFEXITED(ctx->wstatus) ? WEXITSTATUS(ctx->wstatus) : -1;
-  iwlog_info("FFR | [fix] exited, code: %d", code);
-}
-
-/// Trying to fix corrupted media files: genpts, write headers
-static iwrc _m_fix(struct _ctx *ctx) {
+/// Remuxes media file in-process regenerating missing timestamps and dropping corrupted packets.
+static iwrc _m_remux(const char *src, const char *dst) {
   iwrc rc = 0;
-  IWXSTR *xargs = 0;
-  int c = 0;
-  IWPOOL *pool = 0;
-
-  for (struct _m *m = ctx->media; m; m = m->next) {
-    if (m->flags & FLG_FIX_NEEDED) {
-      c = 1;
-      break;
+  int rci = 0;
+  int64_t *last_dts = 0;
+  AVFormatContext *ictx = 0, *octx = 0;
+  AVPacket *pkt = av_packet_alloc();
+  RCA(pkt, finish);
+
+  RCB(finish, ictx = avformat_alloc_context());
+  ictx->flags |= AVFMT_FLAG_GENPTS | AVFMT_FLAG_DISCARD_CORRUPT;
+  if ((rci = avformat_open_input(&ictx, src, 0, 0))) {
+    goto finish;
+  }
+  avformat_find_stream_info(ictx, 0);
+  if ((rci = avformat_alloc_output_context2(&octx, 0, 0, dst))) {
+    goto finish;
+  }
+  RCB(finish, last_dts = calloc(ictx->nb_streams, sizeof(*last_dts)));
+  for (int i = 0; i < ictx->nb_streams; ++i) {
+    AVStream *os = avformat_new_stream(octx, 0);
+    RCA(os, finish);
+    if ((rci = avcodec_parameters_copy(os->codecpar, ictx->streams[i]->codecpar)) < 0) {
+      goto finish;
     }
+    os->codecpar->codec_tag = 0;
+    os->time_base = ictx->streams[i]->time_base;
+    last_dts[i] = AV_NOPTS_VALUE;
   }
-  if (!c) {
-    return 0;
+  if ((rci = avio_open(&octx->pb, dst, AVIO_FLAG_WRITE)) < 0) {
+    goto finish;
   }
-  RCB(finish, xargs = iwxstr_new());
-  RCB(finish, pool = iwpool_create_empty());
-
-  if (g_env.recording.ffmpeg == g_env.program_file) {
-    RCC(rc, finish, iwxstr_cat2(xargs, "f"));
+  if ((rci = avformat_write_header(octx, 0)) < 0) {
+    goto finish;
   }
-  RCC(rc, finish, iwxstr_cat2(
-        xargs,
-        "\1-y\1-fflags\1+genpts"
-        "\1-err_detect\1ignore_err"));
-
-  if (g_env.recording.verbose) {
-    RCC(rc, finish, iwxstr_cat2(xargs, "\1-loglevel\1debug"));
-  } else {
-    RCC(rc, finish, iwxstr_cat2(xargs, "\1-loglevel\1fatal"));
+  while (av_read_frame(ictx, pkt) >= 0) {
+    int si = pkt->stream_index;
+    if (  pkt->pts == AV_NOPTS_VALUE
+       || (last_dts[si] != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE && pkt->dts <= last_dts[si])) {
+      av_packet_unref(pkt);
+      continue;
+    }
+    if (pkt->dts != AV_NOPTS_VALUE) {
+      last_dts[si] = pkt->dts;
+    }
+    av_packet_rescale_ts(pkt, ictx->streams[si]->time_base, octx->streams[si]->time_base);
+    pkt->pos = -1;
+    av_interleaved_write_frame(octx, pkt); // Broken packets are skipped
   }
+  rci = av_write_trailer(octx);
 
-  for (struct _m *m = ctx->media; m; m = m->next) {
-    if (!(m->flags & FLG_FIX_NEEDED)) {
-      continue;
+finish:
+  if (rci < 0 && !rc) {
+    iwlog_warn("FFR | Failed to remux %s: %s", src, av_err2str(rci));
+    rc = GR_ERROR_MEDIA_PROCESSING;
+  }
+  if (octx) {
+    if (octx->pb) {
+      avio_closep(&octx->pb);
     }
-    RCC(rc, finish, iwxstr_printf(xargs, "\1-i\1%s", m->path));
+    avformat_free_context(octx);
+  }
+  if (ictx) {
+    avformat_close_input(&ictx);
   }
+  av_packet_free(&pkt);
+  free(last_dts);
+  return rc;
+}
 
-  c = 0;
-  for (struct _m *m = ctx->media; m; m = m->next) {
+/// Trying to fix corrupted media files: genpts, write headers
+static iwrc _m_fix(struct _ctx *ctx) {
+  for (struct _m *m = ctx->media, *p = 0; m; m = m->next) {
     if (!(m->flags & FLG_FIX_NEEDED)) {
+      p = m;
       continue;
     }
-    char *path = strrchr(m->path, '/');
+    // Fixed media file: <start ts>-<user id>-<b|w>.ex
+    char *path = iwpool_strdup2(ctx->pool, m->path);
     if (!path) {
-      continue;
+      return iwrc_set_errno(IW_ERROR_ALLOC, errno);
     }
-    if (m->flags & FLG_AUDIO) {
-      char *p = strchr(path, 'a');
-      if (!p) {
-        continue;
-      }
-      *p = 'b';
-    } else if (m->flags & FLG_VIDEO) {
-      char *p = strchr(path, 'v');
-      if (!p) {
-        continue;
-      }
-      *p = 'w';
+    char *fname = strrchr(path, '/');
+    char *c = fname ? strrchr(fname, (m->flags & FLG_AUDIO) ? 'a' : 'v') : 0;
+    if (c) {
+      *c = (m->flags & FLG_AUDIO) ? 'b' : 'w';
     }
-    RCC(rc, finish, iwxstr_printf(xargs, "\1-map\1%d\1-c\1copy\1%s", c++, m->path));
-  }
-
-  struct iwn_proc_spec pspec = (struct iwn_proc_spec) {
-    .poller = g_env.poller,
-    .path = g_env.recording.ffmpeg,
-    .on_stdout = _ffmfix_on_output,
-    .on_stderr = _ffmfix_on_output,
-    .on_exit = _ffmfix_on_exit
-  };
-
-  RCB(finish, pspec.args = iwpool_split_string(pool, iwxstr_ptr(xargs), "\1", true));
-
-  int pid;
-  RCC(rc, finish, iwn_proc_spawn(&pspec, &pid));
-  RCC(rc, finish, iwn_proc_wait(pid));
-
-  // Now filter out unrecoverable media items
-  for (struct _m *m = ctx->media, *p = 0; m; m = m->next) {
-    m->flags &= ~FLG_FIX_NEEDED;
-    if (!_m_process(ctx, m) || (m->flags & FLG_FIX_NEEDED)) {
+    struct stat st, fst;
+    iwrc rc = 0;
+    if (!c) {
+      rc = GR_ERROR_MEDIA_PROCESSING;
+    } else if (  stat(path, &fst) == -1
+              || stat(m->path, &st) == -1
+              || fst.st_mtime <= st.st_mtime) {
+      // File may be fixed by previous run already, unless the source is modified since then
+      rc = _m_remux(m->path, path);
+    }
+    if (!rc) {
+      m->path = path;
+      m->fname = fname + 1;
+      m->flags &= ~FLG_FIX_NEEDED;
+      rc = _m_process(ctx, m);
+    }
+    if (rc || (m->flags & FLG_FIX_NEEDED)) {
+      // Unrecoverable media item
+      iwlog_warn("FFR | Skipping unrecoverable media: %s", m->fname);
       if (p) {
         p->next = m->next;
       } else {
@@ -338,11 +465,7 @@ static iwrc _m_fix(struct _ctx *ctx) {
       p = m;
     }
   }
-
-finish:
-  iwpool_destroy(pool);
-  iwxstr_destroy(xargs);
-  return rc;
+  return 0;
 }
 
 struct _pt {
@@ -360,9 +483,23 @@ struct _st {
 
 struct _pctx {         // Postprocessing context
   IWULIST     *stlist; // Steps list (struct _st)
-  IWXSTR      *spec;   // FFMpeg filter spec (stdin)
-  const char **args;   // FFMpeg arguments
+  IWXSTR      *spec;   // FFMpeg filter spec of the current step (stdin)
+  const char  *segdir; // Directory of rendered segments
   struct _ctx *ctx;
+  pthread_mutex_t mtx;
+  pthread_cond_t  cond;
+  int running;         // Number of running segment renderers
+};
+
+struct _seg {          // Timeline segment rendered by the separate ffmpeg process
+  struct _st   *st;
+  struct _pctx *pctx;
+  char *path;          // Rendered segment file, exists only if segment is completed
+  char *tmp_path;      // Segment file being rendered
+  const char **args;
+  char *spec;
+  int   code;          // Renderer exit code
+  bool  done;
 };
 
 static int _postproc_sort_pt(const void *o1, const void *o2, void *op) {
@@ -371,13 +508,14 @@ static int _postproc_sort_pt(const void *o1, const void *o2, void *op) {
   return p1->time < p2->time ? -1 : p1->time > p2->time ? 1 : 0;
 }
 
-static iwrc _postproc_create_args(struct _pctx *pctx) {
+static iwrc _seg_create_args(struct _pctx *pctx, struct _seg *seg) {
   iwrc rc = 0;
   IWXSTR *xargs = iwxstr_new();
   if (!xargs) {
     return iwrc_set_errno(IW_ERROR_ALLOC, errno);
   }
   struct _ctx *ctx = pctx->ctx;
+  struct _st *st = seg->st;
   if (g_env.recording.ffmpeg == g_env.program_file) {
     RCC(rc, finish, iwxstr_cat2(xargs, "f"));
   }
@@ -387,16 +525,15 @@ static iwrc _postproc_create_args(struct _pctx *pctx) {
   } else {
     RCC(rc, finish, iwxstr_cat2(xargs, "\1-loglevel\1fatal"));
   }
-  for (struct _m *m = ctx->media; m; m = m->next) {
+  for (int i = 0; i < st->mlist->num; ++i) {
+    struct _m *m = *(struct _m**) iwulist_at2(st->mlist, i);
     RCC(rc, finish, iwxstr_printf(xargs, "\1-i\1%s/%s", ctx->basedir, m->fname));
   }
   RCC(rc, finish, iwxstr_cat2(xargs, "\1-filter_complex_script\1pipe:0"));
-  RCC(rc, finish, iwxstr_cat2(xargs,
-                              "\1-c:v\1libvpx-vp9\1-cpu-used\1" "5" "\1-deadline\1realtime" "\1-auto-alt-ref\1" "0"
-                              "\1-c:a\1libopus\1-application\1voip"));
-  RCC(rc, finish, iwxstr_printf(xargs, "\1-map\1[vid]\1-map\1[aud]\1%s/%s",
-                                ctx->basedir, ctx->output_fname));
-  RCB(finish, pctx->args = iwpool_split_string(pctx->ctx->pool, iwxstr_ptr(xargs), "\1", true));
+  RCC(rc, finish, _profile_encoder_args(&ctx->profile, xargs));
+  RCC(rc, finish, iwxstr_printf(xargs, "\1-map\1[s%d_out_v]\1-map\1[s%d_out_a]\1-f\1%s\1%s",
+                                st->id, st->id, _profile_format(&ctx->profile), seg->tmp_path));
+  RCB(finish, seg->args = iwpool_split_string(ctx->pool, iwxstr_ptr(xargs), "\1", true));
 
 finish:
   iwxstr_destroy(xargs);
@@ -462,11 +599,13 @@ static iwrc _postproc_generate_step(struct _pctx *pctx, struct _st *st) {
   IWXSTR *fspec = pctx->spec;
   struct _box size = pctx->ctx->size;
   double duration = (double) (st->end_time - st->start_time) / 1000.0;
+  // Video of audio only interval is static, so it is generated at the minimal frame rate
+  int rate = _m_has(st->mlist, -1, FLG_VIDEO) ? pctx->ctx->profile.fps : 1;
   RCC(rc, finish,
       iwxstr_printf(
         fspec,
-        "color=s=%.0fx%.0f,trim=0:%.3f[s%d_bg];",
-        size.w, size.h, duration, st->id));
+        "color=s=%.0fx%.0f:r=%d,trim=0:%.3f[s%d_bg];",
+        size.w, size.h, rate, duration, st->id));
 
   for (int i = 0; i < st->mlist->num; ++i) {
     struct _m *m = *(struct _m**) iwulist_at2(st->mlist, i);
@@ -479,13 +618,13 @@ static iwrc _postproc_generate_step(struct _pctx *pctx, struct _st *st) {
       RCC(rc, finish, iwxstr_printf(
             fspec,
             "[%d:v]trim=%.3f:%.3f,setpts=PTS-STARTPTS,",
-            m->id, trim_s, trim_e));
+            m->in, trim_s, trim_e));
     } else {
       // TODO: Insert user ava
       RCC(rc, finish,
           iwxstr_printf(
             fspec,
-            "color=s=640x480:c=#003a58,trim=0:%.3f,", duration));
+            "color=s=640x480:c=#003a58:r=%d,trim=0:%.3f,", rate, duration));
     }
     RCC(rc, finish, iwxstr_printf(
           fspec,
@@ -531,7 +670,7 @@ static iwrc _postproc_generate_step(struct _pctx *pctx, struct _st *st) {
     RCC(rc, finish, iwxstr_printf(
           fspec,
           "[%d:a]atrim=%.3f:%.3f,asetpts=PTS-STARTPTS[s%d_%d_a];",
-          m->id, trim_s, trim_e, st->id, m->id
+          m->in, trim_s, trim_e, st->id, m->id
           ));
   }
 
@@ -579,38 +718,319 @@ static void _ffgen_on_err(const struct iwn_proc_ctx *ctx, const char *chunk, siz
   iwlog_info("FFR | [gen:%d] %.*s", ctx->pid, (int) len, chunk);
 }
 
+/// Stores exit code of process into `int` pointed by `user_data`, if set.
 static void _ffgen_on_exit(const struct iwn_proc_ctx *ctx) {
   int code = WIFEXITED(ctx->wstatus) ? WEXITSTATUS(ctx->wstatus) : -1;
   iwlog_info("FFR | [gen] exited, code: %d", code);
+  if (ctx->user_data) {
+    *(int*) ctx->user_data = code;
+  }
 }
 
-static iwrc _postproc_generate_spec(struct _pctx *pctx) {
+static void _seg_on_exit(const struct iwn_proc_ctx *ctx) {
+  struct _seg *seg = ctx->user_data;
+  struct _pctx *pctx = seg->pctx;
+  int code = WIFEXITED(ctx->wstatus) ? WEXITSTATUS(ctx->wstatus) : -1;
+  if (code == 0 && rename(seg->tmp_path, seg->path) == -1) { // Checkpoint completed segment
+    iwrc rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+    iwlog_ecode_error(rc, "FFR | Failed to rename %s", seg->tmp_path);
+    code = -1;
+  }
+  if (code) {
+    unlink(seg->tmp_path);
+  }
+  iwlog_info("FFR | [seg:%d] exited, code: %d", seg->st->id, code);
+  pthread_mutex_lock(&pctx->mtx);
+  seg->code = code;
+  seg->done = true;
+  --pctx->running;
+  pthread_cond_broadcast(&pctx->cond);
+  pthread_mutex_unlock(&pctx->mtx);
+}
+
+/// FNV-1a hash of segment renderer inputs, used to identify checkpointed segments.
+static uint64_t _seg_hash(struct _seg *seg) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char *p = seg->spec; *p; ++p) {
+    h = (h ^ (uint8_t) *p) * 0x100000001b3ULL;
+  }
+  for (const char **a = seg->args; *a; ++a) {
+    if (!strcmp(*a, seg->tmp_path)) {
+      continue;
+    }
+    for (const char *p = *a; *p; ++p) {
+      h = (h ^ (uint8_t) *p) * 0x100000001b3ULL;
+    }
+  }
+  return h;
+}
+
+static iwrc _seg_create(struct _pctx *pctx, struct _st *st, struct _seg *seg) {
   iwrc rc = 0;
-  int i = 0;
-  for ( ; i < pctx->stlist->num; ++i) {
-    struct _st *st = (struct _st*) iwulist_at2(pctx->stlist, i);
-    RCC(rc, finish, _postproc_generate_step(pctx, st));
+  struct _ctx *ctx = pctx->ctx;
+  *seg = (struct _seg) {
+    .st   = st,
+    .pctx = pctx
+  };
+  for (int i = 0; i < st->mlist->num; ++i) {
+    struct _m *m = *(struct _m**) iwulist_at2(st->mlist, i);
+    m->in = i;
   }
-  for (i = 0; i < pctx->stlist->num; ++i) {
-    struct _st *st = (struct _st*) iwulist_at2(pctx->stlist, i);
-    RCC(rc, finish, iwxstr_printf(pctx->spec, "[s%d_out_v][s%d_out_a]", st->id, st->id));
+  iwxstr_clear(pctx->spec);
+  RCC(rc, finish, _postproc_generate_step(pctx, st));
+  RCB(finish, seg->spec = iwpool_strdup2(ctx->pool, iwxstr_ptr(pctx->spec)));
+  for (size_t len = strlen(seg->spec); len && seg->spec[len - 1] == ';'; --len) {
+    seg->spec[len - 1] = '\0'; // Step outputs are mapped directly
   }
-  RCC(rc, finish, iwxstr_printf(pctx->spec, "concat=n=%d:v=1:a=1[vid][aud]", i));
-  RCC(rc, finish, _postproc_create_args(pctx));
+  RCB(finish, seg->tmp_path = iwpool_printf(ctx->pool, "%s/seg-%04d.tmp", pctx->segdir, st->id));
+  RCC(rc, finish, _seg_create_args(pctx, seg));
+  RCB(finish, seg->path = iwpool_printf(ctx->pool, "%s/seg-%04d-%016" PRIx64 ".%s",
+                                        pctx->segdir, st->id, _seg_hash(seg),
+                                        strrchr(ctx->output_fname, '.') + 1));
 
 finish:
   return rc;
 }
 
+static iwrc _seg_spawn(struct _seg *seg) {
+  int pid;
+  struct iwn_proc_spec pspec = (struct iwn_proc_spec) {
+    .poller = g_env.poller,
+    .path = g_env.recording.ffmpeg,
+    .args = seg->args,
+    .user_data = seg,
+    .on_stdout = _ffgen_on_output,
+    .on_stderr = _ffgen_on_err,
+    .on_exit = _seg_on_exit,
+    .write_stdin = true
+  };
+  if (g_env.recording.verbose) {
+    iwlog_info("FFR | [seg:%d] Filter %s", seg->st->id, seg->spec);
+  }
+  iwrc rc = RCR(iwn_proc_spawn(&pspec, &pid));
+  rc = iwn_proc_stdin_write(pid, seg->spec, strlen(seg->spec), true);
+  if (rc) {
+    iwlog_ecode_error3(rc);
+    iwn_proc_kill(pid, SIGINT); // Failure is reported by `_seg_on_exit()`
+  }
+  return 0;
+}
+
+/// Renders timeline segments in parallel by at most `postproc_workers` processes.
+/// Segments rendered by previous runs of the same task are reused.
+static iwrc _segs_render(struct _pctx *pctx, struct _seg *segs, int num) {
+  iwrc rc = 0;
+  int failed = 0;
+
+  for (int i = 0; i < num; ++i) {
+    struct _seg *seg = &segs[i];
+    struct stat st;
+    if (stat(seg->path, &st) == 0) {
+      if (g_env.recording.verbose) {
+        iwlog_info("FFR | [seg:%d] Reusing %s", seg->st->id, seg->path);
+      }
+      seg->done = true;
+      continue;
+    }
+    pthread_mutex_lock(&pctx->mtx);
+    while (pctx->running >= g_env.recording.postproc_workers) {
+      pthread_cond_wait(&pctx->cond, &pctx->mtx);
+    }
+    for (int j = 0; j < i; ++j) {
+      if (segs[j].done && segs[j].code) {
+        ++failed;
+      }
+    }
+    if (failed || g_env.shutdown) {
+      pthread_mutex_unlock(&pctx->mtx);
+      break;
+    }
+    ++pctx->running;
+    pthread_mutex_unlock(&pctx->mtx);
+
+    rc = _seg_spawn(seg);
+    if (rc) {
+      pthread_mutex_lock(&pctx->mtx);
+      --pctx->running;
+      pthread_mutex_unlock(&pctx->mtx);
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&pctx->mtx);
+  while (pctx->running > 0) {
+    pthread_cond_wait(&pctx->cond, &pctx->mtx);
+  }
+  pthread_mutex_unlock(&pctx->mtx);
+
+  if (!rc) {
+    for (int i = 0; i < num; ++i) {
+      if (!segs[i].done || segs[i].code) {
+        rc = GR_ERROR_MEDIA_PROCESSING;
+        break;
+      }
+    }
+  }
+  return rc;
+}
+
+/// Joins rendered segments into the output file using concat demuxer.
+static iwrc _segs_concat(struct _pctx *pctx, struct _seg *segs, int num) {
+  iwrc rc = 0;
+  int pid = -1, code = -1;
+  FILE *f = 0;
+  IWXSTR *xargs = 0;
+  struct _ctx *ctx = pctx->ctx;
+  const char **args;
+  char *list = iwpool_printf(ctx->pool, "%s/concat.txt", pctx->segdir);
+  RCA(list, finish);
+
+  f = fopen(list, "w");
+  if (!f) {
+    rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+    goto finish;
+  }
+  for (int i = 0; i < num; ++i) {
+    fprintf(f, "file '%s'\n", strrchr(segs[i].path, '/') + 1);
+  }
+  if (fclose(f)) {
+    f = 0;
+    rc = iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+    goto finish;
+  }
+  f = 0;
+
+  RCB(finish, xargs = iwxstr_new());
+  if (g_env.recording.ffmpeg == g_env.program_file) {
+    RCC(rc, finish, iwxstr_cat2(xargs, "f"));
+  }
+  RCC(rc, finish, iwxstr_cat2(xargs, "\1-y"));
+  if (g_env.recording.verbose) {
+    RCC(rc, finish, iwxstr_cat2(xargs, "\1-loglevel\1debug"));
+  } else {
+    RCC(rc, finish, iwxstr_cat2(xargs, "\1-loglevel\1fatal"));
+  }
+  RCC(rc, finish, iwxstr_printf(xargs, "\1-f\1concat\1-safe\1" "0" "\1-i\1%s\1-c\1copy\1%s/%s",
+                                list, ctx->basedir, ctx->output_fname));
+  RCB(finish, args = iwpool_split_string(ctx->pool, iwxstr_ptr(xargs), "\1", true));
+
+  struct iwn_proc_spec pspec = (struct iwn_proc_spec) {
+    .poller = g_env.poller,
+    .path = g_env.recording.ffmpeg,
+    .args = args,
+    .on_stdout = _ffgen_on_output,
+    .on_stderr = _ffgen_on_err,
+    .on_exit = _ffgen_on_exit,
+    .user_data = &code,
+  };
+  RCC(rc, finish, iwn_proc_spawn(&pspec, &pid));
+  RCC(rc, finish, iwn_proc_wait(pid));
+  if (code) {
+    iwlog_error("FFR | Failed to write %s/%s, ffmpeg exit code: %d", ctx->basedir, ctx->output_fname, code);
+    rc = GR_ERROR_MEDIA_PROCESSING;
+    goto finish;
+  }
+
+finish:
+  if (f) {
+    fclose(f);
+  }
+  iwxstr_destroy(xargs);
+  return rc;
+}
+
+/// Single speaker recording with WebM compatible codecs is remuxed by stream copy
+/// without decoding and composing of media.
+static iwrc _postproc_copy(struct _ctx *ctx, bool *out_done) {
+  iwrc rc = 0;
+  int pid = -1, code = -1;
+  IWXSTR *xargs = 0;
+  const char **args;
+  struct _m *v = 0, *a = 0;
+  *out_done = false;
+
+  for (struct _m *m = ctx->media; m; m = m->next) {
+    if (m->user_id != ctx->media->user_id) {
+      return 0;
+    }
+    if (m->flags & FLG_VIDEO) {
+      if (v || (m->codec_id != AV_CODEC_ID_VP8 && m->codec_id != AV_CODEC_ID_VP9)) {
+        return 0;
+      }
+      v = m;
+    } else {
+      if (a || m->codec_id != AV_CODEC_ID_OPUS) {
+        return 0;
+      }
+      a = m;
+    }
+  }
+  if (!v) { // Audio only recording is composed with background video
+    return 0;
+  }
+  int64_t start_time = a && a->start_time < v->start_time ? a->start_time : v->start_time;
+
+  RCB(finish, xargs = iwxstr_new());
+  if (g_env.recording.ffmpeg == g_env.program_file) {
+    RCC(rc, finish, iwxstr_cat2(xargs, "f"));
+  }
+  RCC(rc, finish, iwxstr_cat2(xargs, "\1-y"));
+  if (g_env.recording.verbose) {
+    RCC(rc, finish, iwxstr_cat2(xargs, "\1-loglevel\1debug"));
+  } else {
+    RCC(rc, finish, iwxstr_cat2(xargs, "\1-loglevel\1fatal"));
+  }
+  RCC(rc, finish, iwxstr_printf(xargs, "\1-itsoffset\1%.3f\1-i\1%s",
+                                (double) (v->start_time - start_time) / 1000.0, v->path));
+  if (a) {
+    RCC(rc, finish, iwxstr_printf(xargs, "\1-itsoffset\1%.3f\1-i\1%s",
+                                  (double) (a->start_time - start_time) / 1000.0, a->path));
+  }
+  RCC(rc, finish, iwxstr_printf(xargs, "\1-map\1" "0:%d", v->nstream));
+  if (a) {
+    RCC(rc, finish, iwxstr_printf(xargs, "\1-map\1" "1:%d", a->nstream));
+  }
+  RCC(rc, finish, iwxstr_printf(xargs, "\1-c\1copy\1-f\1%s\1%s/%s",
+                                _profile_format(&ctx->profile), ctx->basedir, ctx->output_fname));
+  RCB(finish, args = iwpool_split_string(ctx->pool, iwxstr_ptr(xargs), "\1", true));
+
+  if (g_env.recording.verbose) {
+    iwlog_info("FFR | Single speaker recording, stream copy of %s", v->fname);
+  }
+  struct iwn_proc_spec pspec = (struct iwn_proc_spec) {
+    .poller = g_env.poller,
+    .path = g_env.recording.ffmpeg,
+    .args = args,
+    .on_stdout = _ffgen_on_output,
+    .on_stderr = _ffgen_on_err,
+    .on_exit = _ffgen_on_exit,
+    .user_data = &code,
+  };
+  RCC(rc, finish, iwn_proc_spawn(&pspec, &pid));
+  RCC(rc, finish, iwn_proc_wait(pid));
+  if (code) {
+    iwlog_error("FFR | Failed to write %s/%s, ffmpeg exit code: %d", ctx->basedir, ctx->output_fname, code);
+    rc = GR_ERROR_MEDIA_PROCESSING;
+    goto finish;
+  }
+  *out_done = true;
+
+finish:
+  iwxstr_destroy(xargs);
+  return rc;
+}
+
 static iwrc _postproc_run(struct _ctx *ctx) {
-  int pid = -1;
   IWULIST ptlist; // Pointer list (struct _pt)
   IWULIST stlist; // Steps list (struct _st)
   IWULIST mlist;  // Current media list
+  struct _seg *segs = 0;
   struct _pctx pctx = {
     .stlist = &stlist,
     .ctx    = ctx,
     .spec   = iwxstr_new(),
+    .mtx    = PTHREAD_MUTEX_INITIALIZER,
+    .cond   = PTHREAD_COND_INITIALIZER,
   };
 
   iwrc rc = RCR(iwulist_init(&ptlist, 64, sizeof(struct _pt)));
@@ -678,7 +1098,17 @@ static iwrc _postproc_run(struct _ctx *ctx) {
     }
     ptime = pt->time;
   }
-  if (stlist.num == 0) {
+  int num = (int) stlist.num;
+  if (ctx->cutoff) {
+    // Steps are ordered by time, render only ones not affected by media still being recorded
+    for (num = 0; num < stlist.num; ++num) {
+      struct _st *st = iwulist_at2(&stlist, num);
+      if (st->end_time > ctx->cutoff) {
+        break;
+      }
+    }
+  }
+  if (num == 0) {
     goto finish;
   }
   if (g_env.recording.verbose) {
@@ -689,25 +1119,17 @@ static iwrc _postproc_run(struct _ctx *ctx) {
                  i, st->mlist->num, st->start_time, st->end_time, st->end_time - st->start_time);
     }
   }
-  RCC(rc, finish, _postproc_generate_spec(&pctx));
 
-  if (g_env.recording.verbose) {
-    iwlog_info("FFR | Filter %s", iwxstr_ptr(pctx.spec));
+  RCB(finish, pctx.segdir = iwpool_printf(ctx->pool, "%s/.segments", ctx->basedir));
+  RCC(rc, finish, iwp_mkdirs(pctx.segdir));
+  RCB(finish, segs = iwpool_calloc(num * sizeof(*segs), ctx->pool));
+  for (i = 0; i < num; ++i) {
+    RCC(rc, finish, _seg_create(&pctx, iwulist_at2(&stlist, i), &segs[i]));
+  }
+  RCC(rc, finish, _segs_render(&pctx, segs, num));
+  if (!ctx->cutoff) {
+    RCC(rc, finish, _segs_concat(&pctx, segs, num));
   }
-
-  struct iwn_proc_spec pspec = (struct iwn_proc_spec) {
-    .poller = g_env.poller,
-    .path = g_env.recording.ffmpeg,
-    .args = pctx.args,
-    .on_stdout = _ffgen_on_output,
-    .on_stderr = _ffgen_on_err,
-    .on_exit = _ffgen_on_exit,
-    .write_stdin = true
-  };
-
-  RCC(rc, finish, iwn_proc_spawn(&pspec, &pid));
-  RCC(rc, finish, iwn_proc_stdin_write(pid, iwxstr_ptr(pctx.spec), iwxstr_size(pctx.spec), true));
-  RCC(rc, finish, iwn_proc_wait(pid));
 
 finish:
   iwulist_destroy_keep(&ptlist);
@@ -718,22 +1140,47 @@ finish:
   }
   iwulist_destroy_keep(&stlist);
   iwxstr_destroy(pctx.spec);
-  if (rc && pid > -1) {
-    iwn_proc_kill(pid, SIGINT);
-  }
+  pthread_cond_destroy(&pctx.cond);
+  pthread_mutex_destroy(&pctx.mtx);
   return rc;
 }
 
+/// Removes directory of checkpointed segments once the final output is written.
+/// It also holds segments of previous renderer runs and prerendering not referenced by the final timeline.
+static void _segdir_remove(struct _ctx *ctx) {
+  char *segdir = iwpool_printf(ctx->pool, "%s/.segments", ctx->basedir);
+  if (segdir && access(segdir, F_OK) == 0) {
+    iwrc rc = iwp_removedir(segdir);
+    if (rc) {
+      iwlog_ecode_warn(rc, "FFR | Failed to remove %s", segdir);
+    }
+  }
+}
+
 static iwrc _postproc(struct _ctx *ctx) {
+  _profile_apply(ctx);
   iwrc rc = RCR(_m_collect(ctx));
   RCC(rc, finish, _m_fix(ctx));
-  if (!ctx->media) {
+  if (!ctx->media && ctx->cutoff) {
+    goto finish; // Nothing is recorded yet
+  } else if (!ctx->media) {
     // No valid media to process
     rc = GR_ERROR_MEDIA_PROCESSING;
     iwlog_error2("No valid media to process");
     goto finish;
   }
-  rc = _postproc_run(ctx);
+  if (!ctx->cutoff) {
+    bool done = false;
+    RCC(rc, finish, _postproc_copy(ctx, &done));
+    if (done) {
+      _segdir_remove(ctx);
+      goto finish;
+    }
+  }
+  RCC(rc, finish, _postproc_run(ctx));
+  if (!ctx->cutoff) {
+    _segdir_remove(ctx);
+  }
 
 finish:
   if (rc) {
@@ -763,6 +1210,8 @@ int recording_postproc(int64_t task_id, JBL task) {
   RCC(rc, finish, jbl_at(task, "/spec", &jbl));
   RCC(rc, finish, jbl_object_get_str(task, "hook", &cid));
   RCC(rc, finish, jbl_object_get_str(jbl, "uuid", &uuid));
+  // Room events may still be in write-behind queue
+  RCC(rc, finish, gr_db_wb_flush(false));
   RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] or /[cid = :?]"));
   RCC(rc, finish, jql_set_str(q, 0, 0, cid));
   RCC(rc, finish, jql_set_str(q, 0, 1, cid));
@@ -779,15 +1228,10 @@ int recording_postproc(int64_t task_id, JBL task) {
 
   struct _ctx ctx = (struct _ctx) {
     .task_id = task_id,
-    .output_fname = "output.webm",
     .room = list->first->raw,
     .room_ctime = ctime,
     .basedir = dirname,
-    .pool = pool,
-    .size = {
-      .w = 1280,
-      .h = 960
-    }
+    .pool = pool
   };
 
   RCC(rc, finish, _postproc(&ctx));
@@ -796,7 +1240,13 @@ int recording_postproc(int64_t task_id, JBL task) {
   jbl_destroy(&jbl);
   RCC(rc, finish, jbl_create_empty_object(&jbl));
   RCC(rc, finish, jbl_set_string(jbl, "recf", ctx.output_fname));
-  RCC(rc, finish, ejdb_patch_jbl(g_env.db, "rooms", jbl, list->first->id));
+  RCC(rc, finish, gr_db_wb_submit(&(struct gr_db_wb_spec) {
+    .op = GR_DB_WB_PATCH,
+    .wclass = GR_DB_WB_COMMIT,
+    .coll = "rooms",
+    .jbl = jbl,
+    .id = list->first->id
+  }));
 
   jbl_destroy(&jbl);
   RCC(rc, finish, jbl_create_empty_object(&jbl));
@@ -807,19 +1257,104 @@ int recording_postproc(int64_t task_id, JBL task) {
   // Now notify users and rest of system
   RCB(finish, xstr = iwxstr_new());
   if (!jbl_as_json(jbl, jbl_xstr_json_printer, xstr, 0)) {
-    grh_ws_send_all_room_participants(list->first->id, iwxstr_ptr(xstr), iwxstr_size(xstr));
+    grh_ws_send_all_room_participants(list->first->id, cid, iwxstr_ptr(xstr), iwxstr_size(xstr));
   }
   wrc_notify_event_handlers(WRC_EVT_ROOM_RECORDING_PP, 0, jbl);
   jbl = 0; // jbl ownership is transfered to wrc_notify_event_handlers()
 
 finish:
+  grh_ws_room_participants_release(cid);
   ejdb_list_destroy(&list);
   jql_destroy(&q);
   iwpool_destroy(pool);
   jbl_destroy(&jbl);
   iwxstr_destroy(xstr);
   if (rc) {
+    // Rendering interrupted by shutdown will be resumed from rendered segments
+    ret = g_env.shutdown ? 0 : -1;
+  }
+  return ret;
+}
+
+int recording_prerender(int64_t task_id, JBL task) {
+  iwrc rc = 0;
+  int ret = 1;
+  JQL q = 0;
+  EJDB_LIST list = 0;
+  JBL jbl = 0;
+  JBL_NODE spec, n;
+  const char *cid = 0, *dirname;
+  int64_t ctime, count = 0;
+  char cid_dir[FILES_UUID_DIR_BUFSZ];
+
+  IWPOOL *pool = iwpool_create_empty();
+  if (!pool) {
+    rc = iwrc_set_errno(rc, IW_ERROR_ALLOC);
+    goto finish;
+  }
+
+  RCC(rc, finish, jbl_object_get_str(task, "hook", &cid));
+
+  // Room is closed already, all segments will be rendered by postprocessing task
+  RCC(rc, finish, jql_create(&q, "tasks", "/[type = :?] and /[hook = :?]"));
+  RCC(rc, finish, jql_set_i64(q, 0, 0, PT_RECORDING_POSTPROC));
+  RCC(rc, finish, jql_set_str(q, 0, 1, cid));
+  RCC(rc, finish, ejdb_count(g_env.db, q, &count, 1));
+  if (count) {
+    goto finish;
+  }
+  jql_destroy(&q);
+
+  RCC(rc, finish, jbl_at(task, "/spec", &jbl));
+  RCC(rc, finish, jbl_to_node(jbl, &spec, false, pool));
+  RCC(rc, finish, jql_create(&q, "rooms", "/[cid = :?]"));
+  RCC(rc, finish, jql_set_str(q, 0, 0, cid));
+  RCC(rc, finish, ejdb_list4(g_env.db, q, 1, 0, &list));
+  if (!list->first) {
     ret = -1;
+    goto finish;
+  }
+  RCC(rc, finish, jbl_object_get_i64(list->first->raw, "ctime", &ctime));
+  files_uuid_dir_copy(cid, cid_dir);
+  RCB(finish, dirname = iwpool_printf(pool, "%s/%s", g_env.recording.dir, cid_dir));
+
+  struct _ctx ctx = (struct _ctx) {
+    .task_id = task_id,
+    .room = list->first->raw,
+    .room_ctime = ctime,
+    .basedir = dirname,
+    .pool = pool
+  };
+
+  // Segments after the start of any media still being recorded may change
+  RCC(rc, finish, jbn_at(spec, "/ts", &n));
+  RCIF(n->type != JBV_I64, rc, IW_ERROR_INVALID_VALUE, finish);
+  ctx.cutoff = n->vi64;
+  if (!jbn_at(spec, "/open", &n) && n->type == JBV_ARRAY) {
+    ctx.open = n;
+    for (n = n->child; n; n = n->next) {
+      if (n->type == JBV_STR) {
+        int64_t ts = ctime + iwatoi(n->vptr);
+        if (ts < ctx.cutoff) {
+          ctx.cutoff = ts;
+        }
+      }
+    }
+  }
+  if (ctx.cutoff <= ctime) {
+    goto finish;
+  }
+
+  iwlog_info("FFR | Prerendering room recording segments, room: %s", cid);
+  RCC(rc, finish, _postproc(&ctx));
+
+finish:
+  ejdb_list_destroy(&list);
+  jql_destroy(&q);
+  jbl_destroy(&jbl);
+  iwpool_destroy(pool);
+  if (rc) {
+    ret = g_env.shutdown ? 0 : -1;
   }
   return ret;
 }
@@ -833,15 +1368,10 @@ iwrc recording_postproc_test(const char *basedir, JBL room) {
   RCC(rc, finish, jbl_object_get_i64(room, "ctime", &ctime));
   rc = _postproc(&(struct _ctx) {
     .task_id = 1,
-    .output_fname = "output.webm",
     .room = room,
     .room_ctime = ctime,
     .basedir = basedir,
-    .pool = pool,
-    .size = {
-      .w = 1280,
-      .h = 960
-    }
+    .pool = pool
   });
 
 finish:
@@ -19,3 +19,8 @@
 #include <iowow/iwjson.h>
 
 int recording_postproc(int64_t task_id, JBL doc);
+
+/// Renders timeline segments of room recording in progress
+/// which will not be affected by media still being recorded.
+/// Rendered segments are picked up by `recording_postproc()` once room is closed.
+int recording_prerender(int64_t task_id, JBL doc);
@@ -2,6 +2,11 @@
 #include <CUnit/Basic.h>
 #include <ejdb2/iowow/iwp.h>
 
+#include <libavformat/avformat.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
 extern struct gr_env g_env;
 
 const char *base = "bbc2db05-ec3e-4343-8723-b437338274b8";
@@ -40,13 +45,84 @@ static JBL _room_create(void) {
   return jbl;
 }
 
+/// Fixture media are not in the tree, tests are skipped if they are not found in `[recording] dir`.
+static bool _fixture_exists(const char *basedir) {
+  if (access(basedir, F_OK) == 0) {
+    return true;
+  }
+  fprintf(stderr, "\nFixture %s not found, skipped\n", basedir);
+  return false;
+}
+
+/// Duration of media file in milliseconds or -1.
+static int64_t _output_duration(const char *path) {
+  AVFormatContext *fctx = 0;
+  int64_t ret = -1;
+  if (avformat_open_input(&fctx, path, 0, 0) == 0) {
+    if (avformat_find_stream_info(fctx, 0) >= 0 && fctx->duration > 0) {
+      ret = fctx->duration * 1000 / AV_TIME_BASE;
+    }
+    avformat_close_input(&fctx);
+  }
+  return ret;
+}
+
 static void test_postproc1(void) {
   JBL room = _room_create();
   CU_ASSERT_PTR_NOT_NULL_FATAL(room);
   IWXSTR *xstr = iwxstr_new();
   iwxstr_printf(xstr, "%s/%s", g_env.recording.dir, base);
+  if (!_fixture_exists(iwxstr_ptr(xstr))) {
+    goto finish;
+  }
   iwrc rc = recording_postproc_test(iwxstr_ptr(xstr), room);
-  CU_ASSERT_EQUAL_FATAL(rc, 0);
+  CU_ASSERT_EQUAL(rc, 0);
+
+finish:
+  jbl_destroy(&room);
+  iwxstr_destroy(xstr);
+}
+
+static void test_postproc_profiles(void) {
+  const char *profiles[] = { "fast", "balanced", "quality" };
+  JBL room = _room_create();
+  CU_ASSERT_PTR_NOT_NULL_FATAL(room);
+  IWXSTR *xstr = iwxstr_new();
+  iwxstr_printf(xstr, "%s/%s", g_env.recording.dir, base);
+  if (!_fixture_exists(iwxstr_ptr(xstr))) {
+    goto finish;
+  }
+  IWXSTR *oxstr = iwxstr_new();
+  CU_ASSERT_PTR_NOT_NULL_FATAL(oxstr);
+  iwxstr_printf(oxstr, "%s/output.webm", iwxstr_ptr(xstr));
+  const char *output = iwxstr_ptr(oxstr);
+  const char *profile = g_env.recording.output.profile;
+
+  fprintf(stderr, "\n%-10s %12s %12s %10s %12s\n", "Profile", "Duration ms", "Encode ms", "Speed", "Size bytes");
+  for (int i = 0; i < sizeof(profiles) / sizeof(profiles[0]); ++i) {
+    uint64_t ts1, ts2;
+    struct stat st = { 0 };
+    g_env.recording.output.profile = profiles[i];
+    unlink(output); // Output of the previous profile must not be taken as result of this one
+    iwp_current_time_ms(&ts1, true);
+    iwrc rc = recording_postproc_test(iwxstr_ptr(xstr), room);
+    iwp_current_time_ms(&ts2, true);
+    CU_ASSERT_EQUAL(rc, 0);
+    if (rc) {
+      continue;
+    }
+    CU_ASSERT_EQUAL(stat(output, &st), 0);
+    int64_t duration = _output_duration(output);
+    CU_ASSERT_TRUE(duration > 0);
+    // Throughput is reported as realtime factor: output duration per wall time of processing
+    fprintf(stderr, "%-10s %12" PRId64 " %12" PRIu64 " %9.2fx %12" PRId64 "\n",
+            profiles[i], duration, ts2 - ts1,
+            ts2 > ts1 ? (double) duration / (double) (ts2 - ts1) : 0.0, (int64_t) st.st_size);
+  }
+  g_env.recording.output.profile = profile;
+  iwxstr_destroy(oxstr);
+
+finish:
   jbl_destroy(&room);
   iwxstr_destroy(xstr);
 }
@@ -66,7 +142,8 @@ int main(int argc, char *argv[]) {
     CU_cleanup_registry();
     return CU_get_error();
   }
-  if ((NULL == CU_add_test(pSuite, "test_postproc1", test_postproc1))) {
+  if (  (NULL == CU_add_test(pSuite, "test_postproc1", test_postproc1))
+     || (NULL == CU_add_test(pSuite, "test_postproc_profiles", test_postproc_profiles))) {
     CU_cleanup_registry();
     return CU_get_error();
   }
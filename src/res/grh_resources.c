@@ -21,33 +21,39 @@
 
 #include "data_front_index_html.inc"
 #include "data_front_bundle_js_gz.inc"
+#include "data_front_bundle_js_br.inc"
 
 #include <iwnet/iwn_wf_files.h>
 
 #include <stdlib.h>
 
 static struct resource _res[] = {
-  RES("/",           0x2b5d4,    "text/html;charset=UTF-8",              data_front_index_html,   false, false),
-  RES("/index.html", 0xe114b9cf, "text/html;charset=UTF-8",              data_front_index_html,   false, true),
-  RES("/bundle.js",  0x89fc95d9, "application/javascript;charset=UTF-8", data_front_bundle_js_gz, true,  false)
+  RES_HTML("/",          "text/html;charset=UTF-8",              data_front_index_html, false),
+  RES_HTML("/index.html", "text/html;charset=UTF-8",              data_front_index_html, true),
+  RES_BR("/bundle.js",    "application/javascript;charset=UTF-8", data_front_bundle_js,  false)
 };
 
+static struct resources_index _idx;
+
 static int _resources(struct iwn_wf_req *req, void *user_data) {
-  uint32_t hash = _hash(req->path);
-  for (int i = 0; i < sizeof(_res) / sizeof(_res[0]); ++i) {
-    struct resource *r = &_res[i];
-    if (r->hash == hash && strcmp(req->path, r->path) == 0) {
-      return _serve(r, req);
-    }
+  struct resource *r = grh_resources_index_find(&_idx, req->path);
+  if (r) {
+    return grh_resources_serve(r, req);
   }
   return 0;
 }
 
+static void _resources_dispose(struct iwn_wf_ctx *ctx, void *user_data) {
+  grh_resources_index_dispose(&_idx);
+}
+
 iwrc grh_route_resources(struct iwn_wf_route *parent) {
   iwrc rc = 0;
+  RCC(rc, finish, grh_resources_index_init(&_idx, _res, sizeof(_res) / sizeof(_res[0])));
   RCC(rc, finish, iwn_wf_route(&(struct iwn_wf_route) {
     .parent = parent,
     .handler = _resources,
+    .handler_dispose = _resources_dispose,
     .tag = "resources"
   }, 0));
 
@@ -36,15 +36,19 @@ static const unsigned char admin_html[]
 const unsigned int admin_html_len = sizeof(admin_html) - 1;
 
 #include "data_front_admin_js_gz.inc"
+#include "data_front_admin_js_br.inc"
 #include "data_front_admin_css_gz.inc"
+#include "data_front_admin_css_br.inc"
 
 static struct resource _res[] = {
-  RES("/admin",      0x7c9576bd, "text/html;charset=UTF-8",              admin_html,              false, true),
-  RES("/admin.html", 0x9ec99f60, "text/html;charset=UTF-8",              admin_html,              false, true),
-  RES("/admin.css",  0x23d77b14, "text/css;charset=UTF-8",               data_front_admin_css_gz, true,  false),
-  RES("/admin.js",   0xf1922b68, "application/javascript;charset=UTF-8", data_front_admin_js_gz,  true,  false),
+  RES_HTML("/admin",      "text/html;charset=UTF-8",              admin_html,           true),
+  RES_HTML("/admin.html", "text/html;charset=UTF-8",              admin_html,           true),
+  RES_BR("/admin.css",    "text/css;charset=UTF-8",               data_front_admin_css, false),
+  RES_BR("/admin.js",     "application/javascript;charset=UTF-8", data_front_admin_js,  false),
 };
 
+static struct resources_index _idx;
+
 static bool _check_access(struct resource *r, struct iwn_wf_req *req) {
   if (!(req->http->user_flags & REQ_FLAG_ROLE_ADMIN)) {
     if (r && ((strcmp(r->path, "/admin") == 0) || (strcmp(r->path, "/admin.html") == 0))) {
@@ -57,7 +61,7 @@ static bool _check_access(struct resource *r, struct iwn_wf_req *req) {
 
 static int _serve_check_access(struct resource *r, struct iwn_wf_req *req) {
   if (_check_access(r, req)) {
-    return _serve(r, req);
+    return grh_resources_serve(r, req);
   } else {
     return 0;
   }
@@ -67,16 +71,17 @@ static int _handler_resources_admin(struct iwn_wf_req *req, void *data) {
   if (!(req->flags & IWN_WF_GET)) {
     return 0;
   }
-  uint32_t hash = _hash(req->path);
-  for (int i = 0; i < sizeof(_res) / sizeof(_res[0]); ++i) {
-    struct resource *r = &_res[i];
-    if ((r->hash == hash) && (strcmp(req->path, r->path) == 0)) {
-      return _serve_check_access(r, req);
-    }
+  struct resource *r = grh_resources_index_find(&_idx, req->path);
+  if (r) {
+    return _serve_check_access(r, req);
   }
   return 0;
 }
 
+static void _handler_resources_admin_dispose(struct iwn_wf_ctx *ctx, void *user_data) {
+  grh_resources_index_dispose(&_idx);
+}
+
 static int _handler_admin(struct iwn_wf_req *req, void *data) {
   if (!(req->http->user_flags & REQ_FLAG_ROLE_ADMIN)) {
     return -2; // Disable processing of child routes
@@ -87,10 +92,12 @@ static int _handler_admin(struct iwn_wf_req *req, void *data) {
 
 iwrc grh_route_resources_adm(struct iwn_wf_route *parent) {
   iwrc rc;
+  RCC(rc, finish, grh_resources_index_init(&_idx, _res, sizeof(_res) / sizeof(_res[0])));
 
   RCC(rc, finish, iwn_wf_route(&(struct iwn_wf_route) {
     .parent = parent,
     .handler = _handler_resources_admin,
+    .handler_dispose = _handler_resources_admin_dispose,
     .tag = "resources_admin"
   }, 0));
 
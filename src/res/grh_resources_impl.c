@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "grh_resources_impl.h"
+
+#include <iowow/iwxstr.h>
+#include <iowow/iwp.h>
+
+#include <stdlib.h>
+#include <strings.h>
+#include <inttypes.h>
+
+/// Max number of seeds tried for the given index size
+#define SEEDS_MAX 4096
+
+/// Max number of resources indexes links of HTML pages are looked up in
+#define INDEXES_MAX 8
+
+#define ENC_GZIP 0x01U
+#define ENC_BR   0x02U
+
+static uint32_t _hash(const char *str) {
+  unsigned char c;
+  uint32_t hash = 5381;
+  while ((c = *str++)) {
+    hash = ((hash << 5) + hash) + c;
+  }
+  return hash;
+}
+
+/// Registered indexes in order of initialization
+static struct resources_index *_indexes[INDEXES_MAX];
+static int _indexes_num;
+
+/// Last modification time of embedded resources is the server start time
+static uint64_t _mtime_ms;
+
+IW_INLINE uint32_t _slot(uint32_t hash, uint32_t seed, uint32_t bits) {
+  return ((hash ^ seed) * 0x9e3779b1U) >> (32 - bits);
+}
+
+static iwrc _index_build(struct resources_index *idx, struct resource *res, size_t num) {
+  memset(idx, 0, sizeof(*idx));
+  idx->res = res;
+  idx->num = num;
+  for (size_t i = 0; i < num; ++i) {
+    res[i].hash = _hash(res[i].path);
+  }
+  // Start from load factor at most 0.5 and grow index until collision free seed is found
+  for (uint32_t bits = 1; (1U << bits) <= RESOURCES_INDEX_SLOTS_MAX; ++bits) {
+    if ((1U << bits) < 2 * num) {
+      continue;
+    }
+    for (uint32_t seed = 0; seed < SEEDS_MAX; ++seed) {
+      size_t i = 0;
+      memset(idx->slots, 0, sizeof(idx->slots));
+      for ( ; i < num; ++i) {
+        struct resource **sp = &idx->slots[_slot(res[i].hash, seed, bits)];
+        if (*sp) {
+          break;
+        }
+        *sp = &res[i];
+      }
+      if (i == num) {
+        idx->seed = seed;
+        idx->bits = bits;
+        return 0;
+      }
+    }
+  }
+  memset(idx->slots, 0, sizeof(idx->slots));
+  iwlog_error("Failed to build perfect hash index of %zu resources", num);
+  return IW_ERROR_OVERFLOW;
+}
+
+struct resource* grh_resources_index_find(const struct resources_index *idx, const char *path) {
+  if (!idx->bits) {
+    return 0;
+  }
+  uint32_t hash = _hash(path);
+  struct resource *r = idx->slots[_slot(hash, idx->seed, idx->bits)];
+  if (r && r->hash == hash && strcmp(path, r->path) == 0) {
+    return r;
+  }
+  return 0;
+}
+
+/// Same FNV-1a 64 entity tag as `strliteral --etag` computes at build time.
+static void _etag_fill(const unsigned char *data, size_t len, char buf[20]) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  snprintf(buf, 20, "\"%016" PRIx64 "\"", hash);
+}
+
+/// Finds resource having entity tag in all registered indexes.
+static struct resource* _find_fingerprinted(const char *path, size_t len) {
+  char buf[len + 1];
+  memcpy(buf, path, len);
+  buf[len] = '\0';
+  for (int i = 0; i < _indexes_num; ++i) {
+    struct resource *r = grh_resources_index_find(_indexes[i], buf);
+    if (r && r->etag) {
+      return r;
+    }
+  }
+  return 0;
+}
+
+/// Resolves link found in HTML page `r` into path of embedded resource.
+static struct resource* _link_resolve(struct resource *r, const char *link, size_t len) {
+  char path[256];
+  if (len == 0 || len >= sizeof(path) || memchr(link, '?', len) || memchr(link, ':', len)) {
+    return 0; // Link having query or scheme
+  }
+  if (link[0] == '/') {
+    return _find_fingerprinted(link, len);
+  }
+  if (len > 2 && link[0] == '.' && link[1] == '/') {
+    link += 2, len -= 2;
+  }
+  size_t dlen = strrchr(r->path, '/') - r->path + 1;
+  if (dlen + len >= sizeof(path)) {
+    return 0;
+  }
+  memcpy(path, r->path, dlen);
+  memcpy(path + dlen, link, len);
+  return _find_fingerprinted(path, dlen + len);
+}
+
+/// Appends `?v=<fingerprint>` to `src` and `href` attributes of HTML page pointing to embedded resources.
+static iwrc _html_rewrite(struct resource *r) {
+  iwrc rc = 0;
+  IWXSTR *xstr;
+  const char *data = (const char*) r->data, *sp = data, *ep = data + r->len;
+
+  RCB(finish, xstr = iwxstr_new2(r->len + 256));
+  for (const char *p = data; p < ep; ++p) {
+    size_t alen;
+    if (p > data && (p[-1] == ' ' || p[-1] == '\n' || p[-1] == '\t')) {
+      if (ep - p > IW_LLEN("src=") && strncmp(p, "src=", IW_LLEN("src=")) == 0) {
+        alen = IW_LLEN("src=");
+      } else if (ep - p > IW_LLEN("href=") && strncmp(p, "href=", IW_LLEN("href=")) == 0) {
+        alen = IW_LLEN("href=");
+      } else {
+        continue;
+      }
+    } else {
+      continue;
+    }
+    char q = p[alen];
+    if (q != '"' && q != '\'') {
+      continue;
+    }
+    const char *vp = p + alen + 1, *vep = memchr(vp, q, ep - vp);
+    if (!vep) {
+      break;
+    }
+    struct resource *lr = _link_resolve(r, vp, vep - vp);
+    if (lr) {
+      RCC(rc, finish, iwxstr_cat(xstr, sp, vep - sp));
+      RCC(rc, finish, iwxstr_printf(xstr, "?v=%.*s", (int) strlen(lr->etag) - 2, lr->etag + 1));
+      sp = vep;
+    }
+    p = vep;
+  }
+  RCC(rc, finish, iwxstr_cat(xstr, sp, ep - sp));
+
+  r->len = iwxstr_size(xstr);
+  r->data = r->html_data = (unsigned char*) iwxstr_destroy_keep_ptr(xstr);
+  xstr = 0;
+  _etag_fill(r->data, r->len, r->etag_buf);
+  r->etag = r->etag_buf;
+
+finish:
+  iwxstr_destroy(xstr);
+  return rc;
+}
+
+iwrc grh_resources_index_init(struct resources_index *idx, struct resource *res, size_t num) {
+  iwrc rc = 0;
+  if (_indexes_num >= INDEXES_MAX) {
+    return IW_ERROR_OVERFLOW;
+  }
+  if (!_mtime_ms) {
+    RCR(iwp_current_time_ms(&_mtime_ms, false));
+  }
+  RCR(_index_build(idx, res, num));
+  _indexes[_indexes_num++] = idx;
+  for (size_t i = 0; i < num; ++i) {
+    if (res[i].html) {
+      RCC(rc, finish, _html_rewrite(&res[i]));
+    }
+  }
+
+finish:
+  if (rc) {
+    grh_resources_index_dispose(idx);
+  }
+  return rc;
+}
+
+void grh_resources_index_dispose(struct resources_index *idx) {
+  for (size_t i = 0; i < idx->num; ++i) {
+    struct resource *r = &idx->res[i];
+    if (r->html_data) {
+      free(r->html_data);
+      r->html_data = 0;
+    }
+  }
+  for (int i = 0; i < _indexes_num; ++i) {
+    if (_indexes[i] == idx) {
+      memmove(&_indexes[i], &_indexes[i + 1], (_indexes_num - i - 1) * sizeof(_indexes[0]));
+      --_indexes_num;
+      break;
+    }
+  }
+  memset(idx, 0, sizeof(*idx));
+}
+
+/// Returns set of content codings from `Accept-Encoding` header. Codings with zero quality are excluded.
+static unsigned _accept_encoding(struct iwn_wf_req *req) {
+  unsigned ret = 0;
+  struct iwn_val val = iwn_http_request_header_get(req->http, "accept-encoding", IW_LLEN("accept-encoding"));
+  const char *sp = val.buf, *ep = val.buf + val.len;
+
+  while (sp < ep) {
+    const char *tp, *qp;
+    unsigned enc = 0;
+    while (sp < ep && (*sp == ' ' || *sp == ',')) {
+      ++sp;
+    }
+    for (tp = sp; tp < ep && *tp != ',' && *tp != ';' && *tp != ' '; ++tp);
+    if (tp - sp == IW_LLEN("br") && strncasecmp(sp, "br", tp - sp) == 0) {
+      enc = ENC_BR;
+    } else if (  (tp - sp == IW_LLEN("gzip") && strncasecmp(sp, "gzip", tp - sp) == 0)
+              || (tp - sp == IW_LLEN("x-gzip") && strncasecmp(sp, "x-gzip", tp - sp) == 0)) {
+      enc = ENC_GZIP;
+    } else if (tp - sp == 1 && *sp == '*') {
+      enc = ENC_GZIP | ENC_BR;
+    }
+    // Coding parameters: `;q=0`, `;q=0.0` etc. disables coding
+    for (sp = tp; sp < ep && *sp != ','; ++sp) {
+      if (*sp == 'q' && sp + 1 < ep && sp[1] == '=') {
+        bool zero = true;
+        for (qp = sp + 2; qp < ep && *qp != ',' && *qp != ';' && *qp != ' '; ++qp) {
+          if (*qp != '0' && *qp != '.') {
+            zero = false;
+          }
+        }
+        if (zero) {
+          enc = 0;
+        }
+        sp = qp - 1;
+      }
+    }
+    ret |= enc;
+  }
+  return ret;
+}
+
+/// Returns true if request URL has `v` query parameter matching the resource fingerprint.
+static bool _fingerprint_matched(struct resource *r, struct iwn_wf_req *req) {
+  if (!r->etag) {
+    return false;
+  }
+  struct iwn_val val = iwn_pair_find_val(&req->query_params, "v", IW_LLEN("v"));
+  size_t len = strlen(r->etag) - 2;
+  return val.len == len && memcmp(val.buf, r->etag + 1, len) == 0;
+}
+
+int grh_resources_serve(struct resource *r, struct iwn_wf_req *req) {
+  const unsigned char *data = r->data;
+  size_t len = r->len;
+  const char *etag = r->etag, *encoding = 0;
+
+  if (_fingerprint_matched(r, req)) {
+    iwn_http_response_header_set(req->http, "cache-control", "public, max-age=31536000, immutable",
+                                 IW_LLEN("public, max-age=31536000, immutable"));
+  } else if (r->cache) {
+    iwn_http_response_header_set(req->http, "cache-control", "max-age=604800, immutable",
+                                 IW_LLEN("max-age=604800, immutable"));
+  } else if (!g_env.private_overlays.watch) {
+    iwn_http_response_header_set(req->http, "cache-control", "max-age=300", IW_LLEN("max-age=300"));
+  }
+  if (r->gz) {
+    // Resources have no identity variant, so gzip is sent if client accepts nothing better
+    iwn_http_response_header_set(req->http, "vary", "accept-encoding", IW_LLEN("accept-encoding"));
+    if (r->data_br && (_accept_encoding(req) & ENC_BR)) {
+      data = r->data_br;
+      len = r->len_br;
+      etag = r->etag_br;
+      encoding = "br";
+    } else {
+      encoding = "gzip";
+    }
+  }
+  if (iwn_http_response_not_modified(req->http, etag, _mtime_ms)) {
+    return 304;
+  }
+  if (encoding) {
+    iwn_http_response_header_set(req->http, "content-encoding", encoding, strlen(encoding));
+  }
+  return iwn_http_response_write(req->http, 200, r->ctype, (const char*) data, len) ? 1 : -1;
+}
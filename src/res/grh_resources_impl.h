@@ -25,41 +25,66 @@ extern struct gr_env g_env;
 struct resource {
   const char *path;
   const char *ctype;
-  const unsigned char *data;
-  size_t   len;
-  uint32_t hash;
-  bool     gz;
-  bool     cache;
+  const unsigned char *data;    ///< Resource data, gzip encoded if `gz` is set
+  size_t len;
+  const unsigned char *data_br; ///< Optional brotli encoded variant of resource data
+  size_t      len_br;
+  const char *etag;             ///< Strong entity tag of `data` computed at build time
+  const char *etag_br;          ///< Strong entity tag of `data_br`
+  uint32_t    hash;             ///< Hash of path, set by `grh_resources_index_init()`
+  bool gz;
+  bool cache;
+  bool html;                    ///< Links of HTML page to embedded resources are fingerprinted
+  unsigned char *html_data;     ///< Rewritten HTML page data owned by resource
+  char etag_buf[20];            ///< Entity tag of rewritten HTML page
 };
 
-/* Python code for easy calculation:
-   def _hash(s):
-    hash = 5381
-    for i in s: hash = hash * 33 + ord(i)
-    return hash % (1 << 32)
+/// Max number of slots in resources index
+#define RESOURCES_INDEX_SLOTS_MAX 256
+
+/// Perfect hash index of static resources table.
+struct resources_index {
+  struct resource *slots[RESOURCES_INDEX_SLOTS_MAX];
+  struct resource *res;
+  size_t   num;
+  uint32_t seed;
+  uint32_t bits; ///< Number of slots is `1 << bits`
+};
+
+#define RES(path_, ctype_, name_, gz_, cache_)                                                       \
+  { .path = (path_), .ctype = (ctype_), .data = (name_), .len = name_ ## _len, .etag = name_ ## _etag, \
+    .gz = (gz_), .cache = (cache_) }
+
+/// Resource having gzip `name_gz` and brotli `name_br` encoded variants.
+#define RES_BR(path_, ctype_, name_, cache_)                                                                    \
+  { .path = (path_), .ctype = (ctype_), .data = (name_ ## _gz), .len = name_ ## _gz_len, .data_br = (name_ ## _br), \
+    .len_br = name_ ## _br_len, .etag = name_ ## _gz_etag, .etag_br = name_ ## _br_etag, .gz = true, .cache = (cache_) }
+
+/// HTML page, its links to embedded resources are rewritten into fingerprinted URLs.
+#define RES_HTML(path_, ctype_, name_, cache_) \
+  { .path = (path_), .ctype = (ctype_), .data = (name_), .len = name_ ## _len, .html = true, .cache = (cache_) }
+
+/**
+ * @brief Builds collision free index of `num` resources, so every resource
+ *        is found by single hash computation and path comparison.
+ *
+ * Links of HTML resources to resources of this and previously initialized indexes
+ * get `?v=<fingerprint>` query, fingerprinted resources are cached by clients as immutable.
  */
-IW_INLINE uint32_t _hash(const char *str) {
-  unsigned char c;
-  uint32_t hash = 5381;
-  while ((c = *str++)) {
-    hash = ((hash << 5) + hash) + c;
-  }
-  return hash;
-}
+iwrc grh_resources_index_init(struct resources_index *idx, struct resource *res, size_t num);
 
-#define RES(path_, hash_, ctype_, name_, gz_, cache_) \
-  { .path = (path_), .hash = (hash_), .ctype = (ctype_), .data = (name_), .len = name_ ## _len, .gz = (gz_), \
-    .cache = (cache_) }
+/**
+ * @brief Releases HTML pages rewritten by `grh_resources_index_init()`.
+ */
+void grh_resources_index_dispose(struct resources_index *idx);
 
-static int _serve(struct resource *r, struct iwn_wf_req *req) {
-  if (r->cache) {
-    iwn_http_response_header_set(req->http, "cache-control", "max-age=604800, immutable",
-                                 IW_LLEN("max-age=604800, immutable"));
-  } else if (!g_env.private_overlays.watch) {
-    iwn_http_response_header_set(req->http, "cache-control", "max-age=300", IW_LLEN("max-age=300"));
-  }
-  if (r->gz) {
-    iwn_http_response_header_set(req->http, "content-encoding", "gzip", IW_LLEN("gzip"));
-  }
-  return iwn_http_response_write(req->http, 200, r->ctype, (const char*) r->data, r->len) ? 1 : -1;
-}
+/**
+ * @brief Finds resource by request path.
+ */
+struct resource* grh_resources_index_find(const struct resources_index *idx, const char *path);
+
+/**
+ * @brief Writes resource response choosing resource encoding acceptable by client.
+ * Responds with `304 Not Modified` if client has the actual copy of resource.
+ */
+int grh_resources_serve(struct resource *r, struct iwn_wf_req *req);
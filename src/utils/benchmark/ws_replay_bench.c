@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+/**
+ * Replays recorded WS signalling traffic through the message parsing path
+ * of `grh_ws.c` (`grh_ws_dispatch.c`) and compares former per-message pool allocation
+ * + locked handlers lookup against preallocated parse arena + lock-free lookup of sealed handlers table.
+ *
+ * Usage: ws_replay_bench [traffic file] [rounds]
+ *
+ * Traffic file contains one WS message per line. Lines may be copied as is
+ * from debug server log, `RECV[wsid, user]: ` prefix is stripped.
+ */
+
+#include "../../grh_ws_dispatch.h"
+
+#include <iowow/iwp.h>
+#include <iowow/iwulist.h>
+#include <iowow/iwxstr.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+struct msg {
+  char  *data;
+  size_t len;
+};
+
+static IWULIST _msgs;
+static struct grh_ws_handlers _handlers = {
+  .mtx = PTHREAD_MUTEX_INITIALIZER
+};
+static uint64_t _dispatched;
+
+static iwrc _traffic_load(const char *path) {
+  iwrc rc = 0;
+  char *line = 0;
+  size_t cap = 0;
+  ssize_t len;
+
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Failed to open traffic file: %s\n", path);
+    return iwrc_set_errno(IW_ERROR_IO_ERRNO, errno);
+  }
+  while ((len = getline(&line, &cap, f)) > 0) {
+    char *p = line;
+    while (len > 0 && (p[len - 1] == '\n' || p[len - 1] == '\r')) {
+      p[--len] = '\0';
+    }
+    if (!strncmp(p, "RECV[", IW_LLEN("RECV["))) {
+      char *s = strstr(p, "]: ");
+      if (!s) {
+        continue;
+      }
+      s += IW_LLEN("]: ");
+      len -= s - p;
+      p = s;
+    }
+    if (len == 0 || *p != '{') {
+      continue;
+    }
+    struct msg m = { .data = strndup(p, len), .len = len };
+    RCB(finish, m.data);
+    RCC(rc, finish, iwulist_push(&_msgs, &m));
+  }
+
+finish:
+  free(line);
+  fclose(f);
+  return rc;
+}
+
+static void _handler_free(void *key, void *val) {
+  free(key);
+}
+
+static iwrc _handlers_register(void) {
+  iwrc rc = 0;
+  RCB(finish, _handlers.map = iwhmap_create_str(_handler_free));
+  for (int i = 0, l = iwulist_length(&_msgs); i < l; ++i) {
+    struct msg *m = iwulist_at2(&_msgs, i);
+    JBL_NODE n, n2;
+    IWPOOL *pool = iwpool_create_empty();
+    RCB(finish, pool);
+    if (!jbn_from_json(m->data, &n, pool) && !jbn_at(n, "/cmd", &n2) && n2->type == JBV_STR) {
+      pthread_mutex_lock(&_handlers.mtx);
+      if (!iwhmap_get(_handlers.map, n2->vptr)) {
+        char *cmd = strdup(n2->vptr);
+        if (!cmd || (rc = iwhmap_put(_handlers.map, cmd, cmd))) {
+          free(cmd);
+        }
+      }
+      pthread_mutex_unlock(&_handlers.mtx);
+    }
+    iwpool_destroy(pool);
+    RCGO(rc, finish);
+  }
+
+finish:
+  return rc;
+}
+
+static void _dispatch(JBL_NODE n, const char *cmd, IWPOOL *pool) {
+  // Handlers usually build a response node in the message pool
+  JBL_NODE r;
+  if (!jbn_from_json("{}", &r, pool)) {
+    jbn_add_item_str(r, "cmd", cmd, -1, 0, pool);
+    ++_dispatched;
+  }
+}
+
+static iwrc _message_handle(const struct msg *m, IWPOOL *pool, bool lock) {
+  void *h;
+  JBL_NODE n;
+  const char *cmd, *hook;
+  RCR(grh_ws_message_parse(m->data, pool, &n, &cmd, &hook));
+  if (lock) { // Former lookup guarded by handlers mutex
+    pthread_mutex_lock(&_handlers.mtx);
+    h = iwhmap_get(_handlers.map, cmd);
+    pthread_mutex_unlock(&_handlers.mtx);
+  } else {
+    h = grh_ws_handlers_find(&_handlers, cmd);
+  }
+  if (h) {
+    _dispatch(n, cmd, pool);
+  }
+  return 0;
+}
+
+static iwrc _round_pool_per_message(void) {
+  for (int i = 0, l = iwulist_length(&_msgs); i < l; ++i) {
+    IWPOOL *pool = iwpool_create_empty();
+    if (!pool) {
+      return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+    }
+    _message_handle(iwulist_at2(&_msgs, i), pool, true);
+    iwpool_destroy(pool);
+  }
+  return 0;
+}
+
+static iwrc _round_arena(void) {
+  for (int i = 0, l = iwulist_length(&_msgs); i < l; ++i) {
+    IWPOOL *pool = grh_ws_arena_acquire();
+    if (!pool) {
+      return iwrc_set_errno(IW_ERROR_ALLOC, errno);
+    }
+    _message_handle(iwulist_at2(&_msgs, i), pool, false);
+    grh_ws_arena_release(pool);
+  }
+  return 0;
+}
+
+static iwrc _run(const char *name, iwrc (*round)(void), int rounds) {
+  uint64_t ts1, ts2;
+  _dispatched = 0;
+  RCR(iwp_current_time_ms(&ts1, true));
+  for (int i = 0; i < rounds; ++i) {
+    RCR(round());
+  }
+  RCR(iwp_current_time_ms(&ts2, true));
+  uint64_t ms = ts2 - ts1;
+  uint64_t num = (uint64_t) rounds * iwulist_length(&_msgs);
+  fprintf(stdout, "%-20s %10" PRIu64 " msgs %8" PRIu64 " ms %12.0f msgs/sec dispatched: %" PRIu64 "\n",
+          name, num, ms, ms ? (double) num * 1000 / ms : 0.0, _dispatched);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  iwrc rc = 0;
+  const char *path = argc > 1 ? argv[1] : "ws_signalling.log";
+  int rounds = argc > 2 ? atoi(argv[2]) : 2000;
+  if (rounds < 1) {
+    rounds = 1;
+  }
+
+  RCC(rc, finish, iw_init());
+  RCC(rc, finish, iwulist_init(&_msgs, 256, sizeof(struct msg)));
+  RCC(rc, finish, _traffic_load(path));
+  if (iwulist_length(&_msgs) == 0) {
+    fprintf(stderr, "No messages found in: %s\n", path);
+    rc = IW_ERROR_INVALID_VALUE;
+    goto finish;
+  }
+  RCC(rc, finish, _handlers_register());
+  grh_ws_handlers_seal(&_handlers);
+
+  fprintf(stdout, "Messages: %zu, rounds: %d\n", iwulist_length(&_msgs), rounds);
+  RCC(rc, finish, _run("pool per message", _round_pool_per_message, rounds));
+  RCC(rc, finish, _run("arena", _round_arena, rounds));
+
+finish:
+  for (int i = 0, l = iwulist_length(&_msgs); i < l; ++i) {
+    struct msg *m = iwulist_at2(&_msgs, i);
+    free(m->data);
+  }
+  iwulist_destroy_keep(&_msgs);
+  iwhmap_destroy(_handlers.map);
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
+  return rc != 0;
+}
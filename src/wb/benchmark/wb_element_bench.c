@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+/**
+ * Replays synthetic freehand drawing session through whiteboard element commits
+ * and compares the former merge + clone of the whole element on every update
+ * against copy-on-write updates of `wb_element_commit()`.
+ *
+ * Every stroke is drawn by pointer-move batches, like Excalidraw does every batch
+ * sends the whole element with all points drawn so far and incremented version.
+ *
+ * Usage: wb_element_bench [strokes] [batches per stroke] [points per batch]
+ */
+
+#include "../wb_element.h"
+
+#include <iowow/iwp.h>
+#include <iowow/iwxstr.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+struct stats {
+  uint64_t commits;
+  uint64_t pools;      ///< Number of element pools created, every one is full copy of element
+  uint64_t allocated;  ///< Bytes allocated by element pools
+  uint64_t ms;
+};
+
+static int _batches = 100;
+static int _points = 20;
+
+/// Builds element patches of the single stroke, patch `i` holds `(i + 1) * _points` points.
+static iwrc _stroke_patches(int stroke, JBL_NODE *patches, IWPOOL *pool) {
+  iwrc rc = 0;
+  IWXSTR *xstr = 0;
+  JBL_NODE n;
+
+  RCB(finish, xstr = iwxstr_new());
+  for (int i = 0; i < _batches; ++i) {
+    iwxstr_clear(xstr);
+    RCC(rc, finish, iwxstr_printf(xstr, "{\"el%d\":{\"type\":\"freedraw\",\"x\":%d,\"y\":%d,"
+                                  "\"strokeColor\":\"#000000\",\"version\":%d,\"versionNonce\":%d,\"points\":[",
+                                  stroke, stroke, stroke, i + 2, rand()));
+    for (int j = 0, l = (i + 1) * _points; j < l; ++j) {
+      RCC(rc, finish, iwxstr_printf(xstr, "%s[%d.5,%d.25]", j ? "," : "", j, j / 2));
+    }
+    RCC(rc, finish, iwxstr_cat2(xstr, "]}}"));
+    RCC(rc, finish, jbn_from_json(iwxstr_ptr(xstr), &n, pool));
+    patches[i] = n->child;
+  }
+
+finish:
+  iwxstr_destroy(xstr);
+  return rc;
+}
+
+/// Former element update: merge patch and clone the whole element into the new pool.
+static iwrc _commit_clone(struct wb_element *el, JBL_NODE patch, struct stats *st) {
+  iwrc rc = 0;
+  JBL_NODE n;
+  IWPOOL *pool;
+
+  if (!wb_element_is_newer(el->state, patch)) {
+    return 0;
+  }
+  RCC(rc, finish, jbn_merge_patch(el->state, patch, el->pool));
+  RCB(finish, pool = iwpool_create_empty());
+  RCC(rc, finish, jbn_clone(el->state, &n, pool));
+  iwpool_destroy(el->pool);
+  el->pool = pool, el->state = n;
+  st->pools++;
+  st->allocated += iwpool_allocated_size(pool);
+
+finish:
+  return rc;
+}
+
+static iwrc _commit_cow(struct wb_element *el, JBL_NODE patch, struct stats *st) {
+  bool applied;
+  IWPOOL *pool = el->pool;
+  size_t size = iwpool_allocated_size(pool);
+  iwrc rc = wb_element_commit(el, patch, &applied);
+  if (el->pool != pool) {
+    st->pools++;
+    st->allocated += iwpool_allocated_size(el->pool);
+  } else {
+    st->allocated += iwpool_allocated_size(pool) - size;
+  }
+  return rc;
+}
+
+static iwrc _run(int strokes, iwrc (*commit)(struct wb_element*, JBL_NODE, struct stats*), struct stats *st) {
+  iwrc rc = 0;
+  uint64_t ts1, ts2;
+  struct wb_element *el = 0;
+  IWPOOL *pool = 0;
+  JBL_NODE *patches = 0;
+  JBL_NODE n;
+
+  RCB(finish, patches = calloc(_batches, sizeof(*patches)));
+  for (int i = 0; i < strokes; ++i) {
+    srand(i);
+    RCB(finish, pool = iwpool_create_empty());
+    RCC(rc, finish, _stroke_patches(i, patches, pool));
+    RCC(rc, finish, jbn_from_json("{\"type\":\"freedraw\",\"version\":1,\"versionNonce\":0,\"points\":[]}", &n, pool));
+    RCC(rc, finish, wb_element_create(n, &el));
+
+    RCC(rc, finish, iwp_current_time_ms(&ts1, true));
+    for (int j = 0; j < _batches; ++j) {
+      RCC(rc, finish, commit(el, patches[j], st));
+      st->commits++;
+    }
+    RCC(rc, finish, iwp_current_time_ms(&ts2, true));
+    st->ms += ts2 - ts1;
+
+    wb_element_destroy(el), el = 0;
+    iwpool_destroy(pool), pool = 0;
+  }
+
+finish:
+  wb_element_destroy(el);
+  iwpool_destroy(pool);
+  free(patches);
+  return rc;
+}
+
+static void _report(const char *name, const struct stats *st) {
+  fprintf(stdout, "%-20s %10" PRIu64 " commits %8" PRIu64 " ms %10" PRIu64 " pools %14" PRIu64 " bytes allocated\n",
+          name, st->commits, st->ms, st->pools, st->allocated);
+}
+
+int main(int argc, char *argv[]) {
+  iwrc rc = 0;
+  struct stats st1 = { 0 }, st2 = { 0 };
+  int strokes = argc > 1 ? atoi(argv[1]) : 50;
+  if (argc > 2) {
+    _batches = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    _points = atoi(argv[3]);
+  }
+  if (strokes < 1 || _batches < 1 || _points < 1) {
+    fprintf(stderr, "Usage: wb_element_bench [strokes] [batches per stroke] [points per batch]\n");
+    return 1;
+  }
+
+  RCC(rc, finish, iw_init());
+  fprintf(stdout, "Strokes: %d, batches: %d, points per batch: %d\n", strokes, _batches, _points);
+  RCC(rc, finish, _run(strokes, _commit_clone, &st1));
+  _report("clone per commit", &st1);
+  RCC(rc, finish, _run(strokes, _commit_cow, &st2));
+  _report("copy-on-write", &st2);
+
+finish:
+  if (rc) {
+    iwlog_ecode_error3(rc);
+  }
+  return rc != 0;
+}
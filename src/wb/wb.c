@@ -16,18 +16,23 @@
  */
 
 #include "wb.h"
+#include "wb_element.h"
 #include "grh.h"
 #include "rct/rct.h"
 #include "lic_env.h"
 #include "grh_auth.h"
+#include "gr_db_wb.h"
 
 #include <ejdb2/ejdb2.h>
 #include <iowow/iwpool.h>
 #include <iowow/iwuuid.h>
 #include <iowow/iwxstr.h>
 #include <iowow/iwhmap.h>
+#include <iowow/iwulist.h>
+#include <iwnet/iwn_scheduler.h>
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -35,19 +40,50 @@
 
 #define ROOM_CID_REGEX "[a-z0-9]{8}-[a-z0-9]{4}-[a-z0-9]{4}-[a-z0-9]{4}-[a-z0-9]{12}"
 
-static pthread_mutex_t _mtx;
-static struct wb_room_t *_rooms = 0;
+/// Max number of elements changed after sync cache was built sent to joining users separately
+#define WB_SYNC_DELTA_MAX 256
+/// Updates broadcasted to room users are collected within this window and sent in a single frame
+#define WB_BATCH_WINDOW_MS 20
+
+/// Number of open rooms registry buckets
+#define WB_ROOMS_BUCKETS 64
+
+/// Open rooms registry bucket.
+/// Bucket lock also guards references, loading state and cached metadata of bucket rooms.
+struct wb_rooms_bucket {
+  pthread_mutex_t   mtx;
+  struct wb_room_t *rooms;
+};
+
+static struct wb_rooms_bucket _buckets[WB_ROOMS_BUCKETS];
+
+/// Incremented every time cached rooms metadata is invalidated
+static atomic_uint_fast64_t _meta_gen;
 
 struct wb_room_t {
   size_t version, version_init; // Increments when someone opens room
   size_t refs;
+  struct wb_rooms_bucket *bucket;
   struct wb_room_t *next;
   char    cid[IW_UUID_STR_LEN + 1];
-  int64_t ejdb_id;
+  int64_t ejdb_id; // Snapshot document id, guarded by `snapshot_mtx` once room is loaded
+  char   *title; // Cached room title, zero if room metadata is not cached
+  int64_t flags; // Cached room flags
 
   pthread_mutex_t state_mtx;
+  pthread_cond_t  state_cond; // Signaled when recipient references of closed user are released
   IWHMAP     *elements;
   atomic_bool loaded;
+  uint64_t    seq;          // Sequence number of the last logged operation
+  uint64_t    snapshot_seq; // Sequence number of the last operation compacted into snapshot
+  bool snapshot_pending;
+  pthread_mutex_t snapshot_mtx; // Serializes snapshots stored by compaction and room saving
+  IWXSTR *sync_els;   // Cached serialized elements shared by joining users
+  IWHMAP *sync_delta; // Keys of elements changed after `sync_els` was built
+
+  pthread_mutex_t batch_mtx;
+  IWPOOL *batch_pool; // Holds queued broadcast updates
+  IWHMAP *batch;      // Queued broadcast updates: ("e" | "c") + key -> struct wb_batch_item
 
   struct wb_user_t *users;
   size_t next_user_id;
@@ -59,76 +95,51 @@ struct wb_user_t {
   struct iwn_ws_sess *ws;
   char     id[sizeof(size_t) * 2 + 1]; // size_t in hex format
   bool     readonly;
+  bool     closed;
+  int      refs; // Number of broadcasts in progress having this user as recipient
   IWPOOL  *pool;
   JBL_NODE state;
 };
 
-struct wb_element_t {
-  IWPOOL  *pool;
-  JBL_NODE state;
+/// Queued element or participant state update.
+struct wb_batch_item {
+  const char *key;                     // Element id or participant id
+  JBL_NODE    value;                   // Accumulated update
+  char origin[sizeof(size_t) * 2 + 1]; // Id of user the update came from, it is not sent back to that user
+  bool element;
 };
 
 static void _wb_room_load(void *_room);
 static void _wb_room_save(void *_room);
 static iwrc _wb_room_close(struct wb_room_t *room);
-
-static iwrc _wb_element_create(struct wb_element_t **el_out) {
-  iwrc rc = 0;
-  struct wb_element_t *el = 0;
-
-  RCA((el = malloc(sizeof(*el))), finish);
-  RCA((el->pool = iwpool_create_empty()), finish);
-  RCA((el->state = iwpool_calloc(sizeof(*el->state), el->pool)), finish);
-  el->state->type = JBV_OBJECT;
-
-finish:
-  if (rc) {
-    iwpool_destroy(el ? el->pool : 0);
-    free(el);
-  }
-  *el_out = rc ? 0 : el;
-  return rc;
-}
-
-static void _wb_element_destroy(struct wb_element_t *el) {
-  if (el) {
-    iwpool_destroy(el->pool);
-    free(el);
-  }
-}
+static iwrc _wb_room_commit_element(struct wb_room_t *room, JBL_NODE patch, JBL_NODE *rollback_out, IWPOOL *pool);
 
 static void _wb_elements_kv_free(void *key, void *value) {
-  _wb_element_destroy((struct wb_element_t*) value);
+  wb_element_destroy(value);
   free(key);
 }
 
-// Returns true if new is selected for use
-static bool _wb_elements_compare_versions_jbn(JBL_NODE old_el, JBL_NODE new_el) {
-  int64_t old_ver, old_nonce, new_ver, new_nonce;
-  JBL_NODE n;
-
-  if (jbn_at(old_el, "/version", &n) || n->type != JBV_I64) {
-    return false;
-  }
-  old_ver = n->vi64;
-
-  if (jbn_at(old_el, "/versionNonce", &n) || n->type != JBV_I64) {
-    return false;
-  }
-  old_nonce = n->vi64;
+static void _wb_keys_kv_free(void *key, void *value) {
+  free(key);
+}
 
-  if (jbn_at(new_el, "/version", &n) || n->type != JBV_I64) {
-    return false;
+static struct wb_rooms_bucket* _wb_rooms_bucket(const char *cid) {
+  uint32_t h = 2166136261U; // FNV-1a
+  for (const char *p = cid; *p; ++p) {
+    h ^= (uint8_t) *p;
+    h *= 16777619U;
   }
-  new_ver = n->vi64;
+  return &_buckets[h % WB_ROOMS_BUCKETS];
+}
 
-  if (jbn_at(new_el, "/versionNonce", &n) || n->type != JBV_I64) {
-    return false;
+/// @note Must be called in bucket->mtx locked context
+static struct wb_room_t* _wb_rooms_find_lk(struct wb_rooms_bucket *bucket, const char *cid) {
+  for (struct wb_room_t *i = bucket->rooms; i; i = i->next) {
+    if (strcmp(cid, i->cid) == 0) {
+      return i;
+    }
   }
-  new_nonce = n->vi64;
-
-  // Versions are incremented on changes and nonce is random. Selection is deterministic
-  return new_ver > old_ver || (new_ver == old_ver && new_nonce > old_nonce);
+  return 0;
 }
 
 static iwrc _wb_room_create(struct wb_room_t **room_out, const char *cid) {
@@ -136,21 +147,27 @@ static iwrc _wb_room_create(struct wb_room_t **room_out, const char *cid) {
   struct wb_room_t *room;
   pthread_mutexattr_t state_mtx_attr;
 
-  RCA((room = calloc(1, sizeof(*_rooms))), finish);
+  RCA((room = calloc(1, sizeof(*room))), finish);
 
   memcpy(room->cid, cid, IW_UUID_STR_LEN);
   room->cid[IW_UUID_STR_LEN] = '\0';
+  room->bucket = _wb_rooms_bucket(room->cid);
 
   RCA((room->elements = iwhmap_create_str(_wb_elements_kv_free)), finish);
+  RCA((room->sync_delta = iwhmap_create_str(_wb_keys_kv_free)), finish);
 
   pthread_mutexattr_init(&state_mtx_attr);
   pthread_mutexattr_settype(&state_mtx_attr, PTHREAD_MUTEX_RECURSIVE);
   pthread_mutex_init(&room->state_mtx, &state_mtx_attr);
+  pthread_cond_init(&room->state_cond, 0);
+  pthread_mutex_init(&room->batch_mtx, 0);
+  pthread_mutex_init(&room->snapshot_mtx, 0);
 
 finish:
   pthread_mutexattr_destroy(&state_mtx_attr);
   if (rc && room) {
     iwhmap_destroy(room->elements);
+    iwhmap_destroy(room->sync_delta);
     free(room);
   }
   *room_out = rc ? 0 : room;
@@ -160,30 +177,32 @@ finish:
 static void _wb_room_destroy(struct wb_room_t *room) {
   if (room) {
     pthread_mutex_destroy(&room->state_mtx);
+    pthread_cond_destroy(&room->state_cond);
+    pthread_mutex_destroy(&room->batch_mtx);
+    pthread_mutex_destroy(&room->snapshot_mtx);
+    iwhmap_destroy(room->batch);
+    iwpool_destroy(room->batch_pool);
     iwhmap_destroy(room->elements);
+    iwhmap_destroy(room->sync_delta);
+    iwxstr_destroy(room->sync_els);
+    free(room->title);
     free(room);
   }
 }
 
 static iwrc _wb_room_open(struct wb_room_t **room_out, const char *cid, bool readonly) {
   iwrc rc = 0;
-  struct wb_room_t *room = 0;
+  struct wb_rooms_bucket *bucket = _wb_rooms_bucket(cid);
 
-  pthread_mutex_lock(&_mtx);
-
-  for (struct wb_room_t *i = _rooms; i; i = i->next) {
-    if (strcmp(cid, i->cid) == 0) {
-      room = i;
-      break;
-    }
-  }
+  pthread_mutex_lock(&bucket->mtx);
 
+  struct wb_room_t *room = _wb_rooms_find_lk(bucket, cid);
   if (!room) {
     RCC(rc, finish, _wb_room_create(&room, cid));
 
     room->refs = 1; // 1 for load task
-    room->next = _rooms;
-    _rooms = room;
+    room->next = bucket->rooms;
+    bucket->rooms = room;
     RCC(rc, finish, iwtp_schedule(g_env.tp, _wb_room_load, room));
   }
 
@@ -197,7 +216,7 @@ finish:
     // Close loading reference and destroy room
     _wb_room_close(room);
   }
-  pthread_mutex_unlock(&_mtx);
+  pthread_mutex_unlock(&bucket->mtx);
   *room_out = rc ? 0 : room;
   return rc;
 }
@@ -208,8 +227,9 @@ static iwrc _wb_room_close(struct wb_room_t *room) {
   }
   iwrc rc = 0;
   bool destroy = false;
+  struct wb_rooms_bucket *bucket = room->bucket;
 
-  pthread_mutex_lock(&_mtx);
+  pthread_mutex_lock(&bucket->mtx);
   room->refs--;
 
   if (room->refs == 0 && room->loaded) {
@@ -218,10 +238,10 @@ static iwrc _wb_room_close(struct wb_room_t *room) {
   }
 
   if (room->refs == 0 && !room->loaded) {
-    if (room == _rooms) {
-      _rooms = room->next;
+    if (room == bucket->rooms) {
+      bucket->rooms = room->next;
     } else {
-      for (struct wb_room_t *i = _rooms; i && i->next; i = i->next) {
+      for (struct wb_room_t *i = bucket->rooms; i && i->next; i = i->next) {
         if (room == i->next) {
           i->next = room->next;
           break;
@@ -232,7 +252,7 @@ static iwrc _wb_room_close(struct wb_room_t *room) {
     destroy = true;
   }
 
-  pthread_mutex_unlock(&_mtx);
+  pthread_mutex_unlock(&bucket->mtx);
 
 finish:
   if (rc) {
@@ -244,67 +264,293 @@ finish:
   return rc;
 }
 
-static iwrc _wb_room_sync_jbn(struct wb_room_t *room, JBL_NODE *node_out, IWPOOL *pool, struct wb_user_t *ignore_user) {
+/// Serializes room elements or only elements listed in `keys` into `xstr`.
+/// Elements state is not copied, so must be called in room->state_mtx locked context.
+static iwrc _wb_room_elements_json(struct wb_room_t *room, IWHMAP *keys, IWXSTR *xstr) {
   iwrc rc = 0;
-  JBL_NODE n, n2, n3;
-  IWHMAP_ITER iter_el;
+  IWPOOL *pool;
+  IWHMAP_ITER iter;
+  JBL_NODE root, n;
+  struct wb_element *el;
 
-  pthread_mutex_lock(&room->state_mtx);
+  RCA((pool = iwpool_create_empty()), finish);
+  RCA((root = iwpool_calloc(sizeof(*root), pool)), finish);
+  root->type = JBV_OBJECT;
+
+  iwhmap_iter_init(keys ? keys : room->elements, &iter);
+  while (iwhmap_iter_next(&iter)) {
+    el = keys ? iwhmap_get(room->elements, iter.key) : (void*) iter.val;
+    if (el) {
+      RCC(rc, finish, jbn_add_item_obj(root, iter.key, &n, pool));
+      jbn_apply_from(n, el->state);
+    }
+  }
+  RCC(rc, finish, jbn_as_json(root, jbl_xstr_json_printer, xstr, 0));
+
+finish:
+  iwpool_destroy(pool);
+  return rc;
+}
+
+/// Returns serialized room elements shared by all joining users.
+/// Cache is rebuilt only if it does not exist or `exact` state is required
+/// and there are elements changed after cache was built.
+/// @note Must be called in room->state_mtx locked context
+static iwrc _wb_room_sync_elements(struct wb_room_t *room, bool exact, IWXSTR **out) {
+  iwrc rc = 0;
+  IWXSTR *xstr = 0;
+
+  if (room->sync_els && exact && iwhmap_count(room->sync_delta)) {
+    iwxstr_destroy(room->sync_els);
+    room->sync_els = 0;
+  }
+  if (!room->sync_els) {
+    RCA((xstr = iwxstr_new()), finish);
+    RCC(rc, finish, _wb_room_elements_json(room, 0, xstr));
+    iwhmap_clear(room->sync_delta);
+    room->sync_els = xstr, xstr = 0;
+  }
+  *out = room->sync_els;
 
-  RCC(rc, finish, jbn_from_json("{\"sync\":{\"e\":{},\"c\":{}}}", node_out, pool));
+finish:
+  iwxstr_destroy(xstr);
+  return rc;
+}
 
-  if (!jbn_at(*node_out, "/sync/e", &n) && n->type == JBV_OBJECT) {
-    iwhmap_iter_init(room->elements, &iter_el);
-    while (iwhmap_iter_next(&iter_el)) {
-      RCC(rc, finish, jbn_add_item_obj(n, (const char*) iter_el.key, &n2, pool));
-      RCC(rc, finish, jbn_clone(((struct wb_element_t*) iter_el.val)->state, &n3, pool));
-      jbn_apply_from(n2, n3);
+/// Registers change of element identified by `key` made after sync cache was built.
+/// Cache is dropped when there are too many changes to send them separately.
+/// @note Must be called in room->state_mtx locked context
+static iwrc _wb_room_sync_touch(struct wb_room_t *room, const char *key) {
+  iwrc rc = 0;
+  char *k;
+
+  if (!room->sync_els || iwhmap_get(room->sync_delta, key)) {
+    return 0;
+  }
+  if (iwhmap_count(room->sync_delta) >= WB_SYNC_DELTA_MAX) {
+    iwxstr_destroy(room->sync_els);
+    room->sync_els = 0;
+    iwhmap_clear(room->sync_delta);
+    return 0;
+  }
+  RCA((k = strdup(key)), finish);
+  if ((rc = iwhmap_put(room->sync_delta, k, k))) {
+    free(k);
+  }
+
+finish:
+  return rc;
+}
+
+/// Sends sync packet with room elements and participants except `user` itself to the `user`.
+/// Elements changed after sync cache was built are sent by the next update packet.
+/// @note Must be called in room->state_mtx locked context
+static iwrc _wb_room_sync_send(struct wb_room_t *room, struct wb_user_t *user) {
+  iwrc rc = 0;
+  IWXSTR *els, *xstr = 0;
+  IWPOOL *pool;
+  JBL_NODE root, n;
+
+  RCA((pool = iwpool_create_empty()), finish);
+  RCC(rc, finish, _wb_room_sync_elements(room, false, &els));
+
+  RCA((root = iwpool_calloc(sizeof(*root), pool)), finish);
+  root->type = JBV_OBJECT;
+  for (struct wb_user_t *u = room->users; u; u = u->next) {
+    // Collect users to list without readonly users (to hide them)
+    if (u != user && !u->readonly) {
+      RCC(rc, finish, jbn_add_item_obj(root, u->id, &n, pool));
+      jbn_apply_from(n, u->state);
     }
-  } else {
-    RCC(rc, finish, IW_ERROR_INVALID_STATE);
   }
 
-  if (!jbn_at(*node_out, "/sync/c", &n) && n->type == JBV_OBJECT) {
-    for (struct wb_user_t *i = room->users; i; i = i->next) {
-      // Collect users to list without readonly users (to hide them)
-      if (i != ignore_user && !i->readonly) {
-        RCC(rc, finish, jbn_add_item_obj(n, i->id, &n2, pool));
-        RCC(rc, finish, jbn_clone(i->state, &n3, pool));
-        jbn_apply_from(n2, n3);
-      }
+  RCA((xstr = iwxstr_new2(iwxstr_size(els) + 256)), finish);
+  RCC(rc, finish, iwxstr_cat2(xstr, "{\"sync\":{\"e\":"));
+  RCC(rc, finish, iwxstr_cat(xstr, iwxstr_ptr(els), iwxstr_size(els)));
+  RCC(rc, finish, iwxstr_cat2(xstr, ",\"c\":"));
+  RCC(rc, finish, jbn_as_json(root, jbl_xstr_json_printer, xstr, 0));
+  RCC(rc, finish, iwxstr_printf(xstr, "},\"readonly\":%s}", user->readonly ? "true" : "false"));
+  iwn_ws_server_write(user->ws, iwxstr_ptr(xstr), iwxstr_size(xstr));
+
+  if (iwhmap_count(room->sync_delta)) {
+    iwxstr_clear(xstr);
+    RCC(rc, finish, iwxstr_cat2(xstr, "{\"e\":"));
+    RCC(rc, finish, _wb_room_elements_json(room, room->sync_delta, xstr));
+    RCC(rc, finish, iwxstr_cat2(xstr, "}"));
+    iwn_ws_server_write(user->ws, iwxstr_ptr(xstr), iwxstr_size(xstr));
+  }
+
+finish:
+  iwxstr_destroy(xstr);
+  iwpool_destroy(pool);
+  return rc;
+}
+
+/// Applies operations logged after the last snapshot of room.
+static iwrc _wb_room_replay(struct wb_room_t *room) {
+  iwrc rc = 0;
+  JQL q = 0;
+  EJDB_LIST list = 0;
+  JBL_NODE n, n2, rollback;
+
+  RCC(rc, finish, jql_create(&q, "whiteboard_ops", "/[cid = :?] and /[seq > :?] | asc /seq"));
+  RCC(rc, finish, jql_set_str(q, 0, 0, room->cid));
+  RCC(rc, finish, jql_set_i64(q, 0, 1, (int64_t) room->snapshot_seq));
+  RCC(rc, finish, ejdb_list4(g_env.db, q, 0, 0, &list));
+
+  for (EJDB_DOC doc = list->first; doc; doc = doc->next) {
+    if (  jbn_at(doc->node, "/seq", &n) || n->type != JBV_I64
+       || jbn_at(doc->node, "/e", &n2) || n2->type != JBV_OBJECT) {
+      continue;
     }
-  } else {
-    RCC(rc, finish, IW_ERROR_INVALID_STATE);
+    for (n2 = n2->child; n2; n2 = n2->next) {
+      RCC(rc, finish, _wb_room_commit_element(room, n2, &rollback, list->pool));
+    }
+    room->seq = n->vi64;
   }
 
 finish:
+  jql_destroy(&q);
+  ejdb_list_destroy(&list);
+  return rc;
+}
+
+/// Appends committed elements changes to the operations log of room.
+/// @note Must be called in room->state_mtx locked context
+static iwrc _wb_room_log(struct wb_room_t *room, JBL_NODE els, IWPOOL *pool) {
+  iwrc rc = 0;
+  uint64_t ts;
+  JBL_NODE op, n;
+
+  RCC(rc, finish, iwp_current_time_ms(&ts, false));
+  RCC(rc, finish, jbn_from_json_printf(&op, pool, "{\"seq\": %" PRIu64 ", \"ts\": %" PRIu64 ", \"e\": {}}",
+                                       room->seq + 1, ts));
+  RCC(rc, finish, jbn_add_item_str(op, "cid", room->cid, -1, 0, pool));
+  RCC(rc, finish, jbn_at(op, "/e", &n));
+  jbn_apply_from(n, els);
+
+  RCC(rc, finish, gr_db_wb_submit(&(struct gr_db_wb_spec) {
+    .op = GR_DB_WB_PUT_NEW,
+    .coll = "whiteboard_ops",
+    .json = op
+  }));
+  room->seq++;
+
+finish:
+  return rc;
+}
+
+/// Stores the whole room state as the new snapshot and removes compacted operations log.
+/// Snapshots of the same room are serialized, so only the first one creates the snapshot document.
+static iwrc _wb_room_snapshot(struct wb_room_t *room) {
+  iwrc rc = 0;
+  IWXSTR *xstr, *els;
+  JBL jbl = 0;
+  JQL q = 0;
+  uint64_t ts, seq;
+  int64_t id;
+
+  pthread_mutex_lock(&room->snapshot_mtx);
+  RCA((xstr = iwxstr_new()), finish);
+  RCC(rc, finish, iwp_current_time_ms(&ts, false));
+
+  pthread_mutex_lock(&room->state_mtx);
+  seq = room->seq;
+  rc = _wb_room_sync_elements(room, true, &els);
+  if (!rc) {
+    rc = iwxstr_printf(xstr, "{\"cid\":\"%s\",\"ctime\":%" PRIu64 ",\"seq\":%" PRIu64 ",\"elements\":",
+                       room->cid, ts, seq);
+  }
+  if (!rc) {
+    rc = iwxstr_cat(xstr, iwxstr_ptr(els), iwxstr_size(els));
+  }
+  pthread_mutex_unlock(&room->state_mtx);
+  RCGO(rc, finish);
+  RCC(rc, finish, iwxstr_cat2(xstr, "}"));
+
+  RCC(rc, finish, jbl_from_json(&jbl, iwxstr_ptr(xstr)));
+  if (room->ejdb_id) {
+    RCC(rc, finish, ejdb_put(g_env.db, "whiteboards", jbl, room->ejdb_id));
+  } else {
+    RCC(rc, finish, ejdb_put_new(g_env.db, "whiteboards", jbl, &id));
+    room->ejdb_id = id;
+  }
+
+  // Apply queued operations before removal to not leave stale ones
+  RCC(rc, finish, gr_db_wb_flush(false));
+  RCC(rc, finish, jql_create(&q, "whiteboard_ops", "/[cid = :?] and /[seq <= :?] | del"));
+  RCC(rc, finish, jql_set_str(q, 0, 0, room->cid));
+  RCC(rc, finish, jql_set_i64(q, 0, 1, (int64_t) seq));
+  RCC(rc, finish, ejdb_update(g_env.db, q));
+
+  pthread_mutex_lock(&room->state_mtx);
+  room->snapshot_seq = seq;
   pthread_mutex_unlock(&room->state_mtx);
+
+finish:
+  pthread_mutex_unlock(&room->snapshot_mtx);
+  jql_destroy(&q);
+  jbl_destroy(&jbl);
+  iwxstr_destroy(xstr);
   return rc;
 }
 
+static void _wb_room_compact(void *_room) {
+  struct wb_room_t *room = _room;
+  iwrc rc = _wb_room_snapshot(room);
+  if (rc) {
+    iwlog_ecode_error(rc, "Whiteboard room snapshot error");
+  }
+  pthread_mutex_lock(&room->state_mtx);
+  room->snapshot_pending = false;
+  pthread_mutex_unlock(&room->state_mtx);
+  _wb_room_close(room);
+}
+
+static void _wb_room_compact_schedule(struct wb_room_t *room) {
+  pthread_mutex_lock(&room->bucket->mtx);
+  room->refs++; // Keep room until snapshot is stored
+  iwrc rc = iwtp_schedule(g_env.tp, _wb_room_compact, room);
+  if (rc) {
+    room->refs--;
+  }
+  pthread_mutex_unlock(&room->bucket->mtx);
+  if (rc) {
+    iwlog_ecode_error3(rc);
+    pthread_mutex_lock(&room->state_mtx);
+    room->snapshot_pending = false;
+    pthread_mutex_unlock(&room->state_mtx);
+  }
+}
+
 static void _wb_room_load(void *_room) {
   iwrc rc = 0;
   struct wb_room_t *room = 0;
+  struct wb_rooms_bucket *bucket = 0;
   IWPOOL *pool;
-  JBL_NODE json, n, n2, n3;
+  JBL_NODE json, n;
   bool locked = false, locked2 = false;
   JQL q = 0;
   EJDB_DOC doc;
-  struct wb_element_t *el = 0;
+  struct wb_element *el = 0;
   char *el_key = 0;
 
   RCA((pool = iwpool_create_empty()), finish);
 
   RCA((room = _room), finish);
+  bucket = room->bucket;
 
   // Maybe there is no users so can skip loading and destroy room
-  pthread_mutex_lock(&_mtx), locked2 = true;
+  pthread_mutex_lock(&bucket->mtx), locked2 = true;
   if (room->refs == 1) {
     RCC(rc, finish, _wb_room_close(room));
     room = 0;
     goto finish;
   }
-  pthread_mutex_unlock(&_mtx), locked2 = false;
+  pthread_mutex_unlock(&bucket->mtx), locked2 = false;
+
+  // Operations logged by the previous instance of room may still be queued
+  RCC(rc, finish, gr_db_wb_flush(false));
 
   RCC(rc, finish, jql_create(&q, "whiteboards", "/[uuid = :?] or /[cid = :?] | /* | limit 1"));
   RCC(rc, finish, jql_set_str(q, 0, 0, room->cid));
@@ -315,11 +561,12 @@ static void _wb_room_load(void *_room) {
   // But new users can connect so do not lock mutex here
   if (doc) {
     room->ejdb_id = doc->id;
+    if (!jbn_at(doc->node, "/seq", &n) && n->type == JBV_I64) {
+      room->seq = room->snapshot_seq = n->vi64;
+    }
     RCC(rc, finish, jbn_at(doc->node, "/elements", &json));
     for (n = json->child; n; n = n->next) {
-      RCC(rc, finish, _wb_element_create(&el));
-      RCC(rc, finish, jbn_clone(n, &n2, el->pool));
-      jbn_apply_from(el->state, n2);
+      RCC(rc, finish, wb_element_create(n, &el));
 
       RCA((el_key = malloc(sizeof(*n->key) * (n->klidx + 1))), finish);
       el_key[n->klidx] = '\0';
@@ -329,29 +576,14 @@ static void _wb_room_load(void *_room) {
       el = 0, el_key = 0;
     }
   }
+  RCC(rc, finish, _wb_room_replay(room));
 
   pthread_mutex_lock(&room->state_mtx), locked = true;
 
   room->loaded = true;
 
-  RCC(rc, finish, _wb_room_sync_jbn(room, &json, pool, 0));
-  RCC(rc, finish, jbn_add_item_bool(json, "readonly", false, &n3, pool));
-  RCC(rc, finish, jbn_at(json, "/sync/c", &n));
-
-  char id[sizeof(room->users->id) / sizeof(*room->users->id) + 1] = "/";
   for (struct wb_user_t *u = room->users; u; u = u->next) {
-    n3->vbool = u->readonly;
-    if (u->readonly) {
-      // Readonly users are not included in sync packet so dont need to hide object
-      iwn_ws_server_write_jbn(u->ws, json);
-    } else {
-      // Send sync packet to each user without that users
-      memcpy(&id[1], u->id, sizeof(u->id));
-      RCC(rc, finish, jbn_at(n, id, &n2));
-      jbn_remove_item(n, n2);
-      iwn_ws_server_write_jbn(u->ws, json);
-      jbn_add_item(n, n2);
-    }
+    RCC(rc, finish, _wb_room_sync_send(room, u));
   }
 
   pthread_mutex_unlock(&room->state_mtx), locked = false;
@@ -364,10 +596,10 @@ finish:
     pthread_mutex_unlock(&room->state_mtx);
   }
   if (locked2) {
-    pthread_mutex_unlock(&_mtx);
+    pthread_mutex_unlock(&bucket->mtx);
   }
   jql_destroy(&q);
-  _wb_element_destroy(el);
+  wb_element_destroy(el);
   free(el_key);
   iwpool_destroy(pool);
   _wb_room_close(room);
@@ -376,51 +608,33 @@ finish:
 static void _wb_room_save(void *_room) {
   iwrc rc = 0;
   struct wb_room_t *room = 0;
-  IWPOOL *pool = 0;
-  JBL_NODE json, n, n2;
-  JBL jbl = 0;
+  struct wb_rooms_bucket *bucket = 0;
   bool locked = false;
-  uint64_t ts;
   size_t ver = 0;
 
-  RCA((pool = iwpool_create_empty()), finish);
-
   RCA((room = _room), finish);
+  bucket = room->bucket;
   // If there are users
-  pthread_mutex_lock(&_mtx), locked = true;
+  pthread_mutex_lock(&bucket->mtx), locked = true;
   if (room->refs != 1) {
     RCC(rc, finish, _wb_room_close(room));
     room = 0;
     goto finish;
   }
   ver = room->version;
-  // If room was not changed since start
-  if (ver == room->version_init) {
+  // If room was not changed since start or all changes are in snapshot already.
+  // No snapshot is in progress here since compaction holds a room reference until it is stored.
+  if (ver == room->version_init || (room->ejdb_id && room->seq == room->snapshot_seq)) {
     room->loaded = false;
     RCC(rc, finish, _wb_room_close(room));
     room = 0;
     goto finish;
   }
-  pthread_mutex_unlock(&_mtx), locked = false;
-
-  RCC(rc, finish, iwp_current_time_ms(&ts, false));
-  RCC(rc, finish, jbn_from_json_printf(&json, pool, "{\"ctime\": %" PRIu64 ", \"elements\": {}}", ts));
-  RCC(rc, finish, jbn_add_item_str(json, "cid", room->cid, -1, 0, pool));
+  pthread_mutex_unlock(&bucket->mtx), locked = false;
 
-  RCC(rc, finish, _wb_room_sync_jbn(room, &n, pool, 0));
-  RCC(rc, finish, jbn_at(n, "/sync/e", &n2));
-
-  RCC(rc, finish, jbn_at(json, "/elements", &n));
-  jbn_apply_from(n, n2);
-
-  RCC(rc, finish, jbl_from_node(&jbl, json));
-  if (room->ejdb_id) {
-    RCC(rc, finish, ejdb_put(g_env.db, "whiteboards", jbl, room->ejdb_id));
-  } else {
-    RCC(rc, finish, ejdb_put_new_jbn(g_env.db, "whiteboards", json, 0));
-  }
+  RCC(rc, finish, _wb_room_snapshot(room));
 
-  pthread_mutex_lock(&_mtx), locked = true;
+  pthread_mutex_lock(&bucket->mtx), locked = true;
   // Ensure that saved data is relevant
   // If it is then destroy room immediately
   if (room->version == ver) {
@@ -429,26 +643,25 @@ static void _wb_room_save(void *_room) {
     room = 0;
     goto finish;
   }
-  pthread_mutex_unlock(&_mtx), locked = false;
+  pthread_mutex_unlock(&bucket->mtx), locked = false;
 
 finish:
   if (locked) {
-    pthread_mutex_unlock(&_mtx);
+    pthread_mutex_unlock(&bucket->mtx);
   }
   if (rc) {
-    iwlog_ecode_debug(rc, "Whiteboard room loading error");
+    iwlog_ecode_debug(rc, "Whiteboard room saving error");
   }
-  jbl_destroy(&jbl);
-  iwpool_destroy(pool);
   _wb_room_close(room);
 }
 
 static iwrc _wb_room_commit_element(struct wb_room_t *room, JBL_NODE patch, JBL_NODE *rollback_out, IWPOOL *pool) {
   iwrc rc = 0;
   JBL_NODE n, rollback = 0;
-  IWPOOL *pool2 = 0;
-  struct wb_element_t *json_el;
+  struct wb_element *json_el, *el_new = 0;
   char *json_el_key = 0;
+  const char *key;
+  bool applied;
 
   if (!jbn_at(patch, "/id", &n)) {
     // Excalidraw has id as internal field
@@ -461,27 +674,23 @@ static iwrc _wb_room_commit_element(struct wb_room_t *room, JBL_NODE patch, JBL_
   strncpy(json_el_key, patch->key, patch->klidx);
 
   if ((json_el = iwhmap_get(room->elements, json_el_key))) {
-    if (_wb_elements_compare_versions_jbn(json_el->state, patch)) {
-      RCC(rc, finish, jbn_merge_patch(json_el->state, patch, json_el->pool));
-      RCA((pool2 = iwpool_create_empty()), finish);
-      RCC(rc, finish, jbn_clone(json_el->state, &n, pool2));
-      iwpool_destroy(json_el->pool);
-      json_el->pool = pool2, json_el->state = n;
+    RCC(rc, finish, wb_element_commit(json_el, patch, &applied));
+    if (applied) {
+      RCC(rc, finish, _wb_room_sync_touch(room, json_el_key));
     } else {
       RCC(rc, finish, jbn_clone(json_el->state, &rollback, pool));
     }
   } else {
-    RCC(rc, finish, _wb_element_create(&json_el));
-    RCC(rc, finish, jbn_clone(patch, &json_el->state, json_el->pool));
-    RCC(rc, finish, iwhmap_put(room->elements, json_el_key, json_el));
-    json_el_key = 0; // Need to keep it for iwhmap
+    RCC(rc, finish, wb_element_create(patch, &el_new));
+    RCC(rc, finish, iwhmap_put(room->elements, json_el_key, el_new));
+    el_new = 0;
+    key = json_el_key, json_el_key = 0; // Need to keep it for iwhmap
+    RCC(rc, finish, _wb_room_sync_touch(room, key));
   }
 
 finish:
   free(json_el_key);
-  if (rc) {
-    iwpool_destroy(pool);
-  }
+  wb_element_destroy(el_new);
   *rollback_out = rollback;
   return rc;
 }
@@ -502,6 +711,8 @@ static iwrc _wb_user_create(
   user->ws = ws;
   user->room = room;
   user->readonly = readonly;
+  user->closed = false;
+  user->refs = 0;
 
   RCA((user->state = iwpool_calloc(sizeof(*user->state), user->pool)), finish);
   user->state->type = JBV_OBJECT;
@@ -539,6 +750,11 @@ static void _wb_user_destroy(struct wb_user_t *user) {
         }
       }
     }
+    // Wait for broadcasts still writing to the user session
+    user->closed = true;
+    while (user->refs > 0) {
+      pthread_cond_wait(&room->state_cond, &room->state_mtx);
+    }
     pthread_mutex_unlock(&room->state_mtx);
 
     iwpool_destroy(user->pool);
@@ -546,17 +762,49 @@ static void _wb_user_destroy(struct wb_user_t *user) {
   }
 }
 
+/// Collects room users except `except` into `list`.
+/// Collected users are kept alive until _wb_room_recipients_release() so may be written without room lock.
+static iwrc _wb_room_recipients(struct wb_room_t *room, struct wb_user_t *except, IWULIST *list) {
+  iwrc rc = 0;
+  pthread_mutex_lock(&room->state_mtx);
+  for (struct wb_user_t *u = room->users; u; u = u->next) {
+    if (u != except) {
+      RCC(rc, finish, iwulist_push(list, &u));
+      u->refs++;
+    }
+  }
+finish:
+  pthread_mutex_unlock(&room->state_mtx);
+  return rc;
+}
+
+static void _wb_room_recipients_release(struct wb_room_t *room, IWULIST *list) {
+  bool notify = false;
+  pthread_mutex_lock(&room->state_mtx);
+  for (size_t i = 0, l = iwulist_length(list); i < l; ++i) {
+    struct wb_user_t *u = *(struct wb_user_t**) iwulist_at2(list, i);
+    if (--u->refs == 0 && u->closed) {
+      notify = true;
+    }
+  }
+  if (notify) {
+    pthread_cond_broadcast(&room->state_cond);
+  }
+  pthread_mutex_unlock(&room->state_mtx);
+  iwulist_destroy_keep(list);
+}
+
 // When room = 0, send to user, otherwise send to all room participants except user
 static iwrc _wb_ws_send(const char *data, size_t data_len, struct wb_room_t *room, struct wb_user_t *user) {
   iwrc rc = 0;
   if (room) {
-    pthread_mutex_lock(&room->state_mtx);
-    for (struct wb_user_t *u = room->users; u; u = u->next) {
-      if (u != user) {
-        iwn_ws_server_write(u->ws, data, data_len);
-      }
+    IWULIST users;
+    RCC(rc, finish, iwulist_init(&users, 16, sizeof(struct wb_user_t*)));
+    rc = _wb_room_recipients(room, user, &users);
+    for (size_t i = 0, l = iwulist_length(&users); i < l; ++i) {
+      iwn_ws_server_write((*(struct wb_user_t**) iwulist_at2(&users, i))->ws, data, data_len);
     }
-    pthread_mutex_unlock(&room->state_mtx);
+    _wb_room_recipients_release(room, &users);
   } else if (user) {
     iwn_ws_server_write(user->ws, data, data_len);
   } else {
@@ -579,18 +827,238 @@ finish:
   return rc;
 }
 
+static void _wb_batch_kv_free(void *key, void *value) {
+  // Batch items and keys are allocated in batch pool
+}
+
+/// Serializes queued updates into `xstr` except updates originated by user `except`.
+static iwrc _wb_batch_frame(IWHMAP *batch, const char *except, IWXSTR *xstr) {
+  iwrc rc = 0;
+  IWPOOL *pool;
+  IWHMAP_ITER iter;
+  JBL_NODE root, e = 0, c = 0, n;
+
+  RCA((pool = iwpool_create_empty()), finish);
+  RCA((root = iwpool_calloc(sizeof(*root), pool)), finish);
+  root->type = JBV_OBJECT;
+
+  iwhmap_iter_init(batch, &iter);
+  while (iwhmap_iter_next(&iter)) {
+    const struct wb_batch_item *item = iter.val;
+    if (except && !strcmp(item->origin, except)) {
+      continue;
+    }
+    JBL_NODE *parent = item->element ? &e : &c;
+    if (!*parent) {
+      RCC(rc, finish, jbn_add_item_obj(root, item->element ? "e" : "c", parent, pool));
+    }
+    RCC(rc, finish, jbn_add_item_obj(*parent, item->key, &n, pool));
+    jbn_apply_from(n, item->value);
+  }
+  if (root->child) {
+    RCC(rc, finish, jbn_as_json(root, jbl_xstr_json_printer, xstr, 0));
+  }
+
+finish:
+  iwpool_destroy(pool);
+  return rc;
+}
+
+static bool _wb_batch_has_origin(IWHMAP *batch, const char *origin) {
+  IWHMAP_ITER iter;
+  iwhmap_iter_init(batch, &iter);
+  while (iwhmap_iter_next(&iter)) {
+    if (!strcmp(((const struct wb_batch_item*) iter.val)->origin, origin)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Sends queued updates to room users, users which are not origins of updates share the same frame.
+static void _wb_batch_flush(void *arg) {
+  iwrc rc = 0;
+  struct wb_room_t *room = arg;
+  IWULIST users = { 0 };
+  IWXSTR *common = 0, *xstr = 0;
+  bool common_built = false, users_init = false;
+
+  pthread_mutex_lock(&room->batch_mtx);
+  IWPOOL *pool = room->batch_pool;
+  IWHMAP *batch = room->batch;
+  room->batch_pool = 0;
+  room->batch = 0;
+  pthread_mutex_unlock(&room->batch_mtx);
+
+  if (!batch || !iwhmap_count(batch)) {
+    goto finish;
+  }
+  RCA((common = iwxstr_new()), finish);
+  RCA((xstr = iwxstr_new()), finish);
+  RCC(rc, finish, iwulist_init(&users, 16, sizeof(struct wb_user_t*)));
+  users_init = true;
+  RCC(rc, finish, _wb_room_recipients(room, 0, &users));
+
+  for (size_t i = 0, l = iwulist_length(&users); i < l; ++i) {
+    struct wb_user_t *u = *(struct wb_user_t**) iwulist_at2(&users, i);
+    IWXSTR *frame = common;
+    if (_wb_batch_has_origin(batch, u->id)) {
+      iwxstr_clear(xstr);
+      RCC(rc, finish, _wb_batch_frame(batch, u->id, xstr));
+      frame = xstr;
+    } else if (!common_built) {
+      RCC(rc, finish, _wb_batch_frame(batch, 0, common));
+      common_built = true;
+    }
+    if (iwxstr_size(frame)) {
+      iwn_ws_server_write(u->ws, iwxstr_ptr(frame), iwxstr_size(frame));
+    }
+  }
+
+finish:
+  if (rc) {
+    iwlog_ecode_error(rc, "Whiteboard broadcast error");
+  }
+  if (users_init) {
+    _wb_room_recipients_release(room, &users);
+  }
+  iwxstr_destroy(common);
+  iwxstr_destroy(xstr);
+  iwhmap_destroy(batch);
+  iwpool_destroy(pool);
+  _wb_room_close(room);
+}
+
+/// Drops queued updates if flush task is cancelled on poller shutdown.
+static void _wb_batch_cancel(void *arg) {
+  struct wb_room_t *room = arg;
+  pthread_mutex_lock(&room->batch_mtx);
+  IWPOOL *pool = room->batch_pool;
+  IWHMAP *batch = room->batch;
+  room->batch_pool = 0;
+  room->batch = 0;
+  pthread_mutex_unlock(&room->batch_mtx);
+  iwhmap_destroy(batch);
+  iwpool_destroy(pool);
+  _wb_room_close(room);
+}
+
+static void _wb_batch_schedule(struct wb_room_t *room) {
+  pthread_mutex_lock(&room->bucket->mtx);
+  room->refs++; // Keep room until batch is flushed
+  pthread_mutex_unlock(&room->bucket->mtx);
+
+  iwrc rc = iwn_schedule(&(struct iwn_scheduler_spec) {
+    .poller = g_env.poller,
+    .user_data = room,
+    .task_fn = _wb_batch_flush,
+    .on_cancel = _wb_batch_cancel,
+    .timeout_ms = WB_BATCH_WINDOW_MS,
+  });
+  if (rc) {
+    iwlog_ecode_error3(rc);
+    _wb_batch_flush(room);
+  }
+}
+
+/// Queues update of element or participant state for broadcast to room users except `origin` user.
+/// Updates queued within WB_BATCH_WINDOW_MS are sent in a single frame,
+/// fields of later update of the same element or participant replace fields of pending one.
+static iwrc _wb_batch_put(struct wb_room_t *room, const char *origin, bool element, JBL_NODE value) {
+  iwrc rc = 0;
+  bool schedule = false;
+  struct wb_batch_item *item;
+  JBL_NODE n, n2, next;
+  IWPOOL *pool;
+  IWHMAP *batch;
+  char *key;
+
+  if (value->type != JBV_OBJECT || !value->key) {
+    return IW_ERROR_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&room->batch_mtx);
+  if (!room->batch) {
+    RCA((pool = iwpool_create_empty()), finish);
+    if (!(batch = iwhmap_create_str(_wb_batch_kv_free))) {
+      rc = iwrc_set_errno(IW_ERROR_ALLOC, errno);
+      iwpool_destroy(pool);
+      goto finish;
+    }
+    room->batch_pool = pool, room->batch = batch;
+    schedule = true;
+  }
+  pool = room->batch_pool;
+
+  RCA((key = iwpool_printf(pool, "%c%.*s", element ? 'e' : 'c', value->klidx, value->key)), finish);
+  if (!(item = iwhmap_get(room->batch, key))) {
+    RCA((item = iwpool_calloc(sizeof(*item), pool)), finish);
+    RCA((item->value = iwpool_calloc(sizeof(*item->value), pool)), finish);
+    item->value->type = JBV_OBJECT;
+    item->key = key + 1;
+    item->element = element;
+    RCC(rc, finish, iwhmap_put(room->batch, key, item));
+  }
+  snprintf(item->origin, sizeof(item->origin), "%s", origin);
+
+  RCC(rc, finish, jbn_clone(value, &n, pool));
+  for (n = n->child; n; n = next) {
+    next = n->next;
+    for (n2 = item->value->child; n2; n2 = n2->next) {
+      if (n2->klidx == n->klidx && !strncmp(n2->key, n->key, n->klidx)) {
+        jbn_remove_item(item->value, n2);
+        break;
+      }
+    }
+    jbn_add_item(item->value, n);
+  }
+
+finish:
+  pthread_mutex_unlock(&room->batch_mtx);
+  if (schedule) {
+    _wb_batch_schedule(room);
+  }
+  return rc;
+}
+
+/// Queues all element updates `/e` and participant updates `/c` of `data` for broadcast.
+static iwrc _wb_batch_put_jbn(struct wb_room_t *room, const char *origin, JBL_NODE data) {
+  iwrc rc = 0;
+  JBL_NODE n;
+
+  if (!jbn_at(data, "/e", &n) && n->type == JBV_OBJECT) {
+    for (n = n->child; n; n = n->next) {
+      RCR(_wb_batch_put(room, origin, true, n));
+    }
+  }
+  if (!jbn_at(data, "/c", &n) && n->type == JBV_OBJECT) {
+    for (n = n->child; n; n = n->next) {
+      RCR(_wb_batch_put(room, origin, false, n));
+    }
+  }
+  return rc;
+}
+
 static void _wb_ws_destroy_userdata(struct grh_user_data *u) {
   struct wb_user_t *user = u->data;
   struct wb_room_t *room = user->room;
   bool send_leave = !user->readonly;
+  IWPOOL *pool;
+  JBL_NODE json;
 
   const char fmt[] = "{\"c\":{\"%s\":{\"isDeleted\":true}}}";
   char msg[sizeof(fmt) / sizeof(*fmt) + sizeof(user->id) / sizeof(*user->id) + 1];
-  int msg_len = snprintf(msg, sizeof(msg) / sizeof(*msg), fmt, user->id);
+  snprintf(msg, sizeof(msg) / sizeof(*msg), fmt, user->id);
+  char id[sizeof(user->id)];
+  memcpy(id, user->id, sizeof(id));
 
   _wb_user_destroy(user);
-  if (send_leave) {
-    _wb_ws_send(msg, msg_len, room, 0);
+  // Leave is queued to override pending updates of user state
+  if (send_leave && (pool = iwpool_create_empty())) {
+    if (!jbn_from_json(msg, &json, pool)) {
+      _wb_batch_put_jbn(room, id, json);
+    }
+    iwpool_destroy(pool);
   }
   _wb_room_close(room);
   free(u);
@@ -599,10 +1067,8 @@ static void _wb_ws_destroy_userdata(struct grh_user_data *u) {
 static bool _on_ws_message(struct iwn_ws_sess *ws, const char *msg, size_t msg_len, uint8_t opcode) {
   iwrc rc = 0;
   JBL_NODE json_in, json_out, json_out_back, n, n2, n3;
-  struct wb_element_t *json_el = 0;
-  char *json_el_key = 0;
   IWPOOL *pool = 0, *pool2 = 0;
-  bool locked = false, ret = false;
+  bool locked = false, ret = false, compact = false;
   struct wb_room_t *room;
   struct grh_user_data *udata = grh_req_data_find(ws->req->http, GRH_USER_DATA_TYPE_WB);
   struct wb_user_t *user = udata ? udata->data : 0;
@@ -646,7 +1112,13 @@ static bool _on_ws_message(struct iwn_ws_sess *ws, const char *msg, size_t msg_l
         }
       }
 
-      if (!n_els->child) {
+      if (n_els->child) {
+        RCC(rc, finish, _wb_room_log(room, n_els, pool));
+        if (  !room->snapshot_pending
+           && room->seq - room->snapshot_seq >= (uint64_t) g_env.whiteboard.snapshot_ops) {
+          room->snapshot_pending = compact = true;
+        }
+      } else {
         jbn_remove_item(json_out, n_els);
       }
       if (!n_els_back->child) {
@@ -670,11 +1142,14 @@ static bool _on_ws_message(struct iwn_ws_sess *ws, const char *msg, size_t msg_l
     pthread_mutex_unlock(&room->state_mtx), locked = false;
   }
 
+  if (compact) {
+    _wb_room_compact_schedule(room);
+  }
   if (json_out_back->child) {
     RCC(rc, finish, _wb_ws_send_jbn(json_out_back, 0, user));
   }
   if (json_out->child) {
-    RCC(rc, finish, _wb_ws_send_jbn(json_out, room, user));
+    RCC(rc, finish, _wb_batch_put_jbn(room, user->id, json_out));
   }
 
   ret = true;
@@ -685,77 +1160,97 @@ finish:
   }
   if (rc) {
     iwlog_ecode_error(rc, "Whiteboard msg handler error");
-    if (json_el) {
-      iwpool_destroy(json_el->pool);
-      free(json_el);
-    }
-    if (json_el_key) {
-      free(json_el_key);
-    }
     iwpool_destroy(pool2);
   }
   iwpool_destroy(pool);
   return ret;
 }
 
-// If error occurs, room will be "webinar" to restrict maximum access
-static bool _rct_is_webinar(const char *room_cid) {
-  if (!room_cid) {
-    return true;
-  }
+/**
+ * Gets flags and title of the room from the cache of open room or from database.
+ * If room is not found `title_out` is set to zero.
+ * If error occurs, room flags are "webinar" to restrict maximum access.
+ * @param [out] gen_out Metadata generation loaded flags and title are relevant to,
+ *                      zero if they were taken from cache.
+ */
+static iwrc _wb_room_meta_get(
+  const char  *cid,
+  int64_t     *flags_out,
+  const char **title_out,
+  uint64_t    *gen_out,
+  IWPOOL      *pool
+  ) {
   iwrc rc = 0;
   JQL q = 0;
-  bool ret = true;
-  EJDB_LIST list = 0;
-  JBL_NODE n = 0;
+  EJDB_DOC doc;
+  JBL_NODE n;
+  struct wb_rooms_bucket *bucket = _wb_rooms_bucket(cid);
 
-  RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] or /[cid = :?] | /flags | limit 1"));
-  RCC(rc, finish, jql_set_str(q, 0, 0, room_cid));
-  RCC(rc, finish, jql_set_str(q, 0, 1, room_cid));
-  RCC(rc, finish, ejdb_list4(g_env.db, q, 1, 0, &list));
-  if (list->first) {
-    RCC(rc, finish, jbn_at(list->first->node, "/flags", &n));
-    ret = n->vi64 & RCT_ROOM_WEBINAR;
-  }
+  *flags_out = RCT_ROOM_WEBINAR;
+  *title_out = 0;
+  *gen_out = 0;
 
-finish:
-  if (rc) {
-    iwlog_ecode_error3(rc);
+  pthread_mutex_lock(&bucket->mtx);
+  struct wb_room_t *room = _wb_rooms_find_lk(bucket, cid);
+  if (room && room->title) {
+    *flags_out = room->flags;
+    *title_out = iwpool_strdup(pool, room->title, &rc);
   }
-  jql_destroy(&q);
-  ejdb_list_destroy(&list);
-  return ret;
-}
-
-static iwrc _rct_get_title(const char *room_cid, const char **title, IWPOOL *pool) {
-  if (!room_cid) {
-    *title = 0;
-    return 0;
+  pthread_mutex_unlock(&bucket->mtx);
+  if (*title_out || rc) {
+    goto finish;
   }
-  iwrc rc = 0;
-  JQL q = 0;
-  JBL_NODE n = 0;
-  EJDB_DOC doc;
 
-  RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] or /[cid = :?] | /name | limit 1"));
-  RCC(rc, finish, jql_set_str(q, 0, 0, room_cid));
-  RCC(rc, finish, jql_set_str(q, 0, 1, room_cid));
+  *gen_out = atomic_load(&_meta_gen);
+  RCC(rc, finish, jql_create(&q, "rooms", "/[uuid = :?] or /[cid = :?] | /{name,flags} | limit 1"));
+  RCC(rc, finish, jql_set_str(q, 0, 0, cid));
+  RCC(rc, finish, jql_set_str(q, 0, 1, cid));
   RCC(rc, finish, ejdb_list(g_env.db, q, &doc, 1, pool));
-  if (doc && !jbn_at(doc->node, "/name", &n) && n->type == JBV_STR) {
-    *title = n->vptr;
-  } else {
-    *title = 0;
+  if (doc) {
+    if (!jbn_at(doc->node, "/flags", &n) && n->type == JBV_I64) {
+      *flags_out = n->vi64;
+    }
+    if (!jbn_at(doc->node, "/name", &n) && n->type == JBV_STR) {
+      RCA((*title_out = iwpool_strndup(pool, n->vptr, n->vsize, &rc)), finish);
+    }
   }
 
 finish:
   if (rc) {
-    *title = 0;
+    *flags_out = RCT_ROOM_WEBINAR;
+    *title_out = 0;
     iwlog_ecode_error3(rc);
   }
   jql_destroy(&q);
   return rc;
 }
 
+/// Caches metadata loaded by `_wb_room_meta_get()` in the open room
+/// unless rooms metadata was invalidated since `gen`.
+static void _wb_room_meta_set(struct wb_room_t *room, uint64_t gen, int64_t flags, const char *title) {
+  if (!gen) {
+    return;
+  }
+  pthread_mutex_lock(&room->bucket->mtx);
+  if (!room->title && gen == atomic_load(&_meta_gen)) {
+    room->title = strdup(title);
+    room->flags = flags;
+  }
+  pthread_mutex_unlock(&room->bucket->mtx);
+}
+
+void wb_room_meta_invalidate(const char *cid) {
+  struct wb_rooms_bucket *bucket = _wb_rooms_bucket(cid);
+  atomic_fetch_add(&_meta_gen, 1);
+  pthread_mutex_lock(&bucket->mtx);
+  struct wb_room_t *room = _wb_rooms_find_lk(bucket, cid);
+  if (room) {
+    free(room->title);
+    room->title = 0;
+  }
+  pthread_mutex_unlock(&bucket->mtx);
+}
+
 static bool _on_wss_init(struct iwn_ws_sess *ws) {
   iwrc rc = 0;
   bool ret = false;
@@ -773,7 +1268,8 @@ static bool _on_wss_init(struct iwn_ws_sess *ws) {
   struct wb_user_t *user = 0;
   const char *room_title = 0;
   JBL_NODE json, n, n1;
-  int64_t user_id;
+  int64_t user_id, room_flags;
+  uint64_t meta_gen;
   bool is_participant, is_room_owner, is_readonly;
 
   IWPOOL *pool = iwpool_create_empty();
@@ -781,14 +1277,15 @@ static bool _on_wss_init(struct iwn_ws_sess *ws) {
 
   user_id = grh_auth_get_userid(req);
   is_participant = user_id ? grh_auth_is_room_member(room_cid, user_id, &is_room_owner) : false;
-  is_readonly = !is_participant || !username.len || (_rct_is_webinar(room_cid) && !is_room_owner);
-  RCC(rc, finish, _rct_get_title(room_cid, &room_title, pool));
+  RCC(rc, finish, _wb_room_meta_get(room_cid, &room_flags, &room_title, &meta_gen, pool));
+  is_readonly = !is_participant || !username.len || ((room_flags & RCT_ROOM_WEBINAR) && !is_room_owner);
 
   if ((!g_env.whiteboard.public_available && !is_participant) || !room_title) {
     goto finish;
   }
 
   RCC(rc, finish, _wb_room_open(&room, room_cid, is_readonly));
+  _wb_room_meta_set(room, meta_gen, room_flags, room_title);
   RCC(rc, finish, _wb_user_create(&user, room, ws, username.buf, is_readonly));
 
   {
@@ -807,7 +1304,7 @@ static bool _on_wss_init(struct iwn_ws_sess *ws) {
     RCC(rc, finish, jbn_at(json, "/c", &n));
     RCC(rc, finish, jbn_add_item_obj(n, user->id, &n1, pool));
     jbn_apply_from(n1, user->state);
-    RCC(rc, finish, _wb_ws_send_jbn(json, room, user));
+    RCC(rc, finish, _wb_batch_put_jbn(room, user->id, json));
   }
 
   // Send room title
@@ -818,11 +1315,12 @@ static bool _on_wss_init(struct iwn_ws_sess *ws) {
   }
   RCC(rc, finish, _wb_ws_send_jbn(json, 0, user));
 
+  pthread_mutex_lock(&room->state_mtx);
   if (room->loaded) {
-    RCC(rc, finish, _wb_room_sync_jbn(room, &json, pool, user));
-    RCC(rc, finish, jbn_add_item_bool(json, "readonly", is_readonly, 0, pool));
-    RCC(rc, finish, _wb_ws_send_jbn(json, 0, user));
+    rc = _wb_room_sync_send(room, user);
   }
+  pthread_mutex_unlock(&room->state_mtx);
+  RCGO(rc, finish);
 
   ret = true;
 
@@ -835,14 +1333,18 @@ finish:
 }
 
 static void _on_handler_dispose(struct iwn_wf_ctx *ctx, void *user_data) {
-  pthread_mutex_destroy(&_mtx);
+  for (int i = 0; i < WB_ROOMS_BUCKETS; ++i) {
+    pthread_mutex_destroy(&_buckets[i].mtx);
+  }
 }
 
 iwrc grh_route_wb(struct iwn_wf_route *parent) {
   pthread_mutexattr_t mattr;
   pthread_mutexattr_init(&mattr);
   pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
-  pthread_mutex_init(&_mtx, &mattr);
+  for (int i = 0; i < WB_ROOMS_BUCKETS; ++i) {
+    pthread_mutex_init(&_buckets[i].mtx, &mattr);
+  }
   pthread_mutexattr_destroy(&mattr);
 
   RCR(iwn_wf_route(&(struct iwn_wf_route) {
@@ -20,3 +20,9 @@
 
 iwrc grh_route_wb(struct iwn_wf_route *parent);
 
+/**
+ * @brief Drops room flags and title cached by the open whiteboard of the given room.
+ * Must be called when room info is changed in database.
+ */
+void wb_room_meta_invalidate(const char *cid);
+
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "wb_element.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/// Element pool is never compacted below this size
+#define WB_ELEMENT_COMPACT_MIN 4096
+
+iwrc wb_element_create(JBL_NODE state, struct wb_element **el_out) {
+  iwrc rc = 0;
+  struct wb_element *el = 0;
+  JBL_NODE n;
+
+  RCA((el = calloc(1, sizeof(*el))), finish);
+  RCA((el->pool = iwpool_create_empty()), finish);
+  RCA((el->state = iwpool_calloc(sizeof(*el->state), el->pool)), finish);
+  el->state->type = JBV_OBJECT;
+  if (state) {
+    RCC(rc, finish, jbn_clone(state, &n, el->pool));
+    jbn_apply_from(el->state, n);
+  }
+  el->compact_size = iwpool_allocated_size(el->pool);
+
+finish:
+  if (rc) {
+    wb_element_destroy(el);
+  }
+  *el_out = rc ? 0 : el;
+  return rc;
+}
+
+void wb_element_destroy(struct wb_element *el) {
+  if (el) {
+    iwpool_destroy(el->pool);
+    free(el);
+  }
+}
+
+bool wb_element_is_newer(JBL_NODE state, JBL_NODE patch) {
+  int64_t old_ver, old_nonce, new_ver, new_nonce;
+  JBL_NODE n;
+
+  if (jbn_at(state, "/version", &n) || n->type != JBV_I64) {
+    return false;
+  }
+  old_ver = n->vi64;
+
+  if (jbn_at(state, "/versionNonce", &n) || n->type != JBV_I64) {
+    return false;
+  }
+  old_nonce = n->vi64;
+
+  if (jbn_at(patch, "/version", &n) || n->type != JBV_I64) {
+    return false;
+  }
+  new_ver = n->vi64;
+
+  if (jbn_at(patch, "/versionNonce", &n) || n->type != JBV_I64) {
+    return false;
+  }
+  new_nonce = n->vi64;
+
+  // Versions are incremented on changes and nonce is random. Selection is deterministic
+  return new_ver > old_ver || (new_ver == old_ver && new_nonce > old_nonce);
+}
+
+/// Updates `target` points keeping their common prefix with `points` of patch.
+/// Freehand drawing appends points to the end of array so usually only new points are copied.
+static iwrc _points_update(struct wb_element *el, JBL_NODE target, JBL_NODE points) {
+  iwrc rc = 0;
+  JBL_NODE t = target->child, p = points->child, n;
+
+  while (t && p) {
+    int cmp = jbn_compare_nodes(t, p, &rc);
+    RCGO(rc, finish);
+    if (cmp) {
+      break;
+    }
+    t = t->next, p = p->next;
+  }
+  while (t) { // Diverged tail of current points
+    n = t->next;
+    jbn_remove_item(target, t);
+    t = n;
+  }
+  for ( ; p; p = p->next) {
+    RCC(rc, finish, jbn_clone(p, &n, el->pool));
+    jbn_add_item(target, n);
+  }
+
+finish:
+  return rc;
+}
+
+/// Moves element state into the new pool if garbage left by updates exceeds live data.
+static iwrc _compact(struct wb_element *el) {
+  iwrc rc = 0;
+  IWPOOL *pool = 0;
+  JBL_NODE n, state;
+
+  size_t size = iwpool_allocated_size(el->pool);
+  if (size < WB_ELEMENT_COMPACT_MIN || size < 2 * el->compact_size) {
+    return 0;
+  }
+  RCA((pool = iwpool_create_empty()), finish);
+  RCA((state = iwpool_calloc(sizeof(*state), pool)), finish);
+  RCC(rc, finish, jbn_clone(el->state, &n, pool));
+  jbn_apply_from(state, n);
+
+  iwpool_destroy(el->pool);
+  el->pool = pool, el->state = state;
+  el->compact_size = iwpool_allocated_size(pool);
+  pool = 0;
+
+finish:
+  iwpool_destroy(pool);
+  return rc;
+}
+
+iwrc wb_element_commit(struct wb_element *el, JBL_NODE patch, bool *applied_out) {
+  iwrc rc = 0;
+  JBL_NODE copy, n, n2, points = 0, target;
+
+  *applied_out = false;
+  if (!wb_element_is_newer(el->state, patch)) {
+    return 0;
+  }
+
+  if (  !jbn_at(patch, "/points", &points) && points->type == JBV_ARRAY
+     && !jbn_at(el->state, "/points", &target) && target->type == JBV_ARRAY) {
+    RCC(rc, finish, _points_update(el, target, points));
+  } else {
+    points = 0;
+  }
+
+  // Merge patch links patch nodes into target, so copy changed fields into element pool first
+  RCA((copy = iwpool_calloc(sizeof(*copy), el->pool)), finish);
+  copy->type = JBV_OBJECT;
+  for (n = patch->child; n; n = n->next) {
+    if (n != points) {
+      RCC(rc, finish, jbn_clone(n, &n2, el->pool));
+      jbn_add_item(copy, n2);
+    }
+  }
+  RCC(rc, finish, jbn_merge_patch(el->state, copy, el->pool));
+  *applied_out = true;
+
+  rc = _compact(el);
+
+finish:
+  return rc;
+}
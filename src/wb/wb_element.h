@@ -0,0 +1,54 @@
+#pragma once
+/*
+ * Copyright (C) 2022 Greenrooms, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include <ejdb2/ejdb2.h>
+#include <iowow/iwpool.h>
+
+/// Whiteboard element state.
+struct wb_element {
+  IWPOOL  *pool;         ///< Pool holding element state nodes
+  JBL_NODE state;        ///< Current element state
+  size_t   compact_size; ///< Pool size right after the last compaction
+};
+
+/**
+ * @brief Creates element holding a copy of the given `state`.
+ * @param state Initial element state, empty object if zero.
+ */
+iwrc wb_element_create(JBL_NODE state, struct wb_element **el_out);
+
+void wb_element_destroy(struct wb_element *el);
+
+/**
+ * @brief Returns true if `patch` has newer `version` or `versionNonce` than `state`.
+ */
+bool wb_element_is_newer(JBL_NODE state, JBL_NODE patch);
+
+/**
+ * @brief Applies `patch` to the element if patch is newer than element state.
+ *
+ * Only changed parts of element are copied into element pool: `points` array
+ * of freehand elements is updated in place keeping the common prefix of points,
+ * other patch fields are merged into state. Element pool is compacted
+ * when garbage left by updates exceeds live element data.
+ *
+ * `patch` is left unchanged and may be released right after the call.
+ *
+ * @param [out] applied_out Set to false if patch was rejected as outdated.
+ */
+iwrc wb_element_commit(struct wb_element *el, JBL_NODE patch, bool *applied_out);
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 
 static void make_identifier(char *str) {
@@ -32,6 +33,7 @@ static void usage(const char *argv0) {
     "\t-h, --help                  Show this help text\n"
     "\t--no-const                  Output mutable variables instead of consts\n"
     "\t--always-escape             Unconditionally escape every character\n"
+    "\t-e, --etag                  Output strong HTTP entity tag of data as <ident>_etag\n"
     "\t-l, --line-length <length>  Specify how long a line should be\n"
     "\t-i, --ident <ident>         Overwrite the identifier instead of using the file name");
 }
@@ -44,6 +46,8 @@ int main(int argc, char **argv) {
   char *buffer = NULL;
   char *conststr = "static const ";
   int alwaysescape = 0;
+  int etag = 0;
+  uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a 64 of data
   size_t maxlength = 120;
 
   int argidx;
@@ -60,6 +64,8 @@ int main(int argc, char **argv) {
       conststr = "";
     } else if (strcmp(arg, "--always-escape") == 0) {
       alwaysescape = 1;
+    } else if ((strcmp(arg, "--etag") == 0) || (strcmp(arg, "-e") == 0)) {
+      etag = 1;
     } else if ((strcmp(arg, "--line-length") == 0) || (strcmp(arg, "-l") == 0)) {
       if (argidx + 1 >= argc) {
         fprintf(stderr, "%s requires an argument\n", arg);
@@ -121,6 +127,8 @@ int main(int argc, char **argv) {
   size_t length = 0;
   int c;
   while ((c = fgetc(inf)) != EOF) {
+    hash ^= (uint64_t) c;
+    hash *= 0x100000001b3ULL;
     if (alwaysescape) {
       buffer[linechar++] = '\\';
       buffer[linechar++] = '0' + ((c & 0700) >> 6);
@@ -185,6 +193,11 @@ int main(int argc, char **argv) {
     goto fail;
   }
 
+  if (etag && fprintf(outf, "%schar %s_etag[] = \"\\\"%016" PRIx64 "\\\"\";\n", conststr, ident, hash) < 0) {
+    perror("write e");
+    goto fail;
+  }
+
   if (fclose(inf) == EOF) {
     perror("close");
     goto fail;